@@ -7,12 +7,16 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include "protocol.h"
+#include "trace.h"
 
 #define PORT 5555
 #define hostNameLength 50
-#define MAXMSG 512
+#define maxLine 512
 #define STDIN 0
 
+int inFlight;		/* Transactions sent and not answered yet */
+
 /* initSocketAddress
 * Initialises a sockaddr_in struct given a host name and a port.
 */
@@ -38,32 +42,49 @@ void initSocketAddress(struct sockaddr_in *name, char *hostName, unsigned short
 }
 
 
-/* writeMessage
-* Writes the string message to the file (socket)
-* denoted by fileDescriptor.
-*/
-void writeMessage(int fileDescriptor, char *message)
+/* Read the whole file <fileName>, its size goes to <length>. Returns NULL if it cannot be read */
+char * readFile(char *fileName, uint32_t *length)
 {
-	int nOfBytes;
+	FILE *file;
+	char *data;
+	long size;
 
-	nOfBytes = write(fileDescriptor, message, strlen(message) + 1);
-	if(nOfBytes < 0)
+	file = fopen(fileName, "r");
+	if(file == NULL)
+		return NULL;
+	data = NULL;
+	if( (fseek(file, 0, SEEK_END) == 0) && ((size = ftell(file)) >= 0) && (size <= maxFrameLength) && (fseek(file, 0, SEEK_SET) == 0) )
 	{
-		perror("writeMessage - Could not write data\n");
-		exit(EXIT_FAILURE);
+		data = malloc(size + 1);
+		if(data && fread(data, 1, size, file) != (size_t)size)
+		{
+			free(data);
+			data = NULL;
+		}
+		*length = (uint32_t)size;
 	}
+	fclose(file);
+	return data;
 }
-int readMessage(int fileDescriptor)
+
+/* Print the result of one transaction. Returns 0 if the connection is gone */
+int readMessage(int fileDescriptor, struct frame_buffer *b)
 {
-	int nOfBytes;
-	char buffer[MAXMSG];
-	nOfBytes = read(fileDescriptor, buffer, MAXMSG);
-	if(nOfBytes < 0)
+	struct frame_header h;
+	char *payload;
+	int r;
+
+	if(frame_fill(fileDescriptor, b) <= 0)
+		return 0;
+	while((r = frame_next(b, &h, &payload)) > 0)
 	{
-        return 0;
+		trace_event(h.traceId, "receive", "\"type\":\"%s\",\"request\":%llu", frame_type_name(h.type), (unsigned long long)h.requestId);
+		if(h.type == MSG_RESULT && h.length > 0)
+			printf("Message received from server (transaction %llu, trace %016llx): %.*s\n", (unsigned long long)h.requestId,
+				(unsigned long long)h.traceId, (int)h.length - 1, payload + 1);
+		inFlight--;
 	}
-	printf("Message received from server: %s\n", buffer);
-	return 1;
+	return (r == 0);
 }
 
 void choppy(char *a)
@@ -77,17 +98,20 @@ void choppy(char *a)
 
 int main(int argc, char *argv[])
 {
-	int sock, i;
+	int sock, i, k, repeat, quit;
 	struct sockaddr_in serverName;
 	char hostName[hostNameLength];
-	char messageString[MAXMSG];
+	char messageString[maxLine], fileName[maxLine];
+	char *transaction;
+	uint32_t length;
+	uint64_t nextRequestId, traceId;
+	struct frame_buffer in;
 	fd_set activeFdSet, readFdSet;
-	FILE *transaction;
 
 	/* Check arguments */
 	if(argv[1] == NULL)
 	{
-		perror("Usage: client [host name]\n");
+		perror("Usage: client [host name] [trace file]\n");
 		exit(EXIT_FAILURE);
 	}
 	else
@@ -95,6 +119,8 @@ int main(int argc, char *argv[])
 		strncpy(hostName, argv[1], hostNameLength);
 		hostName[hostNameLength - 1] = '\0';
 	}
+	if(argc > 2)
+		trace_open(argv[2], "client");
 	/* Create the socket */
 	sock = socket(PF_INET, SOCK_STREAM, 0);
 	if(sock < 0)
@@ -110,16 +136,19 @@ int main(int argc, char *argv[])
 		perror("Could not connect to server\n");
 		exit(EXIT_FAILURE);
 	}
+	frame_buffer_init(&in);
+	nextRequestId = 1;
+	quit = 0;
 	FD_ZERO(&activeFdSet);
 	FD_ZERO(&readFdSet);
 	FD_SET(sock, &activeFdSet);
 	FD_SET(STDIN, &activeFdSet);
 	/* Send data to the server */
-	printf("\nType a transaction file name to send to server:\n");
-	printf("Type 'quit' to nuke this program.\n");
+	printf("\nType a transaction file name to send to server, optionally followed by how many times to send it:\n");
+	printf("Type 'quit' to nuke this program (once the transactions sent have been answered).\n");
 	fflush(stdin);
 
-	while(1)
+	while( !quit || (inFlight > 0) )
 	{
 		readFdSet=activeFdSet;
 		if(select(FD_SETSIZE, &readFdSet, NULL, NULL, NULL) <= 0)
@@ -133,25 +162,44 @@ int main(int argc, char *argv[])
 			{
 				if(i==STDIN)
 				{
-					fgets(messageString, MAXMSG, stdin);
-					messageString[MAXMSG - 1] = '\0';
-					if(strncmp(messageString, "quit\n", MAXMSG))
+					if( (fgets(messageString, maxLine, stdin) == NULL) || !strncmp(messageString, "quit\n", maxLine) )
 					{
-						choppy(messageString);
-						transaction = fopen(messageString, "r");
-						fread(messageString, MAXMSG, 1, transaction);
-						writeMessage(sock, messageString);
+						/* Stop reading commands, leave once everything sent has been answered */
+						quit = 1;
+						FD_CLR(STDIN, &activeFdSet);
 					}
 					else
 					{
-						close(sock);
-						exit(EXIT_SUCCESS);
+						choppy(messageString);
+						repeat = 1;
+						if(sscanf(messageString, "%s %d", fileName, &repeat) < 1)
+							continue;
+						transaction = readFile(fileName, &length);
+						if(transaction == NULL)
+						{
+							printf("Could not read transaction file %s\n", fileName);
+							continue;
+						}
+						/* All the copies go out back to back, their results come back by request id. Each one is a
+						transaction of its own, with a trace id of its own that the servers tracing it record it under */
+						for(k=0; k<repeat; k++)
+						{
+							traceId = trace_new_id();
+							trace_event(traceId, "send", "\"type\":\"transaction\",\"request\":%llu", (unsigned long long)nextRequestId);
+							if(frame_send(sock, MSG_TRANSACTION, nextRequestId++, traceId, transaction, length) < 0)
+							{
+								perror("Connection closed by server!\n");
+								exit(EXIT_FAILURE);
+							}
+							inFlight++;
+						}
+						free(transaction);
 					}
 					fflush(stdin);
 				}
 				else if(i==sock)
 				{
-					if(!(readMessage(sock)))
+					if(!(readMessage(sock, &in)))
 					{
                         perror("Connection closed by server!\n");
                         exit(EXIT_FAILURE);
@@ -160,4 +208,6 @@ int main(int argc, char *argv[])
 			}
 		}
 	}
+	close(sock);
+	exit(EXIT_SUCCESS);
 }
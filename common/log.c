@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "log.h"
+
+/* The lines one thread logged and the writer has not written yet. Only the owner moves head, only the writer moves tail */
+struct log_ring
+{
+	uint64_t head __attribute__((aligned(64)));		/* Next slot the owner fills */
+	uint64_t tail __attribute__((aligned(64)));		/* Next slot the writer empties */
+	int inUse;						/* Owned by a running thread; a free ring goes to the next thread that logs */
+	struct log_ring *next;
+	uint16_t lengths[logRingSlots];
+	char lines[logRingSlots][logLineSize];
+};
+
+int logLevel = defaultLogLevel;
+
+static pthread_mutex_t ringsLock = PTHREAD_MUTEX_INITIALIZER;		/* Guards the list of rings and handing them out */
+static struct log_ring *rings;
+static pthread_mutex_t drainLock = PTHREAD_MUTEX_INITIALIZER;		/* One drainer at a time: the writer, a thread whose ring is full, or log_flush */
+static pthread_key_t ringKey;
+static __thread struct log_ring *myRing;
+static int started;
+
+static int log_drain(void);
+
+static const char *levelNames[] = {"error", "warn", "info", "debug"};
+
+/* Level named <name>, -1 if there is none */
+int log_level_of(const char *name)
+{
+	int i;
+
+	for(i=0; i<=LOG_DEBUG; i++)
+		if(!strcmp(name, levelNames[i]))
+			return i;
+	return -1;
+}
+
+/* The thread owning <args> (its ring) ended: the ring goes back for another thread, once the writer has emptied it */
+static void ring_release(void *args)
+{
+	struct log_ring *r = (struct log_ring *) args;
+
+	__atomic_store_n(&r->inUse, 0, __ATOMIC_RELEASE);
+}
+
+/* The calling thread's ring, handed out the first time it logs */
+static struct log_ring * ring_mine(void)
+{
+	struct log_ring *r;
+
+	if(myRing)
+		return myRing;
+	pthread_mutex_lock(&ringsLock);
+	for(r = rings; r; r = r->next)
+	{
+		if(!__atomic_load_n(&r->inUse, __ATOMIC_ACQUIRE) && __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == r->head)
+			break;
+	}
+	if(!r)
+	{
+		r = calloc(1, sizeof(struct log_ring));
+		if(!r)
+		{
+			perror("Could not allocate a log ring\n");
+			exit(EXIT_FAILURE);
+		}
+		r->next = rings;
+		__atomic_store_n(&rings, r, __ATOMIC_RELEASE);
+	}
+	r->inUse = 1;
+	pthread_mutex_unlock(&ringsLock);
+	pthread_setspecific(ringKey, r);
+	myRing = r;
+	return r;
+}
+
+/* Log one line: formatted into the calling thread's ring, written out later by the writer thread */
+void log_write(const char *format, ...)
+{
+	struct log_ring *r;
+	va_list args;
+	uint64_t head;
+	char *line;
+	int length;
+
+	if(!started)		//Nobody to write it out yet
+	{
+		va_start(args, format);
+		vprintf(format, args);
+		va_end(args);
+		return;
+	}
+	r = ring_mine();
+	head = r->head;
+	if(head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == logRingSlots)
+		log_drain();		//The writer fell behind: write out the rings ourselves rather than lose the line
+	line = r->lines[head % logRingSlots];
+	va_start(args, format);
+	length = vsnprintf(line, logLineSize, format, args);
+	va_end(args);
+	if(length < 0)
+		length = 0;
+	if(length >= logLineSize)		//Cut, but still a line of its own
+	{
+		length = logLineSize - 1;
+		line[length - 1] = '\n';
+	}
+	r->lengths[head % logRingSlots] = (uint16_t)length;
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Write out what every ring holds. Returns how many lines that was */
+static int log_drain(void)
+{
+	struct log_ring *r;
+	uint64_t tail, head;
+	int written = 0;
+
+	pthread_mutex_lock(&drainLock);
+	for(r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next)
+	{
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		for(tail = r->tail; tail != head; tail++)
+			fwrite(r->lines[tail % logRingSlots], 1, r->lengths[tail % logRingSlots], stdout);
+		written += (int)(head - r->tail);
+		__atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+	}
+	if(written)
+		fflush(stdout);
+	pthread_mutex_unlock(&drainLock);
+	return written;
+}
+
+/* Write out everything logged so far, from any thread (also run at exit) */
+void log_flush(void)
+{
+	if(started)
+		log_drain();
+	fflush(stdout);
+}
+
+static void * log_writer(void *args)
+{
+	struct timespec idle;
+
+	idle.tv_sec = 0;
+	idle.tv_nsec = logFlushMs * 1000000L;
+	while(1)
+	{
+		if(log_drain() == 0)
+			nanosleep(&idle, NULL);
+	}
+	return NULL;
+}
+
+/* Start logging at <level>: from now on lines go through the rings and the writer thread */
+void log_init(int level)
+{
+	pthread_t thread;
+
+	logLevel = level;
+	if(pthread_key_create(&ringKey, ring_release) != 0 || pthread_create(&thread, NULL, log_writer, NULL) != 0)
+	{
+		perror("Could not start the log writer\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_detach(thread);
+	fflush(stdout);
+	started = 1;
+	atexit(log_flush);
+}
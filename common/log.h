@@ -0,0 +1,50 @@
+/*
+ * log.h
+ *
+ * Asynchronous logging for the servers. A thread that logs formats the line
+ * into a ring of its own, which only it writes and only the writer thread
+ * reads, so logging takes no lock and makes no system call; the writer
+ * drains every ring to stdout in the background. A thread that finds its
+ * ring full writes the rings out itself, so no line is lost. Lines of one
+ * thread come out in order, lines of different threads may come out slightly
+ * reordered.
+ *
+ * A line below the runtime level (-v) costs a comparison, its arguments are
+ * not even evaluated; one below LOG_LEVEL_MAX is compiled out altogether.
+ */
+
+#ifndef LOG_H_
+#define LOG_H_
+
+#include <stdint.h>
+
+/* Levels, most important first */
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2				/* Startup, connections, recovery, checkpoints, what reads print */
+#define LOG_DEBUG 3				/* Every step of every transaction */
+
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX LOG_DEBUG	/* Build with -DLOG_LEVEL_MAX=LOG_INFO to compile the per-transaction lines out */
+#endif
+#define defaultLogLevel LOG_INFO
+
+#define logRingSlots 1024		/* Lines a thread can have waiting for the writer */
+#define logLineSize 256			/* Longer lines are cut */
+#define logFlushMs 5			/* The writer looks at the rings this often when there is nothing to write */
+
+extern int logLevel;
+
+#define log_enabled(level) ((level) <= LOG_LEVEL_MAX && (level) <= logLevel)
+#define log_at(level, ...) do { if(log_enabled(level)) log_write(__VA_ARGS__); } while(0)
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_WARN, __VA_ARGS__)
+#define log_info(...) log_at(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+
+void log_init(int level);
+int log_level_of(const char *name);
+void log_write(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void log_flush(void);
+
+#endif /* LOG_H_ */
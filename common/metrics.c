@@ -0,0 +1,257 @@
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <time.h>
+#include "protocol.h"
+#include "metrics.h"
+#include "log.h"
+
+/* What the metrics thread sends, built up for every request */
+struct metrics_text
+{
+	char *data;
+	size_t used, capacity;
+};
+
+/* Registered at startup, before metrics_start: the metrics thread only ever reads the lists */
+static struct counter *counters, **countersTail = &counters;
+static struct histogram *histograms, **histogramsTail = &histograms;
+
+uint64_t metrics_now_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* Bucket of <us>: the values below 2^histogramSubBits have one each, above that every power of two
+is split into 2^histogramSubBits buckets by the bits right after its top one */
+int bucket_of(uint64_t us)
+{
+	int top, index;
+
+	if(us < (1 << histogramSubBits))
+		return (int)us;
+	top = 63 - __builtin_clzll(us);
+	index = ((top - histogramSubBits + 1) << histogramSubBits) + (int)((us >> (top - histogramSubBits)) & ((1 << histogramSubBits) - 1));
+	return (index < histogramBuckets) ? index : histogramBuckets - 1;
+}
+
+/* Largest value (us) in bucket <index>: what its Prometheus bucket is labelled with */
+uint64_t bucket_top(int index)
+{
+	int shift;
+
+	if(index < (1 << histogramSubBits))
+		return (uint64_t)index;
+	shift = (index >> histogramSubBits) - 1;
+	return (((uint64_t)(index & ((1 << histogramSubBits) - 1)) + (1 << histogramSubBits) + 1) << shift) - 1;
+}
+
+void histogram_record(struct histogram *h, uint64_t us)
+{
+	__atomic_fetch_add(&h->buckets[bucket_of(us)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sumUs, us, __ATOMIC_RELAXED);
+}
+
+/* Record the time since <startUs> (from metrics_now_us) */
+void histogram_since(struct histogram *h, uint64_t startUs)
+{
+	histogram_record(h, metrics_now_us() - startUs);
+}
+
+void metrics_counter(struct counter *c)
+{
+	c->next = NULL;
+	*countersTail = c;
+	countersTail = &c->next;
+}
+
+void metrics_histogram(struct histogram *h)
+{
+	h->next = NULL;
+	*histogramsTail = h;
+	histogramsTail = &h->next;
+}
+
+static void text_append(struct metrics_text *t, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void text_append(struct metrics_text *t, const char *format, ...)
+{
+	va_list args;
+	int length;
+
+	while(1)
+	{
+		va_start(args, format);
+		length = vsnprintf(t->data + t->used, t->capacity - t->used, format, args);
+		va_end(args);
+		if(length < 0)
+			return;
+		if(t->used + length < t->capacity)
+			break;
+		t->capacity = (t->used + length + 1) * 2;
+		t->data = realloc(t->data, t->capacity);
+		if(!t->data)
+		{
+			perror("Could not grow the metrics text\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	t->used += length;
+}
+
+/* The HELP and TYPE lines of a family, before its first member */
+static void text_family(struct metrics_text *t, const char *name, const char *help, const char *type)
+{
+	text_append(t, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* Everything registered, in the Prometheus text format. A histogram's buckets go up to its highest
+non-empty one, labelled with the largest value they hold in seconds */
+static void metrics_render(struct metrics_text *t)
+{
+	struct counter *c;
+	struct histogram *h;
+	const char *family = NULL;
+	uint64_t counts[histogramBuckets], total;
+	int i, last;
+
+	t->used = 0;
+	for(c = counters; c; c = c->next)
+	{
+		if(!family || strcmp(family, c->name))
+			text_family(t, c->name, c->help, "counter");
+		family = c->name;
+		text_append(t, "%s%s%s%s %llu\n", c->name, c->labels ? "{" : "", c->labels ? c->labels : "", c->labels ? "}" : "",
+			(unsigned long long)__atomic_load_n(&c->value, __ATOMIC_RELAXED));
+	}
+	family = NULL;
+	for(h = histograms; h; h = h->next)
+	{
+		if(!family || strcmp(family, h->name))
+			text_family(t, h->name, h->help, "histogram");
+		family = h->name;
+		last = -1;
+		for(i=0; i<histogramBuckets; i++)
+		{
+			counts[i] = __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+			if(counts[i])
+				last = i;
+		}
+		total = 0;
+		for(i=0; i<=last; i++)
+		{
+			total += counts[i];
+			text_append(t, "%s_bucket{%s%sle=\"%.12g\"} %llu\n", h->name, h->labels ? h->labels : "", h->labels ? "," : "",
+				bucket_top(i) / 1e6, (unsigned long long)total);
+		}
+		text_append(t, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", h->name, h->labels ? h->labels : "", h->labels ? "," : "", (unsigned long long)total);
+		text_append(t, "%s_sum%s%s%s %.6f\n", h->name, h->labels ? "{" : "", h->labels ? h->labels : "", h->labels ? "}" : "",
+			__atomic_load_n(&h->sumUs, __ATOMIC_RELAXED) / 1e6);
+		text_append(t, "%s_count%s%s%s %llu\n", h->name, h->labels ? "{" : "", h->labels ? h->labels : "", h->labels ? "}" : "",
+			(unsigned long long)total);
+	}
+}
+
+/* Answer the request on <client>: the metrics for a GET of / or /metrics, 404 for anything else */
+static void metrics_answer(int client, struct metrics_text *t)
+{
+	char request[metricsRequestSize], header[256];
+	const char *status;
+	ssize_t n;
+	int length;
+
+	n = recv(client, request, sizeof(request) - 1, 0);
+	if(n <= 0)
+		return;
+	request[n] = '\0';
+	if(!strncmp(request, "GET /metrics ", 13) || !strncmp(request, "GET /metrics?", 13) || !strncmp(request, "GET / ", 6))
+	{
+		status = "200 OK";
+		metrics_render(t);
+	}
+	else
+	{
+		status = "404 Not Found";
+		t->used = 0;
+		text_append(t, "Only /metrics is here\n");
+	}
+	length = snprintf(header, sizeof(header), "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+		status, t->used);
+	if(frame_send_buffer(client, header, length) == 0)
+		frame_send_buffer(client, t->data, t->used);
+}
+
+/* Metrics thread: one scraper at a time on the listening socket <args>, a connection per request */
+static void * metrics_server(void *args)
+{
+	int sock = (int)(intptr_t) args, client;
+	struct metrics_text text;
+	struct timeval timeout;
+
+	text.capacity = 65536;
+	text.used = 0;
+	text.data = malloc(text.capacity);
+	if(!text.data)
+	{
+		perror("Could not allocate the metrics text\n");
+		exit(EXIT_FAILURE);
+	}
+	timeout.tv_sec = metricsTimeoutMs / 1000;
+	timeout.tv_usec = (metricsTimeoutMs % 1000) * 1000;
+	while(1)
+	{
+		client = accept(sock, NULL, NULL);
+		if(client < 0)
+			continue;
+		setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));		//A silent or stuck scraper does not hold up the next one
+		setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		metrics_answer(client, &text);
+		close(client);
+	}
+	return NULL;
+}
+
+/* Serve the metrics on the loopback interface at <port>, 0 for not at all. A port that is taken only costs the metrics */
+void metrics_start(unsigned short port)
+{
+	struct sockaddr_in name;
+	pthread_t thread;
+	int sock, reuse = 1;
+
+	if(port == 0)
+		return;
+	sock = socket(PF_INET, SOCK_STREAM, 0);
+	if(sock < 0)
+	{
+		perror("Could not create the metrics socket\n");
+		exit(EXIT_FAILURE);
+	}
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	name.sin_family = AF_INET;
+	name.sin_port = htons(port);
+	name.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(bind(sock, (struct sockaddr *)&name, sizeof(name)) < 0 || listen(sock, SOMAXCONN) < 0)
+	{
+		log_warn("Could not serve metrics on port %hu (%s), running without them!\n", port, strerror(errno));
+		close(sock);
+		return;
+	}
+	if(pthread_create(&thread, NULL, metrics_server, (void *)(intptr_t) sock) != 0)
+	{
+		perror("Could not start the metrics thread\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_detach(thread);
+	log_info("Serving metrics on http://127.0.0.1:%hu/metrics\n", port);
+}
@@ -0,0 +1,56 @@
+/*
+ * metrics.h
+ *
+ * Counters and latency histograms of a server, for finding out where the time
+ * of its transactions goes without attaching a profiler. Both are updated with
+ * relaxed atomic adds, so recording takes no lock. A histogram keeps HDR-style
+ * buckets, four per power of two of microseconds, so any latency from a
+ * microsecond to days is kept to within 25%. A thread of its own answers HTTP
+ * requests on a local port with all of them, in the Prometheus text format.
+ */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdint.h>
+
+#define histogramSubBits 2			/* 2^histogramSubBits buckets per power of two */
+#define histogramBuckets 148		/* Up to 2^38 us, longer goes in the last bucket */
+#define metricsRequestSize 1024		/* HTTP requests are cut there, only the request line matters */
+#define metricsTimeoutMs 1000		/* How long a scraper gets to send its request */
+
+/* A count that only goes up. Counters of one family (same name, other labels) are registered one after the other */
+struct counter
+{
+	uint64_t value;
+	const char *name;
+	const char *labels;				/* Prometheus labels without the braces, NULL for none */
+	const char *help;
+	struct counter *next;
+};
+
+/* Latencies, in microseconds. Histograms of one family are registered one after the other */
+struct histogram
+{
+	uint64_t buckets[histogramBuckets];		/* Observations per bucket, not cumulative */
+	uint64_t sumUs;
+	const char *name;
+	const char *labels;
+	const char *help;
+	struct histogram *next;
+};
+
+#define COUNTER(name, labels, help) { 0, name, labels, help, NULL }
+#define HISTOGRAM(name, labels, help) { {0}, 0, name, labels, help, NULL }
+#define counter_add(c, n) __atomic_fetch_add(&(c)->value, (uint64_t)(n), __ATOMIC_RELAXED)
+
+uint64_t metrics_now_us(void);
+int bucket_of(uint64_t us);
+uint64_t bucket_top(int index);
+void histogram_record(struct histogram *h, uint64_t us);
+void histogram_since(struct histogram *h, uint64_t startUs);
+void metrics_counter(struct counter *c);
+void metrics_histogram(struct histogram *h);
+void metrics_start(unsigned short port);
+
+#endif /* METRICS_H_ */
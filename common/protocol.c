@@ -0,0 +1,256 @@
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "protocol.h"
+
+#define frameBufferSize 65536
+
+void put_u64(char *p, uint64_t value)
+{
+	int i;
+
+	for(i=7; i>=0; i--)
+	{
+		p[i] = (char)(value & 0xFF);
+		value >>= 8;
+	}
+}
+
+uint64_t get_u64(const char *p)
+{
+	uint64_t value = 0;
+	int i;
+
+	for(i=0; i<8; i++)
+		value = (value << 8) | (unsigned char)p[i];
+	return value;
+}
+
+void put_u32(char *p, uint32_t value)
+{
+	p[0] = (char)(value >> 24);
+	p[1] = (char)(value >> 16);
+	p[2] = (char)(value >> 8);
+	p[3] = (char)value;
+}
+
+uint32_t get_u32(const char *p)
+{
+	return ((uint32_t)(unsigned char)p[0] << 24) | ((uint32_t)(unsigned char)p[1] << 16) |
+		((uint32_t)(unsigned char)p[2] << 8) | (uint32_t)(unsigned char)p[3];
+}
+
+void frame_buffer_init(struct frame_buffer *b)
+{
+	b->data = NULL;
+	b->start = b->used = b->capacity = 0;
+}
+
+void frame_buffer_free(struct frame_buffer *b)
+{
+	free(b->data);
+	frame_buffer_init(b);
+}
+
+/* Encode the header of a frame carrying <length> payload bytes into <header> (frameHeaderSize bytes) */
+void frame_header_put(char *header, int type, uint64_t requestId, uint64_t traceId, uint32_t length)
+{
+	put_u32(header, length);
+	header[4] = (char)type;
+	header[5] = 0;
+	header[6] = header[7] = 0;
+	put_u64(header + 8, requestId);
+	put_u64(header + 16, traceId);
+}
+
+/* Read whatever <fd> has into <b>, making room for at least the frame that is pending.
+Returns the number of bytes read, 0 at end of file, -1 on error (errno is EAGAIN if a non-blocking socket had nothing) */
+int frame_fill(int fd, struct frame_buffer *b)
+{
+	size_t need;
+	ssize_t n;
+
+	/* Move the unconsumed bytes to the front, then grow if the pending frame still does not fit */
+	if(b->start > 0)
+	{
+		memmove(b->data, b->data + b->start, b->used - b->start);
+		b->used -= b->start;
+		b->start = 0;
+	}
+	need = frameBufferSize;
+	if(b->used >= frameHeaderSize)
+		need = frameHeaderSize + get_u32(b->data);
+	if(need < b->used + 1)
+		need = b->used + 1;
+	if(need > b->capacity)
+	{
+		if(need < frameBufferSize)
+			need = frameBufferSize;
+		b->data = realloc(b->data, need);
+		if(!b->data)
+		{
+			perror("Could not grow a receive buffer\n");
+			exit(EXIT_FAILURE);
+		}
+		b->capacity = need;
+	}
+	do
+		n = read(fd, b->data + b->used, b->capacity - b->used);
+	while(n < 0 && errno == EINTR);
+	if(n > 0)
+		b->used += n;
+	return (int)n;
+}
+
+static void frame_header_get(const char *p, struct frame_header *h)
+{
+	h->length = get_u32(p);
+	h->type = (uint8_t)p[4];
+	h->flags = (uint8_t)p[5];
+	h->requestId = get_u64(p + 8);
+	h->traceId = get_u64(p + 16);
+}
+
+/* Cut the next complete frame out of <b>. <payload> points into the buffer and stays valid until the next frame_fill.
+Returns 1 if there was one, 0 if more data is needed, -1 if the stream is not a valid frame stream */
+int frame_next(struct frame_buffer *b, struct frame_header *h, char **payload)
+{
+	if(b->used - b->start < frameHeaderSize)
+		return 0;
+	frame_header_get(b->data + b->start, h);
+	if(h->length > maxFrameLength)
+		return -1;
+	if(b->used - b->start < frameHeaderSize + (size_t)h->length)
+		return 0;
+	*payload = b->data + b->start + frameHeaderSize;
+	b->start += frameHeaderSize + h->length;
+	return 1;
+}
+
+/* Blocking receive of the next frame from <fd>, buffered in <b>.
+Returns 0, or -1 if the connection ended or broke */
+int frame_recv(int fd, struct frame_buffer *b, struct frame_header *h, char **payload)
+{
+	int r;
+
+	while((r = frame_next(b, h, payload)) == 0)
+	{
+		if(frame_fill(fd, b) <= 0)
+			return -1;
+	}
+	return (r < 0) ? -1 : 0;
+}
+
+/* Send one frame. Short writes are continued (waiting for the socket to drain if it is non-blocking).
+Returns 0, or -1 if the other side has gone away */
+int frame_send(int fd, int type, uint64_t requestId, uint64_t traceId, const void *payload, uint32_t length)
+{
+	char header[frameHeaderSize];
+	struct iovec iov[2];
+	struct msghdr msg;
+	struct pollfd pfd;
+	ssize_t n;
+	int count;
+
+	frame_header_put(header, type, requestId, traceId, length);
+	iov[0].iov_base = header;
+	iov[0].iov_len = frameHeaderSize;
+	iov[1].iov_base = (void *)payload;
+	iov[1].iov_len = length;
+	count = (length > 0) ? 2 : 1;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	while(count > 0)
+	{
+		msg.msg_iovlen = count;
+		n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				pfd.fd = fd;
+				pfd.events = POLLOUT;
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			return -1;
+		}
+		/* Skip what went out */
+		while(count > 0 && (size_t)n >= msg.msg_iov[0].iov_len)
+		{
+			n -= msg.msg_iov[0].iov_len;
+			msg.msg_iov++;
+			count--;
+		}
+		if(count > 0)
+		{
+			msg.msg_iov[0].iov_base = (char *)msg.msg_iov[0].iov_base + n;
+			msg.msg_iov[0].iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+/* Next frame of MSG_GROUP payload <batch> (<length> bytes), starting at <offset>, which moves past it.
+Returns 1 if there was one, 0 at the end of the batch, -1 if the batch is malformed */
+int frame_batch_next(const char *batch, uint32_t length, uint32_t *offset, struct frame_header *h, char **payload)
+{
+	if(*offset == length)
+		return 0;
+	if(length - *offset < frameHeaderSize)
+		return -1;
+	frame_header_get(batch + *offset, h);
+	if(h->length > length - *offset - frameHeaderSize || h->type == MSG_GROUP)
+		return -1;
+	*payload = (char *)batch + *offset + frameHeaderSize;
+	*offset += frameHeaderSize + h->length;
+	return 1;
+}
+
+/* Send <length> bytes of ready-made frames, see frame_send. Returns 0, or -1 if the other side has gone away */
+int frame_send_buffer(int fd, const char *data, size_t length)
+{
+	struct pollfd pfd;
+	ssize_t n;
+
+	while(length > 0)
+	{
+		n = send(fd, data, length, MSG_NOSIGNAL);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				pfd.fd = fd;
+				pfd.events = POLLOUT;
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			return -1;
+		}
+		data += n;
+		length -= n;
+	}
+	return 0;
+}
+
+/* Name of message type <type>, for logs and traces */
+const char * frame_type_name(int type)
+{
+	static const char *names[] = {"unknown", "transaction", "vote", "decision", "ack", "resolve", "result", "ping", "execute",
+		"group", "prepare", "status", "sequence", "order", "waits", "break", "subscribe", "state", "log"};
+
+	if(type < 0 || type >= (int)(sizeof(names) / sizeof(names[0])))
+		return names[0];
+	return names[type];
+}
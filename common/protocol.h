@@ -0,0 +1,108 @@
+/*
+ * protocol.h
+ *
+ * Wire protocol shared by the client, the middleware and the database server.
+ * Every message is a frame: a fixed header with the payload length, the message
+ * type and a request id, followed by the payload. A reply carries the id of the
+ * request it answers, so a connection can have any number of requests in flight
+ * and the replies may come back in any order.
+ */
+
+#ifndef PROTOCOL_H_
+#define PROTOCOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define frameHeaderSize 24
+#define maxFrameLength (16 << 20)		/* Larger frames are treated as a protocol error */
+
+/* Message types */
+#define MSG_TRANSACTION 1		/* Transaction text; answered by MSG_VOTE (between servers) or MSG_RESULT (to a client) */
+#define MSG_VOTE 2				/* Vote byte ('0', '1' or RESULT_REFUSED), then the 8 byte id the db server gave the transaction */
+#define MSG_DECISION 3			/* Decision byte for the transaction sent under the same request id; answered by MSG_ACK */
+#define MSG_ACK 4
+#define MSG_RESOLVE 5			/* 8 byte transaction id, then the decision byte; answered by MSG_ACK */
+#define MSG_RESULT 6			/* Outcome byte, then a text message for the user */
+#define MSG_PING 7				/* Health check of a long-lived connection; answered by MSG_ACK */
+#define MSG_EXECUTE 8			/* Transaction text of a single shard, or a read-only piece, run and committed in one go; answered by MSG_RESULT */
+#define MSG_GROUP 9				/* Many frames (not groups) sent as one: the payload is their headers and payloads back to back */
+#define MSG_PREPARE 10			/* 8 byte global transaction id, 4 byte mask of the shards it touches, then the text; answered by MSG_VOTE */
+#define MSG_STATUS 11			/* 8 byte global transaction id; answered by MSG_RESULT, see below */
+#define MSG_SEQUENCE 12			/* Sequenced mode: 8 byte batch id, then the batch's transactions for one shard, each a 4 byte length
+								and its text; run in batch order and answered by MSG_ACK once durable, with the 4 byte
+								positions in it of the transactions that could not run */
+#define MSG_ORDER 13			/* Sequenced mode: transaction text for the sequencer; answered by MSG_RESULT once every shard ran it */
+#define MSG_WAITS 14			/* Empty; answered by MSG_WAITS with the database server's wait-for edges, waitEdgeSize bytes each:
+								the waiting transaction's id (8), the id of one it waits for (8), how long the waiter has been at it in ms (4) */
+#define MSG_BREAK 15			/* 8 byte id of a deadlock victim, whose lock wait gives up; answered by MSG_ACK */
+#define MSG_SUBSCRIBE 16		/* Empty, from a replica; answered by MSG_STATE and then MSG_LOG frames for as long as the connection lasts */
+#define MSG_STATE 17			/* The primary's values: 8 byte log position the log follows from, 8 byte position the replica has
+								to get to before it serves reads, then log entries (key length, key, value) back to back */
+#define MSG_LOG 18				/* 8 byte log position of the records, 8 byte position the primary's log is durable up to, then
+								whole log records; without records it only says the primary is still there */
+
+/* Outcome of a transaction in MSG_RESULT */
+#define RESULT_ABORTED '0'
+#define RESULT_COMMITTED '1'
+#define RESULT_UNKNOWN '?'		/* The connection broke while it ran, it may or may not have committed */
+#define RESULT_PREPARED 'P'		/* MSG_STATUS: prepared, not decided yet */
+#define RESULT_REFUSED '!'		/* Aborted because an increment could cross its bound, running it again would not help yet */
+#define RESULT_STALE 'S'		/* A replica is too far behind its primary to serve the read, the primary has to */
+
+/* Global transaction ids, given by the coordinating middleware, have the top bit set so they never meet
+the ids a database server numbers its own transactions with. A transaction commits if and only if every
+shard it touches prepared it: MSG_STATUS answers an id the database server has not prepared with
+RESULT_ABORTED and keeps it from ever preparing, so whoever asks gets an answer that stays true. */
+#define globalTxidFlag 0x8000000000000000ULL
+
+/* Batch ids carry the sequencer's incarnation in the high 32 bits and the batch number, from 1, in the low ones.
+A database server runs the batches of a sequencer one after the other in number order, those of a newer one from its first. */
+
+#define votePayloadSize 9
+#define resolvePayloadSize 9
+#define preparePrefixSize 12
+#define statusPayloadSize 8
+#define batchPrefixSize 8
+#define breakPayloadSize 8
+#define waitEdgeSize 20
+#define shipPrefixSize 16
+#define resultLagSize 5			/* A replica's MSG_RESULT: the outcome, then how far behind its primary it read, in ms (4) */
+#define maxWaitEdges 4096		/* Edges one MSG_WAITS answer carries at most */
+
+/* Frame header. On the wire: length (4), type (1), flags (1), reserved (2), request id (8), trace id (8), big endian */
+struct frame_header
+{
+	uint32_t length;			/* Payload bytes following the header */
+	uint8_t  type;
+	uint8_t  flags;
+	uint64_t requestId;
+	uint64_t traceId;			/* The client's id of the transaction the frame is about, 0 for none (see trace.h) */
+};
+
+/* Receive buffer that frames are cut out of */
+struct frame_buffer
+{
+	char *data;
+	size_t start;				/* First byte not consumed yet */
+	size_t used;				/* End of the data read so far */
+	size_t capacity;
+};
+
+void put_u64(char *p, uint64_t value);
+uint64_t get_u64(const char *p);
+void put_u32(char *p, uint32_t value);
+uint32_t get_u32(const char *p);
+
+void frame_header_put(char *header, int type, uint64_t requestId, uint64_t traceId, uint32_t length);
+void frame_buffer_init(struct frame_buffer *b);
+void frame_buffer_free(struct frame_buffer *b);
+int frame_fill(int fd, struct frame_buffer *b);
+int frame_next(struct frame_buffer *b, struct frame_header *h, char **payload);
+int frame_recv(int fd, struct frame_buffer *b, struct frame_header *h, char **payload);
+int frame_send(int fd, int type, uint64_t requestId, uint64_t traceId, const void *payload, uint32_t length);
+int frame_send_buffer(int fd, const char *data, size_t length);
+int frame_batch_next(const char *batch, uint32_t length, uint32_t *offset, struct frame_header *h, char **payload);
+const char * frame_type_name(int type);
+
+#endif /* PROTOCOL_H_ */
@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include "trace.h"
+
+FILE *traceFile;					/* NULL when not tracing */
+static int processId;				/* The "pid" of our events: unique across machines, unlike our pid */
+static uint64_t nextTraceId;
+static __thread int threadId;
+
+/* Mix <x> into 64 well spread bits (splitmix64) */
+static uint64_t trace_mix(uint64_t x)
+{
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+/* A trace id for a new transaction: a random start for this process, counted up from there. Never 0 */
+uint64_t trace_new_id(void)
+{
+	uint64_t id, unset = 0;
+
+	if(!__atomic_load_n(&nextTraceId, __ATOMIC_RELAXED))
+	{
+		id = trace_mix(((uint64_t)time(NULL) << 20) ^ (uint64_t)getpid() ^ ((uint64_t)clock() << 40));
+		__atomic_compare_exchange_n(&nextTraceId, &unset, id, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+	do
+		id = __atomic_fetch_add(&nextTraceId, 1, __ATOMIC_RELAXED);
+	while(id == 0);
+	return id;
+}
+
+/* Record event <name> of transaction <traceId>, with more args (JSON members, printf style, "" for none) */
+void trace_write(uint64_t traceId, const char *name, const char *args, ...)
+{
+	char event[traceEventSize];
+	struct timespec now;
+	va_list list;
+	int used;
+
+	if(!threadId)
+		threadId = (int)syscall(SYS_gettid);
+	clock_gettime(CLOCK_REALTIME, &now);		//Comparable across machines, as far as their clocks agree
+	used = snprintf(event, sizeof(event), "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%llu,\"pid\":%d,\"tid\":%d,\"args\":{\"trace\":\"%016llx\"",
+		name, (unsigned long long)now.tv_sec * 1000000 + now.tv_nsec / 1000, processId, threadId, (unsigned long long)traceId);
+	if(used < (int)sizeof(event) && args[0])
+	{
+		event[used++] = ',';
+		va_start(list, args);
+		used += vsnprintf(event + used, sizeof(event) - used, args, list);
+		va_end(list);
+	}
+	if(used >= (int)sizeof(event) - 4)		//Cut: the args are lost, the event still parses
+		used = snprintf(event, sizeof(event), "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%llu,\"pid\":%d,\"tid\":%d,\"args\":{\"trace\":\"%016llx\"",
+			name, (unsigned long long)now.tv_sec * 1000000 + now.tv_nsec / 1000, processId, threadId, (unsigned long long)traceId);
+	memcpy(event + used, "}},\n", 4);
+	fwrite(event, 1, used + 4, traceFile);		//One call per event: stdio keeps the events of different threads apart
+}
+
+static void trace_flush(void)
+{
+	fflush(traceFile);
+}
+
+/* Writes out what was recorded every traceFlushMs, so a server that is killed loses little */
+static void * trace_flusher(void *args)
+{
+	struct timespec period;
+
+	period.tv_sec = 0;
+	period.tv_nsec = traceFlushMs * 1000000L;
+	while(1)
+	{
+		nanosleep(&period, NULL);
+		trace_flush();
+	}
+	return NULL;
+}
+
+/* Record the events of this process, named <process> in the viewer, in trace file <path>. The file is a JSON
+array that is never closed, as Chrome and Perfetto allow; the files of several processes go together as
+the lines after their first */
+void trace_open(const char *path, const char *process)
+{
+	char host[64];
+	pthread_t thread;
+	uint64_t hash;
+	int i;
+
+	traceFile = fopen(path, "w");
+	if(!traceFile)
+	{
+		perror("Could not open the trace file\n");
+		exit(EXIT_FAILURE);
+	}
+	setvbuf(traceFile, NULL, _IOFBF, 1 << 20);
+	if(gethostname(host, sizeof(host)) < 0)
+		host[0] = '\0';
+	host[sizeof(host) - 1] = '\0';
+	hash = (uint64_t)getpid();
+	for(i=0; host[i]; i++)
+		hash = hash * 31 + (unsigned char)host[i];
+	processId = (int)(trace_mix(hash) & 0x7FFFFFFF);
+	fprintf(traceFile, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s on %s (%d)\"}},\n",
+		processId, process, host, (int)getpid());
+	fflush(traceFile);
+	if(pthread_create(&thread, NULL, trace_flusher, NULL) != 0)
+	{
+		perror("Could not start the trace flusher\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_detach(thread);
+	atexit(trace_flush);
+}
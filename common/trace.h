@@ -0,0 +1,33 @@
+/*
+ * trace.h
+ *
+ * Tracing of transactions across processes. The client gives every
+ * transaction a trace id, which travels in the header of every frame sent
+ * for it, between the middlewares and to the database servers. A process
+ * started with a trace file records the steps of the transactions it sees
+ * there (received, sent, locks acquired, voted, committed...) as Chrome
+ * trace events: one JSON object per line, with wall clock timestamps in
+ * microseconds and the trace id among its args. The lines of one trace id
+ * in the files of all the processes, in timestamp order, are the path of
+ * that transaction through the system.
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define traceFlushMs 100			/* Recorded events reach the file at most this late */
+#define traceEventSize 512			/* Longer events are cut */
+
+extern FILE *traceFile;
+
+#define trace_enabled(traceId) (traceFile && (traceId))
+#define trace_event(traceId, ...) do { if(trace_enabled(traceId)) trace_write(traceId, __VA_ARGS__); } while(0)
+
+void trace_open(const char *path, const char *process);
+uint64_t trace_new_id(void);
+void trace_write(uint64_t traceId, const char *name, const char *args, ...) __attribute__((format(printf, 3, 4)));
+
+#endif /* TRACE_H_ */
@@ -0,0 +1,295 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+#include "db_serv.h"
+#include "wal.h"
+#include "recovery.h"
+#include "checkpoint.h"
+#include "replication.h"
+#include "log.h"
+
+/* Committers work in the current epoch and mark their keys in that epoch's dirty bits (kept in the store chunks).
+A checkpoint starts a new epoch, waits until nobody is still inside the old one and
+then owns the old bits: committers never wait on a checkpoint, they just land in the next one. */
+static unsigned int epoch;
+static int active[2] __attribute__((aligned(64)));		/* Committers inside an epoch of each parity */
+
+static int snapshotFd, keysFd;
+static uint32_t persistedKeys;			/* Keys whose names and value slots the snapshot files already have */
+static uint64_t lastLsn;				/* Log position of the previous checkpoint */
+static int checkpointMs;
+
+/* Called by a committer before it applies its values; returns the epoch to pass to checkpoint_mark and checkpoint_leave */
+int checkpoint_enter(void)
+{
+	unsigned int e;
+
+	while(1)
+	{
+		e = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&active[e & 1], 1, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&epoch, __ATOMIC_SEQ_CST) == e)
+			return e & 1;
+		__atomic_sub_fetch(&active[e & 1], 1, __ATOMIC_SEQ_CST);		/* A checkpoint moved on in between, retry in the new epoch */
+	}
+}
+
+void checkpoint_mark(int e, uint32_t id)
+{
+	struct store_chunk *chunk = storeChunks[id >> storeChunkBits];
+	uint32_t i = id & (storeChunkSize - 1);
+
+	__atomic_fetch_or(&chunk->dirty[e][i / 64].bits, (uint64_t)1 << (i % 64), __ATOMIC_RELAXED);
+	if(!__atomic_load_n(&chunk->dirtyAny[e], __ATOMIC_RELAXED))
+		__atomic_store_n(&chunk->dirtyAny[e], 1, __ATOMIC_RELAXED);
+}
+
+/* Called once the committer's values are applied and its log record appended */
+void checkpoint_leave(int e)
+{
+	__atomic_sub_fetch(&active[e], 1, __ATOMIC_SEQ_CST);
+}
+
+/* Values copied out of the store by a checkpoint, one run of consecutive ids after the other, written once the log covers them */
+struct checkpoint_copy
+{
+	uint32_t *firsts, *counts;		/* The runs */
+	int  runs, runCapacity;
+	int64_t *values;				/* Their values, back to back */
+	size_t used, capacity;
+};
+
+static struct checkpoint_copy copy;
+
+/* Copy the values of ids <first> .. <first> + <count> - 1 (all in one chunk) as they are now */
+static void copy_values(uint32_t first, uint32_t count)
+{
+	const int64_t *values = &storeChunks[first >> storeChunkBits]->values[first & (storeChunkSize - 1)];
+	uint32_t i;
+
+	if(copy.runs == copy.runCapacity)
+	{
+		copy.runCapacity = copy.runCapacity ? 2 * copy.runCapacity : 1024;
+		copy.firsts = realloc(copy.firsts, copy.runCapacity * sizeof(uint32_t));
+		copy.counts = realloc(copy.counts, copy.runCapacity * sizeof(uint32_t));
+	}
+	if(copy.used + count > copy.capacity)
+	{
+		copy.capacity = (copy.used + count > 2 * copy.capacity) ? copy.used + count : 2 * copy.capacity;
+		copy.values = realloc(copy.values, copy.capacity * sizeof(int64_t));
+	}
+	if(!copy.firsts || !copy.counts || !copy.values)
+	{
+		perror("Could not allocate checkpoint values\n");
+		exit(EXIT_FAILURE);
+	}
+	copy.firsts[copy.runs] = first;
+	copy.counts[copy.runs++] = count;
+	for(i=0; i<count; i++)
+		copy.values[copy.used + i] = __atomic_load_n(&values[i], __ATOMIC_ACQUIRE);		//Pairs with the fence in snapshot_install: the record is appended by then
+	copy.used += count;
+}
+
+/* Write the copied runs into their snapshot slots */
+static void write_values(void)
+{
+	size_t offset = 0;
+	int i;
+
+	for(i=0; i<copy.runs; i++)
+	{
+		if(pwrite(snapshotFd, copy.values + offset, copy.counts[i] * sizeof(int64_t), sizeof(struct snapshot_header) + (off_t)copy.firsts[i] * sizeof(int64_t)) < 0)
+		{
+			perror("Could not write checkpoint values\n");
+			exit(EXIT_FAILURE);
+		}
+		offset += copy.counts[i];
+	}
+	copy.runs = 0;
+	copy.used = 0;
+}
+
+/* Append the names of keys <from> .. <to> - 1 to the key file */
+static void write_keys(uint32_t from, uint32_t to)
+{
+	char buffer[65536];
+	const char *name;
+	size_t used;
+	int length;
+
+	used = 0;
+	for(; from<to; from++)
+	{
+		name = store_key(from, &length);
+		if(used + 1 + length > sizeof(buffer))
+		{
+			if(write(keysFd, buffer, used) != (ssize_t)used)
+			{
+				perror("Could not write the key file\n");
+				exit(EXIT_FAILURE);
+			}
+			used = 0;
+		}
+		buffer[used++] = (char)length;
+		memcpy(buffer + used, name, length);
+		used += length;
+	}
+	if(write(keysFd, buffer, used) != (ssize_t)used || fdatasync(keysFd) < 0)
+	{
+		perror("Could not write the key file\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Copy the dirty values of one chunk, one run per stretch of consecutive dirty ids. Returns how many */
+static int copy_dirty(uint32_t chunkIndex, int old)
+{
+	struct store_chunk *chunk = storeChunks[chunkIndex];
+	uint64_t bits;
+	uint32_t w, i, base, first;
+	int written, inRun;
+
+	if(!__atomic_exchange_n(&chunk->dirtyAny[old], 0, __ATOMIC_RELAXED))
+		return 0;
+	base = chunkIndex << storeChunkBits;
+	written = 0;
+	inRun = 0;
+	first = 0;
+	for(w=0; w<storeChunkSize/64; w++)
+	{
+		bits = __atomic_exchange_n(&chunk->dirty[old][w].bits, 0, __ATOMIC_RELAXED);
+		for(i=w*64; i<w*64+64; i++)
+		{
+			if(bits & ((uint64_t)1 << (i % 64)))
+			{
+				if(!inRun)
+					first = i;
+				inRun = 1;
+				written++;
+			}
+			else if(inRun)
+			{
+				copy_values(base + first, i - first);
+				inRun = 0;
+			}
+		}
+	}
+	if(inRun)
+		copy_values(base + first, storeChunkSize - first);
+	return written;
+}
+
+/* Write the values changed since the last checkpoint into the snapshot.
+The checkpoint is fuzzy: values applied after its start may end up in it as well,
+replay from the new replay position applies them again (records carry after-images).
+Values go out only once the log covering them is durable, and before the header that makes them count: they are
+copied out of the store first, and a committer logs its values before it installs them (see commit_apply), so
+flushing the log after the copy covers every value copied, even ones a commit of the new epoch installed meanwhile. */
+void checkpoint_run(void)
+{
+	struct snapshot_header header;
+	unsigned int old;
+	uint64_t lsn, replayLsn, batch;
+	uint32_t count, chunk, from, to;
+	int written;
+
+	/* Everything before lsn is either in the old epoch's dirty bits or will be replayed. Batches of the sequencer
+wait meanwhile: one that is half in the values would run again on top of them if its end did not make it to the log */
+	pthread_mutex_lock(&batchLock);
+	replayLsn = replay_start(&lsn);
+	batch = lastBatch;
+	old = __atomic_fetch_add(&epoch, 1, __ATOMIC_SEQ_CST) & 1;
+	while(__atomic_load_n(&active[old], __ATOMIC_SEQ_CST) > 0)
+		sched_yield();
+	count = store_count();
+	if(count == persistedKeys && lsn == lastLsn)
+	{
+		pthread_mutex_unlock(&batchLock);
+		return;
+	}
+
+	/* Names of new keys first, the header must never count a key the key file does not have yet */
+	if(count > persistedKeys)
+		write_keys(persistedKeys, count);
+	written = 0;
+	for(chunk=0; chunk * storeChunkSize < count; chunk++)
+		written += copy_dirty(chunk, old);
+	/* New keys get their whole slot range written, dirty or not */
+	for(from=persistedKeys; from<count; from=to)
+	{
+		to = ((from >> storeChunkBits) + 1) << storeChunkBits;
+		if(to > count)
+			to = count;
+		copy_values(from, to - from);
+	}
+	wal_flush_all(&wal);
+	write_values();
+	if(fdatasync(snapshotFd) < 0)
+	{
+		perror("Could not sync the snapshot\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_mutex_unlock(&batchLock);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+	header.lsn = lsn;
+	header.replayLsn = replayLsn;
+	header.nextTxid = __atomic_load_n(&nextTxid, __ATOMIC_RELAXED) + 1;
+	header.lastBatch = batch;
+	header.count = count;
+	header.checksum = snapshot_checksum(&header);
+	if(pwrite(snapshotFd, &header, sizeof(header), 0) != sizeof(header) || fdatasync(snapshotFd) < 0)
+	{
+		perror("Could not write the snapshot header\n");
+		exit(EXIT_FAILURE);
+	}
+	log_info("Checkpoint at log position %llu: %d values written, %u new keys\n", (unsigned long long)lsn, written, count - persistedKeys);
+	persistedKeys = count;
+	lastLsn = lsn;
+	wal_truncate(&wal, ship_horizon(replayLsn));		//Not what a replica still has to be sent
+}
+
+static void * checkpoint_thread(void *args)
+{
+	struct timespec interval;
+
+	interval.tv_sec = checkpointMs / 1000;
+	interval.tv_nsec = (long)(checkpointMs % 1000) * 1000000L;
+	while(1)
+	{
+		nanosleep(&interval, NULL);
+		checkpoint_run();
+	}
+	return NULL;
+}
+
+/* Take over the snapshot files at <snapshotPath> and KEYS_FILE (just written by startup) and checkpoint into them every <intervalMs> */
+void checkpoint_start(const char *snapshotPath, int intervalMs)
+{
+	pthread_t thread;
+
+	snapshotFd = open(snapshotPath, O_RDWR);
+	keysFd = open(KEYS_FILE, O_WRONLY | O_APPEND);
+	if(snapshotFd < 0 || keysFd < 0)
+	{
+		perror("Could not open the snapshot for checkpoints\n");
+		exit(EXIT_FAILURE);
+	}
+	persistedKeys = store_count();
+	lastLsn = wal_end(&wal);
+	checkpointMs = intervalMs;
+	if(intervalMs <= 0)
+		return;
+	if(pthread_create(&thread, NULL, checkpoint_thread, NULL) != 0)
+	{
+		perror("Could not start the checkpoint thread\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_detach(thread);
+}
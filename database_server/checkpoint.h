@@ -0,0 +1,23 @@
+/*
+ * checkpoint.h
+ *
+ * Incremental background checkpoints. Committers mark the keys they change
+ * as dirty; every checkpoint interval a background thread writes just those
+ * values into the snapshot in place, moves the snapshot's replay position up
+ * and deletes the log segments it no longer needs.
+ */
+
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <stdint.h>
+
+#define defaultCheckpointMs 1000		/* Checkpoint interval (-c), 0 turns background checkpoints off */
+
+void checkpoint_start(const char *snapshotPath, int intervalMs);
+int checkpoint_enter(void);
+void checkpoint_mark(int epoch, uint32_t id);
+void checkpoint_leave(int epoch);
+void checkpoint_run(void);
+
+#endif /* CHECKPOINT_H_ */
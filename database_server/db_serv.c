@@ -3,15 +3,30 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <ctype.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/times.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <signal.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <pthread.h>
 #include <time.h>
+#include <fcntl.h>
 #include "db_serv.h"
+#include "wal.h"
+#include "recovery.h"
+#include "checkpoint.h"
+#include "snapshot.h"
+#include "partition.h"
+#include "replication.h"
+#include "log.h"
+#include "trace.h"
 
 
 /* makeSocket
@@ -26,7 +41,7 @@
 */
 int makeSocket(unsigned short int port)
 {
-	int sock;
+	int sock, reuse;
 	struct sockaddr_in name;
 
 	/* Create a socket. */
@@ -36,6 +51,9 @@ int makeSocket(unsigned short int port)
 		perror("Could not create a socket\n");
 		exit(EXIT_FAILURE);
 	}
+	/* Allow an immediate restart while old middleware connections linger in TIME_WAIT */
+	reuse = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 	/* Give the socket a name. */
 	/* Socket address format set to AF_INET for internet use. */
 	name.sin_family = AF_INET;
@@ -56,6 +74,39 @@ int makeSocket(unsigned short int port)
 	return(sock);
 }
 
+/* makeLocalSocket
+* Creates a socket in the local (AF_UNIX) namespace, named <path>,
+* for a middleware on the same machine: its frames skip the TCP stack.
+* A socket file left behind by an earlier run is replaced.
+*/
+int makeLocalSocket(const char *path)
+{
+	int sock;
+	struct sockaddr_un name;
+
+	if(strlen(path) >= sizeof(name.sun_path))
+	{
+		fprintf(stderr, "Local socket path %s is too long\n", path);
+		exit(EXIT_FAILURE);
+	}
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(sock < 0)
+	{
+		perror("Could not create a local socket\n");
+		exit(EXIT_FAILURE);
+	}
+	memset(&name, 0, sizeof(name));
+	name.sun_family = AF_UNIX;
+	strcpy(name.sun_path, path);
+	unlink(path);
+	if(bind(sock, (struct sockaddr *)&name, sizeof(name)) < 0)
+	{
+		perror("Could not bind a name to the local socket\n");
+		exit(EXIT_FAILURE);
+	}
+	return(sock);
+}
+
 /* initSocketAddress
 * Initialises a sockaddr_in struct given a host name and a port. */
 void initSocketAddress(struct sockaddr_in *name, char *hostName, unsigned short int port)
@@ -79,576 +130,1811 @@ void initSocketAddress(struct sockaddr_in *name, char *hostName, unsigned short
 	name->sin_addr = *(struct in_addr *)hostInfo->h_addr;
 }
 
-/* Read data from FD <int fileDescriptor> and put it into <char *buf> */
-int readMessage(int fileDescriptor, char *buf)
+/*Releases acquired locks, and then the transaction's claims on partitions
+Parameters:
+struct transaction *t - the transaction holding the locks*/
+void release_locks(struct transaction *t)
 {
-	int nOfBytes;
+	int j, length;
+	const char *name;
+	if(t->owned)
+		t->locks.count = 0;		//Its partition's thread ran it, nothing was locked
+	for(j=0; j<t->locks.count && log_enabled(LOG_DEBUG); j++)
+	{
+		if(t->locks.requests[j].mode != LOCK_NONE)
+		{
+			name = store_key(t->locks.requests[j].key, &length);
+			log_debug("Released lock for %.*s!\n", length, name);
+		}
+	}
+	lock_release_all(&t->locks);		//Releasing variable locks, waiting transactions get woken up
+	if(t->partitions)
+	{
+		partition_release(t->partitions);
+		t->partitions = 0;
+	}
+}
 
-	nOfBytes = read(fileDescriptor, buf, MAXMSG);
-	if(nOfBytes < 0)
+/* Lock <key> of a plan for transaction <t> in the mode the plan needs, waiting at most <timeoutMs>
+(an increment lock with the plan's delta and bounds). Returns LOCK_OK, LOCK_TIMEOUT or LOCK_REFUSED */
+int lock_key(struct transaction *t, const struct plan_key *key, int timeoutMs)
+{
+	if(key->mode == LOCK_INCREMENT)
+		return lock_acquire_increment(&t->locks, key->id, key->delta, key->low, key->high, timeoutMs);
+	return lock_acquire(&t->locks, key->id, key->mode, timeoutMs);
+}
+
+/*Acquires the lock on a variable for a transaction
+Parameters:
+struct transaction *t - the transaction
+const struct plan_key *key - the variable and the mode it needs: LOCK_SHARED for reading, LOCK_EXCLUSIVE for writing, LOCK_INCREMENT for adding to it
+int patient - keep waiting past the lock wait timeout
+Returns LOCK_OK if the lock was acquired, LOCK_TIMEOUT if the wait timed out, LOCK_REFUSED if an increment could cross its bound,
+LOCK_DEADLOCK if the wait was broken off to end a deadlock*/
+int acquire_lock(struct transaction *t, const struct plan_key *key, int patient)
+{
+	static const char *modes[] = { "no", "shared", "exclusive", "increment" };
+	int length = 0, rc;
+	const char *name = "";
+
+	if(log_enabled(LOG_DEBUG))
+		name = store_key(key->id, &length);
+	while((rc = lock_key(t, key, lockWaitMs)) == LOCK_TIMEOUT)
 	{
-		perror("Could not read data from client\n");
-		return (-2);
+		log_debug("Timed out waiting for lock on %.*s!\n", length, name);
+		if(!patient)
+			return rc;
 	}
-	else if(nOfBytes == 0)
-	/* End of file */
-	return(-1);
+	if(rc == LOCK_REFUSED)
+		log_debug("Increment of %.*s could cross its bound!\n", length, name);
+	else if(rc == LOCK_DEADLOCK)
+		log_debug("Gave up waiting for lock on %.*s, deadlock victim!\n", length, name);
 	else
-	/* Data read */
-	return(0);
+		log_debug("Acquired %s lock for %.*s!\n", modes[key->mode], length, name);
+	return rc;
 }
 
-/* Write the message <char *message> onto FD <int fileDescriptor> */
-void writeMessage(int fileDescriptor, char *message)
+/* Transaction <t>'s cached copy of variable <id>, which it holds a lock on */
+int64_t * cache_slot(struct transaction *t, uint32_t id)
 {
-	int nOfBytes;
+	int i;
 
-	nOfBytes = write(fileDescriptor, message, strlen(message) + 1);
-	if(nOfBytes < 0)
+	for(i=0; i<t->locks.count; i++)
 	{
-		perror("writeMessage - Could not write data\n");
-		exit(EXIT_FAILURE);
+		if(t->locks.requests[i].key == id && t->locks.requests[i].mode != LOCK_NONE)
+			return &t->trans_cache[i];
 	}
+	return NULL;
 }
 
-/*Splits transaction into single operations
-Parameters:
-char *transaction - the transaction string to be split
-char *transaction_operations[maxOperationLength] - the string array to place the different operations in*/
-int split_transaction(char *transaction, char transaction_operations[][maxOperationLength])
+/**** Worker pool and connection bookkeeping ****/
+void commit_transaction(struct transaction *t);
+void abort_transaction(struct transaction *t);
+void wait_durable(uint64_t lsn);
+void wait_prepared(uint64_t lsn);
+struct job_queue jobQueue;			/* New transactions */
+struct job_queue decisionQueue;		/* Decisions, resolves, status queries, deadlock detection and pings, kept apart so they never wait behind lock waits */
+struct job_queue batchQueue;		/* Batches of the sequencer, run by a thread of their own in batch order */
+struct job_queue partitionQueues[maxPartitions];		/* Partitioned mode: the transactions each partition's thread runs */
+int epollfd;
+int localSock = -1;		/* -U: listening socket for a middleware on this machine, its epoll entry points at it */
+char serverConn[maxConn][hostNameLength];			/* Keeps track of other middlewares' IP addresses */
+int conn_count;				/* conn_count - how many other middlewares are there */
+int lockWaitMs;
+int optimistic;
+struct wal wal;						/* Write-ahead log every commit goes through */
+unsigned long long nextTxid;			/* Transaction numbering, continues across restarts */
+struct connection *freeConnections;		/* Connections kept around for reuse instead of going back to malloc */
+pthread_mutex_t freeConnectionsLock = PTHREAD_MUTEX_INITIALIZER;
+struct transaction *freeTransactions;
+pthread_mutex_t freeTransactionsLock = PTHREAD_MUTEX_INITIALIZER;
+struct transaction *inDoubt;			/* Prepared transactions that lost their coordinator connection */
+pthread_mutex_t inDoubtLock = PTHREAD_MUTEX_INITIALIZER;
+struct transaction *preparedList;		/* Every prepared transaction still waiting for its decision, in doubt or not */
+pthread_mutex_t preparedLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t incrementLock = PTHREAD_MUTEX_INITIALIZER;		/* Orders the commits of increments, see commit_apply */
+struct decided_entry decided[decidedSlots];		/* Recently decided global transactions, oldest overwritten first */
+int decidedBuckets[decidedSlots];
+int decidedNext;
+uint64_t lastBatch;
+struct batch_failure batchFailures[batchFailureSlots];		/* Oldest overwritten first, guarded by batchLock */
+int batchFailureNext;
+pthread_mutex_t batchLock = PTHREAD_MUTEX_INITIALIZER;		/* Held while a batch runs, a checkpoint takes whole batches only */
+struct counter commits = COUNTER("distra_commits_total", NULL, "Transactions committed");
+struct counter aborts[abortReasons] =
 {
-	int i, j, a;
-	j=0;
-	a=0;
-	for(i=0; i<strlen(transaction); i++)
+	COUNTER("distra_aborts_total", "reason=\"malformed\"", "Transactions aborted, by why"),
+	COUNTER("distra_aborts_total", "reason=\"lock_timeout\"", "Transactions aborted, by why"),
+	COUNTER("distra_aborts_total", "reason=\"deadlock\"", "Transactions aborted, by why"),
+	COUNTER("distra_aborts_total", "reason=\"validation\"", "Transactions aborted, by why"),
+	COUNTER("distra_aborts_total", "reason=\"refused\"", "Transactions aborted, by why"),
+	COUNTER("distra_aborts_total", "reason=\"coordinator\"", "Transactions aborted, by why"),
+	COUNTER("distra_aborts_total", "reason=\"fenced\"", "Transactions aborted, by why"),
+	COUNTER("distra_aborts_total", "reason=\"hangup\"", "Transactions aborted, by why"),
+	COUNTER("distra_aborts_total", "reason=\"replica\"", "Transactions aborted, by why"),
+};
+struct counter staleReads = COUNTER("distra_stale_reads_total", NULL, "Reads a replica sent back to the primary, being too far behind");
+struct counter batchFailed = COUNTER("distra_batch_failures_total", NULL, "Sequenced transactions that could not run, reported to the sequencer");
+struct histogram phases[phaseCount] =
+{
+	HISTOGRAM("distra_phase_seconds", "phase=\"queue\"", "Time transactions spend in each phase"),
+	HISTOGRAM("distra_phase_seconds", "phase=\"lock\"", "Time transactions spend in each phase"),
+	HISTOGRAM("distra_phase_seconds", "phase=\"log\"", "Time transactions spend in each phase"),
+	HISTOGRAM("distra_phase_seconds", "phase=\"decision\"", "Time transactions spend in each phase"),
+	HISTOGRAM("distra_phase_seconds", "phase=\"run\"", "Time transactions spend in each phase"),
+};
+
+/* Get a fresh transaction with the next transaction id */
+struct transaction * transaction_new(void)
+{
+	struct transaction *t;
+
+	pthread_mutex_lock(&freeTransactionsLock);
+	t = freeTransactions;
+	if(t)
+		freeTransactions = t->next;
+	pthread_mutex_unlock(&freeTransactionsLock);
+	if(!t)
 	{
-		if(transaction[i] != '\n')
+		t = malloc(sizeof(struct transaction));
+		if(!t)
 		{
-			transaction_operations[j][a++] = transaction[i];
+			perror("Could not allocate transaction state\n");
+			exit(EXIT_FAILURE);
 		}
-		else
+		lock_txn_init(&t->locks, 0);
+		plan_init(&t->plan);
+	}
+	t->txid = __atomic_add_fetch(&nextTxid, 1, __ATOMIC_RELAXED);
+	t->locks.txid = t->txid;
+	t->locks.count = 0;
+	t->prepared = 0;
+	t->sequenced = 0;
+	t->prepareLsn = 0;
+	t->votedUs = 0;
+	t->traceId = 0;
+	t->partitions = 0;
+	t->owned = 0;
+	t->next = NULL;
+	return t;
+}
+
+void transaction_free(struct transaction *t)
+{
+	pthread_mutex_lock(&freeTransactionsLock);
+	t->next = freeTransactions;
+	freeTransactions = t;
+	pthread_mutex_unlock(&freeTransactionsLock);
+}
+
+/* Register prepared transaction <t>. Callers that log the PREPARE record do it under preparedLock,
+so that replay_start never misses a PREPARE record that is already in the log */
+void prepared_add(struct transaction *t)
+{
+	t->prevPrepared = NULL;
+	t->nextPrepared = preparedList;
+	if(preparedList)
+		preparedList->prevPrepared = t;
+	preparedList = t;
+}
+
+/* Remember that global transaction <txid> was decided (<outcome> is RESULT_COMMITTED or RESULT_ABORTED),
+for the status queries of a middleware recovering it. Only the last decidedSlots are kept.
+Called under preparedLock, or during replay before there are workers */
+void decided_add(unsigned long long txid, char outcome)
+{
+	struct decided_entry *e;
+	int *link;
+	unsigned int b;
+
+	e = &decided[decidedNext];
+	if(e->txid)		//Forget the oldest one
+	{
+		for(link = &decidedBuckets[e->txid % decidedSlots]; *link != decidedNext; link = &decided[*link].next);
+		*link = e->next;
+	}
+	b = txid % decidedSlots;
+	e->txid = txid;
+	e->outcome = outcome;
+	e->next = decidedBuckets[b];
+	decidedBuckets[b] = decidedNext;
+	decidedNext = (decidedNext + 1) % decidedSlots;
+}
+
+/* Outcome of global transaction <txid> if it was decided recently, 0 if not. Called under preparedLock */
+char decided_find(unsigned long long txid)
+{
+	int i;
+
+	for(i = decidedBuckets[txid % decidedSlots]; i >= 0; i = decided[i].next)
+	{
+		if(decided[i].txid == txid)
+			return decided[i].outcome;
+	}
+	return 0;
+}
+
+/* Take <t> out of the registry once its decision (<outcome>) is logged */
+void prepared_remove(struct transaction *t, char outcome)
+{
+	pthread_mutex_lock(&preparedLock);
+	if(t->prevPrepared)
+		t->prevPrepared->nextPrepared = t->nextPrepared;
+	else
+		preparedList = t->nextPrepared;
+	if(t->nextPrepared)
+		t->nextPrepared->prevPrepared = t->prevPrepared;
+	if(t->txid & globalTxidFlag)
+		decided_add(t->txid, outcome);
+	pthread_mutex_unlock(&preparedLock);
+}
+
+/* Current end of the log (to <endLsn>) and the position replay would have to start at
+to still see the PREPARE record of every transaction not decided yet */
+uint64_t replay_start(uint64_t *endLsn)
+{
+	struct transaction *t;
+	uint64_t lsn;
+
+	pthread_mutex_lock(&preparedLock);
+	*endLsn = lsn = wal_end(&wal);
+	for(t = preparedList; t; t = t->nextPrepared)
+		if(t->prepareLsn < lsn)
+			lsn = t->prepareLsn;
+	pthread_mutex_unlock(&preparedLock);
+	return lsn;
+}
+
+/* Get a clean connection structure for socket <int socketfd>, holding the reactor's reference */
+struct connection * connection_new(int socketfd)
+{
+	struct connection *c;
+
+	pthread_mutex_lock(&freeConnectionsLock);
+	c = freeConnections;
+	if(c)
+		freeConnections = c->nextFree;
+	pthread_mutex_unlock(&freeConnectionsLock);
+	if(!c)
+	{
+		c = malloc(sizeof(struct connection));
+		if(!c)
 		{
-			transaction_operations[j][a] = '\0';
-			j++; a = 0;
+			perror("Could not allocate connection state\n");
+			exit(EXIT_FAILURE);
 		}
-		if( i==(strlen(transaction)-1) )	//Add null terminator to the last operation
+		pthread_mutex_init(&c->lock, NULL);
+		frame_buffer_init(&c->in);
+		c->out = c->spare = NULL;
+		c->outCapacity = c->spareCapacity = 0;
+	}
+	c->socketfd = socketfd;
+	c->refs = 1;
+	c->closed = 0;
+	c->waiting = NULL;
+	c->in.start = c->in.used = 0;
+	c->outUsed = 0;
+	c->outFrames = 0;
+	c->sending = 0;
+	c->nextFree = NULL;
+	return c;
+}
+
+/* Drop a reference; the last one closes the socket and keeps the structure for the next connection */
+void connection_release(struct connection *c)
+{
+	int last;
+
+	pthread_mutex_lock(&c->lock);
+	last = (--c->refs == 0);
+	pthread_mutex_unlock(&c->lock);
+	if(!last)
+		return;
+	close(c->socketfd);
+	pthread_mutex_lock(&freeConnectionsLock);
+	c->nextFree = freeConnections;
+	freeConnections = c;
+	pthread_mutex_unlock(&freeConnectionsLock);
+}
+
+/* A transaction whose coordinator connection is gone: if it prepared, only the coordinator can decide it,
+so it keeps its locks and waits to be resolved; otherwise nothing is lost by aborting it */
+void transaction_orphan(struct transaction *t)
+{
+	if(t->prepared)
+	{
+		log_info("Transaction %llu in doubt, waiting for the coordinator to resolve it!\n", t->txid);
+		pthread_mutex_lock(&inDoubtLock);
+		t->next = inDoubt;
+		inDoubt = t;
+		pthread_mutex_unlock(&inDoubtLock);
+	}
+	else
+	{
+		counter_add(&aborts[ABORT_HANGUP], 1);
+		abort_transaction(t);
+	}
+}
+
+/* The middleware hung up (or broke the protocol): stop reading, and orphan the transactions still waiting for a decision */
+void connection_hangup(struct connection *c)
+{
+	struct transaction *t, *next;
+
+	epoll_ctl(epollfd, EPOLL_CTL_DEL, c->socketfd, NULL);
+	pthread_mutex_lock(&c->lock);
+	c->closed = 1;
+	t = c->waiting;
+	c->waiting = NULL;
+	pthread_mutex_unlock(&c->lock);
+	for(; t; t = next)
+	{
+		next = t->next;
+		transaction_orphan(t);
+	}
+	connection_release(c);
+}
+
+/* Queue a reply frame on connection <c>, its lock held. It carries the trace id <traceId> of the request it answers */
+void reply_queue(struct connection *c, int type, uint64_t requestId, uint64_t traceId, const void *payload, uint32_t length)
+{
+	size_t need;
+
+	if(c->outUsed == 0)
+		c->outUsed = frameHeaderSize;		//Room for the header of a batch
+	need = c->outUsed + frameHeaderSize + length;
+	if(need > c->outCapacity)
+	{
+		c->outCapacity = (need > 2 * c->outCapacity) ? need : 2 * c->outCapacity;
+		c->out = realloc(c->out, c->outCapacity);
+		if(!c->out)
 		{
-			transaction_operations[j][a] = '\0';
+			perror("Could not grow a reply buffer\n");
+			exit(EXIT_FAILURE);
 		}
-		if( j==maxTransOp )
+	}
+	trace_event(traceId, "reply", "\"type\":\"%s\"", frame_type_name(type));
+	frame_header_put(c->out + c->outUsed, type, requestId, traceId, length);
+	memcpy(c->out + c->outUsed + frameHeaderSize, payload, length);
+	c->outUsed = need;
+	c->outFrames++;
+}
+
+/* Send the replies queued on <c>; its lock is held, and released while writing.
+Like the log's group commit: whoever finds nobody sending becomes the sender, the replies other workers
+queue meanwhile go out with its next write, several of them as one MSG_GROUP */
+void reply_send(struct connection *c)
+{
+	char *data;
+	size_t used, capacity;
+	int frames;
+
+	if(c->sending)
+		return;
+	c->sending = 1;
+	while(c->outUsed > 0)
+	{
+		data = c->out;
+		used = c->outUsed;
+		capacity = c->outCapacity;
+		frames = c->outFrames;
+		c->out = c->spare;
+		c->outCapacity = c->spareCapacity;
+		c->outUsed = 0;
+		c->outFrames = 0;
+		pthread_mutex_unlock(&c->lock);
+		if(frames > 1 && used - frameHeaderSize <= maxFrameLength)
 		{
-			return -1;
+			frame_header_put(data, MSG_GROUP, 0, 0, used - frameHeaderSize);
+			frame_send_buffer(c->socketfd, data, used);
 		}
+		else
+			frame_send_buffer(c->socketfd, data + frameHeaderSize, used - frameHeaderSize);
+		pthread_mutex_lock(&c->lock);
+		c->spare = data;
+		c->spareCapacity = capacity;
+	}
+	c->sending = 0;
+}
+
+/* Send a reply frame on connection <c>, replies of concurrent requests don't interleave */
+void reply(struct connection *c, int type, uint64_t requestId, uint64_t traceId, const void *payload, uint32_t length)
+{
+	pthread_mutex_lock(&c->lock);
+	reply_queue(c, type, requestId, traceId, payload, length);
+	reply_send(c);
+	pthread_mutex_unlock(&c->lock);
+}
+
+/* Queue a vote on <c> (its lock held): <vote> ('0', '1' or RESULT_REFUSED) and our id for the transaction */
+void reply_queue_vote(struct connection *c, uint64_t requestId, uint64_t traceId, char vote, uint64_t txid)
+{
+	char payload[votePayloadSize];
+
+	payload[0] = vote;
+	put_u64(payload + 1, txid);
+	trace_event(traceId, "voted", "\"vote\":\"%c\",\"txid\":%llu", vote, (unsigned long long)txid);
+	reply_queue(c, MSG_VOTE, requestId, traceId, payload, votePayloadSize);
+}
+
+/* Package frame <h> received on <c> as a job, it holds a reference on the connection until it is done */
+struct job * job_new(struct connection *c, struct frame_header *h, const char *payload)
+{
+	struct job *j;
+
+	j = malloc(sizeof(struct job) + h->length + 1);
+	if(!j)
+	{
+		perror("Could not allocate a request\n");
+		exit(EXIT_FAILURE);
 	}
+	j->c = c;
+	j->t = NULL;
+	j->h = *h;
+	j->queuedUs = metrics_now_us();
+	memcpy(j->payload, payload, h->length);
+	j->payload[h->length] = '\0';
+	pthread_mutex_lock(&c->lock);
+	c->refs++;
+	pthread_mutex_unlock(&c->lock);
 	return j;
 }
 
-/*Splits transaction operations into operands
-Parameters:
-char *operation - the single operation string
-char *operands[] - the string array that will hold the operands*/
-void split_operation(char *operation, char operands[][maxOperationLength])
-{
-	char temp_operation[maxOperationLength];
-	char *token;
-	strcpy(temp_operation, operation);
-	
-	token = strtok(temp_operation, " ");
-	strcpy(operands[0], token);
-	
-	token = strtok(NULL, " ");
-	strcpy(operands[1], token);
-	
-	token = strtok(NULL, " ");
-	strcpy(operands[2], token);
-	
-	if(strcmp(operands[0],"ASSIGN"))
-	{
-		token = strtok(NULL, " ");
-		strcpy(operands[3], token);
-	}
-}
-
-/*Releases acquired locks
-Parameters:
-int *lockedVariables - the local thread mutex array pointer*/
-void release_locks(int *lockedVariables)
+void job_queue_init(struct job_queue *q)
+{
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->notEmpty, NULL);
+	q->head = q->tail = NULL;
+}
+
+/* Queue request <struct job *j> for the worker pool */
+void job_push(struct job_queue *q, struct job *j)
 {
-	int j;
-	for(j=0; j<256; j++)		//Releasing variable locks
+	j->next = NULL;
+	pthread_mutex_lock(&q->lock);
+	if(q->tail)
+		q->tail->next = j;
+	else
+		q->head = j;
+	q->tail = j;
+	pthread_cond_signal(&q->notEmpty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Take the next request, blocks while the queue is empty */
+struct job * job_pop(struct job_queue *q)
+{
+	struct job *j;
+
+	pthread_mutex_lock(&q->lock);
+	while(q->head == NULL)
+		pthread_cond_wait(&q->notEmpty, &q->lock);
+	j = q->head;
+	q->head = j->next;
+	if(q->head == NULL)
+		q->tail = NULL;
+	pthread_mutex_unlock(&q->lock);
+	return j;
+}
+
+/* Take every queued request at once, in queue order; blocks while the queue is empty */
+struct job * job_pop_all(struct job_queue *q)
+{
+	struct job *j;
+
+	pthread_mutex_lock(&q->lock);
+	while(q->head == NULL)
+		pthread_cond_wait(&q->notEmpty, &q->lock);
+	j = q->head;
+	q->head = q->tail = NULL;
+	pthread_mutex_unlock(&q->lock);
+	return j;
+}
+/* The queue requests of type <type> go to */
+struct job_queue * job_queue_of(int type)
+{
+	if(type == MSG_TRANSACTION || type == MSG_PREPARE || type == MSG_EXECUTE)
+		return &jobQueue;
+	if(type == MSG_SEQUENCE)
+		return &batchQueue;
+	return &decisionQueue;
+}
+
+/* Queue the frames of batch <payload> (header <batch>) received on <c>: every transaction becomes a job of its own,
+whatever else the batch carries one job for a decision thread. Returns -1 if the batch is malformed */
+int queue_batch(struct connection *c, struct frame_header *batch, const char *payload)
+{
+	struct frame_header h;
+	struct job_queue *q;
+	char *inner;
+	uint32_t offset = 0;
+	int r, rest = 0;
+
+	while((r = frame_batch_next(payload, batch->length, &offset, &h, &inner)) > 0)
+	{
+		q = job_queue_of(h.type);
+		if(q != &decisionQueue)
+			job_push(q, job_new(c, &h, inner));
+		else
+			rest = 1;
+	}
+	if(r == 0 && rest)
+		job_push(&decisionQueue, job_new(c, batch, payload));
+	return r;
+}
+/**** End of worker pool and connection bookkeeping ****/
+
+/* Fill <changes> with the values of transaction <t>'s variables locked in <mode>: what it wrote (LOCK_EXCLUSIVE),
+or its increments (LOCK_INCREMENT; the deltas until it commits, the new values after). Returns how many */
+int collect_changes(struct transaction *t, int mode, struct wal_entry *changes)
+{
+	int i, count;
+	struct lock_request *r;
+
+	count = 0;
+	for(i=0; i<t->locks.count; i++)
 	{
-		if(lockedVariables[j])
+		r = &t->locks.requests[i];
+		if(r->mode == mode)
 		{
-			printf("Released lock for %c!\n", (char)j);
-			lockedVariables[j] = 0;
-			dbmutex[j] = 0;
+			changes[count].key = store_key(r->key, &changes[count].keyLength);
+			changes[count].value = t->trans_cache[i];
+			changes[count].low = r->low;
+			changes[count].high = r->high;
+			count++;
 		}
 	}
+	return count;
 }
 
-/* Thread handle for incoming transaction from a middleware */
-void * handle(void * args)
-{
-	int operationsNumber, flag, flag_value;
-	int trans_operand1, trans_operand2, trans_operand3;
-	int i, j, printCount;
-	int timesRetried, timesToRetry;
-	char controlMsgs[MAXMSG];
-	char hostName[hostNameLength];
-	char operands[4][maxOperationLength];
-	char transactionOperations[maxTransOp][hostNameLength];
-	char printQueue[maxTransOp][hostNameLength];
-	int trans_cache[256];
-	int lockedVariables[256];
-	struct thread_data t;
-	struct thread_data *temp;
-	FILE *dbfile; 		/* File pointer to database for commit operation */
-	fd_set tempFdSet, readFdSet;
-
-	/* Initiation of variables */
-	temp = (struct thread_data *) args;
-	t.thread_id = temp->thread_id;
-	t.socketfd = temp->socketfd;
-	strncpy(t.buffer, temp->buffer, MAXMSG);
-	printCount = 0;
-	timesRetried = 0;
-	timesToRetry = ( (rand()%11)+5 );
-	for(i=0; i<256; i++)
-	{
-		trans_cache[i] = -1;
-		lockedVariables[i] = 0;
-	}
-	/* lockedVariables - which variables have already been locked for use by this particular transaction */
-
-	/* Splitting transaction operations into multiple strings */
-	operationsNumber = split_transaction(t.buffer, transactionOperations);
-
-	if(operationsNumber == -1)
-	{
-		printf("Invalid transaction - cannot split operations!\n");
-		writeMessage(t.socketfd, "0");
-		goto answer;
-	}
-	printf("Number of operations: %d\n", operationsNumber);
-	printf("Retry times = %d\n", timesToRetry);
-	/* Mutex control*/
-	while(1)	/* Try to get all mutexes as many times as needed */
-	{
-		printf("Transaction start!\n");
-		flag = 1;
-		for(i=0; i<operationsNumber; i++)
-		{
-			split_operation(transactionOperations[i], operands);
-			
-			/* ASSIGN transaction operation parsing */
-			if( !(strcmp(operands[0],"ASSIGN")) )
-			{
-				if( strlen(operands[1])>1 )			//If the variable is not 1 character long - error
-				{
-					perror("Transaction discarded: faulty first operand (ASSIGN)!\n");
-					release_locks(lockedVariables);
-					writeMessage(t.socketfd, "0");
-					goto answer;
-				}
-				trans_operand1 = (int)operands[1][0];	//Geting the variable to assign a value to
-				if( (dbmutex[trans_operand1]) && (!(lockedVariables[trans_operand1])) )
-				{
-					/*Checking if the variable has already been previously locked and if we already have the lock*/
-					flag = 0;		//flag=0 means retry/abort
-				}
-				else if ( !(lockedVariables[trans_operand1]) )
-				{
-					printf("Acquired lock for %c!\n", (char)trans_operand1);
-					dbmutex[trans_operand1] = 1;	//Set to 1 to acknowledge that we will be using this DB variable
-					lockedVariables[trans_operand1] = 1;
-					if( !(isdigit(operands[2][0])) )		//The second operand has to be a numeric value
-					{
-						perror("Transaction discarded: faulty second operand (ASSIGN)!\n");
-						release_locks(lockedVariables);
-						writeMessage(t.socketfd, "0");
-						goto answer;
-					}
-					trans_cache[trans_operand1] = database[trans_operand1];	//Setting the value in the local db cache
-				}
-			}
+/* Optimistic run of compiled transaction <t>: read the values without locks and run the operations against the copies,
+then validate. The read/write set is locked in key id order, and every key read must still have the version it was
+read at; after that the transaction is where a locking run would be, holding its locks. A lock that is taken is waited
+for (at most lockWaitMs) rather than given up on at once: retrying while the holder commits would only fail again.
+Blind increments are not read, so there is nothing to validate about them. Returns 0, or -1 (and frees <t>) if validation
+failed (a conflict aborts the transaction that finds it, nobody else) or a lock wait timed out or was broken off;
+-2 if an increment could cross its bound */
+int run_optimistic(struct transaction *t)
+{
+	int rc, i, stale;
+	struct plan *plan = &t->plan;
 
-			/* ADD transaction operation parsing */
-			else if( !(strcmp(operands[0],"ADD")) )
-			{
-				/* Handling of first operand */
-				if( strlen(operands[1])>1 ) 		//If the variable is not 1 character long - error
-				{
-					perror("Transaction discarded: faulty first operand (ADD)!\n");
-					release_locks(lockedVariables);
-					writeMessage(t.socketfd, "0");
-					goto answer;
-				}
-				trans_operand1 = (int)operands[1][0];
-				if( (dbmutex[trans_operand1]) && (!(lockedVariables[trans_operand1])) )
-				{
-					/*Checking if the variable has already been previously locked and if we already have the lock*/
-					flag = 0;		//flag=0 means retry/abort
-				}
-				else if( (!(lockedVariables[trans_operand1])) )	//We have not previously acquired the global mutex for this variable
-				{
-					printf("Acquired lock for %c!\n", (char)trans_operand1);
-					dbmutex[trans_operand1] = 1;	//Set mutex to 1 to acknowledge that we will be using it
-					lockedVariables[trans_operand1] = 1;
-					trans_cache[trans_operand1] = database[trans_operand1];	//Set the global value in the local transaction cache
-				}
-				/* End of first operand handling */
+	log_debug("Optimistic transaction start!\n");
+	for(i=0; i<plan->keyCount; i++)
+	{
+		if(plan->keys[i].mode == LOCK_INCREMENT)
+			t->trans_cache[i] = 0;
+		else
+			t->trans_cache[i] = store_read(plan->keys[i].id, &t->versions[i]);
+	}
+	plan_execute(plan, t->trans_cache);
 
-				/* Handling of second operand */
-				if ( (strlen(operands[2])==1) && (isalpha(operands[2][0])) && (flag) )		//If the second operand is a variable
-				{
-					trans_operand2 = (int)operands[2][0];
-					if( (dbmutex[trans_operand2]) && (!(lockedVariables[trans_operand2])) )
-					{
-						/*Checking if the variable has already been previously locked and if we already have the lock*/
-						flag = 0;		//flag=0 means retry/abort
-					}
-					else if( !(lockedVariables[trans_operand2]) )	//We have not previously acquired the global mutex for this variable
-					{
-						printf("Acquired lock for %c!\n", (char)trans_operand2);
-						dbmutex[trans_operand2] = 1;	//Set mutex to 1 to acknowledge that we will be using it
-						lockedVariables[trans_operand2] = 1;
-						trans_cache[trans_operand2] = database[trans_operand2]; //Set the global value in the local transaction cache
-					}
-				}
-				else if ( (!isdigit(operands[2][0])) )	//The second operand is neither a numeric value nor a variable - error
-				{
-					perror("Transaction discarded: faulty second operand (ADD)!\n");
-					release_locks(lockedVariables);
-					writeMessage(t.socketfd, "0");
-					goto answer;
-				}
-				/* End of handling of second operand */
+	rc = LOCK_OK;
+	stale = 0;
+	for(i=0; (i<plan->keyCount) && rc == LOCK_OK && !stale; i++)
+	{
+		rc = lock_key(t, &plan->keys[i], lockWaitMs);
+		stale = (rc == LOCK_OK && plan->keys[i].mode != LOCK_INCREMENT && store_version(plan->keys[i].id) != t->versions[i]);
+	}
+	if(stale)
+	{
+		log_debug("Validation failed - sending abort to middleware!\n");
+		counter_add(&aborts[ABORT_VALIDATION], 1);
+		release_locks(t);
+		transaction_free(t);
+		return -1;
+	}
+	if(rc != LOCK_OK)
+	{
+		log_debug("%s - sending abort to middleware!\n", (rc == LOCK_REFUSED) ? "Increment refused" : (rc == LOCK_DEADLOCK) ? "Deadlock" : "Lock wait timed out");
+		counter_add(&aborts[(rc == LOCK_REFUSED) ? ABORT_REFUSED : (rc == LOCK_DEADLOCK) ? ABORT_DEADLOCK : ABORT_LOCK_TIMEOUT], 1);
+		release_locks(t);
+		transaction_free(t);
+		return (rc == LOCK_REFUSED) ? -2 : -1;
+	}
+	log_debug("Validated, all locks acquired!\n");
+	return 0;
+}
 
-				/* Handling of third operand */
-				if ( (strlen(operands[3])==1) && (isalpha(operands[3][0])) && (flag) )		//If the third operand is a variable
-				{
-					trans_operand3 = (int)operands[3][0];
-					if( (dbmutex[trans_operand3]) && (!(lockedVariables[trans_operand3])) )
-					{
-						/*Checking if the variable has already been previously locked and if we already have the lock*/
-						flag = 0;		//flag=0 means retry/abort
-					}
-					else if( !(lockedVariables[trans_operand3]) )
-					{
-						printf("Acquired lock for %c!\n", (char)trans_operand3);
-						/* Nobody has locked it and we don't have the lock - acquire it */
-						dbmutex[trans_operand3] = 1;	//Set mutex to 1 to acknowledge that we will be using it
-						lockedVariables[trans_operand3] = 1;
-						trans_cache[trans_operand3] = database[trans_operand3];
-					}
-				}
-				else if ( (!isdigit(operands[3][0])) )	//The third operand is neither a numeric value nor a variable
-				{
-					perror("Transaction discarded: faulty third operand (ADD)!\n");
-					release_locks(lockedVariables);
-					writeMessage(t.socketfd, "0");
-					goto answer;
-				}
-				/* End of handling of third operand */
-			}
+/* The partitions the keys of plan <p> belong to */
+uint64_t plan_partitions(const struct plan *p)
+{
+	uint64_t set = 0;
+	int i;
 
-			/* PRINT transaction operation parsing */
-			else if( !(strcmp(operands[0],"PRINT")) )
-			{
-				if( strlen(operands[1])>1 || !(isalpha(operands[1][0])) )			//If the variable is not 1 character long - error
-				{
-					perror("Transaction discarded: faulty operand (PRINT)!\n");
-					release_locks(lockedVariables);
-					writeMessage(t.socketfd, "0");
-					goto answer;
-				}
-				else
-				{
-					trans_operand1 = (int)operands[1][0];	//Geting the variable to print
-					if( (dbmutex[trans_operand1]) && (!(lockedVariables[trans_operand1])) )
-					{
-						/*Checking if the variable has already been previously locked and if we already have the lock*/
-						flag = 0;		//flag=0 means retry/abort
-					}
-					else if( !(lockedVariables[trans_operand1]) )
-					{
-						dbmutex[trans_operand1] = 1;	//Set to 1 to acknowledge that we will be using this DB variable
-						lockedVariables[trans_operand1] = 1;
-						trans_cache[trans_operand1] = database[trans_operand1];
-					}
-				}
-			}
+	for(i=0; i<p->keyCount; i++)
+		set |= (uint64_t)1 << partition_of(p->keys[i].id);
+	return set;
+}
 
-			/* If any of the locks haven't been acquired, abort/timesRetried */
-			if(!flag)
-			{
-				release_locks(lockedVariables);
-				timesRetried++;
-				if(timesRetried == timesToRetry)
-				{
-					printf("Retried for %d - sending abort to middleware!\n", timesRetried);
-					writeMessage(t.socketfd, "0");
-					goto answer;
-				}
-				break;
-			}
+/* Partitioned mode: claim the partitions of transaction <t>'s keys before it reads or locks any of them, waiting
+at most lockWaitMs (however long it takes if <patient>). Returns LOCK_OK or LOCK_TIMEOUT */
+int claim_partitions(struct transaction *t, int patient)
+{
+	uint64_t set;
+	int rc;
+
+	set = plan_partitions(&t->plan);
+	while((rc = partition_claim(set, lockWaitMs)) == LOCK_TIMEOUT)
+	{
+		log_debug("Timed out waiting for the partitions of transaction %llu!\n", t->txid);
+		if(!patient)
+			return rc;
+	}
+	t->partitions = set;
+	return rc;
+}
+
+/* Compile transaction <text> into <t>'s plan (<text> is NULL if that is done already), acquire the locks and run the
+operations against the transaction cache (or run it optimistically, with -o). <flags>: RUN_PATIENT waits for the locks
+however long it takes, with RUN_SNAPSHOT a read-only transaction reads a snapshot instead and holds no locks afterwards.
+In partitioned mode the partitions of its keys are claimed before anything else.
+Returns 0, or -1 (and frees <t>) if the transaction is malformed or a lock wait timed out or was broken off, -2 if an increment could cross its bound */
+int run_transaction(struct transaction *t, const char *text, int flags)
+{
+	int rc, i;
+	struct plan *plan = &t->plan;
+	uint64_t start;
+
+	/* Compile the transaction once: key ids, literals and the read/write set are resolved here */
+	if(text && plan_compile(text, plan) < 0)
+	{
+		counter_add(&aborts[ABORT_MALFORMED], 1);
+		transaction_free(t);
+		return -1;
+	}
+	log_debug("Number of operations: %d\n", plan->opCount);
+	if((flags & RUN_SNAPSHOT) && plan_read_only(plan))
+	{
+		log_debug("Snapshot read!\n");
+		trace_event(t->traceId, "snapshot read", "\"keys\":%d", plan->keyCount);
+		snapshot_read(plan, t->trans_cache);
+		plan_execute(plan, t->trans_cache);
+		return 0;
+	}
+	plan_intern(plan);		//A read that locks needs ids for the keys nobody wrote yet
+	start = metrics_now_us();
+	if(partitionCount && claim_partitions(t, flags & RUN_PATIENT) != LOCK_OK)
+	{
+		counter_add(&aborts[ABORT_LOCK_TIMEOUT], 1);
+		histogram_since(&phases[PHASE_LOCK], start);
+		transaction_free(t);
+		return -1;
+	}
+	if(optimistic && !(flags & RUN_PATIENT))		//A sequenced transaction cannot abort, it locks
+	{
+		rc = run_optimistic(t);
+		histogram_since(&phases[PHASE_LOCK], start);
+		return rc;
+	}
+	/* Lock control: a single pass over the read/write set in key id order, a conflicting lock is waited for
+	(at most lockWaitMs) instead of releasing everything and retrying. Slot i of the plan becomes lock request i. */
+	log_debug("Transaction start!\n");
+	rc = LOCK_OK;
+	for(i=0; (i<plan->keyCount) && rc == LOCK_OK; i++)
+		rc = acquire_lock(t, &plan->keys[i], flags & RUN_PATIENT);
+	histogram_since(&phases[PHASE_LOCK], start);
+	trace_event(t->traceId, (rc == LOCK_OK) ? "locked" : "lock failed", "\"keys\":%d,\"wait_us\":%llu",
+		plan->keyCount, (unsigned long long)(metrics_now_us() - start));
+
+	/* If any of the locks couldn't be acquired in time, abort */
+	if(rc != LOCK_OK)
+	{
+		log_debug("%s - sending abort to middleware!\n", (rc == LOCK_REFUSED) ? "Increment refused" : (rc == LOCK_DEADLOCK) ? "Deadlock" : "Lock wait timed out");
+		counter_add(&aborts[(rc == LOCK_REFUSED) ? ABORT_REFUSED : (rc == LOCK_DEADLOCK) ? ABORT_DEADLOCK : ABORT_LOCK_TIMEOUT], 1);
+		release_locks(t);
+		transaction_free(t);
+		return (rc == LOCK_REFUSED) ? -2 : -1;
+	}
+	/* Load the locked variables into the transaction cache, an increment starts from nothing */
+	for(i=0; i<plan->keyCount; i++)
+		t->trans_cache[i] = (plan->keys[i].mode == LOCK_INCREMENT) ? 0 : store_get(plan->keys[i].id);
+	/* End of lock control */
+
+	log_debug("All locks acquired!\n");
+	plan_execute(plan, t->trans_cache);
+	return 0;
+}
+
+/* Vote no (<vote>: '0', or RESULT_REFUSED if it would be no again) on request <requestId> of <c>, no decision follows */
+void vote_abort(struct connection *c, uint64_t requestId, uint64_t traceId, char vote)
+{
+	pthread_mutex_lock(&c->lock);
+	reply_queue_vote(c, requestId, traceId, vote, 0);
+	reply_send(c);
+	pthread_mutex_unlock(&c->lock);
+}
+
+/* First phase of transaction <text>, request <requestId> (trace <traceId>) from a middleware, under global id <gtid> (0 for none):
+run it and send the vote. After a yes vote the transaction waits on <c> for the coordinator's decision under the same request id. */
+void prepare_transaction(struct connection *c, uint64_t requestId, uint64_t traceId, const char *text, unsigned long long gtid)
+{
+	struct transaction *t;
+	int count, increments, r, fenced = 0;
+	struct wal_entry changes[maxLockedKeys], deltas[maxLockedKeys];
+	uint64_t lsn = 0;
+
+	t = transaction_new();
+	t->requestId = requestId;
+	t->traceId = traceId;
+	if(gtid)
+		t->txid = t->locks.txid = gtid;
+	if((r = run_transaction(t, text, 0)) < 0)
+	{
+		vote_abort(c, requestId, traceId, (r == -2) ? RESULT_REFUSED : '0');
+		return;
+	}
+
+	/* Make the new values durable before voting yes, from here on only the coordinator decides.
+	A global transaction logs its PREPARE even without values, status queries have to find it.
+	Its increments go just ahead of it: their values are only known once it commits */
+	count = collect_changes(t, LOCK_EXCLUSIVE, changes);
+	increments = collect_changes(t, LOCK_INCREMENT, deltas);
+	if(count > 0 || increments > 0 || gtid)
+	{
+		pthread_mutex_lock(&preparedLock);
+		if(gtid && decided_find(gtid))
+			fenced = 1;		//A status query got here first and answered abort
+		else
+		{
+			if(increments > 0)
+				wal_append(&wal, WAL_INCREMENTS, t->txid, deltas, increments, &t->prepareLsn);
+			lsn = wal_append(&wal, WAL_PREPARE, t->txid, changes, count, increments ? NULL : &t->prepareLsn);
+			prepared_add(t);
 		}
-		if(!flag)	//Sleep for a random period of time before retrying
+		pthread_mutex_unlock(&preparedLock);
+		if(fenced)
 		{
-			srand(time(NULL));
-			printf("Aborting transaction (RETRY)!\n");
-			sleep( (rand()%7)+3 );
+			log_debug("Transaction %llu was already given up, voting abort!\n", t->txid);
+			counter_add(&aborts[ABORT_FENCED], 1);
+			abort_transaction(t);
+			vote_abort(c, requestId, traceId, '0');
+			return;
 		}
+		wait_prepared(lsn);
+		t->prepared = 1;
+	}
+	/* Wait for the decision on the connection; queued before the vote goes out, the decision can follow right behind it */
+	pthread_mutex_lock(&c->lock);
+	if(c->closed)
+	{
+		pthread_mutex_unlock(&c->lock);
+		if(t->prepared && gtid)
+			transaction_orphan(t);		//Status queries may find it prepared and commit it
 		else
-			break;
+		{
+			counter_add(&aborts[ABORT_HANGUP], 1);
+			abort_transaction(t);		//The vote never went out, so no coordinator can have committed it
+		}
+		return;
 	}
-	/* End of mutex control */
+	t->next = c->waiting;
+	c->waiting = t;
+	t->votedUs = metrics_now_us();
+	reply_queue_vote(c, requestId, traceId, '1', t->txid);		//The coordinator names this transaction by its id when it has to resolve it
+	reply_send(c);
+	pthread_mutex_unlock(&c->lock);
+}
+
+/* Partitioned mode: hand compiled transaction <t>, request <requestId> of <c>, to the thread of the one partition
+its keys belong to. Returns 1 if it did; 0 if it only reads or touches more than one partition, it runs here */
+int partition_route(struct connection *c, uint64_t requestId, uint64_t traceId, struct transaction *t)
+{
+	struct frame_header h;
+	struct job *j;
+	uint64_t set;
+	int k;
+	char result = RESULT_ABORTED;
+
+	if(plan_read_only(&t->plan))
+		return 0;
+	set = plan_partitions(&t->plan);
+	if(set & (set - 1))
+		return 0;
+	for(k = 0; !(set & ((uint64_t)1 << k)); k++);
+	h.type = MSG_EXECUTE;
+	h.flags = 0;
+	h.requestId = requestId;
+	h.traceId = traceId;
+	h.length = 1;
+	j = job_new(c, &h, &result);		//Its payload becomes the outcome
+	j->t = t;
+	job_push(&partitionQueues[k], j);
+	return 1;
+}
 
-	sleep(6);
-	/* Send answer to middleware and parse operations */
-	if(flag)
+/* Transaction <text> touches only this shard (request <requestId>, trace <traceId>), or only reads: no vote, it commits as soon as it ran.
+A read-only one is served from a snapshot. In partitioned mode one that stays in one partition goes to its thread,
+which replies: then it returns 1, otherwise 0 */
+int execute_transaction(struct connection *c, uint64_t requestId, uint64_t traceId, const char *text)
+{
+	struct transaction *t;
+	char result;
+	int r;
+
+	t = transaction_new();
+	t->traceId = traceId;
+	if(partitionCount)
 	{
-        printf("All locks acquired!\n");
-		writeMessage(t.socketfd, "1");
-		for(i=0; i<operationsNumber; i++)
+		if(plan_compile(text, &t->plan) < 0)
 		{
-			split_operation(transactionOperations[i], operands);
-			
-			/* ASSIGN transaction operation parsing */
-			if( !(strcmp(operands[0],"ASSIGN")) )
-			{
-				trans_operand1 = (int)operands[1][0];
-				trans_operand2 = atoi(operands[2]);
-				trans_cache[trans_operand1] = trans_operand2;	//Setting the value in the local db cache
-			}
+			counter_add(&aborts[ABORT_MALFORMED], 1);
+			transaction_free(t);
+			result = RESULT_ABORTED;
+			reply(c, MSG_RESULT, requestId, traceId, &result, 1);
+			return 0;
+		}
+		if(partition_route(c, requestId, traceId, t))
+			return 1;
+		text = NULL;		//Compiled already
+	}
+	if((r = run_transaction(t, text, RUN_SNAPSHOT)) < 0)
+		result = (r == -2) ? RESULT_REFUSED : RESULT_ABORTED;
+	else if(c->closed)		//Nobody would learn the outcome
+	{
+		counter_add(&aborts[ABORT_HANGUP], 1);
+		abort_transaction(t);
+		result = RESULT_ABORTED;
+	}
+	else
+	{
+		commit_transaction(t);		//Durable before the reply
+		result = RESULT_COMMITTED;
+	}
+	reply(c, MSG_RESULT, requestId, traceId, &result, 1);
+	return 0;
+}
 
-			/* ADD transaction operation parsing */
-			else if( !(strcmp(operands[0],"ADD")) )
-			{
-				flag_value=0;
-				/* Handling of first operand */
-				trans_operand1 = (int)operands[1][0];
-				/* End of first operand handling */
+/* Transaction <text> (request <requestId>) at a replica: only one that reads, from a snapshot, and only while the replica
+is at most maxLagMs behind its primary. The outcome goes out with how far behind it was */
+void replica_execute(struct connection *c, uint64_t requestId, uint64_t traceId, const char *text)
+{
+	struct transaction *t;
+	char result[resultLagSize];
+	int lag;
 
-				/* Handling of second operand */
-				if( isdigit(operands[2][0]) )	//If the second operand is a numeric value
-				{
-					trans_operand2 = atoi(operands[2]);
-					flag_value = 1;
-				}
-				else					//If the second operand is a variable
-					trans_operand2 = (int)operands[2][0];
-				/* End of handling of second operand */
+	t = transaction_new();
+	t->traceId = traceId;
+	lag = replica_lag();
+	if(plan_compile(text, &t->plan) < 0 || !plan_read_only(&t->plan))
+	{
+		counter_add(&aborts[ABORT_REPLICA], 1);
+		result[0] = RESULT_ABORTED;
+	}
+	else if(lag < 0 || lag > maxLagMs)
+	{
+		log_debug("Replica %s, sending the read to the primary!\n", (lag < 0) ? "not caught up yet" : "too far behind");
+		counter_add(&staleReads, 1);
+		result[0] = RESULT_STALE;
+	}
+	else
+	{
+		run_transaction(t, NULL, RUN_SNAPSHOT);
+		result[0] = RESULT_COMMITTED;
+	}
+	transaction_free(t);
+	put_u32(result + 1, (lag < 0) ? 0 : (uint32_t)lag);
+	reply(c, MSG_RESULT, requestId, traceId, result, resultLagSize);
+}
 
-				/* Handling of third operand */
-				if( isdigit(operands[3][0]) )
-				{
-					trans_operand3 = atoi(operands[3]);
-					if( flag_value )	//Third - value; Second - value
-					{
-						trans_cache[trans_operand1] = trans_operand2 + trans_operand3;
-					}
-					else				//Third - value; Second - variable
-					{
-						if(trans_operand1==trans_operand2)
-							trans_cache[trans_operand1] += trans_operand3;
-						else
-							trans_cache[trans_operand1] = trans_cache[trans_operand2] + trans_operand3;
-					}
-				}
-				else	//If the third operand is a variable
-				{
-					trans_operand3 = (int)operands[3][0];
-					if( !flag_value )			//Third - variable; Second - variable
-					{
-						trans_cache[trans_operand1] = trans_cache[trans_operand2] + trans_cache[trans_operand3];
-					}
-					else if( flag_value )		//Third - variable; Second - value
-					{
-						trans_cache[trans_operand1] = trans_operand2 + trans_cache[trans_operand3];
-					}
-				}
-				/* End of handling of third operand */
-			}
+/* Commit transaction <t>: apply its values, log the decision and release its locks.
+Returns the log position the commit is durable at, for the caller to wait for */
+uint64_t commit_apply(struct transaction *t)
+{
+	int i, count, epoch, length, increments;
+	struct wal_entry changes[maxLockedKeys];
+	struct lock_request *r;
+	const char *name;
+	uint64_t lsn = 0, stamp = 0, horizon = 0;
 
-			/* PRINT transaction operation parsing*/
-			else if( !(strcmp(operands[0],"PRINT")) )
-			{
-				trans_operand1 = (int)operands[1][0];	//Geting the variable to print
-				sprintf(printQueue[printCount++], "%c = %d\n", operands[1][0], trans_cache[trans_operand1]);
-			}
-			/* SLEEP transaction operation parsing */
-			else if( !(strcmp(operands[0],"SLEEP")) )
+	/* Committing transaction to RAM memory database, only exclusively locked variables were written and incremented ones added to.
+	The values go in under one commit timestamp, published before the locks go. Transactions incrementing the same key
+	hold their locks together, so they add their deltas and log the sums one at a time, in the same order
+	(the thread of a partition has the keys of the transactions it runs to itself) */
+	epoch = checkpoint_enter();
+	increments = 0;
+	for(i=0; i<t->locks.count && !t->owned; i++)
+		increments |= (t->locks.requests[i].mode == LOCK_INCREMENT);
+	if(increments)
+		pthread_mutex_lock(&incrementLock);
+	for(i=0; i<t->locks.count; i++)
+	{
+		r = &t->locks.requests[i];
+		if(r->mode == LOCK_INCREMENT)
+			t->trans_cache[i] += store_get(r->key);		//The delta becomes the new value
+		if((r->mode == LOCK_EXCLUSIVE || r->mode == LOCK_INCREMENT) && !stamp)
+			stamp = snapshot_begin(&horizon);
+	}
+
+	/* Log the decision while the locks still order us against conflicting commits; the caller waits for
+	durability once they are released. A prepared transaction's values are already in its PREPARE record,
+	its increments' new values are not. The record goes in before the values do: a checkpoint that finds a value
+	in the store makes the log durable up to it before writing it (see checkpoint_run). The commit becomes visible
+	to snapshots only once it is in the log, so a snapshot never has a commit the log position taken right after it
+	does not (see ship_state) */
+	count = t->prepared ? 0 : collect_changes(t, LOCK_EXCLUSIVE, changes);
+	count += collect_changes(t, LOCK_INCREMENT, changes + count);
+	if(t->prepared || count > 0)
+		lsn = wal_append(&wal, t->sequenced ? WAL_SEQUENCED : WAL_COMMIT, t->txid, changes, count, NULL);
+	for(i=0; i<t->locks.count; i++)
+	{
+		r = &t->locks.requests[i];
+		if(r->mode == LOCK_EXCLUSIVE || r->mode == LOCK_INCREMENT)
+		{
+			snapshot_install(r->key, t->trans_cache[i], stamp, horizon);
+			checkpoint_mark(epoch, r->key);
+			if(log_enabled(LOG_DEBUG))
 			{
-				/* ---TODO--- */
+				name = store_key(r->key, &length);
+				log_write("COMMMIT: %.*s = %lld\n", length, name, (long long)t->trans_cache[i]);
 			}
 		}
 	}
+	/* End of transaction commit to RAM */
+	if(stamp)
+		snapshot_publish(stamp);
+	if(increments)
+		pthread_mutex_unlock(&incrementLock);
+	checkpoint_leave(epoch);
+	if(t->prepared)
+		prepared_remove(t, RESULT_COMMITTED);
+	trace_event(t->traceId, "committed", "\"txid\":%llu,\"lsn\":%llu", t->txid, (unsigned long long)lsn);
+	release_locks(t);
+	transaction_free(t);
+	counter_add(&commits, 1);
+	return lsn;
+}
+
+/* Wait for the log to be durable up to <lsn> (0 for nothing to wait for) */
+void wait_durable(uint64_t lsn)
+{
+	uint64_t start;
+
+	if(!lsn)
+		return;
+	start = metrics_now_us();
+	wal_flush(&wal, lsn);
+	histogram_since(&phases[PHASE_LOG], start);
+}
+
+/* Wait for the PREPARE record at <lsn> to be durable, whatever the durability mode: a yes vote lets the coordinator
+commit (and tell the client so) without asking again, a prepare lost in a crash would lose a commit with it */
+void wait_prepared(uint64_t lsn)
+{
+	uint64_t start;
+
+	if(!lsn)
+		return;
+	start = metrics_now_us();
+	if(wal.mode == WAL_SYNC_PERIODIC)
+		wal_flush_all(&wal);		//wal_flush does not wait in that mode
+	else
+		wal_flush(&wal, lsn);
+	histogram_since(&phases[PHASE_LOG], start);
+}
+
+void commit_transaction(struct transaction *t)
+{
+	wait_durable(commit_apply(t));
+}
+
+/* Abort transaction <t>: nothing was applied, only the log needs to know if it had prepared */
+void abort_transaction(struct transaction *t)
+{
+	trace_event(t->traceId, "aborted", "\"txid\":%llu", t->txid);
+	if(t->prepared)
+	{
+		wal_append(&wal, WAL_ABORT, t->txid, NULL, 0, NULL);
+		prepared_remove(t, RESULT_ABORTED);
+	}
+	release_locks(t);
+	transaction_free(t);
+}
+
+/* Second phase: apply the coordinator's decision for the transaction it sent as request <requestId>.
+Returns the log position to wait for before acknowledging it */
+uint64_t decide_transaction(struct connection *c, uint64_t requestId, const char *payload, uint32_t length)
+{
+	struct transaction *t, **link;
+
+	pthread_mutex_lock(&c->lock);
+	for(link = &c->waiting; *link && (*link)->requestId != requestId; link = &(*link)->next);
+	t = *link;
+	if(t)
+		*link = t->next;
+	pthread_mutex_unlock(&c->lock);
+
+	/* Checking answer */
+	if(!t)
+	{
+		log_warn("Decision for unknown request %llu!\n", (unsigned long long)requestId);
+		return 0;
+	}
+	if(t->votedUs)
+		histogram_since(&phases[PHASE_DECISION], t->votedUs);
+	trace_event(t->traceId, "decision", "\"decision\":\"%c\"", (length > 0) ? payload[0] : '0');
+	if(length > 0 && payload[0] == '1')	//Answer received - commit
+		return commit_apply(t);
+	log_debug("Aborting transaction! (Checking answer)\n");		//Answer received - abort
+	counter_add(&aborts[ABORT_COORDINATOR], 1);
+	abort_transaction(t);
+	return 0;
+}
+
+void finish_transaction(struct connection *c, uint64_t requestId, uint64_t traceId, const char *payload, uint32_t length)
+{
+	wait_durable(decide_transaction(c, requestId, payload, length));
+	reply(c, MSG_ACK, requestId, traceId, NULL, 0);		//Acknowledge the decision
+}
+
+/* Apply a coordinator's RESOLVE (transaction id, decision) to a transaction that was left in doubt
+(its coordinator connection broke after the vote, or it was prepared when the server went down).
+Returns the log position to wait for before acknowledging it */
+uint64_t resolve_apply(const char *payload)
+{
+	unsigned long long txid;
+	int decision;
+	struct transaction *t, **link;
+
+	txid = get_u64(payload);
+	decision = (payload[8] == '1');
+	pthread_mutex_lock(&inDoubtLock);
+	for(link = &inDoubt; *link && (*link)->txid != txid; link = &(*link)->next);
+	t = *link;
+	if(t)
+		*link = t->next;
+	pthread_mutex_unlock(&inDoubtLock);
+
+	if(!t)
+		return 0;		//Already decided (or never prepared here)
+	log_info("Resolving transaction %llu: %s\n", txid, decision ? "commit" : "abort");
+	if(t->votedUs)
+		histogram_since(&phases[PHASE_DECISION], t->votedUs);
+	if(decision)
+		return commit_apply(t);
+	counter_add(&aborts[ABORT_COORDINATOR], 1);
+	abort_transaction(t);
+	return 0;
+}
+
+void resolve_transaction(struct connection *c, uint64_t requestId, uint64_t traceId, const char *payload, uint32_t length)
+{
+	if(length != resolvePayloadSize)
+	{
+		log_warn("Malformed resolve request!\n");
+		return;
+	}
+	wait_durable(resolve_apply(payload));
+	reply(c, MSG_ACK, requestId, traceId, NULL, 0);
+}
 
-answer:
-	/* Receiving answer on what to do from coordinator */
-	FD_ZERO(&tempFdSet);
-	FD_SET(t.socketfd, &tempFdSet);
-    readFdSet = tempFdSet;
-	while((select(FD_SETSIZE, &readFdSet, NULL, NULL, NULL)) <= 0)
+/* Answer a STATUS query (<payload>: global transaction id) of a middleware recovering the transaction:
+prepared and undecided, committed or aborted. An id not prepared here is fenced: an ABORT record keeps it
+from ever preparing, so the answer stays true. Sets <lsn> to the log position to wait for before answering */
+char status_apply(const char *payload, uint64_t *lsn)
+{
+	unsigned long long txid;
+	struct transaction *t;
+	char status;
+
+	txid = get_u64(payload);
+	*lsn = 0;
+	pthread_mutex_lock(&preparedLock);
+	for(t = preparedList; t && t->txid != txid; t = t->nextPrepared);
+	if(t)
+		status = RESULT_PREPARED;
+	else if(!(status = decided_find(txid)))
 	{
-		perror("Select failed\n");
-		readFdSet = tempFdSet;
-		continue;
+		log_info("Status of unknown transaction %llu asked, fencing it off!\n", txid);
+		*lsn = wal_append(&wal, WAL_ABORT, txid, NULL, 0, NULL);
+		decided_add(txid, RESULT_ABORTED);
+		status = RESULT_ABORTED;
 	}
-	if(FD_ISSET(t.socketfd, &readFdSet))
+	pthread_mutex_unlock(&preparedLock);
+	return status;
+}
+
+void status_transaction(struct connection *c, uint64_t requestId, uint64_t traceId, const char *payload, uint32_t length)
+{
+	uint64_t lsn;
+	char status;
+
+	if(length != statusPayloadSize || !(get_u64(payload) & globalTxidFlag))
 	{
-		j = readMessage(t.socketfd, controlMsgs);
+		log_warn("Malformed status request!\n");
+		return;
 	}
-	else	//Select unblocked due to unknown reasons
+	status = status_apply(payload, &lsn);
+	wait_durable(lsn);
+	reply(c, MSG_RESULT, requestId, traceId, &status, 1);
+}
+
+/* Queue our wait-for edges on <c> (its lock held) as the answer to request <requestId> (MSG_WAITS) */
+void waits_queue(struct connection *c, uint64_t requestId)
+{
+	struct lock_edge *edges;
+	char *payload;
+	int i, count;
+
+	edges = malloc(maxWaitEdges * sizeof(struct lock_edge));
+	payload = malloc(maxWaitEdges * waitEdgeSize);
+	if(!edges || !payload)
 	{
-		perror("Aborting transaction! (Select unblocked)\n");
-		for(i=0; i<256; i++)		//Releasing variable locks
-		{
-			if(lockedVariables[i])
-				dbmutex[i] = 0;
-		}
-		close(t.socketfd);
-		pthread_exit(NULL);
+		perror("Could not allocate wait-for edges\n");
+		exit(EXIT_FAILURE);
+	}
+	count = lock_wait_edges(edges, maxWaitEdges);
+	for(i=0; i<count; i++)
+	{
+		put_u64(payload + i * waitEdgeSize, edges[i].waiter);
+		put_u64(payload + i * waitEdgeSize + 8, edges[i].holder);
+		put_u32(payload + i * waitEdgeSize + 16, edges[i].age);
 	}
-	/* Answer receiving end */
+	reply_queue(c, MSG_WAITS, requestId, 0, payload, count * waitEdgeSize);
+	free(payload);
+	free(edges);
+}
 
-	/* Checking answer */
-	if(j < 0 || (controlMsgs[0] == '0'))	//Answer received - abort
+/* Break off the lock wait of the deadlock victim in <payload> (MSG_BREAK); its transaction aborts */
+void break_apply(const char *payload, uint32_t length)
+{
+	unsigned long long txid;
+
+	if(length != breakPayloadSize)
 	{
-		perror("Aborting transaction! (Checking answer)\n");
-		for(i=0; i<256; i++)		//Releasing variable locks
+		log_warn("Malformed deadlock break request!\n");
+		return;
+	}
+	txid = get_u64(payload);
+	if(lock_break(txid))
+		log_info("Transaction %llu is a deadlock victim, breaking off its lock wait!\n", txid);
+}
+
+/* The decisions, resolves, status queries and pings of batch <batch> from <c> (the reactor queued its transactions as jobs of their own):
+all of them applied first, the log waited for once, then acknowledged in one reply */
+void finish_batch(struct connection *c, const char *batch, uint32_t length)
+{
+	struct frame_header h;
+	char *payload;
+	uint32_t offset;
+	uint64_t lsn, last = 0;
+	char status;
+
+	for(offset = 0; frame_batch_next(batch, length, &offset, &h, &payload) > 0; )
+	{
+		lsn = 0;
+		if(h.type == MSG_DECISION)
+			lsn = decide_transaction(c, h.requestId, payload, h.length);
+		else if(h.type == MSG_RESOLVE && h.length == resolvePayloadSize)
+			lsn = resolve_apply(payload);
+		else if(h.type == MSG_STATUS && h.length == statusPayloadSize && (get_u64(payload) & globalTxidFlag))
+			status_apply(payload, &lsn);
+		else if(h.type == MSG_BREAK)
+			break_apply(payload, h.length);
+		if(lsn > last)
+			last = lsn;
+	}
+	wait_durable(last);
+	pthread_mutex_lock(&c->lock);
+	for(offset = 0; frame_batch_next(batch, length, &offset, &h, &payload) > 0; )
+	{
+		if(h.type == MSG_DECISION || h.type == MSG_PING || h.type == MSG_BREAK || (h.type == MSG_RESOLVE && h.length == resolvePayloadSize))
+			reply_queue(c, MSG_ACK, h.requestId, h.traceId, NULL, 0);
+		else if(h.type == MSG_WAITS)
+			waits_queue(c, h.requestId);
+		else if(h.type == MSG_STATUS && h.length == statusPayloadSize && (get_u64(payload) & globalTxidFlag))
 		{
-			if(lockedVariables[i])
-				dbmutex[i] = 0;
+			status = status_apply(payload, &lsn);		//Fenced in the first pass already, nothing new to log
+			reply_queue(c, MSG_RESULT, h.requestId, h.traceId, &status, 1);
 		}
-		close(t.socketfd);
-		pthread_exit(NULL);
 	}
-	else if(controlMsgs[0] == '1')	//Answer received - commit
+	reply_send(c);
+	pthread_mutex_unlock(&c->lock);
+}
+
+/* Worker thread: runs the requests the reactor queues on <args> (a job_queue), in whatever order and on whichever connection */
+void * worker(void * args)
+{
+	struct job_queue *q = (struct job_queue *) args;
+	struct job *j;
+	uint64_t start;
+
+	while(1)
 	{
-		/* Committing transaction to RAM memory database */
-		for(i=0; i<256; i++)
+		j = job_pop(q);
+		start = metrics_now_us();
+		histogram_record(&phases[PHASE_QUEUE], start - j->queuedUs);
+		trace_event(j->h.traceId, "receive", "\"type\":\"%s\",\"queued_us\":%llu", frame_type_name(j->h.type), (unsigned long long)(start - j->queuedUs));
+		switch(j->h.type)
 		{
-			if(lockedVariables[i])
+		case MSG_TRANSACTION:
+			if(replica)		//Writes go to the primary
+			{
+				counter_add(&aborts[ABORT_REPLICA], 1);
+				vote_abort(j->c, j->h.requestId, j->h.traceId, '0');
+			}
+			else
+				prepare_transaction(j->c, j->h.requestId, j->h.traceId, j->payload, 0);
+			histogram_since(&phases[PHASE_RUN], start);
+			break;
+		case MSG_PREPARE:
+			if(replica || j->h.length < preparePrefixSize || !(get_u64(j->payload) & globalTxidFlag))
 			{
-				database[i] = trans_cache[i];
-				printf("COMMMIT: %c = %d\n", (char)i, database[i]);
+				counter_add(&aborts[replica ? ABORT_REPLICA : ABORT_MALFORMED], 1);
+				vote_abort(j->c, j->h.requestId, j->h.traceId, '0');
 			}
+			else
+				prepare_transaction(j->c, j->h.requestId, j->h.traceId, j->payload + preparePrefixSize, get_u64(j->payload));
+			histogram_since(&phases[PHASE_RUN], start);
+			break;
+		case MSG_EXECUTE:
+			if(replica)
+				replica_execute(j->c, j->h.requestId, j->h.traceId, j->payload);
+			else if(execute_transaction(j->c, j->h.requestId, j->h.traceId, j->payload))
+				break;		//Its partition's thread times it
+			histogram_since(&phases[PHASE_RUN], start);
+			break;
+		case MSG_DECISION:
+			finish_transaction(j->c, j->h.requestId, j->h.traceId, j->payload, j->h.length);
+			break;
+		case MSG_RESOLVE:
+			resolve_transaction(j->c, j->h.requestId, j->h.traceId, j->payload, j->h.length);
+			break;
+		case MSG_STATUS:
+			status_transaction(j->c, j->h.requestId, j->h.traceId, j->payload, j->h.length);
+			break;
+		case MSG_PING:
+			reply(j->c, MSG_ACK, j->h.requestId, j->h.traceId, NULL, 0);		//Health check of a pooled middleware connection
+			break;
+		case MSG_WAITS:
+			pthread_mutex_lock(&j->c->lock);
+			waits_queue(j->c, j->h.requestId);
+			reply_send(j->c);
+			pthread_mutex_unlock(&j->c->lock);
+			break;
+		case MSG_BREAK:
+			break_apply(j->payload, j->h.length);
+			reply(j->c, MSG_ACK, j->h.requestId, j->h.traceId, NULL, 0);
+			break;
+		case MSG_SUBSCRIBE:
+			if(!replica)
+				ship_start(j->c, j->h.requestId);
+			break;
+		case MSG_GROUP:
+			finish_batch(j->c, j->payload, j->h.length);
+			break;
+		default:
+			log_warn("Unknown message type %d!\n", j->h.type);
+		}
+		connection_release(j->c);
+		free(j);
+	}
+	return NULL;
+}
+
+/* Does batch <id> come right after batch <last>: the next one of the same sequencer, or the first one of a newer sequencer */
+int batch_follows(uint64_t id, uint64_t last)
+{
+	if((id >> 32) == (last >> 32))
+		return (id & 0xFFFFFFFF) == (last & 0xFFFFFFFF) + 1;
+	return (id >> 32) > (last >> 32) && (id & 0xFFFFFFFF) == 1;
+}
+
+/* Acknowledge batch <id> (job <j>) with the positions in it of the transactions that could not run, 4 bytes each.
+They are only remembered in memory, for the last batchFailureSlots of them: a batch acknowledged again after a
+restart, or after that many more failures, is reported as having run whole */
+void batch_ack(struct job *j, uint64_t id)
+{
+	char positions[batchFailureSlots * 4];
+	uint32_t used;
+	int i, slot;
+
+	used = 0;
+	pthread_mutex_lock(&batchLock);
+	for(i=0; i<batchFailureSlots; i++)
+	{
+		slot = (batchFailureNext + i) % batchFailureSlots;
+		if(batchFailures[slot].batch == id)
+		{
+			put_u32(positions + used, batchFailures[slot].position);
+			used += 4;
 		}
-		/* End of transaction commit to RAM */
+	}
+	pthread_mutex_unlock(&batchLock);
+	reply(j->c, MSG_ACK, j->h.requestId, j->h.traceId, positions, used);
+}
+
+/* Run the transactions of batch job <j> (MSG_SEQUENCE) one after the other, in the order the sequencer put them in.
+None of them should abort: the sequencer only lets through transactions every shard can run, and a lock is waited for
+however long it takes. One that fails all the same is skipped and reported in the acknowledgement.
+They are logged under the batch id and replayed only if the batch's own record follows (a batch cut short by a crash
+runs again, from the same state). The batch is acknowledged once that record is durable */
+void run_batch(struct job *j)
+{
+	struct transaction *t;
+	uint64_t id;
+	uint32_t offset, length, position;
+	char *text, saved;
+	int r;
 
-		/* Start of transaction commit to physical file */
-		dbfile = fopen("database", "w");
-		if(!dbfile)
+	id = get_u64(j->payload);
+	pthread_mutex_lock(&batchLock);
+	log_debug("Running batch %llu of sequencer %llu\n", (unsigned long long)(id & 0xFFFFFFFF), (unsigned long long)(id >> 32));
+	for(offset = batchPrefixSize, position = 0; offset + 4 <= j->h.length; offset += 4 + length, position++)
+	{
+		length = get_u32(j->payload + offset);
+		if(length > j->h.length - offset - 4)
 		{
-			perror("Failed to open database file!\n Transaction commited only to RAM!\n");
-			close(t.socketfd);
-			pthread_exit(NULL);
+			log_warn("Malformed batch, the rest of it is skipped!\n");
+			break;
 		}
-		for(i=0; i<256; i++)
+		/* The text is cut out in place: the byte after it belongs to the next length (or is the payload's NUL) */
+		text = j->payload + offset + 4;
+		saved = text[length];
+		text[length] = '\0';
+		t = transaction_new();
+		t->txid = t->locks.txid = id;
+		t->sequenced = 1;
+		if((r = run_transaction(t, text, RUN_PATIENT)) < 0)
 		{
-			if(database[i] != -1)
+			log_warn("Sequenced transaction %u of batch %llu %s, not run!\n", position, (unsigned long long)(id & 0xFFFFFFFF),
+				(r == -2) ? "could take an increment past its bound" : "was malformed or lost its lock wait");
+			counter_add(&batchFailed, 1);
+			batchFailures[batchFailureNext].batch = id;
+			batchFailures[batchFailureNext].position = position;
+			batchFailureNext = (batchFailureNext + 1) % batchFailureSlots;
+		}
+		else
+			commit_apply(t);
+		text[length] = saved;
+	}
+	wal_append(&wal, WAL_BATCH, id, NULL, 0, NULL);
+	lastBatch = id;
+	pthread_mutex_unlock(&batchLock);
+	wal_flush_all(&wal);		//Whatever the durability mode: the sequencer forgets what is acknowledged, a lost batch would never come again
+	batch_ack(j, id);
+}
+
+/* Batch thread: runs the sequencer's batches in batch order. The sequencer sends each of them again until it
+is acknowledged and over any of its links, so they may come late, out of order or twice: early ones are held
+until their turn, the ones already run are only acknowledged again */
+void * batch_worker(void * args)
+{
+	struct job *held = NULL, *j, **link;
+	uint64_t id;
+	int ran;
+
+	while(1)
+	{
+		j = job_pop(&batchQueue);
+		if(j->h.length < batchPrefixSize)
+		{
+			log_warn("Malformed batch, ignored!\n");
+			connection_release(j->c);
+			free(j);
+			continue;
+		}
+		id = get_u64(j->payload);
+		if(id <= lastBatch)
+		{
+			batch_ack(j, id);
+			connection_release(j->c);
+			free(j);
+			continue;
+		}
+		/* Held in id order; a copy that came again replaces the held one, the acknowledgement goes where it came last */
+		for(link = &held; *link && get_u64((*link)->payload) < id; link = &(*link)->next);
+		if(*link && get_u64((*link)->payload) == id)
+		{
+			j->next = (*link)->next;
+			connection_release((*link)->c);
+			free(*link);
+		}
+		else
+			j->next = *link;
+		*link = j;
+		do
+		{
+			ran = 0;
+			for(link = &held; *link && !batch_follows(get_u64((*link)->payload), lastBatch); link = &(*link)->next);
+			if((j = *link))
 			{
-				sprintf(controlMsgs, "%c %d\n", (char)i,  database[i]);
-				fputs(controlMsgs, dbfile);
+				*link = j->next;
+				run_batch(j);
+				connection_release(j->c);
+				free(j);
+				ran = 1;
 			}
+			/* Batches of an older sequencer that a newer one overtook never run */
+			while(held && get_u64(held->payload) <= lastBatch)
+			{
+				j = held;
+				held = j->next;
+				log_info("Dropping batch %llu of sequencer %llu, a newer sequencer took over\n",
+					(unsigned long long)(get_u64(j->payload) & 0xFFFFFFFF), (unsigned long long)(get_u64(j->payload) >> 32));
+				connection_release(j->c);
+				free(j);
+			}
+		} while(ran);
+	}
+	return NULL;
+}
+
+/* Run transaction <t>, whose keys all belong to the partition of the calling thread, without locks: while the thread
+runs nothing else touches them. Its lock requests are only filled in for the commit to find its keys, they are never
+queued. An increment's bound is checked against the value as it is, nobody else can be adding to it.
+Returns the outcome, and in <lsn> the log position its commit is durable at */
+char run_owned(struct connection *c, struct transaction *t, uint64_t *lsn)
+{
+	struct plan *plan = &t->plan;
+	struct plan_key *key;
+	struct lock_request *r;
+	int64_t value;
+	int i;
+
+	*lsn = 0;
+	t->owned = 1;
+	t->locks.count = plan->keyCount;
+	for(i=0; i<plan->keyCount; i++)
+	{
+		key = &plan->keys[i];
+		r = &t->locks.requests[i];
+		r->key = key->id;
+		r->mode = key->mode;
+		if(key->mode != LOCK_INCREMENT)
+		{
+			t->trans_cache[i] = store_get(key->id);
+			continue;
 		}
-		for(i=0; i<256; i++)		//Releasing variable locks
+		t->trans_cache[i] = 0;
+		value = store_get(key->id) + key->delta;
+		if((key->low != INT64_MIN || key->high != INT64_MAX) && (value < key->low || value > key->high))
 		{
-			if(lockedVariables[i])
-				dbmutex[i] = 0;
+			log_debug("Increment could cross its bound - sending abort to middleware!\n");
+			counter_add(&aborts[ABORT_REFUSED], 1);
+			abort_transaction(t);
+			return RESULT_REFUSED;
 		}
-		fclose(dbfile);
-		/* End of transaction commit to physical file */
 	}
-	close(t.socketfd);
-	pthread_exit(NULL);
+	if(c->closed)		//Nobody would learn the outcome
+	{
+		counter_add(&aborts[ABORT_HANGUP], 1);
+		abort_transaction(t);
+		return RESULT_ABORTED;
+	}
+	plan_execute(plan, t->trans_cache);
+	*lsn = commit_apply(t);
+	return RESULT_COMMITTED;
+}
+
+/* Thread of partition <args>: takes all the transactions queued for it at once and runs them one after the other
+in the partition, then waits for the log once for all of them and sends the outcomes (kept in the jobs' payloads) */
+void * partition_worker(void * args)
+{
+	int k = (int)(intptr_t) args;
+	struct job *j, *next;
+	uint64_t lsn, last, start;
+
+	partition_pin(k);
+	while(1)
+	{
+		j = job_pop_all(&partitionQueues[k]);
+		start = metrics_now_us();
+		last = 0;
+		partition_enter(k);
+		for(next = j; next; next = next->next)
+		{
+			histogram_record(&phases[PHASE_QUEUE], start - next->queuedUs);
+			next->payload[0] = run_owned(next->c, next->t, &lsn);
+			if(lsn > last)
+				last = lsn;
+		}
+		partition_leave(k);
+		wait_durable(last);
+		for(; j; j = next)
+		{
+			next = j->next;
+			reply(j->c, MSG_RESULT, j->h.requestId, j->h.traceId, j->payload, 1);
+			histogram_since(&phases[PHASE_RUN], j->queuedUs);		//Queued by the worker that took it
+			connection_release(j->c);
+			free(j);
+		}
+	}
+	return NULL;
+}
+
+/* Raise the open file limit so the reactor can hold as many middleware connections as the system allows */
+void raise_fd_limit()
+{
+	struct rlimit rl;
+
+	if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+	{
+		rl.rlim_cur = rl.rlim_max;
+		if(setrlimit(RLIMIT_NOFILE, &rl) < 0)
+			perror("Could not raise the open file limit\n");
+	}
 }
 
 int main(int argc, char *argv[])
 {
 	int sock, clientSocket; 		/* Incoming connections (sock) and communication initialization (clientSocket) */
-	int i, j;
-	char hostName[hostNameLength];		/* Temporary string used to keep IP addresses */
+	int i, n, r, one = 1, opt, walMode, walPeriodMs, checkpointMs, partitioned;
+	struct transaction *t;
 	struct sockaddr_in clientName;		/* Temporary address structs used during connection initialization*/
-	size_t size;
-	fd_set activeFdSet, readFdSet; 		/* Used by select */
+	socklen_t size;
+	struct epoll_event ev, events[maxEvents];
+	struct connection *c;
+	struct recovery_result recovered;
+	struct frame_header h;
+	char *payload;
+	char *primaryHost = NULL, *localPath = NULL, *tracePath = NULL;
+	char banner[256];
+	int used, level = defaultLogLevel, metricsPort = defaultMetricsPort;
+	struct sockaddr_in primaryAddress;
 
 	/* Thread declarations and init */
-	pthread_t thread[maxConn];
+	pthread_t thread[workerThreads + decisionThreads], batchThread, partitionThread;
 	pthread_attr_t attr;
-	int thread_counter;				/* Which thread is next to be used */
-	struct thread_data t[maxConn];	/* Data structure to pass to thread handler */
 	pthread_attr_init(&attr);
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 	/* End of thread declarations */
 
+	lockWaitMs = defaultLockWaitMs;
+	walMode = WAL_SYNC_GROUP;
+	walPeriodMs = defaultWalPeriodMs;
+	checkpointMs = defaultCheckpointMs;
+	partitioned = 0;
+	while((opt = getopt(argc, argv, "l:d:p:c:oP:R:b:U:v:m:T:")) != -1)
+	{
+		switch(opt)
+		{
+		case 'l':
+			lockWaitMs = atoi(optarg);
+			break;
+		case 'd':
+			if(!strcmp(optarg, "commit"))
+				walMode = WAL_SYNC_COMMIT;
+			else if(!strcmp(optarg, "group"))
+				walMode = WAL_SYNC_GROUP;
+			else if(!strcmp(optarg, "periodic"))
+				walMode = WAL_SYNC_PERIODIC;
+			else
+			{
+				fprintf(stderr, "Unknown durability mode %s (commit, group or periodic)\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'p':
+			walPeriodMs = atoi(optarg);
+			break;
+		case 'c':
+			checkpointMs = atoi(optarg);
+			break;
+		case 'o':
+			optimistic = 1;
+			break;
+		case 'P':
+			partitioned = atoi(optarg);
+			if(partitioned < 1 || partitioned > maxPartitions)
+			{
+				fprintf(stderr, "Partitions must be between 1 and %d\n", maxPartitions);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'R':
+			primaryHost = optarg;
+			break;
+		case 'b':
+			maxLagMs = atoi(optarg);
+			break;
+		case 'U':
+			localPath = optarg;
+			break;
+		case 'v':
+			if((level = log_level_of(optarg)) < 0)
+			{
+				fprintf(stderr, "Unknown log level %s (error, warn, info or debug)\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'm':
+			metricsPort = atoi(optarg);
+			break;
+		case 'T':
+			tracePath = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-l lock wait timeout in ms] [-d commit|group|periodic] [-p periodic sync interval in ms] [-c checkpoint interval in ms, 0 for none] [-o] [-P partitions] [-R primary host [-b most replica lag to serve reads at, in ms]] [-U local socket path] [-v error|warn|info|debug] [-m metrics port, 0 for none] [-T trace file]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	log_init(level);
+	if(tracePath)
+		trace_open(tracePath, primaryHost ? "database replica" : "database server");
 	srand(time(NULL));
-	for(i=0; i<256; i++)
+	signal(SIGPIPE, SIG_IGN);		/* A middleware hanging up shows up as a failed write instead */
+	lock_table_init();
+	store_init();
+	partition_init(partitioned);
+	memset(decidedBuckets, 0xff, sizeof(decidedBuckets));		//All buckets empty (-1)
+
+	/* A replica has no log of its own: it starts empty and gets everything from its primary */
+	if(primaryHost)
 	{
-		database[i] = -1;
-		dbmutex[i] = 0;
+		replica = 1;
+		initSocketAddress(&primaryAddress, primaryHost, PORT);
 	}
-	j = thread_counter = 0;
+	else
+	{
+		/* Crash recovery: snapshot + log tail, then a fresh snapshot so the next start does not replay this tail again */
+		recovery_run(SNAPSHOT_FILE, &recovered);
+		nextTxid = recovered.nextTxid - 1;
+		inDoubt = recovered.inDoubt;
+		for(t = inDoubt; t; t = t->next)
+		{
+			prepared_add(t);
+			for(i=0; i<t->locks.count && partitioned; i++)
+				t->partitions |= (uint64_t)1 << partition_of(t->locks.requests[i].key);
+			partition_claim(t->partitions, 0);		//Nothing runs yet, so it cannot wait; held until the transaction is resolved
+		}
+		lastBatch = recovered.lastBatch;
+		snapshot_write(SNAPSHOT_FILE, recovered.endLsn, recovered.replayLsn, recovered.nextTxid, recovered.lastBatch);
+		wal_open(&wal, recovered.endLsn, walMode, walPeriodMs);
+		wal_truncate(&wal, recovered.replayLsn);
+		checkpoint_start(SNAPSHOT_FILE, checkpointMs);
+	}
+	raise_fd_limit();
 	/* Create a socket and set it up to accept connections */
 	sock = makeSocket(PORT);
 	/* Listen for connection requests from clients */
-	if(listen(sock,3) < 0)
+	if(listen(sock, SOMAXCONN) < 0)
 	{
 		perror("Could not listen for connections\n");
 		exit(EXIT_FAILURE);
 	}
-	/* Initialise the set of active sockets */
-	FD_ZERO(&activeFdSet);
-	FD_ZERO(&readFdSet);
-	FD_SET(sock, &activeFdSet);
-	printf("Listening for connections...\n");
+	/* Initialise the epoll set, the listening socket is the only entry without a connection */
+	epollfd = epoll_create1(0);
+	if(epollfd < 0)
+	{
+		perror("Could not create epoll instance\n");
+		exit(EXIT_FAILURE);
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if(epoll_ctl(epollfd, EPOLL_CTL_ADD, sock, &ev) < 0)
+	{
+		perror("Could not add listening socket to epoll\n");
+		exit(EXIT_FAILURE);
+	}
+	if(localPath)
+	{
+		localSock = makeLocalSocket(localPath);
+		if(listen(localSock, SOMAXCONN) < 0)
+		{
+			perror("Could not listen for local connections\n");
+			exit(EXIT_FAILURE);
+		}
+		ev.data.ptr = &localSock;
+		if(epoll_ctl(epollfd, EPOLL_CTL_ADD, localSock, &ev) < 0)
+		{
+			perror("Could not add the local socket to epoll\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* Start the worker pool */
+	job_queue_init(&jobQueue);
+	job_queue_init(&decisionQueue);
+	job_queue_init(&batchQueue);
+	for(i=0; i<workerThreads + decisionThreads; i++)
+	{
+		if(pthread_create(&thread[i], &attr, worker, (i < workerThreads) ? &jobQueue : &decisionQueue) != 0)
+		{
+			perror("Could not start worker thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(pthread_create(&batchThread, &attr, batch_worker, NULL) != 0)
+	{
+		perror("Could not start the batch thread\n");
+		exit(EXIT_FAILURE);
+	}
+	for(i=0; i<partitionCount; i++)
+	{
+		job_queue_init(&partitionQueues[i]);
+		if(pthread_create(&partitionThread, &attr, partition_worker, (void *)(intptr_t) i) != 0)
+		{
+			perror("Could not start a partition thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(replica)
+		replica_start(&primaryAddress);
+	metrics_counter(&commits);
+	for(i=0; i<abortReasons; i++)
+		metrics_counter(&aborts[i]);
+	metrics_counter(&staleReads);
+	metrics_counter(&batchFailed);
+	metrics_counter(&lockWaits);
+	for(i=0; i<phaseCount; i++)
+		metrics_histogram(&phases[i]);
+	metrics_start(metricsPort);
+	used = snprintf(banner, sizeof(banner), "%s concurrency control", optimistic ? "optimistic" : "locking");
+	if(partitionCount)
+		used += snprintf(banner + used, sizeof(banner) - used, ", %d partitions", partitionCount);
+	if(replica)
+		used += snprintf(banner + used, sizeof(banner) - used, ", replica of %s serving reads at most %d ms behind", primaryHost, maxLagMs);
+	if(localPath)
+		snprintf(banner + used, sizeof(banner) - used, ", also on %s", localPath);
+	log_info("Listening for connections (%s)...\n", banner);
 
 	while(1)
 	{
-		/* Block until input arrives on one or more active sockets
-		FD_SETSIZE is a constant with value = 1024 */
-		readFdSet = activeFdSet;
-		if(select(FD_SETSIZE, &readFdSet, NULL, NULL, NULL) <= 0)
+		n = epoll_wait(epollfd, events, maxEvents, -1);
+		if(n < 0)
 		{
-			perror("Select failed\n");
+			if(errno != EINTR)
+				perror("epoll_wait failed\n");
 			continue;
 		}
 
 		/* Service all the sockets with input pending */
-		for(i = 0; i < FD_SETSIZE; ++i)
+		for(i = 0; i < n; ++i)
 		{
-			if(FD_ISSET(i, &readFdSet))
+			c = (struct connection *) events[i].data.ptr;
+			/* Incoming connection on original socket, or on the local one */
+			if(c == NULL || (void *)c == &localSock)
 			{
-				/* Incoming connection on original socket */
-				if(i == sock)
+				size = sizeof(clientName);
+				clientSocket = c ? accept(localSock, NULL, NULL) : accept(sock, (struct sockaddr *)&clientName, &size);
+				if(clientSocket < 0)
+				{
+					perror("Could not accept connection\n");
+					continue;
+				}
+				fcntl(clientSocket, F_SETFL, fcntl(clientSocket, F_GETFL) | O_NONBLOCK);
+				if(c)
+					log_info("Incoming local connection from middleware\n");
+				else
+				{
+					log_info("Incoming connection from middleware %s, port %hd\n", inet_ntoa(clientName.sin_addr), ntohs(clientName.sin_port));
+					setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));		//Replies of pipelined requests go out right away
+				}
+				c = connection_new(clientSocket);
+				ev.events = EPOLLIN | EPOLLRDHUP;
+				ev.data.ptr = c;
+				if(epoll_ctl(epollfd, EPOLL_CTL_ADD, clientSocket, &ev) < 0)
+				{
+					perror("Could not add connection to epoll\n");
+					connection_release(c);
+				}
+			}
+			/* Data (or a hangup) on a middleware connection: queue every complete frame, the rest stays buffered */
+			else
+			{
+				r = frame_fill(c->socketfd, &c->in);
+				if(r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+					continue;
+				if(r <= 0)
+				{
+					connection_hangup(c);
+					continue;
+				}
+				while((r = frame_next(&c->in, &h, &payload)) > 0)
 				{
-					size = sizeof(clientName);
-					clientSocket = accept(sock, (struct sockaddr *)&clientName, &size);
-					if(clientSocket < 0)
-					{
-						perror("Could not accept connection\n");
-						exit(EXIT_FAILURE);
-					}
-					strcpy(hostName,inet_ntoa(clientName.sin_addr));
-					printf("Incoming connection from middleware %s, port %hd\n", inet_ntoa(clientName.sin_addr), ntohs(clientName.sin_port));
-					FD_SET(clientSocket, &activeFdSet);
+					if(h.type == MSG_GROUP)
+						r = queue_batch(c, &h, payload);
+					else
+						job_push(job_queue_of(h.type), job_new(c, &h, payload));
+					if(r < 0)
+						break;
 				}
-				else if (FD_ISSET(i, &activeFdSet))
+				if(r < 0)
 				{
-					t[thread_counter].thread_id=thread_counter;
-					t[thread_counter].socketfd=i;
-					j = readMessage(i, t[thread_counter].buffer);
-					if(j<0)
-					{
-						perror("Error while trying to read data from middleware socket!\n");
-						exit(-1);
-					}
-					pthread_create(&thread[thread_counter] , &attr, handle, (void *) &t[thread_counter]);
-					thread_counter++;
-					thread_counter%=maxConn;
-					FD_CLR(i, &activeFdSet);
+					log_warn("Malformed frame from middleware, closing the connection!\n");
+					connection_hangup(c);
 				}
 			}
 		}
@@ -8,24 +8,141 @@
 #ifndef DB_SERV_H_
 #define DB_SERV_H_
 
+#include <pthread.h>
+#include <stdint.h>
+#include "protocol.h"
+#include "lock_manager.h"
+#include "store.h"
+#include "plan.h"
+#include "metrics.h"
+
 #define PORT 7777
-#define MAXMSG 512
 #define maxConn 20
 #define hostNameLength 50
-#define maxOperationLength 50
-#define maxTransOp 25
+#define maxEvents 256			/* How many ready sockets one epoll_wait call hands back */
+#define workerThreads 16		/* Size of the transaction worker pool */
+#define decisionThreads 4		/* Workers for decisions only, these never wait for locks so they can always free some */
+#define defaultLockWaitMs 500	/* How long a transaction waits for a conflicting lock before voting abort */
+#define decidedSlots 65536		/* Decided global transactions remembered for status queries */
+#define batchFailureSlots 256	/* Sequenced transactions that could not run remembered, for acknowledgements sent again */
+
+/* How run_transaction runs a transaction */
+#define RUN_PATIENT 1			/* Wait for its locks however long it takes (sequenced batches cannot abort) */
+#define RUN_SNAPSHOT 2			/* A read-only transaction reads a snapshot instead of locking */
+
+/* Why a transaction aborted, its counter in aborts */
+#define ABORT_MALFORMED 0
+#define ABORT_LOCK_TIMEOUT 1	/* A lock or partition wait timed out */
+#define ABORT_DEADLOCK 2		/* Its lock wait was broken off, it was a deadlock victim */
+#define ABORT_VALIDATION 3		/* Optimistic: something it read changed before it locked */
+#define ABORT_REFUSED 4			/* An increment could cross its bound */
+#define ABORT_COORDINATOR 5		/* Prepared, and its coordinator decided to abort */
+#define ABORT_FENCED 6			/* A status query found it not prepared first */
+#define ABORT_HANGUP 7			/* Its middleware hung up before it could be told the outcome */
+#define ABORT_REPLICA 8			/* Anything but a read sent to a replica */
+#define abortReasons 9
+
+/* The phases of a transaction whose time is kept in histograms, its histogram in phases */
+#define PHASE_QUEUE 0			/* Waiting for a worker */
+#define PHASE_LOCK 1			/* Claiming its partitions and acquiring its locks (optimistic: running and validating) */
+#define PHASE_LOG 2				/* Waiting for its log records to be durable */
+#define PHASE_DECISION 3		/* Voted yes, holding its locks until the coordinator's decision comes */
+#define PHASE_RUN 4				/* A transaction request from a worker taking it until the reply */
+#define phaseCount 5
+
+#define defaultMetricsPort 9777	/* Metrics for Prometheus, on the loopback interface (-m) */
 
 /**** Declaration of global variables and structures ****/
-char serverConn[maxConn][hostNameLength];			/* Keeps track of other middlewares' IP addresses */
-int conn_count;				/* conn_count - how many other middlewares are there */
-int dbmutex[256];			/* Symbolic mutex to keep track of access to database variables */
-int database[256];			/* Local memory copy of the database, everything is saved here prior to commiting*/
-struct thread_data
+extern int lockWaitMs;				/* Lock wait timeout in milliseconds (-l) */
+extern int optimistic;				/* Optimistic concurrency control instead of locking while transactions run (-o) */
+extern struct wal wal;
+extern unsigned long long nextTxid;
+extern uint64_t lastBatch;				/* Last batch of the sequencer run, see run_batch */
+extern pthread_mutex_t batchLock;
+extern struct counter commits, aborts[abortReasons], staleReads, batchFailed;
+extern struct histogram phases[phaseCount];
+
+/* A transaction from its first message until its outcome is applied */
+struct transaction
+{
+	unsigned long long txid;
+	uint64_t requestId;			/* Request id the coordinator sent it under, its decision comes with the same id */
+	int  prepared;				/* Its PREPARE record is logged: only the coordinator can decide it now */
+	int  sequenced;				/* Runs in a batch of the sequencer, under the batch id */
+	uint64_t prepareLsn;		/* Where that record starts in the log */
+	uint64_t votedUs;			/* When it voted yes, 0 if it did not in this run of the server */
+	uint64_t traceId;			/* Trace id of the request it came in, 0 if untraced or recovered */
+	struct transaction *prevPrepared, *nextPrepared;	/* Registry of undecided prepared transactions */
+	int64_t trans_cache[maxLockedKeys];	/* Transaction-local copies of the variables it locked, parallel to locks.requests */
+	uint64_t versions[maxLockedKeys];	/* Optimistic: versions of those copies as they were read, parallel to the plan's keys */
+	struct plan plan;			/* The compiled transaction */
+	struct lock_txn locks;		/* Locks this transaction holds on database variables */
+	uint64_t partitions;		/* Partitioned mode: the partitions it holds a claim on */
+	int  owned;					/* Ran on the thread of the one partition it touches: its lock requests were never queued */
+	struct transaction *next;	/* Waiting / in-doubt / free list link */
+};
+
+/* Per-connection state. The reactor reads the socket and cuts frames out of it,
+the requests are run by the worker pool, any number of them at a time per connection */
+struct connection
 {
-	int  thread_id;
 	int  socketfd;
-	char buffer[MAXMSG];
+	pthread_mutex_t lock;		/* Serializes replies and guards the fields below */
+	int  refs;					/* One for the reactor plus one per queued or running request */
+	int  closed;				/* The middleware hung up */
+	struct transaction *waiting;	/* Voted yes, waiting for the coordinator's decision */
+	char *out;					/* Replies queued and not sent yet, after room for a MSG_GROUP header */
+	size_t outUsed, outCapacity;
+	int  outFrames;
+	char *spare;				/* Second buffer the sending replier swaps in while it writes the first */
+	size_t spareCapacity;
+	int  sending;				/* A replier is writing; what is queued meanwhile goes out with its next write */
+	struct frame_buffer in;		/* Received bytes not cut into frames yet, only touched by the reactor */
+	struct connection *nextFree;
+};
+
+/* One request for the worker pool, the payload (NUL terminated) follows the structure */
+struct job
+{
+	struct connection *c;
+	struct job *next;
+	struct transaction *t;		/* Partitioned mode: compiled already, for the thread of its partition */
+	uint64_t queuedUs;			/* When it was queued */
+	struct frame_header h;
+	char payload[];
+};
+
+/* Queue of requests, filled by the reactor and drained by the worker pool. It is not bounded: the reactor
+must never stop reading, the decisions that free the locks come in behind the transactions waiting for them */
+struct job_queue
+{
+	struct job *head, *tail;
+	pthread_mutex_t lock;
+	pthread_cond_t notEmpty;
+} __attribute__((aligned(64)));
+/* Outcome of a recently decided global transaction */
+struct decided_entry
+{
+	unsigned long long txid;	/* 0 while the slot is unused */
+	int  next;					/* Next slot in the same bucket, -1 at the end */
+	char outcome;
 };
+
+/* A sequenced transaction that could not run: its position in the shard's piece of the batch */
+struct batch_failure
+{
+	uint64_t batch;				/* 0 while the slot is unused */
+	uint32_t position;
+};
+
+struct transaction * transaction_new(void);
+void transaction_free(struct transaction *t);
+int64_t * cache_slot(struct transaction *t, uint32_t id);
+void prepared_add(struct transaction *t);
+void decided_add(unsigned long long txid, char outcome);
+uint64_t replay_start(uint64_t *endLsn);
+void connection_release(struct connection *c);
+void reply(struct connection *c, int type, uint64_t requestId, uint64_t traceId, const void *payload, uint32_t length);
 /**** End of declaration ****/
 
 
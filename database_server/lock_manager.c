@@ -0,0 +1,450 @@
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "lock_manager.h"
+#include "store.h"
+
+/* One stripe of the lock table. Every key hashes to exactly one stripe,
+the stripe mutex protects the key's queue and all the requests in it */
+struct lock_partition
+{
+	pthread_mutex_t lock;
+	struct lock_entry *buckets[lockBuckets];
+	struct lock_entry *freeEntries;
+} __attribute__((aligned(64)));
+
+struct lock_partition lockTable[lockPartitions];
+struct counter lockWaits = COUNTER("distra_lock_waits_total", NULL, "Lock requests that had to wait for another transaction");
+
+static unsigned long lock_hash(unsigned long key)
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdUL;
+	key ^= key >> 33;
+	return key;
+}
+
+/* Find the entry for <key> in partition <p>, creating it if <create> is set */
+static struct lock_entry * entry_find(struct lock_partition *p, unsigned long key, int create)
+{
+	struct lock_entry *e, **bucket;
+
+	bucket = &p->buckets[(lock_hash(key) / lockPartitions) % lockBuckets];
+	for(e = *bucket; e; e = e->next)
+	{
+		if(e->key == key)
+			return e;
+	}
+	if(!create)
+		return NULL;
+	e = p->freeEntries;
+	if(e)
+		p->freeEntries = e->next;
+	else
+	{
+		e = malloc(sizeof(struct lock_entry));
+		if(!e)
+		{
+			perror("Could not allocate lock entry\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	e->key = key;
+	e->head = e->tail = NULL;
+	e->next = *bucket;
+	*bucket = e;
+	return e;
+}
+
+/* Unlink an entry nobody holds or waits for anymore and keep it for reuse */
+static void entry_free(struct lock_partition *p, struct lock_entry *e)
+{
+	struct lock_entry **link;
+
+	link = &p->buckets[(lock_hash(e->key) / lockPartitions) % lockBuckets];
+	while(*link != e)
+		link = &(*link)->next;
+	*link = e->next;
+	e->next = p->freeEntries;
+	p->freeEntries = e;
+}
+
+/* Can <mode> be granted next to the granted requests of <e> (ignoring <self>) */
+static int compatible(struct lock_entry *e, struct lock_request *self, int mode)
+{
+	struct lock_request *r;
+
+	for(r = e->head; r && r->granted; r = r->next)
+	{
+		if(r == self)
+			continue;
+		if(mode != r->mode || mode == LOCK_EXCLUSIVE)		//Shared goes with shared, increment with increment
+			return 0;
+	}
+	return 1;
+}
+
+/* Grant waiting requests from the front of the queue for as long as they fit */
+static void grant_waiters(struct lock_entry *e)
+{
+	struct lock_request *r;
+
+	for(r = e->head; r; r = r->next)
+	{
+		if(r->granted && !r->upgrade)
+			continue;
+		if(!compatible(e, r, r->mode))
+			break;
+		r->granted = 1;
+		r->upgrade = 0;
+		pthread_cond_signal(&r->owner->wakeup);
+	}
+}
+
+/* Take <r> out of <e>'s queue */
+static void queue_remove(struct lock_entry *e, struct lock_request *r)
+{
+	struct lock_request **link, *prev;
+
+	prev = NULL;
+	link = &e->head;
+	while(*link != r)
+	{
+		prev = *link;
+		link = &(*link)->next;
+	}
+	*link = r->next;
+	if(e->tail == r)
+		e->tail = prev;
+}
+
+/* Put an upgrade request right behind the granted group, ahead of ordinary waiters */
+static void queue_upgrade(struct lock_entry *e, struct lock_request *r)
+{
+	struct lock_request **link;
+
+	queue_remove(e, r);
+	link = &e->head;
+	while(*link && (*link)->granted && !(*link)->upgrade)
+		link = &(*link)->next;
+	r->next = *link;
+	*link = r;
+	if(!r->next)
+		e->tail = r;
+}
+
+static unsigned long long now_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* Set up empty lock bookkeeping for transaction <txid> */
+void lock_txn_init(struct lock_txn *t, unsigned long long txid)
+{
+	t->txid = txid;
+	t->start = 0;
+	t->broken = 0;
+	t->count = 0;
+	pthread_cond_init(&t->wakeup, NULL);
+}
+
+void lock_table_init(void)
+{
+	int i;
+
+	for(i=0; i<lockPartitions; i++)
+	{
+		pthread_mutex_init(&lockTable[i].lock, NULL);
+		memset(lockTable[i].buckets, 0, sizeof(lockTable[i].buckets));
+		lockTable[i].freeEntries = NULL;
+	}
+}
+
+/* Mode transaction <t> currently holds on <key> (LOCK_NONE if it does not hold it) */
+int lock_mode_held(struct lock_txn *t, unsigned long key)
+{
+	int i;
+
+	for(i=0; i<t->count; i++)
+	{
+		if(t->requests[i].key == key && t->requests[i].mode != LOCK_NONE && t->requests[i].granted)
+			return t->requests[i].mode;
+	}
+	return LOCK_NONE;
+}
+
+/* Can increment <self> be granted on <e>'s key: whatever the increments granted on it (<self> among them) do, every bounded
+one of them must still keep the key within its own bounds, counting all the other deltas the worst way. So an increment
+granted under a bound keeps it even when unbounded increments or ones with other bounds come after it.
+The value is read under the stripe mutex: an increment that committed is still granted until it releases, so it
+is counted at least once */
+static int escrow_fits(struct lock_entry *e, struct lock_request *self)
+{
+	struct lock_request *r;
+	int64_t value, up, down;
+	int bounded;
+
+	up = down = 0;
+	bounded = 0;
+	for(r = e->head; r && (r->granted || r == self); r = r->next)
+	{
+		if(r->mode != LOCK_INCREMENT)
+			continue;
+		if(r->delta > 0)
+			up += r->delta;
+		else
+			down += r->delta;
+		bounded |= (r->low != INT64_MIN || r->high != INT64_MAX);
+	}
+	if(!bounded)		//Nobody was promised anything, nothing to check
+		return 1;
+	value = store_get((uint32_t)e->key);
+	for(r = e->head; r && (r->granted || r == self); r = r->next)
+	{
+		if(r->mode == LOCK_INCREMENT && (value + down < r->low || value + up > r->high))
+			return 0;
+	}
+	return 1;
+}
+
+/* Acquire <key> in <mode> for transaction <t>, waiting at most <timeoutMs> milliseconds. Increments of <delta> (LOCK_INCREMENT)
+are refused if they could take the key out of [<low>, <high>], or out of the bounds of any increment granted before,
+counting every other granted increment the worst way.
+Re-acquiring a held key is a no-op, asking for LOCK_EXCLUSIVE while holding LOCK_SHARED upgrades in place.
+Returns LOCK_OK, LOCK_TIMEOUT, LOCK_REFUSED or LOCK_DEADLOCK (see lock_break); otherwise the transaction keeps the locks it already had. */
+static int acquire(struct lock_txn *t, unsigned long key, int mode, int64_t delta, int64_t low, int64_t high, int timeoutMs)
+{
+	struct lock_partition *p;
+	struct lock_entry *e;
+	struct lock_request *r;
+	struct timespec deadline;
+	int i, rc;
+
+	r = NULL;
+	for(i=0; i<t->count; i++)
+	{
+		if(t->requests[i].key == key && t->requests[i].mode != LOCK_NONE)
+		{
+			r = &t->requests[i];
+			break;
+		}
+	}
+	if(r && (r->mode == LOCK_EXCLUSIVE || r->mode == mode))
+		return LOCK_OK;
+	if(!r && t->count == maxLockedKeys)
+		return LOCK_TIMEOUT;
+	if(t->count == 0)
+		t->start = now_ms();
+	t->broken = 0;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeoutMs / 1000;
+	deadline.tv_nsec += (long)(timeoutMs % 1000) * 1000000L;
+	if(deadline.tv_nsec >= 1000000000L)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	p = &lockTable[lock_hash(key) % lockPartitions];
+	pthread_mutex_lock(&p->lock);
+	e = entry_find(p, key, 1);
+	if(r)	/* Shared -> exclusive upgrade */
+	{
+		if(compatible(e, r, LOCK_EXCLUSIVE))
+		{
+			r->mode = LOCK_EXCLUSIVE;
+			pthread_mutex_unlock(&p->lock);
+			return LOCK_OK;
+		}
+		r->upgrade = 1;
+		r->mode = LOCK_EXCLUSIVE;
+		queue_upgrade(e, r);
+	}
+	else
+	{
+		r = &t->requests[t->count++];
+		r->owner = t;
+		r->key = key;
+		r->mode = mode;
+		r->upgrade = 0;
+		r->delta = delta;
+		r->low = low;
+		r->high = high;
+		r->next = NULL;
+		/* FIFO: only skip the queue if nobody is waiting already */
+		r->granted = ( (!e->head || e->tail->granted) && compatible(e, r, mode) );
+		if(e->tail)
+			e->tail->next = r;
+		else
+			e->head = r;
+		e->tail = r;
+	}
+
+	/* Wait until a release grants the request, the timeout runs out or the wait is broken off */
+	if(!(r->granted && !r->upgrade))
+		counter_add(&lockWaits, 1);
+	rc = 0;
+	while( !(r->granted && !r->upgrade) && rc != ETIMEDOUT && !t->broken )
+		rc = pthread_cond_timedwait(&t->wakeup, &p->lock, &deadline);
+	if(r->granted && !r->upgrade)
+	{
+		if(mode != LOCK_INCREMENT || escrow_fits(e, r))
+		{
+			pthread_mutex_unlock(&p->lock);
+			return LOCK_OK;
+		}
+		rc = LOCK_REFUSED;
+	}
+	else
+		rc = t->broken ? LOCK_DEADLOCK : LOCK_TIMEOUT;
+
+	/* Timed out, refused or broken off: withdraw the request (an upgrade falls back to the shared lock it had) */
+	if(r->upgrade)
+	{
+		r->upgrade = 0;
+		r->mode = LOCK_SHARED;
+	}
+	else
+	{
+		queue_remove(e, r);
+		r->mode = LOCK_NONE;		/* Slot stays in <requests> but is no longer queued anywhere */
+	}
+	grant_waiters(e);
+	if(!e->head)
+		entry_free(p, e);
+	pthread_mutex_unlock(&p->lock);
+	return rc;
+}
+
+int lock_acquire(struct lock_txn *t, unsigned long key, int mode, int timeoutMs)
+{
+	return acquire(t, key, mode, 0, INT64_MIN, INT64_MAX, timeoutMs);
+}
+
+/* Acquire an increment lock on <key> for adding <delta>, as long as the key stays within [<low>, <high>] (see acquire) */
+int lock_acquire_increment(struct lock_txn *t, unsigned long key, int64_t delta, int64_t low, int64_t high, int timeoutMs)
+{
+	return acquire(t, key, LOCK_INCREMENT, delta, low, high, timeoutMs);
+}
+
+/* Release every lock of transaction <t> and wake whoever can go next */
+void lock_release_all(struct lock_txn *t)
+{
+	struct lock_partition *p;
+	struct lock_entry *e;
+	struct lock_request *r;
+	int i;
+
+	for(i=0; i<t->count; i++)
+	{
+		r = &t->requests[i];
+		if(r->mode == LOCK_NONE)
+			continue;
+		p = &lockTable[lock_hash(r->key) % lockPartitions];
+		pthread_mutex_lock(&p->lock);
+		e = entry_find(p, r->key, 0);
+		queue_remove(e, r);
+		grant_waiters(e);
+		if(!e->head)
+			entry_free(p, e);
+		pthread_mutex_unlock(&p->lock);
+	}
+	t->count = 0;
+}
+
+/* Add the edge from waiting request <r> to <q> to <edges> (holding <count> of room for <max>) */
+static void add_edge(struct lock_edge *edges, int *count, int max, struct lock_request *r, struct lock_request *q, unsigned long long now)
+{
+	if(*count == max || q->owner == r->owner)
+		return;
+	edges[*count].waiter = r->owner->txid;
+	edges[*count].holder = q->owner->txid;
+	edges[*count].age = (unsigned int)(now - r->owner->start);
+	(*count)++;
+}
+
+/* Fill <edges> (room for <max>) with who waits for whom. The first waiter of a key waits for the granted requests
+it conflicts with, every later one for the waiter just ahead of it (which it cannot overtake), so a queue of any
+length makes a chain rather than every waiter pointing at everyone ahead. Each stripe is looked at on its own,
+the edges of different keys are not all from the same moment. Returns how many there are */
+int lock_wait_edges(struct lock_edge *edges, int max)
+{
+	struct lock_partition *p;
+	struct lock_entry *e;
+	struct lock_request *r, *q, *ahead;
+	unsigned long long now;
+	int i, b, count;
+
+	now = now_ms();
+	count = 0;
+	for(i=0; i<lockPartitions && count < max; i++)
+	{
+		p = &lockTable[i];
+		pthread_mutex_lock(&p->lock);
+		for(b=0; b<lockBuckets; b++)
+		{
+			for(e = p->buckets[b]; e; e = e->next)
+			{
+				ahead = NULL;
+				for(r = e->head; r; r = r->next)
+				{
+					if(r->granted && !r->upgrade)
+						continue;
+					if(ahead)
+						add_edge(edges, &count, max, r, ahead, now);
+					else
+					{
+						for(q = e->head; q && q->granted; q = q->next)
+						{
+							if(q != r && (r->mode != q->mode || r->mode == LOCK_EXCLUSIVE))
+								add_edge(edges, &count, max, r, q, now);
+						}
+					}
+					ahead = r;
+				}
+			}
+		}
+		pthread_mutex_unlock(&p->lock);
+	}
+	return count;
+}
+
+/* Break off the lock wait of transaction <txid>, picked as a deadlock victim: it gives up with LOCK_DEADLOCK.
+Returns 1 if it was waiting, 0 if it was not (anymore) */
+int lock_break(unsigned long long txid)
+{
+	struct lock_partition *p;
+	struct lock_entry *e;
+	struct lock_request *r;
+	int i, b, found;
+
+	found = 0;
+	for(i=0; i<lockPartitions && !found; i++)
+	{
+		p = &lockTable[i];
+		pthread_mutex_lock(&p->lock);
+		for(b=0; b<lockBuckets && !found; b++)
+		{
+			for(e = p->buckets[b]; e && !found; e = e->next)
+			{
+				for(r = e->head; r && !found; r = r->next)
+				{
+					if(r->owner->txid != txid || (r->granted && !r->upgrade))
+						continue;
+					r->owner->broken = 1;
+					pthread_cond_signal(&r->owner->wakeup);
+					found = 1;
+				}
+			}
+		}
+		pthread_mutex_unlock(&p->lock);
+	}
+	return found;
+}
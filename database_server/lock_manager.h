@@ -0,0 +1,83 @@
+/*
+ * lock_manager.h
+ *
+ * Lock table for database variables: shared/exclusive locks per key,
+ * FIFO wait queues, in-place upgrades and wakeup on release. Increment locks
+ * only conflict with the other two modes: the blind increments of any number
+ * of transactions commute, and bounds on them are checked escrow-style.
+ * Who waits for whom is exported as wait-for edges, so that deadlocks across
+ * database servers can be found and broken by breaking off one lock wait.
+ */
+
+#ifndef LOCK_MANAGER_H_
+#define LOCK_MANAGER_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include "metrics.h"
+
+#define LOCK_NONE 0
+#define LOCK_SHARED 1
+#define LOCK_EXCLUSIVE 2
+#define LOCK_INCREMENT 3			/* Adds a delta to the key without reading it, never upgraded */
+
+#define LOCK_OK 0
+#define LOCK_TIMEOUT 1
+#define LOCK_REFUSED 2				/* An increment could take the key across its bound */
+#define LOCK_DEADLOCK 3				/* The wait was broken off, the transaction was picked as a deadlock victim */
+
+#define lockPartitions 64			/* Lock table stripes, each with its own mutex */
+#define lockBuckets 256				/* Hash chains per stripe */
+#define maxLockedKeys 256			/* How many keys one transaction can hold locks on */
+
+/* One transaction's request on one key. Sits in the key's queue: granted requests first, then waiters in arrival order */
+struct lock_request
+{
+	struct lock_txn *owner;
+	unsigned long key;
+	int mode;					/* Mode granted, or mode waited for */
+	int granted;				/* 0 while waiting in the queue */
+	int upgrade;				/* Waiting to turn a granted shared lock into an exclusive one */
+	int64_t delta;				/* LOCK_INCREMENT: what the transaction adds to the key */
+	int64_t low, high;			/* LOCK_INCREMENT: the bounds it was admitted under, kept for as long as it is granted */
+	struct lock_request *next;
+};
+
+/* Lock state of one key, only exists while somebody holds or waits for it */
+struct lock_entry
+{
+	unsigned long key;
+	struct lock_request *head, *tail;
+	struct lock_entry *next;
+};
+
+/* Per-transaction lock bookkeeping */
+struct lock_txn
+{
+	unsigned long long txid;
+	unsigned long long start;		/* When it asked for its first lock (ms), to tell the youngest of a deadlock */
+	int broken;						/* Picked as a deadlock victim while it waited */
+	int count;						/* Used entries in <requests> */
+	struct lock_request requests[maxLockedKeys];
+	pthread_cond_t wakeup;			/* Signalled when a request of this transaction gets granted */
+};
+
+/* A transaction waiting for a lock and one it waits for */
+struct lock_edge
+{
+	unsigned long long waiter, holder;
+	unsigned int age;				/* How long the waiter has been at it, in ms */
+};
+
+extern struct counter lockWaits;
+
+void lock_table_init(void);
+void lock_txn_init(struct lock_txn *t, unsigned long long txid);
+int lock_acquire(struct lock_txn *t, unsigned long key, int mode, int timeoutMs);
+int lock_acquire_increment(struct lock_txn *t, unsigned long key, int64_t delta, int64_t low, int64_t high, int timeoutMs);
+int lock_mode_held(struct lock_txn *t, unsigned long key);
+void lock_release_all(struct lock_txn *t);
+int lock_wait_edges(struct lock_edge *edges, int max);
+int lock_break(unsigned long long txid);
+
+#endif /* LOCK_MANAGER_H_ */
@@ -0,0 +1,123 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+#include "partition.h"
+#include "lock_manager.h"
+#include "log.h"
+
+int partitionCount;
+static struct partition partitions[maxPartitions];
+
+void partition_init(int count)
+{
+	int k;
+
+	partitionCount = count;
+	for(k=0; k<count; k++)
+	{
+		pthread_mutex_init(&partitions[k].lock, NULL);
+		pthread_cond_init(&partitions[k].change, NULL);
+		partitions[k].claims = 0;
+		partitions[k].running = 0;
+		partitions[k].turn = 0;
+	}
+}
+
+/* Pin the calling thread, the thread of partition <k>, to a core of its own (as far as there are cores) */
+void partition_pin(int k)
+{
+	cpu_set_t cpus;
+	long cores;
+
+	cores = sysconf(_SC_NPROCESSORS_ONLN);
+	if(cores < 1)
+		cores = 1;
+	CPU_ZERO(&cpus);
+	CPU_SET(k % cores, &cpus);
+	if(pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+		log_warn("Could not pin the thread of partition %d to core %ld!\n", k, k % cores);
+}
+
+/* Claim every partition in <set>, in partition order so that two claimers never wait for each other,
+waiting at most <timeoutMs> for each. Returns LOCK_OK, or LOCK_TIMEOUT holding none of them */
+int partition_claim(uint64_t set, int timeoutMs)
+{
+	struct partition *p;
+	struct timespec deadline;
+	int k, rc;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeoutMs / 1000;
+	deadline.tv_nsec += (long)(timeoutMs % 1000) * 1000000L;
+	if(deadline.tv_nsec >= 1000000000L)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	for(k=0; k<partitionCount; k++)
+	{
+		if(!(set & ((uint64_t)1 << k)))
+			continue;
+		p = &partitions[k];
+		rc = 0;
+		pthread_mutex_lock(&p->lock);
+		while((p->running || p->turn) && rc != ETIMEDOUT)
+			rc = pthread_cond_timedwait(&p->change, &p->lock, &deadline);
+		if(p->running || p->turn)
+		{
+			pthread_mutex_unlock(&p->lock);
+			partition_release(set & (((uint64_t)1 << k) - 1));		//The ones claimed so far
+			return LOCK_TIMEOUT;
+		}
+		p->claims++;
+		pthread_mutex_unlock(&p->lock);
+	}
+	return LOCK_OK;
+}
+
+void partition_release(uint64_t set)
+{
+	struct partition *p;
+	int k;
+
+	for(k=0; k<partitionCount; k++)
+	{
+		if(!(set & ((uint64_t)1 << k)))
+			continue;
+		p = &partitions[k];
+		pthread_mutex_lock(&p->lock);
+		if(--p->claims == 0)
+			pthread_cond_broadcast(&p->change);
+		pthread_mutex_unlock(&p->lock);
+	}
+}
+
+/* The thread of partition <k> is about to run transactions: wait until nobody holds a claim on it */
+void partition_enter(int k)
+{
+	struct partition *p = &partitions[k];
+
+	pthread_mutex_lock(&p->lock);
+	p->turn = 1;
+	while(p->claims > 0)
+		pthread_cond_wait(&p->change, &p->lock);
+	p->turn = 0;
+	p->running = 1;
+	pthread_mutex_unlock(&p->lock);
+}
+
+void partition_leave(int k)
+{
+	struct partition *p = &partitions[k];
+
+	pthread_mutex_lock(&p->lock);
+	p->running = 0;
+	pthread_cond_broadcast(&p->change);
+	pthread_mutex_unlock(&p->lock);
+}
@@ -0,0 +1,52 @@
+/*
+ * partition.h
+ *
+ * Partitioned execution (-P): the keyspace is cut into partitions, each with
+ * a thread of its own pinned to a core. Keys go to partitions 64 ids at a time,
+ * so no cache line of the store is written by two partitions: the chunks and
+ * their per-key arrays are cache line aligned, and the checkpointer's dirty
+ * bits take a line per 64 ids. Pinning is all there is to placement: a page of
+ * the store holds the keys of several partitions, so first touch does not put
+ * a partition's keys on its thread's NUMA node. A transaction whose keys all
+ * fall in one partition runs on that partition's thread without taking locks.
+ * Anything else that touches a partition's keys claims the partition first:
+ * claims are shared among such transactions (they order themselves through
+ * the lock manager as usual) and exclude the partition's thread for as long
+ * as they are held.
+ */
+
+#ifndef PARTITION_H_
+#define PARTITION_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define maxPartitions 64			/* Partitions a transaction can claim fit in a 64-bit set */
+#define partitionKeyBits 6			/* Key ids go to partitions this many bits at a time */
+
+/* Who is in a partition: its thread, or any number of claims */
+struct partition
+{
+	pthread_mutex_t lock;
+	pthread_cond_t change;			/* Signalled when the thread leaves or the last claim goes */
+	int claims;						/* Transactions holding a claim on it */
+	int running;					/* Its thread is running transactions */
+	int turn;						/* Its thread waits for the claims to go, new claims wait behind it */
+} __attribute__((aligned(64)));
+
+extern int partitionCount;			/* 0 unless partitioned (-P) */
+
+/* Partition of key <id> */
+static inline int partition_of(uint32_t id)
+{
+	return (int)((id >> partitionKeyBits) % (uint32_t)partitionCount);
+}
+
+void partition_init(int count);
+void partition_pin(int k);
+int partition_claim(uint64_t set, int timeoutMs);
+void partition_release(uint64_t set);
+void partition_enter(int k);
+void partition_leave(int k);
+
+#endif /* PARTITION_H_ */
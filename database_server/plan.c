@@ -0,0 +1,457 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "lock_manager.h"
+#include "store.h"
+#include "plan.h"
+#include "log.h"
+
+/* A word of the transaction text, not NUL terminated */
+struct token
+{
+	const char *start;
+	int length;
+};
+
+/* Is <t> a variable name: a letter followed by letters, digits or any of _ . : - */
+static int is_variable(const struct token *t)
+{
+	int i;
+
+	if( t->length == 0 || t->length > maxKeyLength || !isalpha((unsigned char)t->start[0]) )
+		return 0;
+	for(i=1; i<t->length; i++)
+	{
+		if( !isalnum((unsigned char)t->start[i]) && !strchr("_.:-", t->start[i]) )
+			return 0;
+	}
+	return 1;
+}
+
+/* Is <t> a numeric literal; its value goes to <value> */
+static int is_number(const struct token *t, int64_t *value)
+{
+	int i;
+
+	if(t->length == 0 || t->length > 18)
+		return 0;
+	*value = 0;
+	for(i=0; i<t->length; i++)
+	{
+		if(!isdigit((unsigned char)t->start[i]))
+			return 0;
+		*value = *value * 10 + (t->start[i] - '0');
+	}
+	return 1;
+}
+
+/* Is <t> a numeric literal with an optional minus sign; its value goes to <value> */
+static int is_signed(const struct token *t, int64_t *value)
+{
+	struct token digits;
+
+	if(t->length == 0 || t->start[0] != '-')
+		return is_number(t, value);
+	digits.start = t->start + 1;
+	digits.length = t->length - 1;
+	if(!is_number(&digits, value))
+		return 0;
+	*value = -*value;
+	return 1;
+}
+
+static int token_is(const struct token *t, const char *word)
+{
+	return t->length == (int)strlen(word) && !memcmp(t->start, word, t->length);
+}
+
+static int token_same(const struct token *a, const struct token *b)
+{
+	return a->length == b->length && !memcmp(a->start, b->start, a->length);
+}
+
+/* Mode of a key used both in <a> and in <b>: an increment of a key that is also read or written is an ordinary write */
+static int mode_join(int a, int b)
+{
+	if(a == b)
+		return a;
+	if(a == LOCK_INCREMENT || b == LOCK_INCREMENT)
+		return LOCK_EXCLUSIVE;
+	return (a > b) ? a : b;
+}
+
+/* Slot of the key named by <t> in the plan's key set, added if it is new; the strongest mode asked for wins (see mode_join).
+The key gets its id once the whole transaction is known to be valid (resolve_keys). Returns -1 if the key set is full */
+static int key_slot(struct plan *p, const struct token *t, int mode)
+{
+	struct token name;
+	int i;
+
+	for(i=0; i<p->keyCount; i++)
+	{
+		name.start = p->keys[i].name;
+		name.length = p->keys[i].length;
+		if(token_same(&name, t))
+		{
+			p->keys[i].mode = mode_join(p->keys[i].mode, mode);
+			return i;
+		}
+	}
+	if(p->keyCount == maxPlanKeys)
+		return -1;
+	p->keys[p->keyCount].id = planNoKey;
+	p->keys[p->keyCount].name = t->start;
+	p->keys[p->keyCount].length = t->length;
+	p->keys[p->keyCount].mode = mode;
+	p->keys[p->keyCount].delta = 0;
+	p->keys[p->keyCount].low = INT64_MIN;
+	p->keys[p->keyCount].high = INT64_MAX;
+	return p->keyCount++;
+}
+
+/* Give the keys of valid plan <p> their ids. A plan that writes adds every key of it to the store, they all get locked.
+A read-only one only looks them up: reads that are turned away or served from a snapshot leave no keys behind */
+static void resolve_keys(struct plan *p)
+{
+	struct plan_key *key;
+	int i, readOnly;
+
+	readOnly = plan_read_only(p);
+	for(i=0; i<p->keyCount; i++)
+	{
+		key = &p->keys[i];
+		if(!readOnly)
+			key->id = store_intern(key->name, key->length);
+		else if(!store_lookup(key->name, key->length, &key->id))
+			key->id = planNoKey;
+	}
+}
+
+/* Resolve a read operand: a variable (read set) or a literal. Returns 0 if it is neither, -1 if the key set is full */
+static int read_operand(struct plan *p, const struct token *t, struct plan_operand *o)
+{
+	if(is_variable(t))
+	{
+		o->slot = key_slot(p, t, LOCK_SHARED);
+		o->value = 0;
+		return (o->slot < 0) ? -1 : 1;
+	}
+	o->slot = -1;
+	return is_number(t, &o->value);
+}
+
+/* Sort the key set by id (so that every transaction locks in the same order) and renumber the slots */
+static void sort_keys(struct plan *p)
+{
+	struct plan_key key;
+	int order[maxPlanKeys], newSlot[maxPlanKeys];
+	struct plan_key sorted[maxPlanKeys];
+	struct plan_op *op;
+	int i, j, k;
+
+	for(i=0; i<p->keyCount; i++)
+	{
+		key = p->keys[i];
+		for(j=i; j>0 && p->keys[order[j-1]].id > key.id; j--)
+			order[j] = order[j-1];
+		order[j] = i;
+	}
+	for(i=0; i<p->keyCount; i++)
+	{
+		sorted[i] = p->keys[order[i]];
+		newSlot[order[i]] = i;
+	}
+	memcpy(p->keys, sorted, p->keyCount * sizeof(struct plan_key));
+	for(k=0; k<p->opCount; k++)
+	{
+		op = &p->ops[k];
+		if(op->target >= 0)
+			op->target = newSlot[op->target];
+		if(op->a.slot >= 0)
+			op->a.slot = newSlot[op->a.slot];
+		if(op->b.slot >= 0)
+			op->b.slot = newSlot[op->b.slot];
+	}
+}
+
+void plan_init(struct plan *p)
+{
+	p->opCount = p->opCapacity = p->keyCount = 0;
+	p->ops = NULL;
+}
+
+/* Room for one more operation in <p> */
+static void grow_ops(struct plan *p)
+{
+	p->opCapacity = p->opCapacity ? p->opCapacity * 2 : planInitialOps;
+	p->ops = realloc(p->ops, p->opCapacity * sizeof(struct plan_op));
+	if(!p->ops)
+	{
+		perror("Could not grow a transaction plan\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Sum up the increments of every key that is only incremented; the increments of a key the plan also
+reads or writes become ordinary additions. Returns -1 if one of those had a bound, which would go unchecked */
+static int settle_increments(struct plan *p)
+{
+	struct plan_op *op;
+	struct plan_key *key;
+	int i;
+
+	for(i=0; i<p->opCount; i++)
+	{
+		op = &p->ops[i];
+		if(op->type != OP_INCR)
+			continue;
+		key = &p->keys[op->target];
+		if(key->mode == LOCK_INCREMENT)
+		{
+			key->delta += op->a.value;
+			continue;
+		}
+		if(key->low != INT64_MIN || key->high != INT64_MAX)
+			return -1;
+		op->type = OP_ADD;
+		op->b = op->a;
+		op->a.slot = op->target;
+		op->a.value = 0;
+	}
+	return 0;
+}
+
+/* Compile transaction <text> (one operation per line) into plan <p>.
+Returns 0, or -1 if the transaction is malformed */
+int plan_compile(const char *text, struct plan *p)
+{
+	struct token tokens[4];
+	struct plan_op *op;
+	struct plan_key *key;
+	const char *s;
+	int64_t bound;
+	int n, r;
+
+	p->opCount = 0;
+	p->keyCount = 0;
+	s = text;
+	while(*s)
+	{
+		/* Split one line into (at most 4) words */
+		n = 0;
+		while(*s && *s != '\n')
+		{
+			while(*s == ' ' || *s == '\t' || *s == '\r')
+				s++;
+			if(!*s || *s == '\n')
+				break;
+			if(n < 4)
+				tokens[n].start = s;
+			while(*s && *s != '\n' && *s != ' ' && *s != '\t' && *s != '\r')
+				s++;
+			if(n < 4)
+			{
+				tokens[n].length = (int)(s - tokens[n].start);
+				n++;
+			}
+		}
+		if(*s == '\n')
+			s++;
+		if(n == 0)
+			continue;
+		for(; n<4; n++)
+		{
+			tokens[n].start = "";
+			tokens[n].length = 0;
+		}
+
+		if(p->opCount == p->opCapacity)
+			grow_ops(p);
+		op = &p->ops[p->opCount];
+		op->target = -1;
+		op->a.slot = op->b.slot = -1;
+		op->a.value = op->b.value = 0;
+		r = 1;
+
+		/* ASSIGN transaction operation parsing */
+		if(token_is(&tokens[0], "ASSIGN"))
+		{
+			if( !is_variable(&tokens[1]) )
+			{
+				log_debug("Transaction discarded: faulty first operand (ASSIGN)!\n");
+				return -1;
+			}
+			if( !is_number(&tokens[2], &op->a.value) )		//The second operand has to be a numeric value
+			{
+				log_debug("Transaction discarded: faulty second operand (ASSIGN)!\n");
+				return -1;
+			}
+			op->type = OP_ASSIGN;
+			op->target = key_slot(p, &tokens[1], LOCK_EXCLUSIVE);
+		}
+		/* ADD transaction operation parsing */
+		else if(token_is(&tokens[0], "ADD"))
+		{
+			if( !is_variable(&tokens[1]) )
+			{
+				log_debug("Transaction discarded: faulty first operand (ADD)!\n");
+				return -1;
+			}
+			/* A key plus a constant back into the same key is a blind increment */
+			if( (token_same(&tokens[1], &tokens[2]) && is_number(&tokens[3], &op->a.value)) ||
+				(token_same(&tokens[1], &tokens[3]) && is_number(&tokens[2], &op->a.value)) )
+			{
+				op->type = OP_INCR;
+				op->target = key_slot(p, &tokens[1], LOCK_INCREMENT);
+			}
+			else
+			{
+				op->type = OP_ADD;
+				op->target = key_slot(p, &tokens[1], LOCK_EXCLUSIVE);
+				if( (r = read_operand(p, &tokens[2], &op->a)) == 0 )		//Neither a numeric value nor a variable
+				{
+					log_debug("Transaction discarded: faulty second operand (ADD)!\n");
+					return -1;
+				}
+				if( r > 0 && (r = read_operand(p, &tokens[3], &op->b)) == 0 )
+				{
+					log_debug("Transaction discarded: faulty third operand (ADD)!\n");
+					return -1;
+				}
+			}
+		}
+		/* INCR transaction operation parsing: INCR key delta [bound], the bound is a floor for a negative delta
+		and a ceiling otherwise */
+		else if(token_is(&tokens[0], "INCR"))
+		{
+			if( !is_variable(&tokens[1]) || !is_signed(&tokens[2], &op->a.value) )
+			{
+				log_debug("Transaction discarded: faulty operand (INCR)!\n");
+				return -1;
+			}
+			if( tokens[3].length > 0 && !is_signed(&tokens[3], &bound) )
+			{
+				log_debug("Transaction discarded: faulty bound (INCR)!\n");
+				return -1;
+			}
+			op->type = OP_INCR;
+			op->target = key_slot(p, &tokens[1], LOCK_INCREMENT);
+			if(op->target >= 0 && tokens[3].length > 0)
+			{
+				key = &p->keys[op->target];
+				if(op->a.value < 0 && bound > key->low)
+					key->low = bound;
+				else if(op->a.value >= 0 && bound < key->high)
+					key->high = bound;
+			}
+		}
+		/* PRINT transaction operation parsing */
+		else if(token_is(&tokens[0], "PRINT"))
+		{
+			if( !is_variable(&tokens[1]) )
+			{
+				log_debug("Transaction discarded: faulty operand (PRINT)!\n");
+				return -1;
+			}
+			op->type = OP_PRINT;
+			op->target = key_slot(p, &tokens[1], LOCK_SHARED);	//Reading only, other readers may share it
+		}
+		/* SLEEP transaction operation parsing */
+		else if(token_is(&tokens[0], "SLEEP"))
+			op->type = OP_SLEEP;
+		else
+			continue;		//Unknown operations are skipped
+		if(r < 0 || (op->type != OP_SLEEP && op->target < 0))
+		{
+			log_warn("Invalid transaction - too many keys!\n");
+			return -1;
+		}
+		p->opCount++;
+	}
+	if(settle_increments(p) < 0)
+	{
+		log_warn("Transaction discarded: a bounded INCR of a key it also reads or writes!\n");
+		return -1;
+	}
+	resolve_keys(p);
+	sort_keys(p);
+	return 0;
+}
+
+/* Add the keys read-only plan <p> found no trace of to the store, so that they can be locked, and keep the key set
+in id order. Runs while the text <p> was compiled from is still around */
+void plan_intern(struct plan *p)
+{
+	int i, added = 0;
+
+	for(i=0; i<p->keyCount; i++)
+	{
+		if(p->keys[i].id == planNoKey)
+		{
+			p->keys[i].id = store_intern(p->keys[i].name, p->keys[i].length);
+			added = 1;
+		}
+	}
+	if(added)
+		sort_keys(p);
+}
+
+static inline int64_t operand_value(const struct plan_operand *o, const int64_t *values)
+{
+	return (o->slot < 0) ? o->value : values[o->slot];
+}
+
+/* Run plan <p> against <values>, the transaction's copies of its keys (indexed by slot) */
+void plan_execute(const struct plan *p, int64_t *values)
+{
+	const struct plan_op *op;
+	const struct plan_key *key;
+	const char *name;
+	int i, length;
+
+	for(i=0; i<p->opCount; i++)
+	{
+		op = &p->ops[i];
+		switch(op->type)
+		{
+		case OP_ASSIGN:
+			values[op->target] = op->a.value;
+			break;
+		case OP_ADD:
+			values[op->target] = operand_value(&op->a, values) + operand_value(&op->b, values);
+			break;
+		case OP_PRINT:
+			if(log_enabled(LOG_INFO))
+			{
+				key = &p->keys[op->target];
+				if(key->id == planNoKey)
+				{
+					name = key->name;
+					length = key->length;
+				}
+				else
+					name = store_key(key->id, &length);
+				log_write("%.*s = %lld\n", length, name, (long long)values[op->target]);
+			}
+			break;
+		case OP_INCR:
+			values[op->target] += op->a.value;		//The slot holds the delta, the value is not read
+			break;
+		case OP_SLEEP:
+			/* ---TODO--- */
+			break;
+		}
+	}
+}
+
+/* Plan <p> writes no key */
+int plan_read_only(const struct plan *p)
+{
+	int i;
+
+	for(i=0; i<p->keyCount; i++)
+		if(p->keys[i].mode != LOCK_SHARED)
+			return 0;
+	return 1;
+}
@@ -0,0 +1,72 @@
+/*
+ * plan.h
+ *
+ * Transactions compiled once into an operation plan: operands are resolved to
+ * key slots or literal constants, and the keys the transaction touches are
+ * collected into one read/write set, sorted by key id, that the lock phase
+ * walks in a single pass. Slot i of a plan is the i-th key it locks.
+ * A key the transaction only ever adds constants to (ADD k k n, INCR k n) is
+ * a blind increment: it takes an increment lock and its slot holds the delta.
+ * Only a plan that writes adds its keys to the store. A read-only one looks
+ * them up, and a key nobody wrote yet stays unknown (planNoKey) until it is
+ * read from a snapshot, or locked (plan_intern).
+ */
+
+#ifndef PLAN_H_
+#define PLAN_H_
+
+#include <stdint.h>
+#include "lock_manager.h"
+
+#define maxPlanKeys maxLockedKeys		/* Distinct keys per transaction, each of them gets locked */
+#define planInitialOps 32				/* The operation array grows from this, there is no limit on operations */
+#define planNoKey UINT32_MAX			/* Id of a key a read-only plan found no trace of, never a store id */
+
+/* Operation types */
+#define OP_ASSIGN 1						/* target = a */
+#define OP_ADD 2						/* target = a + b */
+#define OP_PRINT 3						/* show target */
+#define OP_SLEEP 4
+#define OP_INCR 5						/* target += a, a literal; target is not read */
+
+/* A key slot of the plan or a literal */
+struct plan_operand
+{
+	int     slot;						/* Key slot, -1 for a literal */
+	int64_t value;						/* The literal */
+};
+
+struct plan_op
+{
+	int type;
+	int target;							/* Key slot written (ASSIGN, ADD) or read (PRINT) */
+	struct plan_operand a, b;
+};
+
+/* A key of the read/write set and the lock mode it needs (LOCK_EXCLUSIVE if written, LOCK_INCREMENT if only incremented) */
+struct plan_key
+{
+	uint32_t id;
+	const char *name;					/* In the transaction text, looked at only while id is planNoKey */
+	int      length;
+	int      mode;
+	int64_t  delta;						/* LOCK_INCREMENT: the sum of the increments */
+	int64_t  low, high;					/* LOCK_INCREMENT: bounds the increments must keep the key within */
+};
+
+struct plan
+{
+	int opCount;
+	int opCapacity;
+	int keyCount;
+	struct plan_op *ops;				/* Kept (and reused) with the transaction it belongs to */
+	struct plan_key keys[maxPlanKeys];	/* Sorted by id */
+};
+
+void plan_init(struct plan *p);
+int plan_compile(const char *text, struct plan *p);
+void plan_intern(struct plan *p);
+void plan_execute(const struct plan *p, int64_t *values);
+int plan_read_only(const struct plan *p);
+
+#endif /* PLAN_H_ */
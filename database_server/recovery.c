@@ -0,0 +1,578 @@
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include "db_serv.h"
+#include "wal.h"
+#include "recovery.h"
+#include "log.h"
+
+/* One value to apply during replay */
+struct replay_op
+{
+	uint32_t key;
+	int64_t value;
+};
+
+/* Replay work of one thread: the committed values of its share of the keys, in log order */
+struct replay_partition
+{
+	struct replay_op *ops;
+	size_t count, capacity;
+	pthread_t thread;
+};
+
+/* The SEQUENCED records of the batch being replayed, held back until its BATCH record shows it ran to the end */
+struct replay_batch
+{
+	uint64_t id;
+	const char **entries;		/* Point into the mapped log */
+	int *counts;
+	int used, capacity;
+};
+
+/* A PREPARE record not followed (yet) by its decision, with the INCREMENTS record ahead of it if it had one */
+struct pending_prepare
+{
+	uint64_t txid;
+	uint64_t lsn;
+	const char *entries;		/* Point into the mapped log */
+	int count;
+	const char *increments;
+	int incrementCount;
+	int prepared;				/* Its PREPARE record was found, without it the transaction never voted */
+	struct pending_prepare *next;
+};
+
+#define pendingBuckets 1024
+
+/* CRC32 of the header fields before the checksum */
+uint32_t snapshot_checksum(const struct snapshot_header *header)
+{
+	return wal_crc32(header, offsetof(struct snapshot_header, checksum));
+}
+
+/* Map file <path> read-only; returns NULL if it does not exist */
+static const char * map_file(const char *path, size_t *size)
+{
+	int fd;
+	struct stat st;
+	void *map;
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0)
+	{
+		if(errno != ENOENT)
+		{
+			perror("Could not open a snapshot file\n");
+			exit(EXIT_FAILURE);
+		}
+		return NULL;
+	}
+	if(fstat(fd, &st) < 0)
+	{
+		perror("Could not stat a snapshot file\n");
+		exit(EXIT_FAILURE);
+	}
+	*size = st.st_size;
+	map = (st.st_size > 0) ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : (void *)"";
+	if(map == MAP_FAILED)
+	{
+		perror("Could not map a snapshot file\n");
+		exit(EXIT_FAILURE);
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	close(fd);
+	return map;
+}
+
+/* Hold back a SEQUENCED record of batch <id> (<count> entries at <entries>) */
+static void batch_hold(struct replay_batch *b, uint64_t id, const char *entries, int count)
+{
+	if(b->used == b->capacity)
+	{
+		b->capacity = b->capacity ? 2 * b->capacity : 256;
+		b->entries = realloc(b->entries, b->capacity * sizeof(char *));
+		b->counts = realloc(b->counts, b->capacity * sizeof(int));
+		if(!b->entries || !b->counts)
+		{
+			perror("Could not allocate replay state\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	b->id = id;
+	b->entries[b->used] = entries;
+	b->counts[b->used] = count;
+	b->used++;
+}
+
+/* Load the snapshot at <path> (and the key names in KEYS_FILE) into the store; a missing snapshot means an empty database.
+Keys are interned in id order, so every key gets its id from before the restart back */
+static void snapshot_load(const char *path, struct snapshot_header *header)
+{
+	size_t size, keysSize, used;
+	const char *map, *keys;
+	const int64_t *values;
+	uint64_t id;
+	int length;
+
+	memset(header, 0, sizeof(*header));
+	header->nextTxid = 1;
+
+	map = map_file(path, &size);
+	if(!map)
+	{
+		log_info("No snapshot found, starting from an empty database\n");
+		return;
+	}
+	if(size < sizeof(struct snapshot_header))
+	{
+		fprintf(stderr, "Snapshot %s is truncated\n", path);
+		exit(EXIT_FAILURE);
+	}
+	memcpy(header, map, sizeof(*header));
+	values = (const int64_t *)(map + sizeof(struct snapshot_header));
+	keys = map_file(KEYS_FILE, &keysSize);
+	if( memcmp(header->magic, SNAPSHOT_MAGIC, 8) || snapshot_checksum(header) != header->checksum ||
+		size < sizeof(struct snapshot_header) + header->count * sizeof(int64_t) ||
+		(header->count > 0 && !keys) )
+	{
+		fprintf(stderr, "Snapshot %s is corrupt, refusing to start\n", path);
+		exit(EXIT_FAILURE);
+	}
+	used = 0;
+	for(id=0; id<header->count; id++)
+	{
+		if(used >= keysSize || used + 1 + (unsigned char)keys[used] > keysSize)
+		{
+			fprintf(stderr, "Key file %s is truncated, refusing to start\n", KEYS_FILE);
+			exit(EXIT_FAILURE);
+		}
+		length = (unsigned char)keys[used];
+		if(store_intern(keys + used + 1, length) != id)
+		{
+			fprintf(stderr, "Key file %s is corrupt, refusing to start\n", KEYS_FILE);
+			exit(EXIT_FAILURE);
+		}
+		store_set(id, values[id]);
+		used += 1 + length;
+	}
+	if(keys && keysSize > 0)
+		munmap((void *)keys, keysSize);
+	munmap((void *)map, size);
+	log_info("Loaded snapshot at log position %llu: %llu keys\n", (unsigned long long)header->lsn, (unsigned long long)header->count);
+}
+
+/* Queue the values of <count> log entries at <entries> on the partitions owning their keys */
+static void dispatch_entries(const char *entries, int count, struct replay_partition *partitions, int nPartitions)
+{
+	int i, keyLength;
+	uint32_t key;
+	int64_t value;
+	struct replay_partition *p;
+
+	for(i=0; i<count; i++)
+	{
+		keyLength = (unsigned char)*entries++;
+		key = store_intern(entries, keyLength);
+		entries += keyLength;
+		memcpy(&value, entries, sizeof(int64_t));
+		entries += sizeof(int64_t);
+		p = &partitions[key % nPartitions];
+		if(p->count == p->capacity)
+		{
+			p->capacity = p->capacity ? p->capacity * 2 : 1024;
+			p->ops = realloc(p->ops, p->capacity * sizeof(struct replay_op));
+			if(!p->ops)
+			{
+				perror("Could not allocate replay buffer\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		p->ops[p->count].key = key;
+		p->ops[p->count].value = value;
+		p->count++;
+	}
+}
+
+static void * replay_thread(void *args)
+{
+	struct replay_partition *p = (struct replay_partition *)args;
+	size_t i;
+
+	for(i=0; i<p->count; i++)
+		store_set(p->ops[i].key, p->ops[i].value);
+	return NULL;
+}
+
+/* Do the entries of a record of type <type> fit in <length> bytes */
+static int entries_valid(const char *entries, int count, size_t length, int type)
+{
+	size_t used = 0;
+	int i;
+
+	for(i=0; i<count; i++)
+	{
+		if(used + 1 > length)
+			return 0;
+		used += wal_entry_size(type, (unsigned char)entries[used]);
+		if(used > length)
+			return 0;
+	}
+	return used == length;
+}
+
+/* Rebuild the store from the snapshot and the log written after it.
+The log segments are scanned once from the snapshot's replay position: committed values are handed to
+per-key-partition threads that apply them in parallel (each key's values stay in log order),
+PREPARE records without a decision become in-doubt transactions that hold their locks again (increment locks
+for the deltas of an INCREMENTS record ahead of the PREPARE, within the bounds they were checked against).
+A torn or corrupt record ends the log, which is cut back to the last intact record. */
+void recovery_run(const char *snapshotPath, struct recovery_result *result)
+{
+	struct snapshot_header header;
+	struct wal_record_header record;
+	struct replay_partition partitions[maxReplayThreads];
+	struct pending_prepare **pending, *pp, **link;
+	struct replay_batch batch;
+	struct transaction *t;
+	int fd, i, k, nPartitions, keyLength, nSegments, seg, torn;
+	struct stat st;
+	const char **maps, *map, *entries;
+	size_t *mapSizes;
+	uint64_t *bases, pos, end, maxTxid, replayed;
+	uint32_t id;
+	int64_t value, low, high;
+	long cpus;
+	char name[64];
+
+	snapshot_load(snapshotPath, &header);
+	memset(&batch, 0, sizeof(batch));
+	result->endLsn = header.lsn;
+	result->replayLsn = header.lsn;
+	result->nextTxid = header.nextTxid;
+	result->lastBatch = header.lastBatch;
+	result->inDoubt = NULL;
+
+	nSegments = wal_segments(&bases);
+	maps = calloc(nSegments + 1, sizeof(char *));
+	mapSizes = calloc(nSegments + 1, sizeof(size_t));
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nPartitions = (cpus < 1) ? 1 : (cpus > maxReplayThreads) ? maxReplayThreads : (int)cpus;
+	memset(partitions, 0, sizeof(partitions));
+	pending = calloc(pendingBuckets, sizeof(struct pending_prepare *));
+	if(!maps || !mapSizes || !pending)
+	{
+		perror("Could not allocate replay state\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Sequential scan and decode, one segment after the other */
+	maxTxid = 0;
+	replayed = 0;
+	torn = 0;
+	pos = header.replayLsn;
+	for(seg=0; seg<nSegments && !torn; seg++)
+	{
+		if(seg + 1 < nSegments && bases[seg + 1] <= pos)
+			continue;				/* Entirely covered by the snapshot */
+		if(bases[seg] > pos)
+		{
+			fprintf(stderr, "Write-ahead log segments before %016llx are missing, refusing to start\n",
+				(unsigned long long)bases[seg]);
+			exit(EXIT_FAILURE);
+		}
+		wal_segment_name(name, sizeof(name), bases[seg]);
+		fd = open(name, O_RDWR);
+		if(fd < 0 || fstat(fd, &st) < 0)
+		{
+			perror("Could not open a write-ahead log segment\n");
+			exit(EXIT_FAILURE);
+		}
+		end = bases[seg] + (uint64_t)st.st_size;
+		if(end <= pos)
+		{
+			close(fd);
+			continue;
+		}
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(map == MAP_FAILED)
+		{
+			perror("Could not map the write-ahead log\n");
+			exit(EXIT_FAILURE);
+		}
+		madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+		maps[seg] = map;
+		mapSizes[seg] = st.st_size;
+		map -= bases[seg];			/* So that map + pos addresses log position pos */
+
+		while(pos + sizeof(record) <= end)
+		{
+			memcpy(&record, map + pos, sizeof(record));
+			if( record.length < sizeof(record) || pos + record.length > end ||
+				wal_crc32(map + pos + 8, record.length - 8) != record.checksum ||
+				!entries_valid(map + pos + sizeof(record), record.count, record.length - sizeof(record), record.type) )
+				break;
+			entries = map + pos + sizeof(record);
+			/* A batch is replayed as a whole or not at all, it runs again if it did not get to the end */
+			if(record.type == WAL_SEQUENCED)
+			{
+				if(record.txid != batch.id)
+					batch.used = 0;		//What was held ran again, or a newer sequencer overtook it
+				batch_hold(&batch, record.txid, entries, record.count);
+			}
+			else if(record.type == WAL_BATCH)
+			{
+				for(i=0; i<batch.used && batch.id == record.txid; i++)
+					dispatch_entries(batch.entries[i], batch.counts[i], partitions, nPartitions);
+				batch.used = 0;
+				if(record.txid > result->lastBatch)
+					result->lastBatch = record.txid;
+			}
+			if(record.type == WAL_SEQUENCED || record.type == WAL_BATCH)
+			{
+				replayed++;
+				pos += record.length;
+				continue;
+			}
+			if(record.txid > maxTxid && !(record.txid & globalTxidFlag))		//Global ids are not ours to continue
+				maxTxid = record.txid;
+
+			link = &pending[record.txid % pendingBuckets];
+			while(*link && (*link)->txid != record.txid)
+				link = &(*link)->next;
+			if(record.type == WAL_PREPARE || record.type == WAL_INCREMENTS)
+			{
+				pp = *link;
+				if(!pp)
+				{
+					pp = calloc(1, sizeof(struct pending_prepare));
+					if(!pp)
+					{
+						perror("Could not allocate replay state\n");
+						exit(EXIT_FAILURE);
+					}
+					pp->txid = record.txid;
+					pp->lsn = pos;
+					pp->next = pending[record.txid % pendingBuckets];
+					pending[record.txid % pendingBuckets] = pp;
+				}
+				if(record.type == WAL_PREPARE)
+				{
+					pp->entries = entries;
+					pp->count = record.count;
+					pp->prepared = 1;
+				}
+				else
+				{
+					pp->increments = entries;
+					pp->incrementCount = record.count;
+				}
+			}
+			else if(record.type == WAL_COMMIT || record.type == WAL_ABORT)
+			{
+				pp = *link;
+				if(pp)
+				{
+					*link = pp->next;
+					if(record.type == WAL_COMMIT)		//Its increments' new values are in the COMMIT record
+						dispatch_entries(pp->entries, pp->count, partitions, nPartitions);
+					free(pp);
+				}
+				if(record.type == WAL_COMMIT)
+					dispatch_entries(entries, record.count, partitions, nPartitions);
+				if(record.txid & globalTxidFlag)		//Status queries still get the right answer after a restart
+					decided_add(record.txid, (record.type == WAL_COMMIT) ? RESULT_COMMITTED : RESULT_ABORTED);
+			}
+			replayed++;
+			pos += record.length;
+		}
+		if(pos < end)
+		{
+			/* Everything after a bad record is unusable, later segments included */
+			log_warn("Write-ahead log ends in a torn record at %llu, cutting it off\n", (unsigned long long)pos);
+			if(ftruncate(fd, pos - bases[seg]) < 0 || fsync(fd) < 0)
+			{
+				perror("Could not truncate the write-ahead log\n");
+				exit(EXIT_FAILURE);
+			}
+			for(k=seg+1; k<nSegments; k++)
+			{
+				wal_segment_name(name, sizeof(name), bases[k]);
+				unlink(name);
+			}
+			torn = 1;
+		}
+		close(fd);
+	}
+
+	/* Parallel apply */
+	for(i=0; i<nPartitions; i++)
+	{
+		if(pthread_create(&partitions[i].thread, NULL, replay_thread, &partitions[i]) != 0)
+		{
+			perror("Could not start replay thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for(i=0; i<nPartitions; i++)
+	{
+		pthread_join(partitions[i].thread, NULL);
+		free(partitions[i].ops);
+	}
+
+	/* Whatever is still pending was prepared but never decided: lock it up again until its coordinator tells us */
+	result->endLsn = pos;
+	result->replayLsn = pos;
+	for(i=0; i<pendingBuckets; i++)
+	{
+		while((pp = pending[i]))
+		{
+			pending[i] = pp->next;
+			if(!pp->prepared)		//Cut off between its INCREMENTS and PREPARE records, it never voted yes
+			{
+				free(pp);
+				continue;
+			}
+			t = transaction_new();
+			t->txid = t->locks.txid = pp->txid;
+			t->prepared = 1;
+			t->prepareLsn = pp->lsn;
+			entries = pp->entries;
+			for(k=0; k<pp->count; k++)
+			{
+				keyLength = (unsigned char)*entries++;
+				memcpy(&value, entries + keyLength, sizeof(int64_t));
+				id = store_intern(entries, keyLength);
+				lock_acquire(&t->locks, id, LOCK_EXCLUSIVE, 0);
+				*cache_slot(t, id) = value;
+				entries += keyLength + sizeof(int64_t);
+			}
+			entries = pp->increments;
+			for(k=0; k<pp->incrementCount; k++)
+			{
+				keyLength = (unsigned char)*entries++;
+				memcpy(&value, entries + keyLength, sizeof(int64_t));
+				memcpy(&low, entries + keyLength + sizeof(int64_t), sizeof(int64_t));
+				memcpy(&high, entries + keyLength + 2 * sizeof(int64_t), sizeof(int64_t));
+				id = store_intern(entries, keyLength);
+				lock_acquire_increment(&t->locks, id, value, low, high, 0);		//Keeps the room it needs from later increments
+				*cache_slot(t, id) = value;
+				entries += keyLength + 3 * sizeof(int64_t);
+			}
+			log_info("Transaction %llu is in doubt, holding its locks until it is resolved\n", t->txid);
+			if(pp->lsn < result->replayLsn)
+				result->replayLsn = pp->lsn;
+			t->next = result->inDoubt;
+			result->inDoubt = t;
+			free(pp);
+		}
+	}
+	free(pending);
+	if(batch.used > 0)
+		log_info("Batch %llu of sequencer %llu did not get to the end, it runs again\n",
+			(unsigned long long)(batch.id & 0xFFFFFFFF), (unsigned long long)(batch.id >> 32));
+	free(batch.entries);
+	free(batch.counts);
+	if(maxTxid + 1 > result->nextTxid)
+		result->nextTxid = maxTxid + 1;
+	for(seg=0; seg<nSegments; seg++)
+		if(maps[seg])
+			munmap((void *)maps[seg], mapSizes[seg]);
+	free(maps);
+	free(mapSizes);
+	free(bases);
+	log_info("Replayed %llu log records on %d threads\n", (unsigned long long)replayed, nPartitions);
+}
+
+/* Make renames in the current directory durable */
+static void sync_directory(void)
+{
+	int dirfd;
+
+	dirfd = open(".", O_RDONLY);
+	if(dirfd >= 0)
+	{
+		fsync(dirfd);
+		close(dirfd);
+	}
+}
+
+/* Durably close <f> (writing <tempPath>) and move it over <path> */
+static void install_file(FILE *f, const char *tempPath, const char *path)
+{
+	if(fflush(f) != 0 || fsync(fileno(f)) < 0 || fclose(f) != 0)
+	{
+		perror("Could not write the snapshot\n");
+		exit(EXIT_FAILURE);
+	}
+	if(rename(tempPath, path) < 0)
+	{
+		perror("Could not install the snapshot\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Write the whole store as the new snapshot at <path>, atomically replacing the old one.
+The key names go first: a newer key file only ever extends the ids an older snapshot knows */
+void snapshot_write(const char *path, uint64_t lsn, uint64_t replayLsn, unsigned long long nextTxid, uint64_t lastBatch)
+{
+	struct snapshot_header header;
+	char tempPath[256];
+	const char *name;
+	uint32_t count, id, chunk, n;
+	int length;
+	FILE *f;
+
+	count = store_count();
+	snprintf(tempPath, sizeof(tempPath), "%s.tmp", KEYS_FILE);
+	f = fopen(tempPath, "wb");
+	if(!f)
+	{
+		perror("Could not write the key file\n");
+		exit(EXIT_FAILURE);
+	}
+	for(id=0; id<count; id++)
+	{
+		name = store_key(id, &length);
+		fputc(length, f);
+		fwrite(name, 1, length, f);
+	}
+	install_file(f, tempPath, KEYS_FILE);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+	header.lsn = lsn;
+	header.replayLsn = replayLsn;
+	header.nextTxid = nextTxid;
+	header.lastBatch = lastBatch;
+	header.count = count;
+	header.checksum = snapshot_checksum(&header);
+
+	snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+	f = fopen(tempPath, "wb");
+	if(!f || fwrite(&header, sizeof(header), 1, f) != 1)
+	{
+		perror("Could not write the snapshot\n");
+		exit(EXIT_FAILURE);
+	}
+	for(chunk=0; chunk * storeChunkSize < count; chunk++)
+	{
+		n = count - chunk * storeChunkSize;
+		if(n > storeChunkSize)
+			n = storeChunkSize;
+		if(fwrite(storeChunks[chunk]->values, sizeof(int64_t), n, f) != n)
+		{
+			perror("Could not write the snapshot\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	install_file(f, tempPath, path);
+	sync_directory();
+}
@@ -0,0 +1,44 @@
+/*
+ * recovery.h
+ *
+ * Startup from the last snapshot plus the tail of the write-ahead log.
+ */
+
+#ifndef RECOVERY_H_
+#define RECOVERY_H_
+
+#include <stdint.h>
+#include "db_serv.h"
+
+#define SNAPSHOT_FILE "database.snap"
+#define KEYS_FILE "database.keys"		/* Key names in id order: { uint8_t length; char key[length]; } each */
+#define SNAPSHOT_MAGIC "DSTRSNP3"
+#define maxReplayThreads 8
+
+/* Snapshot file header, followed by <count> int64_t values (value i belongs to key id i, named by entry i of KEYS_FILE) */
+struct snapshot_header
+{
+	char     magic[8];
+	uint64_t lsn;				/* Log position the values are consistent with */
+	uint64_t replayLsn;			/* Where replay has to start: <= lsn, earlier if prepared transactions were in doubt */
+	uint64_t nextTxid;			/* First transaction id not used yet */
+	uint64_t lastBatch;			/* Last batch of the sequencer the values include, 0 if none */
+	uint64_t count;
+	uint32_t checksum;			/* CRC32 of the fields above; values are updated in place by checkpoints */
+	uint32_t reserved;
+};
+
+struct recovery_result
+{
+	uint64_t endLsn;			/* End of the last intact log record */
+	uint64_t replayLsn;			/* Oldest PREPARE record still in doubt (endLsn if none) */
+	unsigned long long nextTxid;
+	uint64_t lastBatch;			/* Last batch of the sequencer run, the next one to run has to follow it */
+	struct transaction *inDoubt;	/* Prepared, undecided transactions, holding their locks again */
+};
+
+void recovery_run(const char *snapshotPath, struct recovery_result *result);
+void snapshot_write(const char *path, uint64_t lsn, uint64_t replayLsn, unsigned long long nextTxid, uint64_t lastBatch);
+uint32_t snapshot_checksum(const struct snapshot_header *header);
+
+#endif /* RECOVERY_H_ */
@@ -0,0 +1,591 @@
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <time.h>
+#include "replication.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "store.h"
+#include "log.h"
+
+#define heldBuckets 1024
+
+int replica;
+int maxLagMs = defaultMaxLagMs;
+
+/* One replica's subscription, on the primary */
+struct shipment
+{
+	struct connection *c;
+	uint64_t requestId;			/* The MSG_SUBSCRIBE's, every frame of the shipment goes under it */
+	uint64_t start;				/* Log position the records follow the values from */
+	uint64_t stamp;				/* Every commit with a timestamp up to this one is in the log before <start> or in the values */
+	uint64_t pos;				/* Next record to send; the log is kept from the oldest of these */
+	struct shipment *next;
+};
+
+static pthread_mutex_t shipLock = PTHREAD_MUTEX_INITIALIZER;
+static struct shipment *shipments;
+
+/* A PREPARE record the replica holds until its decision, by transaction id */
+struct held_prepare
+{
+	uint64_t txid;
+	char *entries;
+	int count;
+	struct held_prepare *next;
+};
+
+/* Replica state, only touched by its thread but for what replica_lag reads */
+static struct held_prepare *held[heldBuckets];
+static char *batchEntries;					/* SEQUENCED records of the batch under way, held until its BATCH record */
+static size_t batchUsed, batchCapacity;
+static int batchCount;
+static uint64_t batchId;
+static uint64_t nextLsn;					/* Next log position expected from the primary */
+static uint64_t readyLsn;					/* The values are consistent once the log is applied this far */
+static unsigned long long freshMs;			/* Last time the replica had everything the primary had durable, 0 while it is not serving */
+
+static unsigned long long now_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
+
+/* Size of <count> entries of a log record of type <type> at <entries>, at most <length> bytes of them; -1 if they do not fit */
+static long entries_length(const char *entries, int count, size_t length, int type)
+{
+	size_t used = 0;
+	int i;
+
+	for(i=0; i<count; i++)
+	{
+		if(used >= length || used + wal_entry_size(type, (unsigned char)entries[used]) > length)
+			return -1;
+		used += wal_entry_size(type, (unsigned char)entries[used]);
+	}
+	return (long)used;
+}
+
+/**** Primary ****/
+
+/* Oldest log position a replica still has to be sent, or <lsn> if that is older */
+uint64_t ship_horizon(uint64_t lsn)
+{
+	struct shipment *s;
+
+	pthread_mutex_lock(&shipLock);
+	for(s = shipments; s; s = s->next)
+		if(s->pos < lsn)
+			lsn = s->pos;
+	pthread_mutex_unlock(&shipLock);
+	return lsn;
+}
+
+/* Send the values as of a snapshot holding every commit up to s->stamp, in MSG_STATE frames.
+Records before s->start have timestamps up to it, so they are all in there; the ones after it may be too
+(they carry after-images and, for any one key, come in commit order, so applying them again is harmless).
+Once the replica has applied the log up to where it was when the snapshot was taken, it is consistent */
+static void ship_state(struct shipment *s)
+{
+	char *frame;
+	const char *key;
+	uint64_t stamp, end;
+	uint32_t id, count;
+	int64_t value;
+	size_t used;
+	int slot, length;
+
+	frame = malloc(shipPrefixSize + shipChunkSize);
+	if(!frame)
+	{
+		perror("Could not allocate a shipment\n");
+		exit(EXIT_FAILURE);
+	}
+	slot = snapshot_hold(s->stamp, &stamp);
+	end = wal_end(&wal);
+	count = store_count();
+	put_u64(frame, s->start);
+	put_u64(frame + 8, end);
+	used = shipPrefixSize;
+	for(id=0; id<count; id++)
+	{
+		value = snapshot_value(id, stamp);
+		if(value == STORE_UNSET)
+			continue;
+		key = store_key(id, &length);
+		if(used + 1 + length + sizeof(int64_t) > shipPrefixSize + shipChunkSize)
+		{
+			reply(s->c, MSG_STATE, s->requestId, 0, frame, used);
+			used = shipPrefixSize;
+		}
+		frame[used++] = (char)length;
+		memcpy(frame + used, key, length);
+		memcpy(frame + used + length, &value, sizeof(int64_t));
+		used += length + sizeof(int64_t);
+	}
+	snapshot_drop(slot);
+	reply(s->c, MSG_STATE, s->requestId, 0, frame, used);
+	free(frame);
+	log_info("Sent the values of %u keys to a replica, the log follows from %llu\n", count, (unsigned long long)s->start);
+}
+
+/* Open the segment holding log position <pos>, its start to <base>. Returns -1 if it is gone */
+static int segment_of(uint64_t pos, uint64_t *base)
+{
+	uint64_t *bases;
+	char name[64];
+	int count, i, fd = -1;
+
+	count = wal_segments(&bases);
+	for(i=count-1; i>=0 && bases[i] > pos; i--);
+	if(i >= 0)
+	{
+		*base = bases[i];
+		wal_segment_name(name, sizeof(name), bases[i]);
+		fd = open(name, O_RDONLY);
+	}
+	free(bases);
+	return fd;
+}
+
+/* Shipment thread: the values, then the log records as they become durable, until the replica hangs up */
+static void * ship_thread(void *args)
+{
+	struct shipment *s = (struct shipment *) args, **link;
+	struct wal_record_header record;
+	char *frame;
+	size_t capacity, want, used;
+	uint64_t durable, base = 0;
+	ssize_t n;
+	int fd = -1, closed;
+
+	ship_state(s);
+	capacity = shipChunkSize;
+	frame = malloc(shipPrefixSize + capacity);
+	if(!frame)
+	{
+		perror("Could not allocate a shipment\n");
+		exit(EXIT_FAILURE);
+	}
+	while(1)
+	{
+		pthread_mutex_lock(&s->c->lock);
+		closed = s->c->closed;
+		pthread_mutex_unlock(&s->c->lock);
+		if(closed)
+			break;
+		durable = wal_wait(&wal, s->pos, heartbeatMs);
+		used = 0;
+		if(durable > s->pos)
+		{
+			if(fd < 0 && (fd = segment_of(s->pos, &base)) < 0)
+			{
+				log_warn("The log a replica needs is gone, dropping it!\n");
+				shutdown(s->c->socketfd, SHUT_RDWR);
+				break;
+			}
+			want = (durable - s->pos < capacity) ? durable - s->pos : capacity;
+			n = pread(fd, frame + shipPrefixSize, want, s->pos - base);
+			if(n <= 0)		//The segment ends here, the next one starts
+			{
+				close(fd);
+				fd = -1;
+				continue;
+			}
+			/* Whole records only */
+			while(used + sizeof(record) <= (size_t)n)
+			{
+				memcpy(&record, frame + shipPrefixSize + used, sizeof(record));
+				if(used + record.length > (size_t)n)
+					break;
+				used += record.length;
+			}
+			if(used == 0 && (size_t)n == want && record.length > capacity)		//One record bigger than a chunk
+			{
+				capacity = record.length;
+				frame = realloc(frame, shipPrefixSize + capacity);
+				if(!frame)
+				{
+					perror("Could not allocate a shipment\n");
+					exit(EXIT_FAILURE);
+				}
+				continue;
+			}
+		}
+		put_u64(frame, s->pos);
+		put_u64(frame + 8, durable);
+		reply(s->c, MSG_LOG, s->requestId, 0, frame, shipPrefixSize + used);
+		pthread_mutex_lock(&shipLock);
+		s->pos += used;
+		pthread_mutex_unlock(&shipLock);
+	}
+	if(fd >= 0)
+		close(fd);
+	free(frame);
+	pthread_mutex_lock(&shipLock);
+	for(link = &shipments; *link != s; link = &(*link)->next);
+	*link = s->next;
+	pthread_mutex_unlock(&shipLock);
+	log_info("Replica gone, stopped shipping the log to it\n");
+	connection_release(s->c);
+	free(s);
+	return NULL;
+}
+
+/* A replica subscribed on <c> (request <requestId>): ship it our values and then our log, on a thread of its own */
+void ship_start(struct connection *c, uint64_t requestId)
+{
+	struct shipment *s;
+	pthread_t thread;
+	uint64_t end;
+
+	s = malloc(sizeof(struct shipment));
+	if(!s)
+	{
+		perror("Could not allocate a shipment\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_mutex_lock(&c->lock);
+	c->refs++;
+	pthread_mutex_unlock(&c->lock);
+	s->c = c;
+	s->requestId = requestId;
+	/* The log from where replay would start on its own (the PREPARE records still undecided are there),
+	kept from now on; then the timestamp the values have to include: every record logged before
+	<start> got its timestamp before this, since commits take one before they log */
+	pthread_mutex_lock(&shipLock);
+	s->start = s->pos = replay_start(&end);
+	s->stamp = snapshot_clock();
+	s->next = shipments;
+	shipments = s;
+	pthread_mutex_unlock(&shipLock);
+	if(pthread_create(&thread, NULL, ship_thread, s) != 0)
+	{
+		perror("Could not start a shipment thread\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_detach(thread);
+	log_info("Replica subscribed, shipping the log from %llu\n", (unsigned long long)s->start);
+}
+
+/**** Replica ****/
+
+/* Apply the entries of <parts> records (<entries>, <counts>) as one commit */
+static void apply_commit(const char **entries, const int *counts, int parts)
+{
+	uint64_t stamp, horizon;
+	const char *e;
+	int64_t value;
+	int i, k, keyLength;
+
+	stamp = 0;
+	for(i=0; i<parts; i++)
+	{
+		e = entries[i];
+		for(k=0; k<counts[i]; k++)
+		{
+			keyLength = (unsigned char)*e++;
+			memcpy(&value, e + keyLength, sizeof(int64_t));
+			if(!stamp)
+				stamp = snapshot_begin(&horizon);
+			snapshot_install(store_intern(e, keyLength), value, stamp, horizon);
+			e += keyLength + sizeof(int64_t);
+		}
+	}
+	if(stamp)
+		snapshot_publish(stamp);
+}
+
+/* Copy of <length> bytes at <data> */
+static char * copy_of(const char *data, size_t length)
+{
+	char *p;
+
+	p = malloc(length ? length : 1);
+	if(!p)
+	{
+		perror("Could not allocate replica state\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(p, data, length);
+	return p;
+}
+
+/* Forget what is held back, the next MSG_STATE starts over */
+static void replica_reset(void)
+{
+	struct held_prepare *h;
+	int i;
+
+	for(i=0; i<heldBuckets; i++)
+	{
+		while((h = held[i]))
+		{
+			held[i] = h->next;
+			free(h->entries);
+			free(h);
+		}
+	}
+	batchUsed = 0;
+	batchCount = 0;
+	__atomic_store_n(&freshMs, 0, __ATOMIC_RELAXED);
+}
+
+/* Apply log record <record> whose entries (<length> bytes of them) are at <entries>, as recovery would */
+static void apply_record(const struct wal_record_header *record, const char *entries, size_t length)
+{
+	struct held_prepare *h, **link;
+	const char *parts[2];
+	int counts[2];
+	const char *e;
+	int i;
+
+	if(record->type == WAL_SEQUENCED)
+	{
+		if(record->txid != batchId)
+			batchUsed = batchCount = 0;		//What was held ran again, or a newer sequencer overtook it
+		batchId = record->txid;
+		if(batchUsed + length + sizeof(int) > batchCapacity)
+		{
+			batchCapacity = 2 * (batchUsed + length + sizeof(int));
+			batchEntries = realloc(batchEntries, batchCapacity);
+			if(!batchEntries)
+			{
+				perror("Could not allocate replica state\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		counts[0] = record->count;
+		memcpy(batchEntries + batchUsed, &counts[0], sizeof(int));
+		memcpy(batchEntries + batchUsed + sizeof(int), entries, length);
+		batchUsed += sizeof(int) + length;
+		batchCount++;
+		return;
+	}
+	if(record->type == WAL_BATCH)
+	{
+		/* The whole batch as one commit: a read sees all of it or none */
+		const char **all;
+		int *allCounts;
+
+		if(record->txid != batchId || batchCount == 0)
+		{
+			batchUsed = batchCount = 0;
+			return;
+		}
+		all = malloc(batchCount * sizeof(char *));
+		allCounts = malloc(batchCount * sizeof(int));
+		if(!all || !allCounts)
+		{
+			perror("Could not allocate replica state\n");
+			exit(EXIT_FAILURE);
+		}
+		for(i=0, e=batchEntries; i<batchCount; i++)
+		{
+			memcpy(&allCounts[i], e, sizeof(int));
+			all[i] = e + sizeof(int);
+			e += sizeof(int) + entries_length(all[i], allCounts[i], batchEntries + batchUsed - all[i], WAL_SEQUENCED);
+		}
+		apply_commit(all, allCounts, batchCount);
+		free(all);
+		free(allCounts);
+		batchUsed = batchCount = 0;
+		return;
+	}
+
+	link = &held[record->txid % heldBuckets];
+	while(*link && (*link)->txid != record->txid)
+		link = &(*link)->next;
+	h = *link;
+	if(record->type == WAL_PREPARE)
+	{
+		if(!h)
+		{
+			h = malloc(sizeof(struct held_prepare));
+			if(!h)
+			{
+				perror("Could not allocate replica state\n");
+				exit(EXIT_FAILURE);
+			}
+			h->txid = record->txid;
+			h->next = held[record->txid % heldBuckets];
+			held[record->txid % heldBuckets] = h;
+		}
+		else
+			free(h->entries);
+		h->entries = copy_of(entries, length);
+		h->count = record->count;
+	}
+	else if(record->type == WAL_COMMIT || record->type == WAL_ABORT)
+	{
+		counts[0] = 0;
+		if(h)
+		{
+			*link = h->next;
+			parts[0] = h->entries;
+			counts[0] = h->count;
+		}
+		if(record->type == WAL_COMMIT)		//Its increments' new values are in the COMMIT record
+		{
+			parts[1] = entries;
+			counts[1] = record->count;
+			if(h)
+				apply_commit(parts, counts, 2);
+			else
+				apply_commit(parts + 1, counts + 1, 1);
+		}
+		if(h)
+		{
+			free(h->entries);
+			free(h);
+		}
+	}
+	//INCREMENTS records only matter to recovery: the new values come with the COMMIT
+}
+
+/* Handle frame <h> (<payload>) of the shipment, received at <received>. Returns -1 if the stream is broken */
+static int replica_frame(struct frame_header *h, const char *payload, unsigned long long received)
+{
+	struct wal_record_header record;
+	const char *p, *end;
+	const char *entry[1];
+	uint64_t pos, durable;
+	long length;
+	int count;
+
+	if(h->length < shipPrefixSize)
+		return -1;
+	pos = get_u64(payload);
+	durable = get_u64(payload + 8);
+	p = payload + shipPrefixSize;
+	end = payload + h->length;
+	if(h->type == MSG_STATE)
+	{
+		/* The values as one commit per frame; reads wait until the log makes them consistent */
+		entry[0] = p;
+		for(count = 0; p < end; count++)
+		{
+			if((length = entries_length(p, 1, end - p, WAL_COMMIT)) < 0)
+				return -1;
+			p += length;
+		}
+		apply_commit(entry, &count, 1);
+		__atomic_store_n(&freshMs, 0, __ATOMIC_RELAXED);
+		nextLsn = pos;
+		readyLsn = durable;
+		return 0;
+	}
+	if(h->type != MSG_LOG)
+		return 0;
+	if(pos != nextLsn)
+	{
+		log_warn("Log from the primary at %llu, expected %llu!\n", (unsigned long long)pos, (unsigned long long)nextLsn);
+		return -1;
+	}
+	while(p + sizeof(record) <= end)
+	{
+		memcpy(&record, p, sizeof(record));
+		if( record.length < sizeof(record) || record.length > (size_t)(end - p) ||
+			wal_crc32(p + 8, record.length - 8) != record.checksum ||
+			entries_length(p + sizeof(record), record.count, record.length - sizeof(record), record.type) < 0 )
+		{
+			log_warn("Bad log record from the primary at %llu!\n", (unsigned long long)nextLsn);
+			return -1;
+		}
+		apply_record(&record, p + sizeof(record), record.length - sizeof(record));
+		p += record.length;
+		nextLsn += record.length;
+	}
+	if(p != end)
+		return -1;
+	if(nextLsn >= durable && nextLsn >= readyLsn)		//Everything the primary had when it sent this
+		__atomic_store_n(&freshMs, received, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* Replica thread: subscribe to the primary at <args> and apply what it ships, subscribing again whenever the connection breaks */
+static void * replica_thread(void *args)
+{
+	struct sockaddr_in *primary = (struct sockaddr_in *) args;
+	struct frame_buffer in;
+	struct frame_header h, inner;
+	struct timespec delay;
+	char *payload, *innerPayload;
+	uint32_t offset;
+	int fd, r, one = 1;
+
+	delay.tv_sec = resubscribeDelayMs / 1000;
+	delay.tv_nsec = (long)(resubscribeDelayMs % 1000) * 1000000L;
+	frame_buffer_init(&in);
+	while(1)
+	{
+		fd = socket(PF_INET, SOCK_STREAM, 0);
+		if(fd < 0)
+		{
+			perror("Could not create a socket\n");
+			exit(EXIT_FAILURE);
+		}
+		if(connect(fd, (struct sockaddr *)primary, sizeof(*primary)) < 0 || frame_send(fd, MSG_SUBSCRIBE, 1, 0, NULL, 0) < 0)
+		{
+			close(fd);
+			nanosleep(&delay, NULL);
+			continue;
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		log_info("Subscribed to the primary\n");
+		in.start = in.used = 0;
+		r = 0;
+		while(r == 0 && frame_recv(fd, &in, &h, &payload) == 0)
+		{
+			if(h.type != MSG_GROUP)
+			{
+				r = replica_frame(&h, payload, now_ms());
+				continue;
+			}
+			offset = 0;
+			while(r == 0 && (r = frame_batch_next(payload, h.length, &offset, &inner, &innerPayload)) > 0)
+				r = replica_frame(&inner, innerPayload, now_ms());
+		}
+		close(fd);
+		replica_reset();
+		log_info("Lost the primary, subscribing again in %d ms\n", resubscribeDelayMs);
+		nanosleep(&delay, NULL);
+	}
+	return NULL;
+}
+
+/* Become a replica of the primary at <primary> */
+void replica_start(const struct sockaddr_in *primary)
+{
+	static struct sockaddr_in address;
+	pthread_t thread;
+
+	address = *primary;
+	if(pthread_create(&thread, NULL, replica_thread, &address) != 0)
+	{
+		perror("Could not start the replica thread\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_detach(thread);
+}
+
+/* How far behind its primary the replica is, in ms: since it last had everything the primary had durable.
+-1 while it has no consistent values */
+int replica_lag(void)
+{
+	unsigned long long fresh;
+
+	fresh = __atomic_load_n(&freshMs, __ATOMIC_RELAXED);
+	if(!fresh)
+		return -1;
+	return (int)(now_ms() - fresh);
+}
@@ -0,0 +1,33 @@
+/*
+ * replication.h
+ *
+ * Log-shipping read replicas. A replica subscribes to its primary, which
+ * sends it a consistent copy of its values and then the write-ahead log
+ * records from where that copy left off, as they become durable. The replica
+ * applies them as the primary's recovery would, one commit at a time, and
+ * serves read-only transactions from its snapshots for as long as it is
+ * no more than maxLagMs behind; further behind, it answers RESULT_STALE and
+ * the middleware reads at the primary instead.
+ */
+
+#ifndef REPLICATION_H_
+#define REPLICATION_H_
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include "db_serv.h"
+
+#define shipChunkSize (1 << 20)		/* Values or log records one MSG_STATE / MSG_LOG frame carries at most */
+#define heartbeatMs 100				/* An idle primary still sends an empty MSG_LOG this often */
+#define defaultMaxLagMs 1000		/* Staleness a replica serves reads at, at most (-b) */
+#define resubscribeDelayMs 1000		/* A replica that lost its primary tries again after this long */
+
+extern int replica;					/* This database server is a replica (-R) */
+extern int maxLagMs;
+
+void ship_start(struct connection *c, uint64_t requestId);
+uint64_t ship_horizon(uint64_t lsn);
+void replica_start(const struct sockaddr_in *primary);
+int replica_lag(void);
+
+#endif /* REPLICATION_H_ */
@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+#include "store.h"
+#include "snapshot.h"
+
+/* Commits take timestamps in order but finish installing their values in any order: a snapshot is the newest
+timestamp below every commit still installing, so it sees each commit entirely or not at all. Handing out
+timestamps and snapshots is serialized by clockLock, finishing a commit or a read is a single store */
+static pthread_mutex_t clockLock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t commitClock;				/* Last timestamp handed out */
+static uint64_t installing[maxSnapshots];	/* Timestamps of the commits installing their values, 0 for a free slot */
+static uint64_t readers[maxSnapshots];		/* Snapshot of each reader plus one, 0 for a free slot */
+
+/* Newest snapshot, with clockLock held */
+static uint64_t snapshot_visible(void)
+{
+	uint64_t s, v;
+	int i;
+
+	s = commitClock;
+	for(i=0; i<maxSnapshots; i++)
+	{
+		v = __atomic_load_n(&installing[i], __ATOMIC_ACQUIRE);
+		if(v && v - 1 < s)
+			s = v - 1;
+	}
+	return s;
+}
+
+/* Free slot of <slots>, with clockLock held; waits (dropping it) while there is none */
+static int snapshot_slot(uint64_t *slots)
+{
+	int i;
+
+	while(1)
+	{
+		for(i=0; i<maxSnapshots; i++)
+			if(!__atomic_load_n(&slots[i], __ATOMIC_RELAXED))
+				return i;
+		pthread_mutex_unlock(&clockLock);
+		sched_yield();
+		pthread_mutex_lock(&clockLock);
+	}
+}
+
+/* Timestamp for a commit about to install its values, snapshot_publish must follow. <horizon> is set to the oldest
+snapshot anyone may read while it installs: the replaced values older than the newest one at or before it are garbage */
+uint64_t snapshot_begin(uint64_t *horizon)
+{
+	uint64_t stamp, h, r;
+	int i, slot;
+
+	pthread_mutex_lock(&clockLock);
+	slot = snapshot_slot(installing);
+	h = snapshot_visible();
+	for(i=0; i<maxSnapshots; i++)
+	{
+		r = __atomic_load_n(&readers[i], __ATOMIC_RELAXED);
+		if(r && r - 1 < h)
+			h = r - 1;
+	}
+	stamp = ++commitClock;
+	__atomic_store_n(&installing[slot], stamp, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&clockLock);
+	*horizon = h;
+	return stamp;
+}
+
+/* Write key <id> under commit timestamp <stamp>, keeping the value it replaces for the snapshots newer than <horizon>
+(see snapshot_begin). One writer at a time per key, its exclusive lock holder. A reader stops at the newest
+version at or before its snapshot, which is never older than the horizon, so it never reaches the versions pruned here. */
+void snapshot_install(uint32_t id, int64_t value, uint64_t stamp, uint64_t horizon)
+{
+	struct store_chunk *c = storeChunks[id >> storeChunkBits];
+	uint32_t i = id & (storeChunkSize - 1);
+	struct store_version *keep, *dead, *v;
+
+	/* Cut the chain behind the newest version at or before the horizon; the value being replaced
+	is that version itself if it is old enough, then the whole chain goes */
+	if(c->stamps[i] <= horizon)
+	{
+		dead = c->older[i];
+		keep = NULL;
+	}
+	else
+	{
+		for(keep=c->older[i]; keep->next && keep->stamp > horizon; keep=keep->next);
+		dead = keep->next;
+		__atomic_store_n(&keep->next, NULL, __ATOMIC_RELAXED);
+		keep = c->older[i];
+	}
+	/* Reuse one garbage version for the replaced value */
+	if(dead)
+	{
+		v = dead;
+		dead = dead->next;
+	}
+	else if(!(v = malloc(sizeof(struct store_version))))
+	{
+		perror("Could not allocate a key version\n");
+		exit(EXIT_FAILURE);
+	}
+	while(dead)
+	{
+		struct store_version *next = dead->next;
+
+		free(dead);
+		dead = next;
+	}
+	v->value = c->values[i];
+	v->stamp = c->stamps[i];
+	v->next = keep;
+
+	__atomic_store_n(&c->versions[i], c->versions[i] + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&c->older[i], v, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->stamps[i], stamp, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->values[i], value, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->versions[i], c->versions[i] + 1, __ATOMIC_RELEASE);
+}
+
+/* Commit <stamp> has installed its values, snapshots may include it */
+void snapshot_publish(uint64_t stamp)
+{
+	int i;
+
+	for(i=0; i<maxSnapshots; i++)
+	{
+		if(__atomic_load_n(&installing[i], __ATOMIC_RELAXED) == stamp)
+		{
+			__atomic_store_n(&installing[i], 0, __ATOMIC_RELEASE);
+			return;
+		}
+	}
+}
+
+/* Value of key <id> as of snapshot <s> */
+static int64_t version_at(uint32_t id, uint64_t s)
+{
+	struct store_chunk *c = storeChunks[id >> storeChunkBits];
+	uint32_t i = id & (storeChunkSize - 1);
+	struct store_version *v;
+	uint64_t before, after, stamp;
+	int64_t value;
+
+	do
+	{
+		before = __atomic_load_n(&c->versions[i], __ATOMIC_ACQUIRE);
+		v = __atomic_load_n(&c->older[i], __ATOMIC_ACQUIRE);
+		stamp = __atomic_load_n(&c->stamps[i], __ATOMIC_ACQUIRE);
+		value = __atomic_load_n(&c->values[i], __ATOMIC_ACQUIRE);
+		after = __atomic_load_n(&c->versions[i], __ATOMIC_ACQUIRE);
+	} while((before & 1) || before != after);		//A write was under way
+	while(stamp > s && v)
+	{
+		value = v->value;
+		stamp = v->stamp;
+		v = __atomic_load_n(&v->next, __ATOMIC_RELAXED);
+	}
+	return value;
+}
+
+/* Last commit timestamp handed out */
+uint64_t snapshot_clock(void)
+{
+	uint64_t stamp;
+
+	pthread_mutex_lock(&clockLock);
+	stamp = commitClock;
+	pthread_mutex_unlock(&clockLock);
+	return stamp;
+}
+
+/* Hold a snapshot that includes every commit up to <stamp>, waiting for the ones still installing, until snapshot_drop.
+Its timestamp goes to <s>, for snapshot_value; returns the slot to drop */
+int snapshot_hold(uint64_t stamp, uint64_t *s)
+{
+	int slot;
+
+	pthread_mutex_lock(&clockLock);
+	while((*s = snapshot_visible()) < stamp)
+	{
+		pthread_mutex_unlock(&clockLock);
+		sched_yield();
+		pthread_mutex_lock(&clockLock);
+	}
+	slot = snapshot_slot(readers);
+	*s = snapshot_visible();
+	__atomic_store_n(&readers[slot], *s + 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&clockLock);
+	return slot;
+}
+
+/* Value of key <id> in held snapshot <s> */
+int64_t snapshot_value(uint32_t id, uint64_t s)
+{
+	return version_at(id, s);
+}
+
+void snapshot_drop(int slot)
+{
+	__atomic_store_n(&readers[slot], 0, __ATOMIC_RELEASE);
+}
+
+/* Read the keys of plan <p> into <values> (indexed by slot) from one snapshot: the newest one every commit of which is in place */
+void snapshot_read(const struct plan *p, int64_t *values)
+{
+	uint64_t s;
+	uint32_t id;
+	int slot, i;
+
+	pthread_mutex_lock(&clockLock);
+	slot = snapshot_slot(readers);
+	s = snapshot_visible();
+	__atomic_store_n(&readers[slot], s + 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&clockLock);
+	for(i=0; i<p->keyCount; i++)
+	{
+		id = p->keys[i].id;
+		if(id == planNoKey && !store_lookup(p->keys[i].name, p->keys[i].length, &id))
+			values[i] = STORE_UNSET;		//Not even there now that the snapshot is fixed, so nothing it sees wrote it
+		else
+			values[i] = version_at(id, s);
+	}
+	__atomic_store_n(&readers[slot], 0, __ATOMIC_RELEASE);
+}
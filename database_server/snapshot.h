@@ -0,0 +1,28 @@
+/*
+ * snapshot.h
+ *
+ * Multi-version reads. Every commit that writes gets a commit timestamp, and
+ * the values it replaces are kept (newest first, behind the key's current
+ * value) for as long as a snapshot may still read them. A read-only
+ * transaction reads the newest values committed at or before its snapshot:
+ * it takes no locks, and writers neither wait for it nor make it wait.
+ */
+
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include <stdint.h>
+#include "plan.h"
+
+#define maxSnapshots 64				/* Snapshots read, and commits installing, at the same time; more wait for a free slot */
+
+uint64_t snapshot_begin(uint64_t *horizon);
+void snapshot_install(uint32_t id, int64_t value, uint64_t stamp, uint64_t horizon);
+void snapshot_publish(uint64_t stamp);
+void snapshot_read(const struct plan *p, int64_t *values);
+uint64_t snapshot_clock(void);
+int snapshot_hold(uint64_t stamp, uint64_t *s);
+int64_t snapshot_value(uint32_t id, uint64_t s);
+void snapshot_drop(int slot);
+
+#endif /* SNAPSHOT_H_ */
@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "store.h"
+
+struct store_chunk *storeChunks[maxStoreChunks];	/* Allocated on demand, never moved or freed */
+static struct store_bucket *buckets;
+static uint32_t bucketMask;				/* Number of buckets - 1, always a power of two minus one */
+static uint32_t keyCount;				/* Ids handed out so far */
+static pthread_rwlock_t indexLock = PTHREAD_RWLOCK_INITIALIZER;	/* Lookups share it, inserts and growth take it exclusively */
+static char *arena;						/* Where the next long key goes */
+static size_t arenaUsed;
+
+/* 64 bit FNV-1a followed by a final mix, so that both the low (bucket) and the high (tag) bits are usable */
+static uint64_t key_hash(const char *key, int length)
+{
+	uint64_t h = 14695981039346656037ULL;
+	int i;
+
+	for(i=0; i<length; i++)
+	{
+		h ^= (unsigned char)key[i];
+		h *= 1099511628211ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static inline uint32_t hash_tag(uint64_t hash)
+{
+	return (uint32_t)(hash >> 32) | 1;		/* Never 0, that marks a free slot */
+}
+
+static inline struct key_slot * key_slot(uint32_t id)
+{
+	return &storeChunks[id >> storeChunkBits]->keys[id & (storeChunkSize - 1)];
+}
+
+/* Name of key <id> and its length (to <length>), not NUL terminated */
+const char * store_key(uint32_t id, int *length)
+{
+	struct key_slot *s = key_slot(id);
+	const char *p;
+
+	*length = s->length;
+	if(s->length <= inlineKeyLength)
+		return s->data;
+	memcpy(&p, s->data, sizeof(p));
+	return p;
+}
+
+/* Look <key> up in the index, the caller holds indexLock. Buckets fill up front to back and keys are
+never removed, so the first free slot on the probe sequence means the key is not there */
+static int index_find(uint64_t hash, const char *key, int length, uint32_t *id)
+{
+	struct store_bucket *b;
+	uint32_t tag = hash_tag(hash), i, n;
+	const char *name;
+	int nameLength;
+
+	for(n = (uint32_t)hash & bucketMask; ; n = (n + 1) & bucketMask)
+	{
+		b = &buckets[n];
+		for(i=0; i<storeBucketSlots; i++)
+		{
+			if(b->tags[i] == 0)
+				return 0;
+			if(b->tags[i] != tag)
+				continue;
+			name = store_key(b->ids[i], &nameLength);
+			if(nameLength == length && !memcmp(name, key, length))
+			{
+				*id = b->ids[i];
+				return 1;
+			}
+		}
+	}
+}
+
+/* Put <id> into the first free slot of its probe sequence */
+static void index_insert(struct store_bucket *table, uint32_t mask, uint64_t hash, uint32_t id)
+{
+	struct store_bucket *b;
+	uint32_t i, n;
+
+	for(n = (uint32_t)hash & mask; ; n = (n + 1) & mask)
+	{
+		b = &table[n];
+		for(i=0; i<storeBucketSlots; i++)
+		{
+			if(b->tags[i] == 0)
+			{
+				b->tags[i] = hash_tag(hash);
+				b->ids[i] = id;
+				return;
+			}
+		}
+	}
+}
+
+static struct store_bucket * buckets_new(uint32_t count)
+{
+	struct store_bucket *table;
+
+	table = aligned_alloc(64, (size_t)count * sizeof(struct store_bucket));
+	if(!table)
+	{
+		perror("Could not allocate the key index\n");
+		exit(EXIT_FAILURE);
+	}
+	memset(table, 0, (size_t)count * sizeof(struct store_bucket));
+	return table;
+}
+
+/* Double the index, keeping it at most 3/4 full. Called with indexLock held exclusively */
+static void index_grow(void)
+{
+	struct store_bucket *table;
+	uint32_t mask, id;
+
+	mask = bucketMask * 2 + 1;
+	table = buckets_new(mask + 1);
+	for(id=0; id<keyCount; id++)
+		index_insert(table, mask, key_slot(id)->hash, id);
+	free(buckets);
+	buckets = table;
+	bucketMask = mask;
+}
+
+void store_init(void)
+{
+	buckets = buckets_new(storeInitialBuckets);
+	bucketMask = storeInitialBuckets - 1;
+	keyCount = 0;
+}
+
+/* Number of ids handed out, ids are 0 .. store_count() - 1 */
+uint32_t store_count(void)
+{
+	return __atomic_load_n(&keyCount, __ATOMIC_ACQUIRE);
+}
+
+/* Id of <key> if it exists: returns 1 and sets <id>, 0 otherwise */
+int store_lookup(const char *key, int length, uint32_t *id)
+{
+	uint64_t hash = key_hash(key, length);
+	int found;
+
+	pthread_rwlock_rdlock(&indexLock);
+	found = index_find(hash, key, length, id);
+	pthread_rwlock_unlock(&indexLock);
+	return found;
+}
+
+/* Id of <key>, creating it (with value STORE_UNSET) the first time the key is seen */
+uint32_t store_intern(const char *key, int length)
+{
+	uint64_t hash = key_hash(key, length);
+	struct key_slot *s;
+	struct store_chunk *chunk;
+	uint32_t id;
+	char *p;
+
+	pthread_rwlock_rdlock(&indexLock);
+	if(index_find(hash, key, length, &id))
+	{
+		pthread_rwlock_unlock(&indexLock);
+		return id;
+	}
+	pthread_rwlock_unlock(&indexLock);
+
+	pthread_rwlock_wrlock(&indexLock);
+	if(index_find(hash, key, length, &id))		//Somebody else added it meanwhile
+	{
+		pthread_rwlock_unlock(&indexLock);
+		return id;
+	}
+	id = keyCount;
+	if((id >> storeChunkBits) >= maxStoreChunks)
+	{
+		fprintf(stderr, "Key store is full (%u keys)\n", id);
+		exit(EXIT_FAILURE);
+	}
+	if(!storeChunks[id >> storeChunkBits])
+	{
+		chunk = aligned_alloc(64, sizeof(struct store_chunk));		//calloc only aligns to 16 bytes
+		if(!chunk)
+		{
+			perror("Could not allocate a key store chunk\n");
+			exit(EXIT_FAILURE);
+		}
+		memset(chunk, 0, sizeof(struct store_chunk));
+		storeChunks[id >> storeChunkBits] = chunk;
+	}
+	if((uint64_t)(keyCount + 1) * 4 > (uint64_t)(bucketMask + 1) * storeBucketSlots * 3)
+		index_grow();
+
+	s = key_slot(id);
+	s->hash = hash;
+	s->length = (uint8_t)length;
+	if(length <= inlineKeyLength)
+		memcpy(s->data, key, length);
+	else
+	{
+		if(!arena || arenaUsed + length > storeArenaSize)
+		{
+			arena = malloc(storeArenaSize);
+			if(!arena)
+			{
+				perror("Could not allocate a key arena\n");
+				exit(EXIT_FAILURE);
+			}
+			arenaUsed = 0;
+		}
+		p = arena + arenaUsed;
+		memcpy(p, key, length);
+		arenaUsed += length;
+		memcpy(s->data, &p, sizeof(p));
+	}
+	store_set(id, STORE_UNSET);
+	index_insert(buckets, bucketMask, hash, id);
+	__atomic_store_n(&keyCount, id + 1, __ATOMIC_RELEASE);
+	pthread_rwlock_unlock(&indexLock);
+	return id;
+}
@@ -0,0 +1,118 @@
+/*
+ * store.h
+ *
+ * In-memory storage engine: string keys mapped to int64 values.
+ * Every key gets a stable dense id the first time it is seen; values and key
+ * names live in fixed-size chunks indexed by id, so nothing is allocated per key
+ * and a value, once its id is known, is read and written without any lookup.
+ * The key -> id index is an open-addressing hash table of cache-line sized
+ * buckets holding 8 (hash tag, id) pairs each.
+ */
+
+#ifndef STORE_H_
+#define STORE_H_
+
+#include <stdint.h>
+
+#define maxKeyLength 255				/* Longest key, what a log record can carry */
+#define inlineKeyLength 23				/* Keys up to this long are kept inside their key slot */
+#define storeChunkBits 16
+#define storeChunkSize (1 << storeChunkBits)	/* Ids per chunk */
+#define maxStoreChunks 1024				/* Up to 64M keys */
+#define storeBucketSlots 8
+#define storeInitialBuckets 1024
+#define storeArenaSize (1 << 20)		/* Long keys are carved out of arenas this big */
+#define STORE_UNSET (-1)				/* Value of a key that was never written */
+
+/* Name of key <id>: short keys inline, long ones point into a key arena */
+struct key_slot
+{
+	uint64_t hash;					/* Kept to rebuild the index when it grows */
+	uint8_t  length;
+	char     data[inlineKeyLength];		/* The key itself, or a char * to it if it does not fit */
+};
+
+/* A value a commit replaced, kept while a snapshot may still read it */
+struct store_version
+{
+	int64_t  value;
+	uint64_t stamp;					/* Commit timestamp of the value */
+	struct store_version *next;		/* The value it replaced in turn */
+};
+
+/* The checkpointer's dirty bits of 64 consecutive ids, alone in their cache line: the ids of one partition (see partition.h) */
+struct store_dirty
+{
+	uint64_t bits;
+} __attribute__((aligned(64)));
+
+/* One chunk of ids: their values, versions, commit timestamps, replaced values, names and the checkpointer's dirty bits (one set per checkpoint epoch).
+Allocated cache line aligned, so every 64 ids of a per-key array start a cache line of their own */
+struct store_chunk
+{
+	int64_t  values[storeChunkSize] __attribute__((aligned(64)));
+	uint64_t versions[storeChunkSize] __attribute__((aligned(64)));	/* Bumped twice per write, odd while the value is being changed */
+	uint64_t stamps[storeChunkSize] __attribute__((aligned(64)));	/* Commit timestamp of the value, 0 if it predates this run */
+	struct store_version *older[storeChunkSize] __attribute__((aligned(64)));	/* Replaced values, newest first */
+	struct key_slot keys[storeChunkSize] __attribute__((aligned(64)));
+	struct store_dirty dirty[2][storeChunkSize / 64];
+	int      dirtyAny[2] __attribute__((aligned(64)));		/* Some bit is set in dirty[epoch]; written once per epoch, read before */
+};
+
+/* One cache line of the index */
+struct store_bucket
+{
+	uint32_t tags[storeBucketSlots];	/* High hash bits of the keys in the bucket, 0 for a free slot */
+	uint32_t ids[storeBucketSlots];
+} __attribute__((aligned(64)));
+
+extern struct store_chunk *storeChunks[maxStoreChunks];
+
+void store_init(void);
+uint32_t store_intern(const char *key, int length);
+int store_lookup(const char *key, int length, uint32_t *id);
+uint32_t store_count(void);
+const char * store_key(uint32_t id, int *length);
+
+/* Value of key <id> */
+static inline int64_t store_get(uint32_t id)
+{
+	return __atomic_load_n(&storeChunks[id >> storeChunkBits]->values[id & (storeChunkSize - 1)], __ATOMIC_RELAXED);
+}
+
+/* Version of key <id>, changes with every write */
+static inline uint64_t store_version(uint32_t id)
+{
+	return __atomic_load_n(&storeChunks[id >> storeChunkBits]->versions[id & (storeChunkSize - 1)], __ATOMIC_ACQUIRE);
+}
+
+/* Value of key <id> and the version it is (to <version>), read without a lock on the key */
+static inline int64_t store_read(uint32_t id, uint64_t *version)
+{
+	struct store_chunk *c = storeChunks[id >> storeChunkBits];
+	uint32_t i = id & (storeChunkSize - 1);
+	uint64_t before;
+	int64_t value;
+
+	do
+	{
+		before = __atomic_load_n(&c->versions[i], __ATOMIC_ACQUIRE);
+		value = __atomic_load_n(&c->values[i], __ATOMIC_ACQUIRE);
+		*version = __atomic_load_n(&c->versions[i], __ATOMIC_ACQUIRE);
+	} while((before & 1) || before != *version);		//A write was under way
+	return value;
+}
+
+/* Write key <id> outside any commit (replay, a new key); commits go through snapshot_install */
+static inline void store_set(uint32_t id, int64_t value)
+{
+	struct store_chunk *c = storeChunks[id >> storeChunkBits];
+	uint32_t i = id & (storeChunkSize - 1);
+
+	__atomic_store_n(&c->versions[i], c->versions[i] + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&c->values[i], value, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->versions[i], c->versions[i] + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* STORE_H_ */
@@ -0,0 +1,421 @@
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include "wal.h"
+#include "log.h"
+
+static uint32_t crcTable[256];
+static pthread_once_t crcTableOnce = PTHREAD_ONCE_INIT;
+
+static void crc_table_init(void)
+{
+	uint32_t c;
+	int i, k;
+
+	for(i=0; i<256; i++)
+	{
+		c = (uint32_t)i;
+		for(k=0; k<8; k++)
+			c = (c & 1) ? (0xEDB88320U ^ (c >> 1)) : (c >> 1);
+		crcTable[i] = c;
+	}
+}
+
+/* Standard (zlib) CRC32 of <length> bytes at <data> */
+uint32_t wal_crc32(const void *data, size_t length)
+{
+	const unsigned char *p = data;
+	uint32_t c = 0xFFFFFFFFU;
+
+	pthread_once(&crcTableOnce, crc_table_init);
+	while(length--)
+		c = crcTable[(c ^ *p++) & 0xFF] ^ (c >> 8);
+	return c ^ 0xFFFFFFFFU;
+}
+
+/* Write <length> bytes to <fd>, retrying short writes */
+static void write_all(int fd, const char *data, size_t length)
+{
+	ssize_t n;
+
+	while(length > 0)
+	{
+		n = write(fd, data, length);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			perror("Could not write to the write-ahead log\n");
+			exit(EXIT_FAILURE);
+		}
+		data += n;
+		length -= n;
+	}
+}
+
+void wal_segment_name(char *name, size_t size, uint64_t base)
+{
+	snprintf(name, size, "%s%016llx", WAL_PREFIX, (unsigned long long)base);
+}
+
+static int compare_bases(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/* Start positions of all segments in the current directory, sorted. Returns how many, the array is malloc'ed */
+int wal_segments(uint64_t **bases)
+{
+	DIR *dir;
+	struct dirent *d;
+	int count, capacity;
+	size_t prefixLength = strlen(WAL_PREFIX);
+
+	count = capacity = 0;
+	*bases = NULL;
+	dir = opendir(".");
+	if(!dir)
+	{
+		perror("Could not list the write-ahead log segments\n");
+		exit(EXIT_FAILURE);
+	}
+	while((d = readdir(dir)))
+	{
+		if(strncmp(d->d_name, WAL_PREFIX, prefixLength) || strlen(d->d_name) != prefixLength + 16)
+			continue;
+		if(count == capacity)
+		{
+			capacity = capacity ? capacity * 2 : 16;
+			*bases = realloc(*bases, capacity * sizeof(uint64_t));
+			if(!*bases)
+			{
+				perror("Could not list the write-ahead log segments\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		(*bases)[count++] = strtoull(d->d_name + prefixLength, NULL, 16);
+	}
+	closedir(dir);
+	qsort(*bases, count, sizeof(uint64_t), compare_bases);
+	return count;
+}
+
+/* Open the segment starting at <base> for appending */
+static int segment_open(uint64_t base)
+{
+	char name[64];
+	int fd;
+
+	wal_segment_name(name, sizeof(name), base);
+	fd = open(name, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if(fd < 0)
+	{
+		perror("Could not open a write-ahead log segment\n");
+		exit(EXIT_FAILURE);
+	}
+	return fd;
+}
+
+/* Write <length> bytes that start at log position <lsn> and make them durable.
+Only one thread at a time gets here (w->flushing); the current segment is closed off first if it is full,
+records never span two segments since buffers only ever hold whole records. */
+static void write_out(struct wal *w, const char *data, size_t length, uint64_t lsn)
+{
+	int dirfd;
+
+	if(length == 0)
+		return;
+	if(lsn - w->segmentBase >= walSegmentSize)
+	{
+		close(w->fd);
+		w->fd = segment_open(lsn);
+		w->segmentBase = lsn;
+		dirfd = open(".", O_RDONLY);
+		if(dirfd >= 0)
+		{
+			fsync(dirfd);
+			close(dirfd);
+		}
+	}
+	write_all(w->fd, data, length);
+	if(fdatasync(w->fd) < 0)
+	{
+		perror("Could not sync the write-ahead log\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Write out and fsync everything appended so far. Called with w->lock held;
+the lock is dropped during the I/O so that other committers can keep appending into the other buffer */
+static void flush_locked(struct wal *w)
+{
+	char *data;
+	size_t length, capacity;
+	uint64_t start, target;
+
+	w->flushing = 1;
+	data = w->buffer;
+	length = w->used;
+	capacity = w->capacity;
+	start = w->durableLsn;
+	target = w->appendLsn;
+	w->buffer = w->spare;
+	w->capacity = w->spareCapacity;
+	w->used = 0;
+	pthread_mutex_unlock(&w->lock);
+
+	write_out(w, data, length, start);
+
+	pthread_mutex_lock(&w->lock);
+	w->spare = data;
+	w->spareCapacity = capacity;
+	w->durableLsn = target;
+	w->flushing = 0;
+	pthread_cond_broadcast(&w->flushed);
+}
+
+/* Background thread for WAL_SYNC_PERIODIC */
+static void * periodic_flusher(void *args)
+{
+	struct wal *w = (struct wal *)args;
+	struct timespec period;
+
+	period.tv_sec = w->periodMs / 1000;
+	period.tv_nsec = (long)(w->periodMs % 1000) * 1000000L;
+	while(1)
+	{
+		nanosleep(&period, NULL);
+		pthread_mutex_lock(&w->lock);
+		if(!w->flushing && w->durableLsn < w->appendLsn)
+			flush_locked(w);
+		pthread_mutex_unlock(&w->lock);
+	}
+	return NULL;
+}
+
+/* Open the log for appending at <endLsn>, the end of the last intact record found by recovery */
+void wal_open(struct wal *w, uint64_t endLsn, int mode, int periodMs)
+{
+	struct stat st;
+	pthread_t thread;
+	uint64_t *bases;
+	int count;
+
+	count = wal_segments(&bases);
+	w->segmentBase = (count > 0 && bases[count - 1] <= endLsn) ? bases[count - 1] : endLsn;
+	free(bases);
+	w->fd = segment_open(w->segmentBase);
+	if(fstat(w->fd, &st) < 0 || w->segmentBase + (uint64_t)st.st_size != endLsn)
+	{
+		fprintf(stderr, "Write-ahead log segment %016llx does not end at %llu\n",
+			(unsigned long long)w->segmentBase, (unsigned long long)endLsn);
+		exit(EXIT_FAILURE);
+	}
+	w->mode = mode;
+	w->periodMs = (periodMs > 0) ? periodMs : defaultWalPeriodMs;
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->flushed, NULL);
+	w->capacity = w->spareCapacity = walBufferSize;
+	w->buffer = malloc(w->capacity);
+	w->spare = malloc(w->spareCapacity);
+	if(!w->buffer || !w->spare)
+	{
+		perror("Could not allocate write-ahead log buffers\n");
+		exit(EXIT_FAILURE);
+	}
+	w->used = 0;
+	w->appendLsn = w->durableLsn = endLsn;
+	w->flushing = 0;
+
+	if(mode == WAL_SYNC_PERIODIC)
+	{
+		if(pthread_create(&thread, NULL, periodic_flusher, w) != 0)
+		{
+			perror("Could not start the log flusher\n");
+			exit(EXIT_FAILURE);
+		}
+		pthread_detach(thread);
+	}
+}
+
+/* Append a record of <type> for transaction <txid> with <count> changed values.
+Returns the log position right after the record, to be passed to wal_flush;
+where the record starts goes to <startLsn> if it is not NULL */
+uint64_t wal_append(struct wal *w, int type, uint64_t txid, struct wal_entry *entries, int count, uint64_t *startLsn)
+{
+	struct wal_record_header header;
+	size_t length;
+	char *p;
+	int i;
+	uint64_t lsn;
+
+	length = sizeof(header);
+	for(i=0; i<count; i++)
+		length += wal_entry_size(type, entries[i].keyLength);
+
+	pthread_mutex_lock(&w->lock);
+	if(w->used + length > w->capacity)
+	{
+		while(w->used + length > w->capacity)
+			w->capacity *= 2;
+		w->buffer = realloc(w->buffer, w->capacity);
+		if(!w->buffer)
+		{
+			perror("Could not grow the write-ahead log buffer\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	p = w->buffer + w->used;
+	header.length = (uint32_t)length;
+	header.checksum = 0;
+	header.txid = txid;
+	header.type = (uint8_t)type;
+	header.reserved = 0;
+	header.count = (uint16_t)count;
+	memcpy(p, &header, sizeof(header));
+	p += sizeof(header);
+	for(i=0; i<count; i++)
+	{
+		*p++ = (char)entries[i].keyLength;
+		memcpy(p, entries[i].key, entries[i].keyLength);
+		p += entries[i].keyLength;
+		memcpy(p, &entries[i].value, sizeof(int64_t));
+		p += sizeof(int64_t);
+		if(type == WAL_INCREMENTS)
+		{
+			memcpy(p, &entries[i].low, sizeof(int64_t));
+			memcpy(p + sizeof(int64_t), &entries[i].high, sizeof(int64_t));
+			p += 2 * sizeof(int64_t);
+		}
+	}
+	header.checksum = wal_crc32(w->buffer + w->used + 8, length - 8);
+	memcpy(w->buffer + w->used + 4, &header.checksum, sizeof(header.checksum));
+	w->used += length;
+	if(startLsn)
+		*startLsn = w->appendLsn;
+	w->appendLsn += length;
+	lsn = w->appendLsn;
+	pthread_mutex_unlock(&w->lock);
+	return lsn;
+}
+
+/* Wait until the log is durable up to <lsn>, according to the durability mode */
+void wal_flush(struct wal *w, uint64_t lsn)
+{
+	if(w->mode == WAL_SYNC_PERIODIC)
+		return;
+
+	pthread_mutex_lock(&w->lock);
+	if(w->mode == WAL_SYNC_COMMIT)
+	{
+		/* No sharing: wait for whoever is syncing, then sync our own record */
+		while(w->flushing)
+			pthread_cond_wait(&w->flushed, &w->lock);
+		if(w->durableLsn < lsn)
+		{
+			w->flushing = 1;
+			write_out(w, w->buffer, w->used, w->durableLsn);
+			w->used = 0;
+			w->durableLsn = w->appendLsn;
+			w->flushing = 0;
+			pthread_cond_broadcast(&w->flushed);
+		}
+		pthread_mutex_unlock(&w->lock);
+		return;
+	}
+
+	/* Group commit: the first committer to find no flush in progress becomes the leader and syncs
+	everything appended so far; the ones arriving meanwhile pile up and go together in the next round */
+	while(w->durableLsn < lsn)
+	{
+		if(!w->flushing)
+			flush_locked(w);
+		else
+			pthread_cond_wait(&w->flushed, &w->lock);
+	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* Make everything appended so far durable, whatever the durability mode */
+void wal_flush_all(struct wal *w)
+{
+	uint64_t lsn;
+
+	pthread_mutex_lock(&w->lock);
+	lsn = w->appendLsn;
+	while(w->durableLsn < lsn)
+	{
+		if(!w->flushing)
+			flush_locked(w);
+		else
+			pthread_cond_wait(&w->flushed, &w->lock);
+	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* Wait at most <timeoutMs> for the log to be durable past <lsn>. Returns the position it is durable up to */
+uint64_t wal_wait(struct wal *w, uint64_t lsn, int timeoutMs)
+{
+	struct timespec deadline;
+	uint64_t durable;
+	int rc = 0;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeoutMs / 1000;
+	deadline.tv_nsec += (long)(timeoutMs % 1000) * 1000000L;
+	if(deadline.tv_nsec >= 1000000000L)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+	pthread_mutex_lock(&w->lock);
+	while(w->durableLsn <= lsn && rc != ETIMEDOUT)
+		rc = pthread_cond_timedwait(&w->flushed, &w->lock, &deadline);
+	durable = w->durableLsn;
+	pthread_mutex_unlock(&w->lock);
+	return durable;
+}
+
+/* Current end of the log, buffered records included */
+uint64_t wal_end(struct wal *w)
+{
+	uint64_t lsn;
+
+	pthread_mutex_lock(&w->lock);
+	lsn = w->appendLsn;
+	pthread_mutex_unlock(&w->lock);
+	return lsn;
+}
+
+/* Delete the segments that lie entirely before log position <lsn> */
+void wal_truncate(struct wal *w, uint64_t lsn)
+{
+	uint64_t *bases, current;
+	char name[64];
+	int count, i;
+
+	pthread_mutex_lock(&w->lock);
+	current = w->segmentBase;
+	pthread_mutex_unlock(&w->lock);
+
+	count = wal_segments(&bases);
+	for(i=0; i+1<count; i++)
+	{
+		if(bases[i+1] > lsn || bases[i] >= current)
+			break;
+		wal_segment_name(name, sizeof(name), bases[i]);
+		if(unlink(name) < 0)
+			perror("Could not delete a write-ahead log segment\n");
+		else
+			log_info("Deleted log segment %s\n", name);
+	}
+	free(bases);
+}
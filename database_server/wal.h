@@ -0,0 +1,88 @@
+/*
+ * wal.h
+ *
+ * Append-only binary write-ahead log. Committers append a record with the
+ * values their transaction changed and then wait for it to become durable;
+ * concurrent committers share one fsync through a group-commit leader.
+ * The log is a sequence of segment files named after the log position they
+ * start at, so that whatever a checkpoint covers can be deleted.
+ */
+
+#ifndef WAL_H_
+#define WAL_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define WAL_PREFIX "database.wal."		/* Segment files are WAL_PREFIX<start position in hex> */
+
+/* Durability modes (-d) */
+#define WAL_SYNC_COMMIT 0		/* Every commit writes and fsyncs on its own */
+#define WAL_SYNC_GROUP 1		/* Commits wait for a shared fsync done by whoever gets there first */
+#define WAL_SYNC_PERIODIC 2		/* Commits don't wait, a background thread fsyncs every walPeriodMs */
+
+/* Record types */
+#define WAL_COMMIT 1			/* Transaction committed; carries its values unless a PREPARE record did */
+#define WAL_PREPARE 2			/* Transaction voted yes, carries the values it will write if it commits */
+#define WAL_ABORT 3				/* A prepared transaction was aborted */
+#define WAL_SEQUENCED 4			/* A transaction of a batch of the sequencer committed, under the batch id; counts once the batch's BATCH record follows */
+#define WAL_BATCH 5				/* The batch of the sequencer with id txid ran to the end */
+#define WAL_INCREMENTS 6		/* Deltas a transaction adds to its incremented keys, the PREPARE record follows; its COMMIT carries the new values */
+
+#define wal_entry_size(type, keyLength) (1 + (keyLength) + ((type) == WAL_INCREMENTS ? 3 : 1) * sizeof(int64_t))
+
+#define walBufferSize (1 << 20)		/* Initial size of each append buffer, grows if a burst does not fit */
+#define walSegmentSize (64 << 20)		/* A new segment is started once the current one is this big */
+#define defaultWalPeriodMs 10
+
+/* On-disk record header, followed by <count> entries of
+   { uint8_t keyLength; char key[keyLength]; int64_t value; }
+   INCREMENTS entries carry the bounds the delta was checked against after it: { ...; int64_t value, low, high; } */
+struct wal_record_header
+{
+	uint32_t length;			/* Size of the whole record, header included */
+	uint32_t checksum;			/* CRC32 of everything after this field */
+	uint64_t txid;
+	uint8_t  type;
+	uint8_t  reserved;
+	uint16_t count;
+} __attribute__((packed));
+
+/* One changed value, as handed to wal_append */
+struct wal_entry
+{
+	const char *key;
+	int keyLength;
+	int64_t value;
+	int64_t low, high;			/* WAL_INCREMENTS only: the bounds the value must stay within */
+};
+
+struct wal
+{
+	int fd;						/* Current segment */
+	uint64_t segmentBase;		/* Log position the current segment starts at */
+	int mode;
+	int periodMs;
+	pthread_mutex_t lock;
+	pthread_cond_t flushed;		/* Broadcast whenever durableLsn moves */
+	char *buffer;				/* Records appended but not yet written */
+	size_t used, capacity;
+	char *spare;				/* Second buffer the leader swaps in while it writes the first */
+	size_t spareCapacity;
+	uint64_t appendLsn;			/* End of the log, including what is still buffered */
+	uint64_t durableLsn;		/* Everything before this is on disk and fsynced */
+	int flushing;				/* A leader is currently writing and syncing */
+};
+
+uint32_t wal_crc32(const void *data, size_t length);
+void wal_open(struct wal *w, uint64_t endLsn, int mode, int periodMs);
+uint64_t wal_append(struct wal *w, int type, uint64_t txid, struct wal_entry *entries, int count, uint64_t *startLsn);
+void wal_flush(struct wal *w, uint64_t lsn);
+void wal_flush_all(struct wal *w);
+uint64_t wal_end(struct wal *w);
+uint64_t wal_wait(struct wal *w, uint64_t lsn, int timeoutMs);
+void wal_truncate(struct wal *w, uint64_t lsn);
+int wal_segments(uint64_t **bases);
+void wal_segment_name(char *name, size_t size, uint64_t base);
+
+#endif /* WAL_H_ */
@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "protocol.h"
+#include "deadlock.h"
+
+#define NODE_NEW 0
+#define NODE_ON_PATH 1				/* On the path the search is following */
+#define NODE_DONE 2					/* Searched, no cycle goes through it */
+#define NODE_GONE 3					/* Picked as a victim, its edges no longer count */
+
+/* A transaction of the wait-for graph */
+struct wait_node
+{
+	uint64_t txid;
+	int shard;						/* The shard its id is from, -1 for a global id */
+	uint32_t age;					/* The longest it has been at it at any shard */
+	uint32_t shards;				/* Shards it waits at */
+	int first, count;				/* Its edges, in the graph's <out> */
+	int state;
+	int pos;						/* Where it is on the path, while NODE_ON_PATH */
+};
+
+struct wait_graph
+{
+	struct wait_node *nodes;
+	int nodeCount;
+	int *slots;						/* Open addressing over <nodes>, -1 if free */
+	int slotMask;
+	int *out;						/* The transactions each one waits for, grouped by waiter */
+	int *path, *cursor;				/* The search's path, and the next edge to follow from each node on it */
+};
+
+static void * graph_alloc(size_t size)
+{
+	void *p;
+
+	p = malloc(size ? size : 1);
+	if(!p)
+	{
+		perror("Could not allocate the wait-for graph\n");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+/* Node of transaction <txid> as shard <shard> reported it, added if it is new */
+static int node_of(struct wait_graph *g, uint64_t txid, int shard)
+{
+	struct wait_node *n;
+	uint64_t h;
+	int i;
+
+	if(txid & globalTxidFlag)
+		shard = -1;
+	h = (txid ^ (uint64_t)(shard + 1) * 0x9E3779B97F4A7C15ULL) * 0xff51afd7ed558ccdULL;
+	for(i = (int)(h >> 40) & g->slotMask; g->slots[i] >= 0; i = (i + 1) & g->slotMask)
+	{
+		n = &g->nodes[g->slots[i]];
+		if(n->txid == txid && n->shard == shard)
+			return g->slots[i];
+	}
+	n = &g->nodes[g->nodeCount];
+	memset(n, 0, sizeof(*n));
+	n->txid = txid;
+	n->shard = shard;
+	g->slots[i] = g->nodeCount;
+	return g->nodeCount++;
+}
+
+/* Look for a cycle among the nodes that are not gone, depth first from each unsearched node.
+Returns the youngest transaction of the first cycle found, or -1 if there is none */
+static int find_cycle(struct wait_graph *g)
+{
+	struct wait_node *n, *next;
+	int i, k, depth, victim;
+
+	for(i=0; i<g->nodeCount; i++)
+	{
+		if(g->nodes[i].state != NODE_GONE)
+			g->nodes[i].state = NODE_NEW;
+	}
+	for(i=0; i<g->nodeCount; i++)
+	{
+		if(g->nodes[i].state != NODE_NEW)
+			continue;
+		depth = 0;
+		g->path[0] = i;
+		g->cursor[0] = 0;
+		g->nodes[i].state = NODE_ON_PATH;
+		g->nodes[i].pos = 0;
+		while(depth >= 0)
+		{
+			n = &g->nodes[g->path[depth]];
+			if(g->cursor[depth] == n->count)		//Every way out of it searched
+			{
+				n->state = NODE_DONE;
+				depth--;
+				continue;
+			}
+			next = &g->nodes[g->out[n->first + g->cursor[depth]++]];
+			if(next->state == NODE_ON_PATH)
+			{
+				/* A cycle: from <next> to the end of the path */
+				victim = g->path[next->pos];
+				for(k = next->pos + 1; k <= depth; k++)
+				{
+					n = &g->nodes[g->path[k]];
+					if(n->age < g->nodes[victim].age || (n->age == g->nodes[victim].age && n->txid > g->nodes[victim].txid))
+						victim = g->path[k];
+				}
+				return victim;
+			}
+			if(next->state != NODE_NEW)
+				continue;
+			depth++;
+			g->path[depth] = (int)(next - g->nodes);
+			g->cursor[depth] = 0;
+			next->state = NODE_ON_PATH;
+			next->pos = depth;
+		}
+	}
+	return -1;
+}
+
+/* Find the cycles of the wait-for graph made of <edges> (<count> of them) and pick a victim in each: the youngest
+of the transactions in it, the one that has been at it the shortest. The edges of different shards, and even of
+different keys, are not from the same moment, so a cycle may be one that is already gone; the price is an abort.
+Fills <victims> (room for <max>) and returns how many there are */
+int deadlock_victims(const struct wait_edge *edges, int count, struct deadlock_victim *victims, int max)
+{
+	struct wait_graph g;
+	struct wait_node *n;
+	int i, slots, w, found, *fill;
+
+	for(slots = 16; slots < 4 * count; slots *= 2);
+	g.nodes = graph_alloc(2 * count * sizeof(struct wait_node));
+	g.nodeCount = 0;
+	g.slots = graph_alloc(slots * sizeof(int));
+	g.slotMask = slots - 1;
+	g.out = graph_alloc(count * sizeof(int));
+	g.path = graph_alloc(2 * count * sizeof(int));
+	g.cursor = graph_alloc(2 * count * sizeof(int));
+	fill = graph_alloc(count * sizeof(int));
+	memset(g.slots, -1, slots * sizeof(int));
+
+	/* Nodes, and how many edges go out of each */
+	for(i=0; i<count; i++)
+	{
+		w = node_of(&g, edges[i].waiter, edges[i].shard);
+		node_of(&g, edges[i].holder, edges[i].shard);
+		fill[i] = w;
+		n = &g.nodes[w];
+		n->count++;
+		n->shards |= 1u << edges[i].shard;
+		if(edges[i].age > n->age)
+			n->age = edges[i].age;
+	}
+	for(i=0, w=0; i<g.nodeCount; i++)
+	{
+		g.nodes[i].first = w;
+		w += g.nodes[i].count;
+		g.nodes[i].count = 0;
+	}
+	for(i=0; i<count; i++)
+	{
+		n = &g.nodes[fill[i]];
+		g.out[n->first + n->count++] = node_of(&g, edges[i].holder, edges[i].shard);
+	}
+
+	/* One victim per cycle, until there are none left */
+	found = 0;
+	while(found < max && (w = find_cycle(&g)) >= 0)
+	{
+		n = &g.nodes[w];
+		n->state = NODE_GONE;
+		victims[found].txid = n->txid;
+		victims[found].shard = n->shard;
+		victims[found].shards = n->shards;
+		found++;
+	}
+	free(fill);
+	free(g.cursor);
+	free(g.path);
+	free(g.out);
+	free(g.slots);
+	free(g.nodes);
+	return found;
+}
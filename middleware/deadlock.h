@@ -0,0 +1,37 @@
+/*
+ * deadlock.h
+ *
+ * Deadlocks across shards: every database server reports who waits for whom
+ * at its locks, the middleware of one shard puts the edges of all of them
+ * together into one wait-for graph and breaks each cycle by aborting the
+ * youngest transaction in it. Global transaction ids are the same on every
+ * shard; a database server's own ids only mean something at that shard.
+ */
+
+#ifndef DEADLOCK_H_
+#define DEADLOCK_H_
+
+#include <stdint.h>
+
+#define deadlockShard 0				/* The middleware of this shard looks for deadlocks, every loop tick */
+#define maxDeadlockVictims 64		/* Cycles broken per round at most, the rest are found in the next one */
+
+/* One edge of the wait-for graph, as the database server of <shard> reported it */
+struct wait_edge
+{
+	uint64_t waiter, holder;
+	uint32_t age;					/* How long the waiter has been at it there, in ms */
+	int shard;
+};
+
+/* A transaction to abort, and the shards it waits at (where its wait is broken off) */
+struct deadlock_victim
+{
+	uint64_t txid;
+	int shard;						/* The shard its id is from, -1 for a global id */
+	uint32_t shards;
+};
+
+int deadlock_victims(const struct wait_edge *edges, int count, struct deadlock_victim *victims, int max);
+
+#endif /* DEADLOCK_H_ */
@@ -0,0 +1,359 @@
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+#include "loop.h"
+#include "pool.h"
+#include "log.h"
+#include "trace.h"
+
+struct loop_handlers loopHandlers;
+static uint64_t nextRequestId;
+
+/* Request ids are unique within the middleware, so one id can name a transaction on every connection it uses */
+uint64_t new_request_id(void)
+{
+	return __atomic_add_fetch(&nextRequestId, 1, __ATOMIC_RELAXED);
+}
+
+uint64_t now_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* Register <c>'s socket with the loop, for output too while it has some the socket did not take */
+void conn_watch(struct conn *c)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN | ((c->writeWait || c->connecting) ? EPOLLOUT : 0);
+	ev.data.ptr = c;
+	if(epoll_ctl(c->loop->epollfd, EPOLL_CTL_MOD, c->socketfd, &ev) < 0 && errno == ENOENT)
+		epoll_ctl(c->loop->epollfd, EPOLL_CTL_ADD, c->socketfd, &ev);
+}
+
+struct conn * conn_new(struct loop *l, int socketfd, int kind)
+{
+	struct conn *c;
+	int one = 1;
+
+	c = calloc(1, sizeof(struct conn));
+	if(!c)
+	{
+		perror("Could not allocate connection state\n");
+		exit(EXIT_FAILURE);
+	}
+	c->socketfd = socketfd;
+	c->kind = kind;
+	c->batch = (kind != CONN_CLIENT);
+	c->loop = l;
+	frame_buffer_init(&c->in);
+	if(socketfd >= 0)
+	{
+		fcntl(socketfd, F_SETFL, fcntl(socketfd, F_GETFL) | O_NONBLOCK);
+		setsockopt(socketfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		conn_watch(c);
+	}
+	return c;
+}
+
+void conn_free(struct conn *c)
+{
+	if(c->dirty)
+	{
+		c->freeing = 1;		//Still on the dirty list, the write pass frees it
+		return;
+	}
+	frame_buffer_free(&c->in);
+	free(c->out);
+	free(c);
+}
+
+/* Queue a frame on <c>; it is written at the end of the round together with everything else queued for <c> */
+void conn_send(struct conn *c, int type, uint64_t requestId, uint64_t traceId, const void *payload, uint32_t length)
+{
+	conn_send_prefixed(c, type, requestId, traceId, NULL, 0, payload, length);
+}
+
+/* Queue a frame whose payload is <prefix> (<prefixLength> bytes) followed by <payload> */
+void conn_send_prefixed(struct conn *c, int type, uint64_t requestId, uint64_t traceId, const void *prefix, uint32_t prefixLength,
+	const void *payload, uint32_t length)
+{
+	size_t need;
+
+	if(c->socketfd < 0 || c->closed)
+		return;
+	if(c->outUsed == 0 && c->batch)
+		c->outUsed = frameHeaderSize;		//Room for the header of the batch
+	need = c->outUsed + frameHeaderSize + prefixLength + length;
+	if(need > c->outCapacity)
+	{
+		c->outCapacity = (need > 2 * c->outCapacity) ? need : 2 * c->outCapacity;
+		c->out = realloc(c->out, c->outCapacity);
+		if(!c->out)
+		{
+			perror("Could not grow an output buffer\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	trace_event(traceId, "send", "\"type\":\"%s\",\"request\":%llu", frame_type_name(type), (unsigned long long)requestId);
+	frame_header_put(c->out + c->outUsed, type, requestId, traceId, prefixLength + length);
+	if(prefixLength > 0)
+		memcpy(c->out + c->outUsed + frameHeaderSize, prefix, prefixLength);
+	memcpy(c->out + c->outUsed + frameHeaderSize + prefixLength, payload, length);
+	c->outUsed = need;
+	c->outFrames++;
+	if(!c->dirty)
+	{
+		c->dirty = 1;
+		c->nextDirty = c->loop->dirty;
+		c->loop->dirty = c;
+	}
+}
+
+/* Close <c>'s socket (the structure stays, see the close handler) */
+void conn_close(struct conn *c)
+{
+	if(c->socketfd < 0)
+		return;
+	epoll_ctl(c->loop->epollfd, EPOLL_CTL_DEL, c->socketfd, NULL);
+	close(c->socketfd);
+	c->socketfd = -1;
+	c->connecting = c->writeWait = 0;
+	c->in.start = c->in.used = 0;
+	c->outUsed = c->outSent = 0;
+	c->outFrames = 0;
+	loopHandlers.close(c);
+}
+
+/* Write what <c> has queued. Returns -1 if the connection broke */
+static int conn_flush(struct conn *c)
+{
+	ssize_t n;
+
+	/* Nothing of this buffer out yet: several frames go as one batch, a single one without the batch header */
+	if(c->batch && c->outSent == 0)
+	{
+		if(c->outFrames > 1 && c->outUsed - frameHeaderSize <= maxFrameLength)
+			frame_header_put(c->out, MSG_GROUP, 0, 0, c->outUsed - frameHeaderSize);
+		else
+			c->outSent = frameHeaderSize;
+	}
+	while(c->outSent < c->outUsed)
+	{
+		n = send(c->socketfd, c->out + c->outSent, c->outUsed - c->outSent, MSG_NOSIGNAL);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			if(!c->writeWait)
+			{
+				c->writeWait = 1;
+				conn_watch(c);
+			}
+			return 0;
+		}
+		if(n < 0)
+			return -1;
+		c->outSent += n;
+	}
+	c->outUsed = c->outSent = 0;
+	c->outFrames = 0;
+	if(c->writeWait)
+	{
+		c->writeWait = 0;
+		conn_watch(c);
+	}
+	return 0;
+}
+
+/* The write pass: one write per connection and round however many frames it got */
+static void loop_flush(struct loop *l)
+{
+	struct conn *c;
+
+	while((c = l->dirty))
+	{
+		l->dirty = c->nextDirty;
+		c->dirty = 0;
+		if(c->freeing)
+			conn_free(c);
+		else if(c->socketfd >= 0 && !c->connecting && conn_flush(c) < 0)
+			conn_close(c);		//May queue more output, the loop picks it up
+	}
+}
+
+static void loop_accept(struct loop *l)
+{
+	struct sockaddr_in address;
+	socklen_t size;
+	int socketfd;
+
+	while(1)
+	{
+		size = sizeof(address);
+		socketfd = accept(l->listenfd, (struct sockaddr *)&address, &size);
+		if(socketfd < 0)
+		{
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				perror("Could not accept connection\n");
+			return;
+		}
+		loopHandlers.accept(l, socketfd, &address);
+	}
+}
+
+/* Hand the frames of batch <payload> (<length> bytes) received on <c> over one by one.
+Returns -1 if the batch is malformed */
+static int conn_unbatch(struct conn *c, char *payload, uint32_t length)
+{
+	struct frame_header h;
+	char *inner;
+	uint32_t offset = 0;
+	int r;
+
+	while((r = frame_batch_next(payload, length, &offset, &h, &inner)) > 0)
+	{
+		loopHandlers.frame(c, &h, inner);
+		if(c->socketfd < 0)
+			return 0;
+	}
+	return r;
+}
+
+/* Input on <c>: hand over every complete frame */
+static void conn_input(struct conn *c)
+{
+	struct frame_header h;
+	char *payload;
+	int r;
+
+	r = frame_fill(c->socketfd, &c->in);
+	if(r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+	if(r <= 0)
+	{
+		conn_close(c);
+		return;
+	}
+	c->lastHeard = c->loop->now;
+	while((r = frame_next(&c->in, &h, &payload)) > 0)
+	{
+		if(h.type == MSG_GROUP)
+			r = conn_unbatch(c, payload, h.length);
+		else
+			loopHandlers.frame(c, &h, payload);
+		if(c->socketfd < 0)
+			return;
+		if(r < 0)
+			break;
+	}
+	if(r < 0)
+	{
+		log_warn("Malformed frame, closing the connection!\n");
+		conn_close(c);
+	}
+}
+
+void loop_init(struct loop *l, int id, int listenfd)
+{
+	struct epoll_event ev;
+
+	l->id = id;
+	l->listenfd = listenfd;
+	l->now = l->lastTick = now_ms();
+	l->dirty = NULL;
+	l->epollfd = epoll_create1(0);
+	if(l->epollfd < 0)
+	{
+		perror("Could not create epoll instance\n");
+		exit(EXIT_FAILURE);
+	}
+	fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;		//The only entry without a connection
+	if(epoll_ctl(l->epollfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+	{
+		perror("Could not add listening socket to epoll\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void loop_run(struct loop *l)
+{
+	struct epoll_event events[loopEvents];
+	struct conn *c;
+	int i, n;
+
+	while(1)
+	{
+		n = epoll_wait(l->epollfd, events, loopEvents, loopTickMs);
+		if(n < 0 && errno != EINTR)
+			perror("epoll_wait failed\n");
+		l->now = now_ms();
+		for(i = 0; i < n; i++)
+		{
+			c = (struct conn *) events[i].data.ptr;
+			if(c == NULL)
+			{
+				loop_accept(l);
+				continue;
+			}
+			if(c->socketfd < 0)
+				continue;		//Closed earlier in this round
+			if(c->connecting)
+			{
+				link_connected(c);
+				continue;
+			}
+			if(events[i].events & EPOLLOUT)
+			{
+				if(!c->dirty)		//The write pass takes EPOLLOUT off once the output is all out
+				{
+					c->dirty = 1;
+					c->nextDirty = l->dirty;
+					l->dirty = c;
+				}
+			}
+			if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				conn_input(c);
+		}
+		if(l->now - l->lastTick >= loopTickMs)
+		{
+			l->lastTick = l->now;
+			loopHandlers.tick(l);
+		}
+		loopHandlers.round(l);
+		loop_flush(l);
+	}
+}
+
+static void * loop_thread(void *args)
+{
+	loop_run((struct loop *) args);
+	return NULL;
+}
+
+/* Run <l> on a thread of its own */
+void loop_start(struct loop *l)
+{
+	pthread_t thread;
+
+	if(pthread_create(&thread, NULL, loop_thread, l) != 0)
+	{
+		perror("Could not start an event loop\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_detach(thread);
+}
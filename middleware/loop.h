@@ -0,0 +1,100 @@
+/*
+ * loop.h
+ *
+ * Event loops of the middleware. Each loop is one thread with its own epoll set,
+ * its own listening socket (the kernel spreads incoming connections over the
+ * loops with SO_REUSEPORT) and its own connections to the database server and
+ * the other middlewares; nothing a loop owns is touched by another thread.
+ * Sockets are non-blocking: input is cut into frames and handed to the
+ * middleware, output is buffered and written out once per round. Between
+ * servers the frames a round queued on a connection go out as one MSG_GROUP,
+ * so a busy loop prepares and decides many transactions per message.
+ */
+
+#ifndef LOOP_H_
+#define LOOP_H_
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include "protocol.h"
+
+#define maxLoops 16
+#define loopTickMs 100				/* Timers (vote timeouts, retries, health checks) are checked this often */
+#define loopEvents 256
+
+/* Connection kinds */
+#define CONN_CLIENT 1				/* Accepted from a client */
+#define CONN_PEER 2					/* Accepted from another middleware coordinating transactions here */
+#define CONN_LINK 3					/* Ours, to the database server or another middleware (see pool.h) */
+
+struct loop;
+struct pool;
+
+struct conn
+{
+	int  socketfd;					/* -1 while a link is down */
+	int  kind;
+	struct loop *loop;
+	struct frame_buffer in;
+	char *out;						/* Frames not written yet; with <batch>, after room for a MSG_GROUP header */
+	size_t outUsed, outSent, outCapacity;
+	int  outFrames;
+	int  batch;						/* The other side is a server, which takes MSG_GROUP */
+	int  dirty;						/* Queued for the write pass at the end of the round */
+	int  writeWait;					/* The socket is full, waiting for EPOLLOUT */
+	int  freeing;					/* Freed by the write pass */
+	struct conn *nextDirty;
+
+	/* Accepted connections */
+	int  closed;					/* The other side hung up; the structure lives until <inFlight> drops to 0 */
+	int  inFlight;					/* Transactions started from it and not finished */
+
+	/* Links */
+	struct pool *pool;
+	int  up;
+	int  connecting;
+	uint64_t connectStart;
+	uint64_t lastHeard;				/* When the other side last sent anything */
+	uint64_t pingSent;
+	uint64_t retryAt;				/* When to connect again after losing the connection */
+};
+
+/* What the middleware does with the events of a loop */
+struct loop_handlers
+{
+	void (*accept)(struct loop *l, int socketfd, struct sockaddr_in *address);
+	void (*frame)(struct conn *c, struct frame_header *h, char *payload);
+	void (*close)(struct conn *c);			/* Called once the socket is closed, before a link reconnects */
+	void (*tick)(struct loop *l);
+	void (*round)(struct loop *l);			/* End of a round, before its output is written */
+};
+
+struct loop
+{
+	int id;
+	int epollfd;
+	int listenfd;
+	uint64_t now;					/* Milliseconds, monotonic, as of the start of the round */
+	uint64_t lastTick;
+	struct conn *dirty;				/* Connections with output to write */
+	void *data;						/* The middleware's state of this loop */
+};
+
+extern struct loop_handlers loopHandlers;
+
+uint64_t new_request_id(void);
+uint64_t now_ms(void);
+
+void loop_init(struct loop *l, int id, int listenfd);
+void loop_start(struct loop *l);
+void loop_run(struct loop *l);
+
+struct conn * conn_new(struct loop *l, int socketfd, int kind);
+void conn_free(struct conn *c);
+void conn_watch(struct conn *c);
+void conn_send(struct conn *c, int type, uint64_t requestId, uint64_t traceId, const void *payload, uint32_t length);
+void conn_send_prefixed(struct conn *c, int type, uint64_t requestId, uint64_t traceId, const void *prefix, uint32_t prefixLength,
+	const void *payload, uint32_t length);
+void conn_close(struct conn *c);
+
+#endif /* LOOP_H_ */
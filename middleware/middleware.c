@@ -5,30 +5,227 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/times.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <pthread.h>
 #include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include "protocol.h"
+#include "loop.h"
+#include "pool.h"
+#include "shard.h"
+#include "deadlock.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
 
 #define PORT 5555
 #define PORT_DB 7777
-#define MAXMSG 512
 #define maxConn 20
+#define maxReplicas 8				/* Read replicas of our database server (-r) */
 #define hostNameLength 50
+#define txnBuckets 16384			/* Per event loop, for finding a transaction by request id */
+#define defaultLoops 4				/* Event loops when not given with -t, at most one per core */
+#define sequencerShard 0			/* Sequenced mode: the middleware of this shard puts the transactions in order */
+#define defaultMetricsPort 9555		/* Metrics for Prometheus, on the loopback interface (-m) */
+#define defaultVoteTimeoutMs 5000	/* Votes not in by then are asked for with status queries (-w) */
+#define INCARNATION_FILE "middleware%d.incarnation"	/* Per shard, in the working directory: which start of it this is */
+
+/* Transaction roles */
+#define ROLE_COORDINATOR 1			/* From one of our clients */
+#define ROLE_PARTICIPANT 2			/* From another middleware, coordinated there */
+
+/* Transaction states */
+#define TX_VOTING 1					/* Waiting for the votes (coordinator) or for our database server's vote (participant) */
+#define TX_DECIDING 2				/* Participant: voted, waiting for the coordinator's decision */
+#define TX_ACKING 3					/* Decision sent, waiting for the acknowledgements (of our database server, and of the participants) */
+#define TX_RESOLVING 4				/* Lost the database server before it acknowledged, resolving the transaction by id */
+#define TX_RETRY 5					/* Coordinator: waiting for the database server to be reachable again */
+#define TX_EXECUTING 6				/* Single shard or read-only: sent to be run and committed in one go, waiting for the result */
+#define TX_RECOVERING 7				/* Participant: lost the coordinator after a yes vote, asking the other shards for the outcome */
+#define TX_NOTIFYING 8				/* Not a transaction of ours any more: telling shards that lost track of it its outcome */
+#define TX_SEQUENCED 9				/* Sequencer: in a batch, waiting for every shard to run it */
+
+/* Votes */
+#define VOTE_PENDING 0
+#define VOTE_YES 1
+#define VOTE_NO 2
+#define VOTE_NONE 3					/* Coordinator: the transaction does not touch our own shard */
+#define VOTE_UNKNOWN 4				/* The link broke before the vote came, it has to be asked for with a status query */
+
+/* Why an attempt of a transaction did not commit, its counter in aborts */
+#define ABORT_VOTE 0				/* Two-phase: a shard voted no */
+#define ABORT_SHARD 1				/* One-phase: its shard aborted it */
+#define ABORT_REFUSED 2				/* An increment could cross its bound, the client is told */
+#define ABORT_REJECTED 3			/* Malformed, too many keys or reads of another shard (or sequenced, no shard could run it), the client is told */
+#define ABORT_UNKNOWN 4				/* The link broke while it ran (or sequenced, only some shards ran it), the client is told the outcome is unknown */
+#define abortReasons 5
+
+/* Why a transaction is tried again, its counter in retries */
+#define RETRY_ABORT 0				/* The attempt aborted */
+#define RETRY_UNREACHABLE 1			/* A shard it touches could not be reached, after waiting */
+#define RETRY_STALE 2				/* Read-only: a replica was too far behind, read at the database server */
+#define RETRY_READ 3				/* Read-only: a shard did not get its values */
+#define retryReasons 4
+
+/* The phases of a transaction whose time is kept in histograms, its histogram in phases */
+#define PHASE_TRANSACTION 0			/* Coordinator: from the client's request to its reply */
+#define PHASE_VOTE 1				/* Coordinator: collecting the votes of an attempt */
+#define PHASE_ACK 2					/* Coordinator: from the decision to every acknowledgement */
+#define PHASE_EXECUTE 3				/* Coordinator: an attempt of a one-phase (or sequenced) transaction */
+#define PHASE_RETRY_WAIT 4			/* Coordinator: waiting for an unreachable shard before the next attempt */
+#define PHASE_PARTICIPANT_VOTE 5	/* Participant: our database server preparing it */
+#define PHASE_PARTICIPANT_DECISION 6	/* Participant: from our vote to the coordinator's decision */
+#define phaseCount 7
 
 /*** Declaration of global variables and structures ***/
 char serverConn[maxConn][hostNameLength];			/* Keeps track of other middlewares' IP addresses */
 char dbServer[hostNameLength];
+char replicaServers[maxReplicas][hostNameLength];
+int replicaCount;
 int conn_count;				/* conn_count - how many other middlewares are there */
-fd_set processingFdSet;
-struct thread_data
+int shardCount, myShard;	/* One shard per middleware, ours is the one of the database server next to us */
+uint64_t incarnation;		/* Goes up with every start, part of the batch and global transaction ids so they stay unique over restarts */
+int sequenced;				/* -s: transactions are put in one global order and run in it, instead of committed in two phases */
+int sequencer;				/* Sequenced mode, and we are the ones putting them in order */
+int detector;				/* Two-phase commit over several shards, and we are the ones looking for deadlocks across them */
+struct sockaddr_in dbAddress, serverAddress[maxConn], replicaAddress[maxReplicas];	/* Resolved once at startup */
+struct sockaddr_un dbLocalAddress;	/* -u: our database server's local socket, used instead of dbAddress */
+
+struct txn;
+
+/* Another shard the transaction touches (coordinator, or participant recovering it) */
+struct txn_part
+{
+	int  peer;					/* Index of the shard's middleware */
+	struct conn *link;			/* The prepare and the decision go over it */
+	struct conn *query;			/* A status query is out on it */
+	int  vote;
+	int  acking;				/* Coordinator: the decision is out, its acknowledgement is not in */
+	uint32_t offset, length;	/* Its operations, in the transaction's pieces */
+};
+
+/* Entry of the request id table: replies on our links are found by (NULL, id),
+decisions from a coordinating middleware by (its connection, its id) */
+struct txn_key
+{
+	struct conn *owner;
+	uint64_t id;
+	struct txn *txn;
+	struct txn_key *next;
+};
+
+/* A transaction in flight, driven by the frames that come back for it */
+struct txn
+{
+	int  role;
+	int  state;
+	struct loop *loop;			/* The event loop it lives on */
+	struct conn *origin;		/* The client (coordinator) or the coordinating middleware (participant) */
+	uint64_t originId;			/* The request id it came under */
+	uint64_t traceId;			/* Given by the client, sent on with every frame for it; 0 if untraced */
+	char *text;					/* Transaction text */
+	uint32_t length;
+	uint64_t requestId;			/* Id of the current attempt on our links */
+	struct txn_key keys[2];		/* (NULL, requestId), and for a participant (origin, originId) */
+	struct conn *db;			/* Link the transaction went to the database server on */
+	struct conn *dbQuery;		/* A status query to the database server is out on it */
+	int  dbVote;
+	int  dbAcking;				/* The decision is out to our database server, its acknowledgement is not in */
+	unsigned long long txid;	/* Global id of the current attempt, the database servers know it by */
+	uint32_t shards;			/* Mask of the shards it touches */
+	char *pieces;				/* Coordinator: the transaction's operations split by shard */
+	uint32_t localOffset, localLength;		/* The piece of our own shard, empty if it is not touched */
+	struct txn_part parts[maxConn];
+	int  partCount;
+	int  onePhase;				/* Coordinator: touches a single shard, which commits it without votes */
+	int  readOnly;				/* Coordinator: writes nothing, every shard it touches reads its piece from a snapshot, no votes either */
+	int  primary;				/* Read-only: a replica was too far behind, read at the database server itself */
+	int  replicaRead;			/* Coordinator: some shard read its piece at a replica ... */
+	uint32_t lagMs;				/* ... at most this far behind its primary */
+	int  refused;				/* A shard voted no because an increment could cross its bound, trying again would not help */
+	int  decided;				/* Participant: the decision arrived (possibly before our vote was ready) */
+	char decision;
+	int  orphaned;				/* Participant: the coordinator hung up before our database server voted */
+	uint32_t notify;			/* Notifying: shards still to be told the outcome */
+	uint32_t failed;			/* Sequenced: shards that could not run their part */
+	uint64_t deadline;			/* Vote timeout, next resolve attempt or next retry */
+	uint64_t startUs;			/* When it came in */
+	uint64_t phaseUs;			/* When its current phase started */
+	struct txn *prev, *next;	/* All transactions of the loop */
+};
+
+/* The middleware's state of one event loop */
+struct loop_state
+{
+	struct pool db;
+	struct pool peers[maxConn];
+	struct pool replicas[maxReplicas];
+	unsigned int nextReplica;	/* Round robin over the replicas */
+	struct txn_key *table[txnBuckets];
+	struct txn *live;
+};
+
+/* Sequenced mode: what one shard gets of a batch, the operations of each of its transactions
+(a 4 byte length, then the text) after room for the batch id */
+struct batch_piece
+{
+	char *data;
+	uint32_t used, capacity;
+};
+
+/* Sequenced mode: transactions in the global order, kept by the sequencer until every shard has run them */
+struct batch
+{
+	uint64_t id;				/* Our incarnation, then the batch number */
+	struct batch_piece pieces[maxConn + 1];
+	struct conn *links[maxConn + 1];	/* Link each shard's piece is out on, NULL if it has to go (again) */
+	uint32_t pending;			/* Shards that have not acknowledged it */
+	struct txn **txns;
+	int  count, capacity;
+	struct batch *next;
+};
+
+struct loop loops[maxLoops];
+struct loop_state states[maxLoops];
+int loopCount;
+int voteTimeoutMs;			/* Coordinator: how long votes are waited for before the shards are asked for them */
+struct batch *openBatch;		/* Sequencer: the batch transactions are added to, sealed at the end of the round */
+struct batch *sentBatches;		/* Sequencer: sealed and not acknowledged by every shard yet, oldest first */
+uint32_t batchNumber;
+uint64_t waitsRound;			/* Deadlock detector: request id of the round of wait-for edges being collected */
+uint32_t waitsPending;			/* Deadlock detector: shards whose edges have not come in this round */
+struct wait_edge *waitEdges;	/* Deadlock detector: the edges of this round so far */
+int waitEdgeCount, waitEdgeCapacity;
+struct counter commits = COUNTER("distra_commits_total", NULL, "Transactions committed");
+struct counter aborts[abortReasons] =
+{
+	COUNTER("distra_aborts_total", "reason=\"vote\"", "Attempts of transactions that did not commit, by why"),
+	COUNTER("distra_aborts_total", "reason=\"shard\"", "Attempts of transactions that did not commit, by why"),
+	COUNTER("distra_aborts_total", "reason=\"refused\"", "Attempts of transactions that did not commit, by why"),
+	COUNTER("distra_aborts_total", "reason=\"rejected\"", "Attempts of transactions that did not commit, by why"),
+	COUNTER("distra_aborts_total", "reason=\"unknown\"", "Attempts of transactions that did not commit, by why"),
+};
+struct counter retries[retryReasons] =
 {
-	int  thread_id;
-	int  socketfd;
-	char buffer[MAXMSG];
-	
+	COUNTER("distra_retries_total", "reason=\"abort\"", "Transactions tried again, by why"),
+	COUNTER("distra_retries_total", "reason=\"unreachable\"", "Transactions tried again, by why"),
+	COUNTER("distra_retries_total", "reason=\"stale\"", "Transactions tried again, by why"),
+	COUNTER("distra_retries_total", "reason=\"read\"", "Transactions tried again, by why"),
+};
+struct counter deadlockVictims = COUNTER("distra_deadlock_victims_total", NULL, "Transactions aborted to break a deadlock across shards");
+struct histogram phases[phaseCount] =
+{
+	HISTOGRAM("distra_phase_seconds", "phase=\"transaction\"", "Time transactions spend in each phase"),
+	HISTOGRAM("distra_phase_seconds", "phase=\"vote\"", "Time transactions spend in each phase"),
+	HISTOGRAM("distra_phase_seconds", "phase=\"ack\"", "Time transactions spend in each phase"),
+	HISTOGRAM("distra_phase_seconds", "phase=\"execute\"", "Time transactions spend in each phase"),
+	HISTOGRAM("distra_phase_seconds", "phase=\"retry_wait\"", "Time transactions spend in each phase"),
+	HISTOGRAM("distra_phase_seconds", "phase=\"participant_vote\"", "Time transactions spend in each phase"),
+	HISTOGRAM("distra_phase_seconds", "phase=\"participant_decision\"", "Time transactions spend in each phase"),
 };
 /*** End of declaration ***/
 
@@ -45,7 +242,7 @@ struct thread_data
 */
 int makeSocket(unsigned short int port)
 {
-	int sock;
+	int sock, one = 1;
 	struct sockaddr_in name;
 
 	/* Create a socket. */
@@ -55,6 +252,8 @@ int makeSocket(unsigned short int port)
 		perror("Could not create a socket\n");
 		exit(EXIT_FAILURE);
 	}
+	/* Every event loop listens on the port, the kernel spreads the connections over them */
+	setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
 	/* Give the socket a name. */
 	/* Socket address format set to AF_INET for internet use. */
 	name.sin_family = AF_INET;
@@ -98,441 +297,1715 @@ void initSocketAddress(struct sockaddr_in *name, char *hostName, unsigned short
 	name->sin_addr = *(struct in_addr *)hostInfo->h_addr;
 }
 
-/* Read data from FD <int fileDescriptor> and put it into <char *buf> */
-int readMessage(int fileDescriptor, char *buf)
+/* Checks if the string b is present in the array of strings a
+if yes, returns 1, else 0 */
+int checkArray(char a[][hostNameLength], int num, char *b)
+{
+	int i;
+	for(i=0;i<num;i++)
+	{
+		if(!(strcmp(a[i],b)))
+		return 1;
+	}
+	return 0;
+}
+
+/* Request id table */
+static unsigned int key_bucket(struct conn *owner, uint64_t id)
+{
+	uint64_t h = (id ^ (uint64_t)(uintptr_t)owner) * 0x9E3779B97F4A7C15ULL;
+
+	return (unsigned int)(h >> 32) & (txnBuckets - 1);
+}
+
+void key_insert(struct loop_state *s, struct txn_key *k, struct conn *owner, uint64_t id, struct txn *t)
+{
+	unsigned int b = key_bucket(owner, id);
+
+	k->owner = owner;
+	k->id = id;
+	k->txn = t;
+	k->next = s->table[b];
+	s->table[b] = k;
+}
+
+void key_remove(struct loop_state *s, struct txn_key *k)
+{
+	struct txn_key **link;
+
+	if(!k->txn)
+		return;
+	for(link = &s->table[key_bucket(k->owner, k->id)]; *link && *link != k; link = &(*link)->next);
+	if(*link)
+		*link = k->next;
+	k->txn = NULL;
+}
+
+struct txn * key_find(struct loop_state *s, struct conn *owner, uint64_t id)
 {
-	int nOfBytes;
-	nOfBytes = read(fileDescriptor, buf, MAXMSG);
-	if(nOfBytes < 0)
+	struct txn_key *k;
+
+	for(k = s->table[key_bucket(owner, id)]; k; k = k->next)
 	{
-		perror("Could not read data from client\n");
-		return (-2);
+		if(k->owner == owner && k->id == id)
+			return k->txn;
 	}
-	else if(nOfBytes == 0)
-	/* End of file */
-	return(-1);
-	else
-	/* Data read */
-	return(0);
+	return NULL;
+}
+
+/* A transaction started from accepted connection <c> is done; the last one out frees a connection the other side already hung up */
+void conn_put(struct conn *c)
+{
+	if(--c->inFlight == 0 && c->closed)
+		conn_free(c);
 }
 
-/* Write the message <char *message> onto FD <int fileDescriptor> */
-void writeMessage(int fileDescriptor, char *message)
+/* A new transaction from frame <h> of <origin> */
+struct txn * txn_new(int role, struct conn *origin, struct frame_header *h, const char *payload)
 {
-	int nOfBytes;
+	struct loop_state *s = (struct loop_state *) origin->loop->data;
+	struct txn *t;
 
-	nOfBytes = write(fileDescriptor, message, strlen(message) + 1);
-	if(nOfBytes < 0)
+	t = calloc(1, sizeof(struct txn));
+	if(t)
+		t->text = malloc(h->length + 1);
+	if(!t || !t->text)
 	{
-		perror("writeMessage - Could not write data\n");
+		perror("Could not allocate transaction state\n");
 		exit(EXIT_FAILURE);
 	}
+	t->role = role;
+	t->loop = origin->loop;
+	t->origin = origin;
+	t->originId = h->requestId;
+	t->traceId = h->traceId;
+	memcpy(t->text, payload, h->length);
+	t->text[h->length] = '\0';
+	t->length = h->length;
+	t->startUs = t->phaseUs = metrics_now_us();
+	origin->inFlight++;
+	t->prev = NULL;
+	t->next = s->live;
+	if(s->live)
+		s->live->prev = t;
+	s->live = t;
+	return t;
 }
 
-/* Checks if the string b is present in the array of strings a
-if yes, returns 1, else 0 */
-int checkArray(char a[][hostNameLength], int num, char *b)
+void txn_free(struct txn *t)
+{
+	struct loop_state *s = (struct loop_state *) t->loop->data;
+
+	key_remove(s, &t->keys[0]);
+	key_remove(s, &t->keys[1]);
+	if(t->prev)
+		t->prev->next = t->next;
+	else
+		s->live = t->next;
+	if(t->next)
+		t->next->prev = t->prev;
+	if(t->origin)
+		conn_put(t->origin);
+	free(t->text);
+	free(t->pieces);
+	free(t);
+}
+
+/* Give transaction <t> a fresh request id for the requests it is about to send */
+void txn_renumber(struct txn *t)
+{
+	struct loop_state *s = (struct loop_state *) t->loop->data;
+
+	key_remove(s, &t->keys[0]);
+	t->requestId = new_request_id();
+	key_insert(s, &t->keys[0], NULL, t->requestId, t);
+}
+
+/* Send the outcome of transaction <t> to its client */
+void client_reply(struct txn *t, char outcome, const char *message)
+{
+	char payload[128];
+	int length;
+
+	length = strlen(message);
+	payload[0] = outcome;
+	memcpy(payload + 1, message, length);
+	conn_send(t->origin, MSG_RESULT, t->originId, t->traceId, payload, length + 1);
+	if(outcome == RESULT_COMMITTED)
+		counter_add(&commits, 1);
+	histogram_since(&phases[PHASE_TRANSACTION], t->startUs);
+}
+
+/* Shard index <k> (not ours) as an index into the other middlewares */
+int peer_of(int k)
+{
+	return (k < myShard) ? k : k - 1;
+}
+
+/* The shard of the other middleware with index <peer> */
+int shard_of_peer(int peer)
+{
+	return (peer < myShard) ? peer : peer + 1;
+}
+
+/* Global id for request <requestId>: unique over the shards (ours is in it) and over the last 65536 restarts (so is our incarnation) */
+unsigned long long global_txid(uint64_t requestId)
+{
+	return globalTxidFlag | ((unsigned long long)myShard << 56) | ((incarnation & 0xFFFF) << 40) | (requestId & 0xFFFFFFFFFFULL);
+}
+
+/* Shard of the middleware that coordinates global transaction <txid> */
+int coordinator_shard(unsigned long long txid)
+{
+	return (int)((txid >> 56) & 0x7F);
+}
+
+/* Link for read-only transaction <t> to read at our shard: one to a replica, in turn, unless it has to read
+at the database server itself (or no replica is up) */
+struct conn * read_link(struct loop_state *s, struct txn *t)
 {
+	struct conn *c;
 	int i;
-	for(i=0;i<num;i++)
+
+	for(i=0; i<replicaCount && !t->primary; i++)
 	{
-		if(!(strcmp(a[i],b)))
-		return 1;
+		c = pool_link(&s->replicas[s->nextReplica++ % replicaCount]);
+		if(c)
+			return c;
 	}
-	return 0;
+	return pool_link(&s->db);
 }
 
-int dbserverConnectAndTransferTransaction(char *transaction)
+/* Ask the database server again, over any link that is up, to apply the decision of prepared transaction <t> */
+void txn_resolve(struct txn *t)
 {
-	char hostName[hostNameLength];
-	int dbsock;
-	struct sockaddr_in serverName;
-	
-	strncpy(hostName, dbServer, hostNameLength);
-	hostName[hostNameLength - 1] = '\0';
-	dbsock = socket(PF_INET, SOCK_STREAM, 0);
-	if( dbsock < 0 )
+	struct loop_state *s = (struct loop_state *) t->loop->data;
+	char resolve[resolvePayloadSize];
+
+	t->deadline = t->loop->now + reconnectDelayMs;		//Asked again if no acknowledgement comes by then
+	t->db = pool_link(&s->db);
+	if(!t->db)
+		return;
+	log_info("Lost the database server before it acknowledged, resolving transaction %llu\n", t->txid);
+	put_u64(resolve, t->txid);
+	resolve[8] = t->decision;
+	conn_send(t->db, MSG_RESOLVE, t->requestId, t->traceId, resolve, resolvePayloadSize);
+}
+
+/* Send a status query for <t> over a link of <p>, which is returned (NULL if none is up) */
+struct conn * txn_query(struct txn *t, struct pool *p)
+{
+	struct conn *c;
+	char status[statusPayloadSize];
+
+	c = pool_link(p);
+	if(!c)
+		return NULL;
+	put_u64(status, t->txid);
+	conn_send(c, MSG_STATUS, t->requestId, t->traceId, status, statusPayloadSize);
+	return c;
+}
+
+/* Ask for the votes of <t> that cannot come any more, and for all the missing ones if <all>.
+A shard that has not prepared by the time it answers never will, so an answer is final */
+void txn_ask(struct txn *t, int all)
+{
+	struct loop_state *s = (struct loop_state *) t->loop->data;
+	struct txn_part *p;
+	int i;
+
+	if((t->dbVote == VOTE_UNKNOWN && (all || !t->dbQuery)) || (t->dbVote == VOTE_PENDING && all))
+		t->dbQuery = txn_query(t, &s->db);
+	for(i=0; i<t->partCount; i++)
 	{
-		perror("Could not create a socket\n");
-		exit(EXIT_FAILURE);
+		p = &t->parts[i];
+		if((p->vote == VOTE_UNKNOWN && (all || !p->query)) || (p->vote == VOTE_PENDING && all))
+			p->query = txn_query(t, &s->peers[p->peer]);
+	}
+}
+
+/* Tell the database servers of the shards in <n>->notify the outcome of <n>->txid, through their middlewares.
+Tried again at every tick while one cannot be reached; <n> goes once all of them are sent */
+void txn_notify(struct txn *n)
+{
+	struct loop_state *s = (struct loop_state *) n->loop->data;
+	struct conn *link;
+	char resolve[resolvePayloadSize];
+	int k;
+
+	put_u64(resolve, n->txid);
+	resolve[8] = n->decision;
+	for(k=0; k<shardCount; k++)
+	{
+		if(!(n->notify & (1u << k)) || !(link = pool_link(&s->peers[peer_of(k)])))
+			continue;
+		conn_send(link, MSG_RESOLVE, new_request_id(), n->traceId, resolve, resolvePayloadSize);
+		n->notify &= ~(1u << k);
 	}
-	initSocketAddress(&serverName, hostName, PORT_DB);
-	if(connect(dbsock, (struct sockaddr *)&serverName, sizeof(serverName)) < 0)
+	if(n->notify == 0)
+		txn_free(n);
+}
+
+/* Start telling <shards> the outcome <t> was given; <t> itself goes on (a coordinator may try again under a new id) */
+void txn_notify_start(struct txn *t, uint32_t shards)
+{
+	struct loop_state *s = (struct loop_state *) t->loop->data;
+	struct txn *n;
+
+	n = calloc(1, sizeof(struct txn));
+	if(!n)
 	{
-		perror("Could not connect to database server\n");
+		perror("Could not allocate transaction state\n");
 		exit(EXIT_FAILURE);
 	}
-	writeMessage(dbsock, transaction);
-	
-	return dbsock;
+	n->loop = t->loop;
+	n->state = TX_NOTIFYING;
+	n->txid = t->txid;
+	n->traceId = t->traceId;
+	n->decision = t->decision;
+	n->notify = shards;
+	n->next = s->live;
+	if(s->live)
+		s->live->prev = n;
+	s->live = n;
+	txn_notify(n);
+}
+
+void coordinator_attempt(struct txn *t);
+void sequencer_add(struct txn *t);
+
+/* Coordinator: the database server has acknowledged the decision (or there was nothing to tell it) */
+void coordinator_done(struct txn *t)
+{
+	histogram_since(&phases[PHASE_ACK], t->phaseUs);
+	if(t->decision == '1')
+		txn_free(t);		//The client knows already
+	else if(t->refused)
+	{
+		client_reply(t, RESULT_ABORTED, "Transaction refused: an increment could cross its bound!\n");
+		txn_free(t);
+	}
+	else
+	{
+		counter_add(&retries[RETRY_ABORT], 1);
+		coordinator_attempt(t);		//Aborted, try again
+	}
 }
 
-/* Thread handle for incoming communication from another middleware */
-void * handle_middleware(void * args)
+/* Coordinator: every shard that prepared, our database server among them, acknowledged the decision */
+void coordinator_acked(struct txn *t)
 {
-	int flag, i, j;
-	char controlMsgs[MAXMSG];
-	int dbsock;
-	struct thread_data t, *temp;
-	fd_set tempFdSet, readFdSet;
+	int i;
 
-	temp = (struct thread_data *) args;
-	t.thread_id = temp->thread_id;
-	t.socketfd = temp->socketfd;
-	strncpy(t.buffer, temp->buffer, MAXMSG);
+	if(t->dbAcking)
+		return;
+	t->state = TX_ACKING;		//No more resolving
+	for(i=0; i<t->partCount; i++)
+	{
+		if(t->parts[i].acking)
+			return;
+	}
+	coordinator_done(t);
+}
 
-	/* Connect to database server and transmit transaction */
-	dbsock = dbserverConnectAndTransferTransaction(t.buffer);
-	/* End of transaction transmit to database server */
+/* Coordinator: tell everyone the outcome. A commit is final once every shard has prepared, so the client
+hears it right away; the decisions, and the locks they release, follow without it waiting */
+void coordinator_decide(struct txn *t, char decision)
+{
+	struct txn_part *p;
+	uint32_t lost;
+	int i;
 
-	/* Wait and receive answer from database server and send answer to coordinator */
-	FD_ZERO(&tempFdSet);
-	FD_SET(dbsock, &tempFdSet);
-	readFdSet = tempFdSet;
-	printf("Checkpoint - waiting for answer from database server (middleware)!\n");
-	while(select(FD_SETSIZE, &readFdSet, NULL, NULL, NULL) <= 0)
+	histogram_since(&phases[PHASE_VOTE], t->phaseUs);
+	t->phaseUs = metrics_now_us();
+	trace_event(t->traceId, "decided", "\"decision\":\"%c\",\"txid\":%llu", decision, t->txid);
+	if(decision == '0')
+		counter_add(&aborts[t->refused ? ABORT_REFUSED : ABORT_VOTE], 1);
+	t->decision = decision;
+	if(decision == '1')
 	{
-		perror("Select failed\n");
-		readFdSet = tempFdSet;
-		continue;
+		client_reply(t, RESULT_COMMITTED, "Transaction successful!\n");
+		if(t->partCount > 0)
+			log_debug("Ready to commit! Transmitting permission to the shards involved!\n");
 	}
-	if( FD_ISSET(dbsock, &readFdSet) )
+	lost = 0;
+	for(i=0; i<t->partCount; i++)
 	{
-		j = readMessage(dbsock, controlMsgs);
-		if( (j < 0) || (controlMsgs[0] == '0') )	//Abort
+		p = &t->parts[i];
+		if(p->link)
 		{
-			printf("Received abort from dbserv, sending abort to coordinator! (middleware)\n");
-			writeMessage(t.socketfd, "0");
-		}
-		else if(controlMsgs[0] == '1')
-		{
-			printf("Locks acquired! (middleware)!\n");
-			writeMessage(t.socketfd, "1");
+			conn_send(p->link, MSG_DECISION, t->requestId, t->traceId, &decision, 1);
+			p->acking = (p->vote == VOTE_YES);
 		}
+		else if(p->vote != VOTE_NO)		//It may be in doubt there, with no middleware left that knows it
+			lost |= 1u << shard_of_peer(p->peer);
 	}
-	else	//Select unblocked due to unknown reasons
+	if(lost)
+		txn_notify_start(t, lost);
+	t->state = TX_ACKING;
+	t->dbAcking = (t->dbVote == VOTE_YES);
+	if(t->dbAcking && t->db)
+		conn_send(t->db, MSG_DECISION, t->requestId, t->traceId, &decision, 1);
+	else if(t->dbAcking)
 	{
-		printf("Select unblocked due to unknown reasons (middleware).\n");
-		writeMessage(dbsock, "0");
-		writeMessage(t.socketfd, "0");
+		t->state = TX_RESOLVING;		//The link it prepared on is gone
+		t->deadline = t->loop->now;
 	}
-	/* End of answer receive from database server and sending answer to coordinator */
+	coordinator_acked(t);
+}
+
+/* Coordinator: decide once the votes allow it. The transaction commits if every shard prepared it; a no vote aborts it,
+once our database server's vote is known (it prepares nothing that is not decided). Votes that do not come in time
+are asked for with status queries */
+void coordinator_check(struct txn *t)
+{
+	char decision;
+	int i, pending;
 
-	/* Receiving answer on what to do from coordinator and forwarding to db server */
-	FD_ZERO(&tempFdSet);
-	FD_SET(t.socketfd, &tempFdSet);
-	readFdSet = tempFdSet;
-	while(select(FD_SETSIZE, &readFdSet, NULL, NULL, NULL) <= 0)
+	if(t->state != TX_VOTING)
+		return;
+	decision = '1';
+	pending = 0;
+	if(t->dbVote == VOTE_NO)
 	{
-		perror("Select failed\n");
-		readFdSet = tempFdSet;
-		continue;
+		log_debug("Abort received from database server\n");
+		decision = '0';
 	}
-	if(FD_ISSET(t.socketfd, &readFdSet))
+	for(i=0; i<t->partCount; i++)
 	{
-		j = readMessage(t.socketfd, controlMsgs);
-		if( (j < 0) || (controlMsgs[0] == '0') )
-		{
-			printf("Received abort from coordinator - aborting!\n");
-			writeMessage(dbsock, "0");
-			sleep(1);
-		}
-		else if( (controlMsgs[0] == '1') )
+		if(t->parts[i].vote == VOTE_NO)
 		{
-			printf("Received COMMIT from coordinator - transmitting to database server (middleware)\n");
-			writeMessage(dbsock, "1");
-			sleep(1);
+			if(decision == '1')
+				log_debug("Received abort from one of the middlewares, retrying!\n");
+			decision = '0';
 		}
+		else if(t->parts[i].vote != VOTE_YES)
+			pending = 1;
 	}
-	else	//Select unblocked due to unknown reasons
+	if((decision == '1' && !pending && t->dbVote != VOTE_PENDING && t->dbVote != VOTE_UNKNOWN) ||
+		(decision == '0' && t->dbVote != VOTE_PENDING && t->dbVote != VOTE_UNKNOWN))
 	{
-		printf("Select unblocked due to unknown reasons (middleware).\n");
-		writeMessage(dbsock, "0");
+		coordinator_decide(t, decision);
+		return;
 	}
-	/* End of answer receive and forward */
-
-	close(dbsock);
-	close(t.socketfd);
-	pthread_exit(NULL);
+	if(t->loop->now >= t->deadline)
+	{
+		log_debug("Wait timeout, asking for the missing votes!\n");
+		t->deadline = t->loop->now + reconnectDelayMs;		//And again then, if no answer came
+		txn_ask(t, 1);
+	}
+	else
+		txn_ask(t, 0);
 }
 
-/* Thread handle for incoming communication from a client */
-void * handle_client(void * args)
+/* Coordinator: wait for every shard the transaction touches to be reachable again */
+void coordinator_wait(struct txn *t, const char *shard)
 {
-	int flag, i, j, k, dbabort;
-	char hostName[hostNameLength], controlMsgs[MAXMSG];
-	int serversock[maxConn], dbsock;	/* File descriptors for socket connections to other middlewares */
-	struct sockaddr_in serverName;
-	struct thread_data t, *temp;
-	struct timeval tv;
-	fd_set serverFdSet, readFdSet, tempFdSet;
+	log_warn("%s unreachable, waiting to retry!\n", shard);
+	counter_add(&retries[RETRY_UNREACHABLE], 1);
+	trace_event(t->traceId, "unreachable", "\"shard\":\"%s\"", shard);
+	t->phaseUs = metrics_now_us();
+	t->state = TX_RETRY;
+	t->deadline = t->loop->now + reconnectDelayMs;
+}
 
-	temp = (struct thread_data *) args;
-	t.thread_id = temp->thread_id;
-	t.socketfd = temp->socketfd;
-	strncpy(t.buffer, temp->buffer, MAXMSG);
-	srand(time(NULL));
-	tv.tv_sec = ( (rand()%101)+50 );
-	tv.tv_usec = 0;
+/* Coordinator: the single shard of a one-phase transaction ran it, <outcome> (RESULT_UNKNOWN if its link broke first) */
+void coordinator_executed(struct txn *t, char outcome)
+{
+	char message[96];
 
-    beginning:
-	i = 0;
-	FD_ZERO(&serverFdSet);
-	/* Initiating the connection to other middlewares and transmitting the transaction */
-	while( i<conn_count )
+	histogram_since(&phases[PHASE_EXECUTE], t->phaseUs);
+	if(outcome == RESULT_COMMITTED)
 	{
-		strncpy(hostName, serverConn[i], hostNameLength);
-		hostName[hostNameLength - 1] = '\0';
-		serversock[i] = socket(PF_INET, SOCK_STREAM, 0);	//Creating a socket for the connection
-		if( serversock[i] < 0 )
-		{
-			perror("Could not create a socket\n");
-			exit(EXIT_FAILURE);
-		}
-		initSocketAddress(&serverName, hostName, PORT);		//The remote socket to connect to
-		if(connect(serversock[i], (struct sockaddr *)&serverName, sizeof(serverName)) < 0)
+		if(t->replicaRead)
 		{
-			perror("Could not connect to server\n");
-			exit(EXIT_FAILURE);
+			snprintf(message, sizeof(message), "Transaction successful! (read at a replica, at most %u ms behind)\n", t->lagMs);
+			client_reply(t, RESULT_COMMITTED, message);
 		}
-		FD_SET(serversock[i], &serverFdSet);
-		writeMessage(serversock[i++], t.buffer);
-	}
-	/* End of transaction transmit and connection initiation */
-	
-	/* Connect to database server and transmit transaction */
-	dbsock = dbserverConnectAndTransferTransaction(t.buffer);
-	/* End of transaction transmit to database server */
-	
-	dbabort=1;
-	/* Wait for and receive answer from database server */
-	FD_ZERO(&tempFdSet);
-	FD_SET(dbsock, &tempFdSet);
-	readFdSet = tempFdSet;
-	printf("Checkpoint - waiting for answer from database server (client)!\n");
-	while((select(FD_SETSIZE, &readFdSet, NULL, NULL, NULL)) <= 0)
-	{
-		perror("Select failed\n");
-		readFdSet = tempFdSet;
-		continue;
-	}
-	if(FD_ISSET(dbsock, &readFdSet))
-	{
-		j = readMessage(dbsock, controlMsgs);
-		if( (j < 0) || (controlMsgs[0] == '0') )	//Abort
+		else
+			client_reply(t, RESULT_COMMITTED, "Transaction successful!\n");
+		txn_free(t);
+	}
+	else if(outcome == RESULT_UNKNOWN)		//Running it again could apply it twice
+	{
+		log_warn("Lost the connection while a transaction ran, its outcome is unknown!\n");
+		counter_add(&aborts[ABORT_UNKNOWN], 1);
+		client_reply(t, RESULT_UNKNOWN, sequenced ? "Connection lost while the transaction ran, or some of its shards could not run it: it may or may not have committed!\n" :
+			"Connection lost while the transaction ran, it may or may not have committed!\n");
+		txn_free(t);
+	}
+	else if(outcome == RESULT_REFUSED)		//And would be again
+	{
+		counter_add(&aborts[ABORT_REFUSED], 1);
+		client_reply(t, RESULT_ABORTED, "Transaction refused: an increment could cross its bound!\n");
+		txn_free(t);
+	}
+	else if(sequenced)		//The sequencer turned it down (and would again), or none of its shards could run it
+	{
+		counter_add(&aborts[ABORT_REJECTED], 1);
+		client_reply(t, RESULT_ABORTED, "Transaction rejected: a malformed operation, too many keys, reads of another shard or its shards could not run it!\n");
+		txn_free(t);
+	}
+	else
+	{
+		counter_add(&aborts[ABORT_SHARD], 1);
+		counter_add(&retries[RETRY_ABORT], 1);
+		coordinator_attempt(t);		//Aborted, try again
+	}
+}
+
+/* Coordinator: the result of a one-phase transaction came in on link <c>, <outcome> (RESULT_UNKNOWN if the link broke first).
+A read-only transaction waits for the result of every shard it touches (kept as their votes), and whatever
+goes wrong it just runs again: reads cannot be applied twice */
+void coordinator_result(struct txn *t, struct conn *c, char outcome)
+{
+	int i, pending;
+
+	if(!t->readOnly)
+	{
+		coordinator_executed(t, outcome);
+		return;
+	}
+	if(outcome == RESULT_STALE)
+	{
+		log_debug("A replica is too far behind, reading at the database server!\n");
+		counter_add(&retries[RETRY_STALE], 1);
+		t->primary = 1;
+	}
+	if(outcome != RESULT_COMMITTED)
+	{
+		if(outcome != RESULT_STALE)
 		{
-            printf("Received abort from dbserv! (client)\n");
-			dbabort=0;
+			log_debug("A read-only transaction did not get its values, reading them again!\n");
+			counter_add(&retries[RETRY_READ], 1);
 		}
-		else if(controlMsgs[0] == '1')
-			printf("Locks acquired! (client)!\n");
+		coordinator_attempt(t);
+		return;
+	}
+	if(c == t->db)
+		t->dbVote = VOTE_YES;
+	pending = (t->dbVote == VOTE_PENDING);
+	for(i=0; i<t->partCount; i++)
+	{
+		if(c == t->parts[i].link)
+			t->parts[i].vote = VOTE_YES;
+		pending |= (t->parts[i].vote == VOTE_PENDING);
+	}
+	if(!pending)
+		coordinator_executed(t, RESULT_COMMITTED);
+}
+
+/* Coordinator, sequenced mode: hand <t> over to the sequencer, which answers once every shard ran it.
+It goes like a one-phase transaction sent to another shard */
+void coordinator_order(struct txn *t)
+{
+	struct loop_state *s = (struct loop_state *) t->loop->data;
+	struct txn_part *p = &t->parts[0];
+
+	if(sequencer)
+	{
+		sequencer_add(t);
+		return;
 	}
-	else	//Select unblocked due to unknown reasons
+	p->peer = peer_of(sequencerShard);
+	if(!(p->link = pool_link(&s->peers[p->peer])))
 	{
-		printf("Select unblocked due to unknown reasons (client).\n");
-		dbabort=0;
+		coordinator_wait(t, serverConn[p->peer]);
+		return;
 	}
-	/* End of answer receive from database server */
+	t->partCount = 1;
+	txn_renumber(t);
+	t->state = TX_EXECUTING;
+	conn_send(p->link, MSG_ORDER, t->requestId, t->traceId, t->text, t->length);
+}
+
+/* Coordinator: send each shard the transaction touches its operations, under a new request id */
+void coordinator_attempt(struct txn *t)
+{
+	struct loop_state *s = (struct loop_state *) t->loop->data;
+	struct txn_part *p;
+	char prefix[preparePrefixSize];
+	int i;
 
-	sleep(1);
-	flag = 1; i = 0;
-	/* Getting the answers from the other middlewares (on the attempt to lock the required mutexes) */
-	printf("Waiting for the answers from the other middlewares timeout sec: %d\n", tv.tv_sec);
-	while( i<conn_count && flag )
+	if(t->state == TX_RETRY)
+		histogram_since(&phases[PHASE_RETRY_WAIT], t->phaseUs);
+	t->phaseUs = metrics_now_us();
+	if(sequenced)
+	{
+		coordinator_order(t);
+		return;
+	}
+	t->db = t->dbQuery = NULL;
+	if(t->localLength > 0 && !(t->db = t->readOnly ? read_link(s, t) : pool_link(&s->db)))
+	{
+		coordinator_wait(t, "Database server");
+		return;
+	}
+	for(i=0; i<t->partCount; i++)
 	{
-		readFdSet = serverFdSet;
-		while( 1 )
+		p = &t->parts[i];
+		p->query = NULL;
+		if(!(p->link = pool_link(&s->peers[p->peer])))
 		{
-			i = select(FD_SETSIZE, &readFdSet, NULL, NULL, &tv);
-			if(i < 0)
-			{
-				perror("Select failed\n");
-				readFdSet = tempFdSet;
-				continue;
-			}
-			if(i == 0)
-			{
-				printf("Wait timeout!\n");
-				flag = 0;
-				break;
-			}
-			else
-				break;
+			coordinator_wait(t, serverConn[p->peer]);
+			return;
 		}
-		for(k = 0; ((k < conn_count) && flag); k++)
+	}
+	txn_renumber(t);
+	trace_event(t->traceId, "attempt", "\"shards\":%u,\"one_phase\":%d,\"read_only\":%d", t->shards, t->onePhase, t->readOnly);
+	/* A single shard decides alone: it runs and commits the transaction in one round trip.
+	So does every shard of a read-only transaction, there is nothing to commit */
+	if(t->onePhase)
+	{
+		t->state = TX_EXECUTING;
+		t->dbVote = t->db ? VOTE_PENDING : VOTE_NONE;
+		if(t->db)
+			conn_send(t->db, MSG_EXECUTE, t->requestId, t->traceId, t->pieces + t->localOffset, t->localLength);
+		for(i=0; i<t->partCount; i++)
 		{
-			if(FD_ISSET(serversock[k], &readFdSet))
-			{
-				i++;
-				FD_CLR(serversock[k], &serverFdSet);
-				j = readMessage(serversock[k], controlMsgs);
-				if( j < 0 )
-				{
-					perror("Error while trying to read data from middleware socket (inthread)!\n");
-					flag = 0;
-					break;
-				}
-				if( controlMsgs[0] == '0' )	//Answer received - abort
-				{
-					flag = 0;
-					break;
-				}
-			}
+			p = &t->parts[i];
+			p->vote = VOTE_PENDING;
+			conn_send(p->link, MSG_EXECUTE, t->requestId, t->traceId, t->pieces + p->offset, p->length);
 		}
+		return;
 	}
-	/* End of getting answers from other middlewares */
-
-	i = 0;
-	/* If everyone is ready to commit, send message and commit */
-	if( flag && dbabort )
+	t->state = TX_VOTING;
+	t->deadline = t->loop->now + voteTimeoutMs;
+	/* Every attempt is a transaction of its own for the shards, under a new global id */
+	t->txid = global_txid(t->requestId);
+	put_u64(prefix, t->txid);
+	put_u32(prefix + 8, t->shards);
+	/* Transmitting the pieces to the middlewares of the other shards */
+	for(i=0; i<t->partCount; i++)
 	{
-		printf("Ready to commit! Transmitting permission to all middlewares!\n");
-		while( i<conn_count )		//Transmitting permission to commit to all other middlewares
-			writeMessage(serversock[i++], "1");
-		writeMessage(dbsock, "1");
-		writeMessage(t.socketfd, "Transaction successful!\n");
+		p = &t->parts[i];
+		p->vote = VOTE_PENDING;
+		conn_send_prefixed(p->link, MSG_PREPARE, t->requestId, t->traceId, prefix, preparePrefixSize, t->pieces + p->offset, p->length);
+	}
+	/* Transmitting our own shard's piece to the database server */
+	if(t->db)
+	{
+		t->dbVote = VOTE_PENDING;
+		conn_send_prefixed(t->db, MSG_PREPARE, t->requestId, t->traceId, prefix, preparePrefixSize, t->pieces + t->localOffset, t->localLength);
 	}
-	/* End of transaction commit */
-
-	/* If any of the other middlewares have voted abort */
 	else
 	{
-		if(!dbabort)
-			printf("Abort received from database server\n");
-		else
-        	printf("Received abort from one of the middlewares (or select timeout), retrying!\n");
-		while( i<conn_count )
-		{
-			writeMessage(serversock[i], "0");
-            		close(serversock[i++]);
-		}
-		writeMessage(dbsock, "0");
-		close(dbsock);
-		goto beginning;
+		t->dbVote = VOTE_NONE;
+		coordinator_check(t);		//Touches no key at all if there are no parts either
 	}
-	FD_CLR(t.socketfd, &processingFdSet);
-	pthread_exit(NULL);
 }
 
-int main(int argc, char *argv[])
+/* A transaction from client <c>: this middleware coordinates it, among the shards it touches */
+void coordinator_start(struct conn *c, struct frame_header *h, char *payload)
 {
-	int sock, clientSocket; 		/* Incoming connections (sock) and communication initialization (clientSocket) */
-	int i, j;
-	char hostName[hostNameLength];		/* Temporary string used to keep IP addresses */
-	struct sockaddr_in clientName;		/* Temporary address structs used during connection initialization */
-	size_t size;
-	fd_set activeFdSet, readFdSet, serverFdSet; 		/* Used by select */
-
-	/* Thread declarations */
-	pthread_t thread[maxConn];
-	pthread_attr_t attr;
-	int thread_counter;				/* Which thread is next to be used */
-	struct thread_data t[maxConn];	/* Data structure to pass to thread handler */
-	pthread_attr_init(&attr);
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-	/* End of thread declarations */
+	uint32_t offsets[maxConn + 1], lengths[maxConn + 1];
+	struct txn *t;
+	int k;
 
-	strcpy(dbServer, "127.0.0.1");
-	j = thread_counter = 0;
-	/* Create a socket and set it up to accept connections */
-	sock = makeSocket(PORT);
-	/* Listen for connection requests from clients */
-	if(listen(sock,3) < 0)
+	t = txn_new(ROLE_COORDINATOR, c, h, payload);
+	if(sequenced)		//Checked and split by the sequencer
+	{
+		coordinator_order(t);
+		return;
+	}
+	t->pieces = malloc(t->length + 1);
+	if(!t->pieces)
 	{
-		perror("Could not listen for connections\n");
+		perror("Could not allocate transaction state\n");
 		exit(EXIT_FAILURE);
 	}
-	/* Initialise the set of active sockets */
-	FD_ZERO(&activeFdSet);
-	FD_ZERO(&readFdSet);
-	FD_ZERO(&processingFdSet);
-	FD_ZERO(&serverFdSet);
-	FD_SET(sock, &activeFdSet);
+	if(shard_split(t->text, t->length, shardCount, myShard, t->pieces, offsets, lengths) < 0)
+	{
+		log_debug("Transaction reads keys of another shard, rejected!\n");
+		counter_add(&aborts[ABORT_REJECTED], 1);
+		client_reply(t, RESULT_ABORTED, "Transaction rejected: an operation reads keys of another shard!\n");
+		txn_free(t);
+		return;
+	}
+	for(k=0; k<shardCount; k++)
+	{
+		if(lengths[k] == 0)
+			continue;
+		t->shards |= 1u << k;
+		if(k == myShard)
+		{
+			t->localOffset = offsets[k];
+			t->localLength = lengths[k];
+			continue;
+		}
+		t->parts[t->partCount].peer = peer_of(k);
+		t->parts[t->partCount].offset = offsets[k];
+		t->parts[t->partCount].length = lengths[k];
+		t->partCount++;
+	}
+	t->readOnly = t->shards && shard_read_only(t->text, t->length);
+	t->onePhase = (t->partCount + (t->localLength > 0) == 1) || t->readOnly;
+	coordinator_attempt(t);
+}
+
+/* Participant: the decision and our database server's vote are both in */
+void participant_apply(struct txn *t)
+{
+	if(t->dbVote != VOTE_YES)
+	{
+		txn_free(t);		//Nothing was prepared there
+		return;
+	}
+	t->dbAcking = 1;
+	if(t->db)
+	{
+		conn_send(t->db, MSG_DECISION, t->requestId, t->traceId, &t->decision, 1);
+		t->state = TX_ACKING;
+	}
+	else
+	{
+		t->state = TX_RESOLVING;		//The link it prepared on is gone
+		t->deadline = t->loop->now;
+	}
+}
 
-	conn_count=argc-1;
+/* Participant: recovery found the outcome of <t>. The coordinator's database server may hold the transaction
+in doubt with nobody left to resolve it, so it is told too (harmless if the coordinator is still around) */
+void participant_recovered(struct txn *t, char decision)
+{
+	int shard;
+
+	log_info("Recovered the outcome of transaction %llu: %s\n", t->txid, (decision == '1') ? "commit" : "abort");
+	t->decided = 1;
+	t->decision = decision;
+	shard = coordinator_shard(t->txid);
+	if(shard != myShard && shard < shardCount && (t->shards & (1u << shard)))
+		txn_notify_start(t, 1u << shard);
+	participant_apply(t);
+}
 
-	/* Copy other middlewares' IP addresses to a global array */
-	while(j<conn_count)
-		strncpy(serverConn[j++], argv[j+1], hostNameLength);
+/* Participant: the coordinator is gone after our database server voted yes. The transaction committed
+if every shard it touches prepared it: ask the others (asking keeps the ones that have not from doing so) */
+void participant_recover(struct txn *t)
+{
+	struct txn_part *p;
+	int k;
 
-	while(1)
+	log_info("Lost the coordinator of transaction %llu, asking the other shards for its outcome\n", t->txid);
+	t->state = TX_RECOVERING;
+	t->partCount = 0;
+	for(k=0; k<shardCount; k++)
 	{
-		/* Block until input arrives on one or more active sockets FD_SETSIZE is a constant with value = 1024 */
-		readFdSet = activeFdSet;
-		if(select(FD_SETSIZE, &readFdSet, NULL, NULL, NULL) <= 0)
-		{
-			perror("Select failed\n");
+		if(k == myShard || !(t->shards & (1u << k)))
 			continue;
-		}
+		p = &t->parts[t->partCount++];
+		p->peer = peer_of(k);
+		p->link = p->query = NULL;
+		p->vote = VOTE_UNKNOWN;
+	}
+	if(t->partCount == 0)
+		participant_recovered(t, '1');
+	else
+		txn_ask(t, 0);
+}
 
-		/* Service all the sockets with input pending */
-		for(i = 0; i < FD_SETSIZE; ++i)
-		{
-			if(FD_ISSET(i, &readFdSet))
-			{
-				/* Incoming connection on original socket */
-				if(i == sock)
-				{
-					size = sizeof(clientName);
-					clientSocket = accept(sock, (struct sockaddr *)&clientName, &size);
-					if(clientSocket < 0)
-					{
-						perror("Could not accept connection\n");
-						exit(EXIT_FAILURE);
-					}
-					strcpy(hostName,inet_ntoa(clientName.sin_addr));
-
-					/* Middleware initiating connection */
-					if((checkArray(serverConn, conn_count, hostName)))
-					{
-						printf("Incoming connection from server %s, port %hd\n", inet_ntoa(clientName.sin_addr), ntohs(clientName.sin_port));
-						FD_SET(clientSocket, &activeFdSet);
-						FD_SET(clientSocket, &serverFdSet);
-					}
-					/* Client initiating connection */
-					else
-					{
-						printf("Incoming connection from client %s, port %hd\n", inet_ntoa(clientName.sin_addr), ntohs(clientName.sin_port));
-						FD_SET(clientSocket, &activeFdSet);
-					}
-				}
-				/* Incoming transaction from a client */
-				else if( (!FD_ISSET(i, &processingFdSet)) && (!FD_ISSET(i, &serverFdSet)) )
-				{
-					t[thread_counter].thread_id=thread_counter;
-					t[thread_counter].socketfd=i;
-					FD_SET(i, &processingFdSet);
-					j = readMessage(i, t[thread_counter].buffer);
-					if(j<0)
-					{
-						perror("Error while trying to read data from client socket!\n");
-						exit(-1);
-					}
-					writeMessage(i, "Transaction accepted, please wait...");
-					pthread_create(&thread[(thread_counter++)%maxConn] , &attr, handle_client, (void *) &t[thread_counter]);
-					thread_counter++;
-					thread_counter%=maxConn;
-				}
-				/* Incoming transaction from another middleware */
-				else if (FD_ISSET(i, &serverFdSet))
-				{
-					t[thread_counter].thread_id=thread_counter;
-					t[thread_counter].socketfd=clientSocket;
-					j = readMessage(i, t[thread_counter].buffer);
-					if( j<0 )
-					{
-						perror("Error while trying to read data from middleware socket!\n");
-						exit(-1);
-					}
-					pthread_create(&thread[thread_counter] , &attr, handle_middleware, (void *) &t[thread_counter]);
-					thread_counter++;
-					thread_counter%=maxConn;
-					FD_CLR(i, &activeFdSet);
-					FD_CLR(i, &serverFdSet);
-				}
-			}
-		}
+/* Participant: the status of <t> at the shard of <p> came back */
+void participant_status(struct txn *t, struct txn_part *p, char status)
+{
+	int i;
+
+	if(status == RESULT_COMMITTED || status == RESULT_ABORTED)		//Somebody decided already
+	{
+		participant_recovered(t, (status == RESULT_COMMITTED) ? '1' : '0');
+		return;
 	}
-	pthread_attr_destroy(&attr);
-	pthread_exit(NULL);
+	if(status == RESULT_PREPARED)
+		p->vote = VOTE_YES;		//Otherwise it is asked again at the next tick
+	for(i=0; i<t->partCount; i++)
+	{
+		if(t->parts[i].vote != VOTE_YES)
+			return;
+	}
+	participant_recovered(t, '1');		//Every shard prepared it
+}
+
+/* Participant: our database server voted, pass the vote on to the coordinator */
+void participant_voted(struct txn *t)
+{
+	char vote[votePayloadSize];
+
+	histogram_since(&phases[PHASE_PARTICIPANT_VOTE], t->phaseUs);
+	t->phaseUs = metrics_now_us();
+	if(t->dbVote == VOTE_YES)
+		log_debug("Locks acquired! (middleware)!\n");
+	else
+		log_debug("Received abort from dbserv, sending abort to coordinator! (middleware)\n");
+	if(t->decided)		//The coordinator has already given up on it
+	{
+		participant_apply(t);
+		return;
+	}
+	if(t->orphaned)		//Nobody to pass it on to
+	{
+		if(t->dbVote == VOTE_YES)
+			participant_recover(t);
+		else
+			txn_free(t);
+		return;
+	}
+	vote[0] = (t->dbVote == VOTE_YES) ? '1' : t->refused ? RESULT_REFUSED : '0';
+	put_u64(vote + 1, (t->dbVote == VOTE_YES) ? t->txid : 0);
+	conn_send(t->origin, MSG_VOTE, t->originId, t->traceId, vote, votePayloadSize);
+	t->state = TX_DECIDING;
+}
+
+/* Participant: the coordinator decided */
+void participant_decision(struct txn *t, char decision)
+{
+	struct loop_state *s = (struct loop_state *) t->loop->data;
+
+	if(t->decided)
+		return;
+	if(t->state == TX_DECIDING)
+		histogram_since(&phases[PHASE_PARTICIPANT_DECISION], t->phaseUs);
+	t->decided = 1;
+	t->decision = decision;
+	trace_event(t->traceId, "decision", "\"decision\":\"%c\"", decision);
+	key_remove(s, &t->keys[1]);
+	if(decision == '1')
+		log_debug("Received COMMIT from coordinator - transmitting to database server (middleware)\n");
+	else
+		log_debug("Received abort from coordinator - aborting!\n");
+	if(t->dbVote != VOTE_PENDING && t->dbVote != VOTE_UNKNOWN)
+		participant_apply(t);
+}
+
+/* Participant: the coordinator hung up before deciding. After a no vote that is an abort; after a yes vote
+(or once one comes) the outcome is recovered from the other shards */
+void participant_orphaned(struct txn *t)
+{
+	struct loop_state *s = (struct loop_state *) t->loop->data;
+
+	if(t->dbVote == VOTE_NO)
+	{
+		participant_decision(t, '0');
+		return;
+	}
+	key_remove(s, &t->keys[1]);
+	if(t->dbVote == VOTE_YES)
+		participant_recover(t);
+	else
+		t->orphaned = 1;
+}
+
+/* A transaction from coordinating middleware <c> (MSG_PREPARE): prepare it at our database server */
+void participant_start(struct conn *c, struct frame_header *h, char *payload)
+{
+	struct loop_state *s = (struct loop_state *) c->loop->data;
+	struct frame_header text;
+	struct txn *t;
+	char vote[votePayloadSize];
+
+	if(h->length < preparePrefixSize)
+	{
+		log_warn("Malformed prepare request, voting abort!\n");
+		vote[0] = '0';
+		put_u64(vote + 1, 0);
+		conn_send(c, MSG_VOTE, h->requestId, h->traceId, vote, votePayloadSize);
+		return;
+	}
+	text = *h;
+	text.length -= preparePrefixSize;
+	t = txn_new(ROLE_PARTICIPANT, c, &text, payload + preparePrefixSize);
+	t->txid = get_u64(payload);
+	t->shards = get_u32(payload + 8);
+	key_insert(s, &t->keys[1], c, h->requestId, t);
+	t->state = TX_VOTING;
+	t->db = pool_link(&s->db);
+	if(!t->db)
+	{
+		log_warn("Database server unreachable!\n");
+		t->dbVote = VOTE_NO;
+		participant_voted(t);
+		return;
+	}
+	txn_renumber(t);		//Our own id towards the database server, the coordinator's is only unique on its connection
+	t->dbVote = VOTE_PENDING;
+	conn_send(t->db, MSG_PREPARE, t->requestId, t->traceId, payload, h->length);
+}
+
+/* A request from coordinating middleware <c> that our database server answers by itself: a single shard transaction
+(run and committed in one go), a status query or a resolve. The answer goes back as it is */
+void participant_relay(struct conn *c, struct frame_header *h, char *payload)
+{
+	struct loop_state *s = (struct loop_state *) c->loop->data;
+	struct txn *t;
+	char outcome;
+
+	t = txn_new(ROLE_PARTICIPANT, c, h, payload);
+	t->decided = 1;
+	t->db = (h->type == MSG_EXECUTE && shard_read_only(t->text, t->length)) ? read_link(s, t) : pool_link(&s->db);
+	if(!t->db)
+	{
+		log_warn("Database server unreachable!\n");
+		outcome = (h->type == MSG_EXECUTE) ? RESULT_ABORTED : RESULT_UNKNOWN;
+		conn_send(c, MSG_RESULT, h->requestId, h->traceId, &outcome, 1);
+		txn_free(t);
+		return;
+	}
+	txn_renumber(t);
+	t->state = TX_EXECUTING;
+	conn_send(t->db, h->type, t->requestId, t->traceId, t->text, t->length);
+}
+
+/* The result of a one-phase transaction came back on its link, <outcome> (RESULT_UNKNOWN if the link broke first) */
+void txn_executed(struct txn *t, char outcome)
+{
+	if(t->role == ROLE_COORDINATOR)
+		coordinator_executed(t, outcome);
+	else
+	{
+		conn_send(t->origin, MSG_RESULT, t->originId, t->traceId, &outcome, 1);
+		txn_free(t);
+	}
+}
+
+/**** Sequencer ****/
+/* Room for <length> more bytes in <p>, which starts with room for the batch id */
+void batch_piece_grow(struct batch_piece *p, uint32_t length)
+{
+	if(p->used == 0)
+		p->used = batchPrefixSize;
+	if(p->used + length <= p->capacity)
+		return;
+	p->capacity = (p->used + length > 2 * p->capacity) ? p->used + length : 2 * p->capacity;
+	p->data = realloc(p->data, p->capacity);
+	if(!p->data)
+	{
+		perror("Could not grow a batch\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Sequencer: add <t> (from a client of ours, or from another middleware with MSG_ORDER) to the open batch,
+which is its place in the global order. Each shard gets the operations on its keys, all of them the same order */
+void sequencer_add(struct txn *t)
+{
+	uint32_t offsets[maxConn + 1], lengths[maxConn + 1];
+	struct batch_piece *p;
+	struct batch *b;
+	int k;
+
+	t->pieces = malloc(t->length + 1);
+	if(!t->pieces)
+	{
+		perror("Could not allocate transaction state\n");
+		exit(EXIT_FAILURE);
+	}
+	/* Nothing in a batch may abort, a shard that could not run its part would break the transaction up */
+	if(shard_check(t->text, t->length, shardCount) < 0 || shard_split(t->text, t->length, shardCount, myShard, t->pieces, offsets, lengths) < 0)
+	{
+		log_debug("Transaction cannot be sequenced, rejected!\n");
+		txn_executed(t, RESULT_ABORTED);
+		return;
+	}
+	if(!openBatch && !(openBatch = calloc(1, sizeof(struct batch))))
+	{
+		perror("Could not allocate a batch\n");
+		exit(EXIT_FAILURE);
+	}
+	b = openBatch;
+	t->shards = 0;
+	for(k=0; k<shardCount; k++)
+	{
+		if(lengths[k] == 0)
+			continue;
+		t->shards |= 1u << k;
+		p = &b->pieces[k];
+		batch_piece_grow(p, 4 + lengths[k]);
+		put_u32(p->data + p->used, lengths[k]);
+		memcpy(p->data + p->used + 4, t->pieces + offsets[k], lengths[k]);
+		p->used += 4 + lengths[k];
+	}
+	if(b->count == b->capacity)
+	{
+		b->capacity = b->capacity ? 2 * b->capacity : 64;
+		b->txns = realloc(b->txns, b->capacity * sizeof(struct txn *));
+		if(!b->txns)
+		{
+			perror("Could not grow a batch\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	b->txns[b->count++] = t;
+	t->state = TX_SEQUENCED;
+}
+
+/* Sequencer: send shard <k> its piece of batch <b>, through its middleware unless it is ours.
+Without a link up it goes at a later tick */
+void sequencer_send(struct loop_state *s, struct batch *b, int k)
+{
+	b->links[k] = (k == myShard) ? pool_link(&s->db) : pool_link(&s->peers[peer_of(k)]);
+	if(b->links[k])
+		conn_send(b->links[k], MSG_SEQUENCE, b->id, 0, b->pieces[k].data, b->pieces[k].used);
+}
+
+/* Sequencer: the transactions that came in during the round make up the next batch. Every shard gets it,
+with nothing for it if need be: a database server runs batch n+1 only after batch n */
+void sequencer_seal(struct loop *l)
+{
+	struct loop_state *s = (struct loop_state *) l->data;
+	struct batch *b, **link;
+	int k;
+
+	b = openBatch;
+	if(!b)
+		return;
+	openBatch = NULL;
+	b->id = ((incarnation & 0xFFFFFFFF) << 32) | ++batchNumber;
+	for(k=0; k<shardCount; k++)
+	{
+		batch_piece_grow(&b->pieces[k], 0);
+		put_u64(b->pieces[k].data, b->id);
+		b->pending |= 1u << k;
+	}
+	for(link = &sentBatches; *link; link = &(*link)->next);
+	*link = b;
+	for(k=0; k<shardCount; k++)
+		sequencer_send(s, b, k);
+}
+
+/* Sequencer: every shard ran batch <b>, so did it its transactions, but for those a shard could not run. One no shard
+ran is aborted; one only some of them ran is neither committed nor aborted, its client is told the outcome is unknown */
+void sequencer_done(struct batch *b)
+{
+	struct batch **link;
+	struct txn *t;
+	int i, k;
+
+	for(link = &sentBatches; *link != b; link = &(*link)->next);
+	*link = b->next;
+	for(i=0; i<b->count; i++)
+	{
+		t = b->txns[i];
+		if(!t->failed)
+			txn_executed(t, RESULT_COMMITTED);
+		else
+		{
+			log_warn("Sequenced transaction %d of batch %u could not run at shards %#x of %#x!\n", i, (unsigned)(b->id & 0xFFFFFFFF), t->failed, t->shards);
+			txn_executed(t, (t->failed == t->shards) ? RESULT_ABORTED : RESULT_UNKNOWN);
+		}
+	}
+	for(k=0; k<shardCount; k++)
+		free(b->pieces[k].data);
+	free(b->txns);
+	free(b);
+}
+
+/* Sequencer: the transactions of batch <b> at positions <positions> (<length> bytes, 4 each) of shard <k>'s piece
+could not run there */
+void sequencer_failed(struct batch *b, int k, const char *positions, uint32_t length)
+{
+	uint32_t position, used;
+	int i;
+
+	for(used = 0; used + 4 <= length; used += 4)
+	{
+		position = get_u32(positions + used);
+		for(i=0; i<b->count; i++)
+		{
+			if(!(b->txns[i]->shards & (1u << k)))
+				continue;
+			if(position-- == 0)
+			{
+				b->txns[i]->failed |= 1u << k;
+				break;
+			}
+		}
+	}
+}
+
+/* Sequencer: a reply on link <c>; returns 0 if it is not about a batch. A batch is acknowledged by the shard
+the link goes to, whichever of its links it went out on, with the transactions it could not run; RESULT_UNKNOWN
+means that shard's middleware could not reach its database server, the piece is sent again */
+int sequencer_reply(struct conn *c, struct frame_header *h, const char *payload)
+{
+	struct loop_state *s = (struct loop_state *) c->loop->data;
+	struct batch *b;
+	int k;
+
+	for(b = sentBatches; b && b->id != h->requestId; b = b->next);
+	if(!b)
+		return 0;
+	k = (c->pool == &s->db) ? myShard : shard_of_peer((int)(c->pool - s->peers));
+	if(!(b->pending & (1u << k)))
+		return 1;
+	b->links[k] = NULL;
+	if(h->type == MSG_ACK)
+	{
+		sequencer_failed(b, k, payload, h->length);
+		b->pending &= ~(1u << k);
+		if(b->pending == 0)
+			sequencer_done(b);
+	}
+	return 1;
+}
+
+/* Sequencer: send again the batch pieces whose link broke, oldest batch first */
+void sequencer_resend(struct loop_state *s)
+{
+	struct batch *b;
+	int k;
+
+	for(b = sentBatches; b; b = b->next)
+	{
+		for(k=0; k<shardCount; k++)
+		{
+			if((b->pending & (1u << k)) && !b->links[k])
+				sequencer_send(s, b, k);
+		}
+	}
+}
+/**** End of sequencer ****/
+
+/**** Deadlock detector ****/
+/* Link to the database server of shard <k>, ours directly and the others through their middleware */
+struct conn * detector_link(struct loop_state *s, int k)
+{
+	return (k == myShard) ? pool_link(&s->db) : pool_link(&s->peers[peer_of(k)]);
+}
+
+/* Start a round: ask every shard for its wait-for edges. A round that did not complete by the next tick
+is dropped, answers to it are ignored */
+void detector_start(struct loop_state *s)
+{
+	struct conn *link;
+	int k;
+
+	waitsRound = new_request_id();
+	waitsPending = 0;
+	waitEdgeCount = 0;
+	for(k=0; k<shardCount; k++)
+	{
+		if(!(link = detector_link(s, k)))
+			continue;		//Its edges are missing this round, cycles through it wait for the next
+		conn_send(link, MSG_WAITS, waitsRound, 0, NULL, 0);
+		waitsPending |= 1u << k;
+	}
+}
+
+/* Every shard's edges are in: break each cycle by breaking off the lock waits of its youngest transaction,
+which then aborts (and its coordinator tries it again) */
+void detector_check(struct loop_state *s)
+{
+	struct deadlock_victim victims[maxDeadlockVictims];
+	char payload[breakPayloadSize];
+	struct conn *link;
+	int i, k, count;
+
+	count = deadlock_victims(waitEdges, waitEdgeCount, victims, maxDeadlockVictims);
+	for(i=0; i<count; i++)
+	{
+		log_info("Deadlock found, aborting transaction %llu, the youngest in the cycle!\n", (unsigned long long)victims[i].txid);
+		counter_add(&deadlockVictims, 1);
+		put_u64(payload, victims[i].txid);
+		for(k=0; k<shardCount; k++)
+		{
+			if((victims[i].shards & (1u << k)) && (link = detector_link(s, k)))
+				conn_send(link, MSG_BREAK, new_request_id(), 0, payload, breakPayloadSize);
+		}
+	}
+	if(count > 0)
+		detector_start(s);		//Deadlocks come in bunches under contention, look again right away
+}
+
+/* Deadlock detector: a reply on link <c>; returns 0 if it is not about the current round. A shard whose
+middleware could not reach its database server answers RESULT_UNKNOWN instead, without edges */
+int detector_reply(struct conn *c, struct frame_header *h, const char *payload)
+{
+	struct loop_state *s = (struct loop_state *) c->loop->data;
+	uint32_t i, count;
+	struct wait_edge *e;
+	int k;
+
+	if(h->requestId != waitsRound || (h->type != MSG_WAITS && h->type != MSG_RESULT))
+		return 0;
+	k = (c->pool == &s->db) ? myShard : shard_of_peer((int)(c->pool - s->peers));
+	if(!(waitsPending & (1u << k)))
+		return 1;
+	waitsPending &= ~(1u << k);
+	count = (h->type == MSG_WAITS) ? h->length / waitEdgeSize : 0;
+	if(waitEdgeCount + count > (uint32_t)waitEdgeCapacity)
+	{
+		waitEdgeCapacity = waitEdgeCount + count + 1024;
+		waitEdges = realloc(waitEdges, waitEdgeCapacity * sizeof(struct wait_edge));
+		if(!waitEdges)
+		{
+			perror("Could not allocate wait-for edges\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for(i=0; i<count; i++)
+	{
+		e = &waitEdges[waitEdgeCount++];
+		e->waiter = get_u64(payload + i * waitEdgeSize);
+		e->holder = get_u64(payload + i * waitEdgeSize + 8);
+		e->age = get_u32(payload + i * waitEdgeSize + 16);
+		e->shard = k;
+	}
+	if(waitsPending == 0)
+		detector_check(s);
+	return 1;
+}
+/**** End of deadlock detector ****/
+
+/* The vote of our database server arrived for <t> */
+void txn_db_vote(struct txn *t, int vote)
+{
+	t->dbVote = vote;
+	if(t->role == ROLE_PARTICIPANT)
+		participant_voted(t);
+	else
+	{
+		if(vote == VOTE_YES)
+			log_debug("Locks acquired! (client)!\n");
+		else
+			log_debug("Received abort from dbserv! (client)\n");
+		coordinator_check(t);
+	}
+}
+
+/* A status query for <t> was answered on <c> with <status> */
+void txn_status(struct txn *t, struct conn *c, char status)
+{
+	struct txn_part *p;
+	int i, vote;
+
+	if(status == RESULT_PREPARED || status == RESULT_COMMITTED)
+		vote = VOTE_YES;
+	else if(status == RESULT_ABORTED)
+		vote = VOTE_NO;
+	else
+		vote = VOTE_UNKNOWN;		//Its middleware could not ask, asked again later
+	if(c == t->dbQuery && t->state == TX_VOTING && (t->dbVote == VOTE_PENDING || t->dbVote == VOTE_UNKNOWN))
+	{
+		t->dbQuery = NULL;
+		if(vote != VOTE_UNKNOWN)
+			txn_db_vote(t, vote);
+		return;
+	}
+	for(i=0; i<t->partCount; i++)
+	{
+		p = &t->parts[i];
+		if(c != p->query || (p->vote != VOTE_PENDING && p->vote != VOTE_UNKNOWN))
+			continue;
+		p->query = NULL;
+		if(t->state == TX_RECOVERING)
+			participant_status(t, p, status);
+		else if(t->state == TX_VOTING && vote != VOTE_UNKNOWN)
+		{
+			p->vote = vote;
+			coordinator_check(t);
+		}
+		return;
+	}
+}
+
+/* A reply on link <c> */
+void link_reply(struct conn *c, struct frame_header *h, char *payload)
+{
+	struct txn *t;
+	int i;
+
+	if(sequencer && (h->type == MSG_ACK || h->type == MSG_RESULT) && sequencer_reply(c, h, payload))
+		return;
+	if(detector && detector_reply(c, h, payload))
+		return;
+	t = key_find((struct loop_state *) c->loop->data, NULL, h->requestId);
+	if(!t)
+		return;		//Ping answers, replies to an attempt that is over
+	if(t->state == TX_EXECUTING)
+	{
+		if(h->type == MSG_RESULT && h->length >= 1 && payload[0] == RESULT_STALE && t->role == ROLE_PARTICIPANT)
+		{
+			/* Our replica is too far behind: read at our database server, the coordinator need not know */
+			t->primary = 1;
+			if((t->db = pool_link(&((struct loop_state *) c->loop->data)->db)))
+			{
+				txn_renumber(t);
+				conn_send(t->db, MSG_EXECUTE, t->requestId, t->traceId, t->text, t->length);
+				return;
+			}
+			payload[0] = RESULT_ABORTED;		//Read again from the start
+		}
+		if(t->role == ROLE_PARTICIPANT)		//Relayed as it is
+		{
+			conn_send(t->origin, h->type, t->originId, t->traceId, payload, h->length);
+			txn_free(t);
+		}
+		else if(h->type == MSG_RESULT && h->length >= 1)
+		{
+			if(h->length >= resultLagSize && payload[0] == RESULT_COMMITTED)		//Read at a replica
+			{
+				t->replicaRead = 1;
+				if(get_u32(payload + 1) > t->lagMs)
+					t->lagMs = get_u32(payload + 1);
+			}
+			coordinator_result(t, c, payload[0]);
+		}
+		return;
+	}
+	if(h->type == MSG_RESULT)
+	{
+		if(h->length >= 1)
+			txn_status(t, c, payload[0]);
+		return;
+	}
+	if(c == t->db)
+	{
+		if(h->type == MSG_VOTE && t->state == TX_VOTING && t->dbVote == VOTE_PENDING)
+		{
+			t->refused |= (h->length >= 1 && payload[0] == RESULT_REFUSED);
+			txn_db_vote(t, (h->length == votePayloadSize && payload[0] == '1') ? VOTE_YES : VOTE_NO);
+		}
+		else if(h->type == MSG_ACK && t->dbAcking)
+		{
+			t->dbAcking = 0;
+			if(t->role == ROLE_COORDINATOR)
+				coordinator_acked(t);
+			else
+			{
+				conn_send(t->origin, MSG_ACK, t->originId, t->traceId, NULL, 0);		//Unless it hung up
+				txn_free(t);
+			}
+		}
+		return;
+	}
+	for(i=0; i<t->partCount; i++)
+	{
+		if(c != t->parts[i].link)
+			continue;
+		if(h->type == MSG_VOTE && t->state == TX_VOTING && t->parts[i].vote == VOTE_PENDING)
+		{
+			t->parts[i].vote = (h->length >= 1 && payload[0] == '1') ? VOTE_YES : VOTE_NO;
+			t->refused |= (h->length >= 1 && payload[0] == RESULT_REFUSED);
+			coordinator_check(t);
+			return;
+		}
+		if(h->type == MSG_ACK && t->parts[i].acking)
+		{
+			t->parts[i].acking = 0;
+			coordinator_acked(t);
+			return;
+		}
+	}
+}
+
+/* Link <c> broke: nothing waited for on it will come. A vote that was on its way may still have been a yes,
+so it is asked for instead of being taken as a no */
+void link_failed(struct conn *c)
+{
+	struct loop_state *s = (struct loop_state *) c->loop->data;
+	struct txn *t, *next;
+	struct txn_part *p;
+	struct batch *b;
+	int i, acked, lost;
+
+	link_down(c);		//First, so no retry picks it again
+	for(b = sentBatches; b; b = b->next)
+	{
+		for(i=0; i<shardCount; i++)
+		{
+			if(b->links[i] == c)
+				b->links[i] = NULL;		//Sent again at the next tick
+		}
+	}
+	for(t = s->live; t; t = next)
+	{
+		next = t->next;
+		acked = 0;
+		if(t->state == TX_EXECUTING)
+		{
+			lost = (t->db == c);
+			for(i=0; i<t->partCount; i++)
+				lost |= (t->parts[i].link == c);
+			if(lost && t->role == ROLE_COORDINATOR)
+				coordinator_result(t, c, RESULT_UNKNOWN);
+			else if(lost)
+				txn_executed(t, RESULT_UNKNOWN);
+			continue;
+		}
+		if(t->dbQuery == c)
+			t->dbQuery = NULL;
+		for(i=0; i<t->partCount; i++)
+		{
+			p = &t->parts[i];
+			if(p->query == c)
+				p->query = NULL;
+			if(p->link == c)
+			{
+				p->link = NULL;		//Reconnected, the same structure would take the decision to the wrong place
+				if(p->vote == VOTE_PENDING)
+					p->vote = VOTE_UNKNOWN;
+				if(p->acking)		//Whether the decision got there is unknown, its database server is told again
+				{
+					p->acking = 0;
+					acked = 1;
+					txn_notify_start(t, 1u << shard_of_peer(p->peer));
+				}
+			}
+		}
+		if(t->db == c)
+		{
+			t->db = NULL;
+			if(t->state == TX_VOTING && t->dbVote == VOTE_PENDING)
+				t->dbVote = VOTE_UNKNOWN;
+			else if(t->dbAcking)
+			{
+				t->state = TX_RESOLVING;
+				t->deadline = c->loop->now;
+			}
+		}
+		if(t->state == TX_VOTING || t->state == TX_RECOVERING)
+			txn_ask(t, 0);
+		else if(acked)
+			coordinator_acked(t);
+	}
+}
+
+/**** Event loop handlers ****/
+void middleware_accept(struct loop *l, int socketfd, struct sockaddr_in *address)
+{
+	char hostName[hostNameLength];		/* Temporary string used to keep IP addresses */
+
+	strncpy(hostName, inet_ntoa(address->sin_addr), hostNameLength);
+	hostName[hostNameLength - 1] = '\0';
+	/* Middleware initiating connection */
+	if((checkArray(serverConn, conn_count, hostName)))
+	{
+		log_info("Incoming connection from server %s, port %hd\n", hostName, ntohs(address->sin_port));
+		conn_new(l, socketfd, CONN_PEER);
+	}
+	/* Client initiating connection */
+	else
+	{
+		log_info("Incoming connection from client %s, port %hd\n", hostName, ntohs(address->sin_port));
+		conn_new(l, socketfd, CONN_CLIENT);
+	}
+}
+
+void middleware_frame(struct conn *c, struct frame_header *h, char *payload)
+{
+	struct txn *t;
+	char outcome;
+
+	trace_event(h->traceId, "receive", "\"type\":\"%s\",\"request\":%llu", frame_type_name(h->type), (unsigned long long)h->requestId);
+	if(c->kind == CONN_LINK)
+	{
+		link_reply(c, h, payload);
+		return;
+	}
+	switch(h->type)
+	{
+	case MSG_TRANSACTION:
+		if(c->kind == CONN_CLIENT)
+			coordinator_start(c, h, payload);
+		break;
+	case MSG_PREPARE:
+		if(c->kind == CONN_PEER)
+			participant_start(c, h, payload);
+		break;
+	case MSG_EXECUTE:
+	case MSG_STATUS:
+	case MSG_RESOLVE:
+	case MSG_SEQUENCE:
+	case MSG_WAITS:
+	case MSG_BREAK:
+		if(c->kind == CONN_PEER)
+			participant_relay(c, h, payload);
+		break;
+	case MSG_ORDER:
+		if(c->kind == CONN_PEER && sequencer)
+			sequencer_add(txn_new(ROLE_PARTICIPANT, c, h, payload));
+		else if(c->kind == CONN_PEER)
+		{
+			log_warn("Transaction to put in order, but we are not the sequencer!\n");
+			outcome = RESULT_ABORTED;
+			conn_send(c, MSG_RESULT, h->requestId, h->traceId, &outcome, 1);
+		}
+		break;
+	case MSG_DECISION:		//For a transaction we are participating in
+		t = (c->kind == CONN_PEER) ? key_find((struct loop_state *) c->loop->data, c, h->requestId) : NULL;
+		if(t)
+			participant_decision(t, (h->length > 0 && payload[0] == '1') ? '1' : '0');
+		else
+			log_warn("Decision for unknown transaction %llu, ignored\n", (unsigned long long)h->requestId);
+		break;
+	case MSG_PING:
+		conn_send(c, MSG_ACK, h->requestId, h->traceId, NULL, 0);
+		break;
+	default:
+		log_warn("Unexpected message type %d, ignored\n", h->type);
+	}
+}
+
+void middleware_close(struct conn *c)
+{
+	struct loop_state *s = (struct loop_state *) c->loop->data;
+	struct txn *t, *next;
+
+	if(c->kind == CONN_LINK)
+	{
+		link_failed(c);
+		return;
+	}
+	/* Hung up: its transactions finish without it (held by one more reference meanwhile).
+	Participants still waiting for a decision from it find out the outcome by themselves */
+	c->closed = 1;
+	c->inFlight++;
+	if(c->kind == CONN_PEER)
+	{
+		for(t = s->live; t; t = next)
+		{
+			next = t->next;
+			if(t->role == ROLE_PARTICIPANT && t->origin == c && !t->decided && !t->orphaned)
+				participant_orphaned(t);
+		}
+	}
+	conn_put(c);
+}
+
+/* Timers: vote timeouts, status queries, resolve attempts and retries, then the health of the links */
+void middleware_tick(struct loop *l)
+{
+	struct loop_state *s = (struct loop_state *) l->data;
+	struct txn *t, *next;
+	int i;
+
+	for(t = s->live; t; t = next)
+	{
+		next = t->next;
+		if(t->state == TX_NOTIFYING)
+			txn_notify(t);
+		else if(t->state == TX_VOTING && t->role == ROLE_COORDINATOR)
+			coordinator_check(t);		//Asks for lost votes as soon as it can, for all of them at the deadline
+		else if(l->now < t->deadline)
+			continue;
+		else if(t->state == TX_VOTING || t->state == TX_RECOVERING)
+		{
+			t->deadline = l->now + reconnectDelayMs;		//Unanswered queries are sent again by then
+			txn_ask(t, t->state == TX_RECOVERING);		//A participant does not fence its own vote
+		}
+		else if(t->state == TX_RESOLVING)
+			txn_resolve(t);
+		else if(t->state == TX_RETRY)
+			coordinator_attempt(t);
+	}
+	if(sequencer)
+		sequencer_resend(s);
+	if(detector && l == &loops[0])
+		detector_start(s);
+	pool_tick(&s->db);
+	for(i=0; i<conn_count; i++)
+		pool_tick(&s->peers[i]);
+	for(i=0; i<replicaCount; i++)
+		pool_tick(&s->replicas[i]);
+}
+
+/* End of a round: the sequencer closes the batch of what came in during it */
+void middleware_round(struct loop *l)
+{
+	if(sequencer)
+		sequencer_seal(l);
+}
+/**** End of event loop handlers ****/
+
+/* Count this start in the incarnation file of our shard and return the new count. The first start counts from the clock,
+so ids stay ahead of a run whose file was lost. The count is on disk before any id made from it goes out: a restart,
+however soon, never hands out the batch or transaction ids of an earlier one */
+uint64_t incarnation_next(void)
+{
+	char path[64], tempPath[80];
+	unsigned long long last;
+	FILE *f;
+	int dir;
+
+	snprintf(path, sizeof(path), INCARNATION_FILE, myShard);
+	last = (unsigned long long)time(NULL) - 1;
+	if((f = fopen(path, "r")))
+	{
+		if(fscanf(f, "%llu", &last) != 1)
+		{
+			fprintf(stderr, "Corrupt incarnation file %s\n", path);
+			exit(EXIT_FAILURE);
+		}
+		fclose(f);
+	}
+	else if(errno != ENOENT)
+	{
+		perror("Could not read the incarnation file\n");
+		exit(EXIT_FAILURE);
+	}
+	snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+	f = fopen(tempPath, "w");
+	if(!f || fprintf(f, "%llu\n", last + 1) < 0 || fflush(f) != 0 || fsync(fileno(f)) != 0)
+	{
+		perror("Could not write the incarnation file\n");
+		exit(EXIT_FAILURE);
+	}
+	fclose(f);
+	if(rename(tempPath, path) != 0 || (dir = open(".", O_RDONLY)) < 0 || fsync(dir) != 0)
+	{
+		perror("Could not install the incarnation file\n");
+		exit(EXIT_FAILURE);
+	}
+	close(dir);
+	return last + 1;
+}
+
+int main(int argc, char *argv[])
+{
+	int sock; 		/* Listening socket of an event loop */
+	int i, j, opt, level = defaultLogLevel, metricsPort = defaultMetricsPort;
+	char *tracePath = NULL;
+	struct loop_state *s;
+
+	loopCount = sysconf(_SC_NPROCESSORS_ONLN);
+	if(loopCount > defaultLoops)
+		loopCount = defaultLoops;
+	myShard = 0;
+	voteTimeoutMs = defaultVoteTimeoutMs;
+	while((opt = getopt(argc, argv, "t:i:sr:u:v:m:T:w:")) != -1)
+	{
+		switch(opt)
+		{
+		case 't':
+			loopCount = atoi(optarg);
+			break;
+		case 'i':
+			myShard = atoi(optarg);
+			break;
+		case 's':
+			sequenced = 1;
+			break;
+		case 'r':
+			if(replicaCount == maxReplicas)
+			{
+				fprintf(stderr, "At most %d replicas\n", maxReplicas);
+				exit(EXIT_FAILURE);
+			}
+			strncpy(replicaServers[replicaCount], optarg, hostNameLength);
+			replicaServers[replicaCount][hostNameLength - 1] = '\0';
+			replicaCount++;
+			break;
+		case 'v':
+			if((level = log_level_of(optarg)) < 0)
+			{
+				fprintf(stderr, "Unknown log level %s (error, warn, info or debug)\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'u':
+			if(strlen(optarg) >= sizeof(dbLocalAddress.sun_path))
+			{
+				fprintf(stderr, "Local socket path %s is too long\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			dbLocalAddress.sun_family = AF_UNIX;
+			strcpy(dbLocalAddress.sun_path, optarg);
+			break;
+		case 'm':
+			metricsPort = atoi(optarg);
+			break;
+		case 'T':
+			tracePath = optarg;
+			break;
+		case 'w':
+			voteTimeoutMs = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-t event loop threads] [-i our shard] [-s (every middleware, or none)] [-r replica of our database server ...] [-u local socket of our database server] [-v error|warn|info|debug] [-m metrics port, 0 for none] [-T trace file] [-w vote timeout ms] [other middleware ...]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(loopCount < 1)
+		loopCount = 1;
+	if(loopCount > maxLoops)
+		loopCount = maxLoops;
+
+	log_init(level);
+	if(tracePath)
+		trace_open(tracePath, "middleware");
+	signal(SIGPIPE, SIG_IGN);		/* Peers hanging up show up as failed writes instead */
+	strcpy(dbServer, "127.0.0.1");
+
+	conn_count = argc - optind;
+	if(conn_count > maxConn)
+	{
+		fprintf(stderr, "At most %d other middlewares\n", maxConn);
+		exit(EXIT_FAILURE);
+	}
+	/* The shards are numbered in the order of the middlewares, with us inserted at our own shard:
+	every middleware is given the others in the same order */
+	shardCount = conn_count + 1;
+	if(myShard < 0 || myShard >= shardCount)
+	{
+		fprintf(stderr, "Our shard has to be between 0 and %d\n", conn_count);
+		exit(EXIT_FAILURE);
+	}
+	incarnation = incarnation_next();
+	/* Copy other middlewares' IP addresses to a global array, and resolve every address once */
+	for(j=0; j<conn_count; j++)
+	{
+		strncpy(serverConn[j], argv[optind + j], hostNameLength);
+		serverConn[j][hostNameLength - 1] = '\0';
+		initSocketAddress(&serverAddress[j], serverConn[j], PORT);
+	}
+	initSocketAddress(&dbAddress, dbServer, PORT_DB);
+	for(j=0; j<replicaCount; j++)
+		initSocketAddress(&replicaAddress[j], replicaServers[j], PORT_DB);
+	/* The sequencer's batches are cut at the end of a loop round, there is one loop to do it on */
+	sequencer = sequenced && myShard == sequencerShard;
+	if(sequencer)
+		loopCount = 1;
+	/* Locks are only waited for across shards in two-phase commit: a transaction of one shard takes its locks in key order */
+	detector = !sequenced && shardCount > 1 && myShard == deadlockShard;
+
+	loopHandlers.accept = middleware_accept;
+	loopHandlers.frame = middleware_frame;
+	loopHandlers.close = middleware_close;
+	loopHandlers.tick = middleware_tick;
+	loopHandlers.round = middleware_round;
+	for(i=0; i<loopCount; i++)
+	{
+		/* Create a socket and set it up to accept connections */
+		sock = makeSocket(PORT);
+		if(listen(sock, SOMAXCONN) < 0)
+		{
+			perror("Could not listen for connections\n");
+			exit(EXIT_FAILURE);
+		}
+		s = &states[i];
+		loop_init(&loops[i], i, sock);
+		loops[i].data = s;
+		/* Long-lived connections of this loop to the database server and the other middlewares */
+		if(dbLocalAddress.sun_family == AF_UNIX)		//Next to us: no TCP stack in the way
+			pool_init(&s->db, &loops[i], "database server", (struct sockaddr *)&dbLocalAddress, sizeof(dbLocalAddress));
+		else
+			pool_init(&s->db, &loops[i], "database server", (struct sockaddr *)&dbAddress, sizeof(dbAddress));
+		for(j=0; j<conn_count; j++)
+			pool_init(&s->peers[j], &loops[i], serverConn[j], (struct sockaddr *)&serverAddress[j], sizeof(serverAddress[j]));
+		for(j=0; j<replicaCount; j++)
+			pool_init(&s->replicas[j], &loops[i], replicaServers[j], (struct sockaddr *)&replicaAddress[j], sizeof(replicaAddress[j]));
+	}
+	metrics_counter(&commits);
+	for(i=0; i<abortReasons; i++)
+		metrics_counter(&aborts[i]);
+	for(i=0; i<retryReasons; i++)
+		metrics_counter(&retries[i]);
+	metrics_counter(&deadlockVictims);
+	for(i=0; i<phaseCount; i++)
+		metrics_histogram(&phases[i]);
+	metrics_start(metricsPort);
+	log_info("Shard %d of %d%s, listening for connections on %d event loops...\n", myShard, shardCount,
+		sequencer ? " (sequencer)" : (sequenced ? " (sequenced)" : ""), loopCount);
+	for(i=1; i<loopCount; i++)
+		loop_start(&loops[i]);
+	loop_run(&loops[0]);
+	return 0;
 }
@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include "pool.h"
+#include "log.h"
+
+/* Start connecting link <c>, the loop finishes the job when the socket turns writable */
+static void link_connect(struct conn *c)
+{
+	int sock, one = 1;
+
+	sock = socket(c->pool->address.ss_family, SOCK_STREAM, 0);
+	if(sock < 0)
+	{
+		perror("Could not create a socket\n");
+		exit(EXIT_FAILURE);
+	}
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+	if(c->pool->address.ss_family == AF_INET)
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if(connect(sock, (struct sockaddr *)&c->pool->address, c->pool->addressLength) < 0 && errno != EINPROGRESS)
+	{
+		close(sock);
+		c->retryAt = c->loop->now + reconnectDelayMs;
+		return;
+	}
+	c->socketfd = sock;
+	c->connecting = 1;
+	c->connectStart = c->loop->now;
+	conn_watch(c);
+}
+
+/* The connect of link <c> finished, one way or the other */
+void link_connected(struct conn *c)
+{
+	int error = 0;
+	socklen_t size = sizeof(error);
+
+	c->connecting = 0;
+	if(getsockopt(c->socketfd, SOL_SOCKET, SO_ERROR, &error, &size) < 0 || error != 0)
+	{
+		conn_close(c);
+		return;
+	}
+	conn_watch(c);
+	c->up = 1;
+	c->lastHeard = c->pingSent = c->loop->now;
+	log_info("Connected to %s\n", c->pool->name);
+}
+
+/* Link <c> was closed: the middleware has failed whatever waited on it, connect again in a while */
+void link_down(struct conn *c)
+{
+	if(c->up)
+		log_info("Lost connection to %s\n", c->pool->name);
+	c->up = 0;
+	c->retryAt = c->loop->now + reconnectDelayMs;
+}
+
+/* Set up pool <p> of links from loop <l> to <address> (<length> bytes, resolved by the caller, once) and start connecting */
+void pool_init(struct pool *p, struct loop *l, const char *name, const struct sockaddr *address, socklen_t length)
+{
+	int i;
+
+	strncpy(p->name, name, sizeof(p->name));
+	p->name[sizeof(p->name) - 1] = '\0';
+	memcpy(&p->address, address, length);
+	p->addressLength = length;
+	p->next = 0;
+	for(i=0; i<poolLinks; i++)
+	{
+		p->links[i] = conn_new(l, -1, CONN_LINK);
+		p->links[i]->pool = p;
+		link_connect(p->links[i]);
+	}
+}
+
+/* Next link of <p> that is up, NULL if the destination cannot be reached right now */
+struct conn * pool_link(struct pool *p)
+{
+	struct conn *c;
+	int i;
+
+	for(i=0; i<poolLinks; i++)
+	{
+		c = p->links[p->next++ % poolLinks];
+		if(c->up)
+			return c;
+	}
+	return NULL;
+}
+
+/* Timers of <p>'s links: reconnect the ones that are down, ping the quiet ones, drop the silent ones */
+void pool_tick(struct pool *p)
+{
+	struct conn *c;
+	uint64_t now;
+	int i;
+
+	for(i=0; i<poolLinks; i++)
+	{
+		c = p->links[i];
+		now = c->loop->now;
+		if(c->socketfd < 0)
+		{
+			if(now >= c->retryAt)
+				link_connect(c);
+		}
+		else if(c->connecting)
+		{
+			if(now - c->connectStart > healthTimeoutMs)
+				conn_close(c);
+		}
+		else if(now - c->lastHeard > healthTimeoutMs)
+		{
+			log_warn("No answer from %s, reconnecting\n", p->name);
+			conn_close(c);
+		}
+		else if(now - c->lastHeard >= healthIntervalMs && now - c->pingSent >= healthIntervalMs)
+		{
+			conn_send(c, MSG_PING, 0, 0, NULL, 0);
+			c->pingSent = now;
+		}
+	}
+}
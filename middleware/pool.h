@@ -0,0 +1,38 @@
+/*
+ * pool.h
+ *
+ * Long-lived connections from the middleware to the database server and to the
+ * other middlewares. Each destination is resolved once and every event loop
+ * keeps a few connections (links) to it that all of the loop's transactions
+ * share: requests are told apart by their request id. Idle links are pinged,
+ * a link that stops answering is dropped and reconnected in the background.
+ */
+
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "loop.h"
+
+#define poolLinks 2					/* Connections each event loop keeps open to each destination */
+#define healthIntervalMs 1000		/* An idle link is pinged this often */
+#define healthTimeoutMs 3000		/* A link that has not been heard from (or connected) for this long is dropped */
+#define reconnectDelayMs 1000
+
+struct pool
+{
+	char name[64];
+	struct sockaddr_storage address;	/* Resolved once: TCP, or a local (AF_UNIX) socket */
+	socklen_t addressLength;
+	struct conn *links[poolLinks];
+	unsigned int next;				/* Round robin over the links */
+};
+
+void pool_init(struct pool *p, struct loop *l, const char *name, const struct sockaddr *address, socklen_t length);
+struct conn * pool_link(struct pool *p);
+void pool_tick(struct pool *p);
+void link_connected(struct conn *c);
+void link_down(struct conn *c);
+
+#endif /* POOL_H_ */
@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include "shard.h"
+
+#define lineShardNone -1			/* The line touches no key, the database servers would skip it anyway */
+#define lineShardCross -2			/* The line reads a key of another shard than the one it writes */
+
+/* Shard of key <key> (<length> bytes) */
+unsigned int shard_of(const char *key, int length, int shards)
+{
+	uint32_t h = 2166136261u;		//FNV-1a
+	int i;
+
+	for(i=0; i<length && key[i] != shardTag; i++)
+	{
+		h ^= (unsigned char)key[i];
+		h *= 16777619u;
+	}
+	return h % shards;
+}
+
+/* Cut line <line> (<length> bytes) into at most 4 words; returns how many */
+static int line_words(const char *line, int length, const char **words, int *sizes)
+{
+	int i, n;
+
+	n = 0;
+	i = 0;
+	while(i < length && n < 4)
+	{
+		while(i < length && isspace((unsigned char)line[i]))
+			i++;
+		if(i == length)
+			break;
+		words[n] = line + i;
+		while(i < length && !isspace((unsigned char)line[i]))
+			i++;
+		sizes[n] = (int)(line + i - words[n]);
+		n++;
+	}
+	return n;
+}
+
+static int word_is(const char *word, int size, const char *name)
+{
+	return size == (int)strlen(name) && !memcmp(word, name, size);
+}
+
+/* Shard of one operation line (<line>, <length> bytes), see lineShard*.
+An operation goes where its target key lives; a malformed one to <home>, whose database server rejects it */
+static int line_shard(const char *line, int length, int shards, int home)
+{
+	const char *words[4];
+	int sizes[4];
+	int i, n, shard;
+
+	n = line_words(line, length, words, sizes);
+	if(n == 0)
+		return lineShardNone;
+	if( !word_is(words[0], sizes[0], "ASSIGN") && !word_is(words[0], sizes[0], "ADD") && !word_is(words[0], sizes[0], "INCR") &&
+		!word_is(words[0], sizes[0], "PRINT") )
+		return lineShardNone;
+	if(n < 2 || !isalpha((unsigned char)words[1][0]))
+		return home;
+	shard = shard_of(words[1], sizes[1], shards);
+	/* Values only flow within a shard: the operands ADD reads have to live with its target */
+	for(i=2; i<n; i++)
+	{
+		if(isalpha((unsigned char)words[i][0]) && (int)shard_of(words[i], sizes[i], shards) != shard)
+			return lineShardCross;
+	}
+	return shard;
+}
+
+/* Is <word> (<size> bytes) a key name as the database servers take it */
+static int is_key(const char *word, int size)
+{
+	int i;
+
+	if(size == 0 || size > shardMaxKeyLength || !isalpha((unsigned char)word[0]))
+		return 0;
+	for(i=1; i<size; i++)
+	{
+		if(!isalnum((unsigned char)word[i]) && !strchr("_.:-", word[i]))
+			return 0;
+	}
+	return 1;
+}
+
+static int is_literal(const char *word, int size)
+{
+	int i;
+
+	if(size == 0 || size > 18)
+		return 0;
+	for(i=0; i<size; i++)
+	{
+		if(!isdigit((unsigned char)word[i]))
+			return 0;
+	}
+	return 1;
+}
+
+/* A literal with an optional minus sign, as INCR takes them */
+static int is_signed(const char *word, int size)
+{
+	if(size > 1 && word[0] == '-')
+		return is_literal(word + 1, size - 1);
+	return is_literal(word, size);
+}
+
+/* Will the database servers run every operation of transaction <text> (<length> bytes) as it is: the operations
+follow their grammar, no INCR has a bound it could be refused for, and no shard's piece names more than shardMaxKeys keys
+(repeats counted, so this is on the safe side). Returns 0 if so, -1 if some shard could refuse its piece */
+int shard_check(const char *text, uint32_t length, int shards)
+{
+	const char *words[4];
+	int sizes[4];
+	int keys[32];		//Per shard, there are at most as many as a shard mask has bits
+	uint32_t start, end;
+	int k, n, shard;
+
+	for(k=0; k<shards; k++)
+		keys[k] = 0;
+	for(start = 0; start < length; start = end + 1)
+	{
+		for(end = start; end < length && text[end] != '\n'; end++);
+		n = line_words(text + start, end - start, words, sizes);
+		if(n == 0)
+			continue;
+		if(word_is(words[0], sizes[0], "ASSIGN"))
+		{
+			if(n < 3 || !is_key(words[1], sizes[1]) || !is_literal(words[2], sizes[2]))
+				return -1;
+		}
+		else if(word_is(words[0], sizes[0], "ADD"))
+		{
+			if(n < 4 || !is_key(words[1], sizes[1]))
+				return -1;
+			if(!is_key(words[2], sizes[2]) && !is_literal(words[2], sizes[2]))
+				return -1;
+			if(!is_key(words[3], sizes[3]) && !is_literal(words[3], sizes[3]))
+				return -1;
+		}
+		else if(word_is(words[0], sizes[0], "INCR"))
+		{
+			if(n != 3 || !is_key(words[1], sizes[1]) || !is_signed(words[2], sizes[2]))
+				return -1;
+		}
+		else if(word_is(words[0], sizes[0], "PRINT"))
+		{
+			if(n < 2 || !is_key(words[1], sizes[1]))
+				return -1;
+		}
+		else
+			continue;
+		shard = shard_of(words[1], sizes[1], shards);
+		for(k=1; k<n; k++)
+			keys[shard] += is_key(words[k], sizes[k]);
+		if(keys[shard] > shardMaxKeys)
+			return -1;
+	}
+	return 0;
+}
+
+/* Does transaction <text> (<length> bytes) write nothing, so each shard can read its piece from a snapshot */
+int shard_read_only(const char *text, uint32_t length)
+{
+	const char *words[4];
+	int sizes[4];
+	uint32_t start, end;
+
+	for(start = 0; start < length; start = end + 1)
+	{
+		for(end = start; end < length && text[end] != '\n'; end++);
+		if(line_words(text + start, end - start, words, sizes) > 0 &&
+			(word_is(words[0], sizes[0], "ASSIGN") || word_is(words[0], sizes[0], "ADD") || word_is(words[0], sizes[0], "INCR")))
+			return 0;
+	}
+	return 1;
+}
+
+/* Split transaction <text> by shard: the operations of shard k are copied, in order, to
+<pieces> + <offsets>[k] (<lengths>[k] bytes, 0 if the transaction does not touch shard k).
+<pieces> has room for <length> + 1 bytes. Returns -1 if an operation reads a key of another shard */
+int shard_split(const char *text, uint32_t length, int shards, int home, char *pieces, uint32_t *offsets, uint32_t *lengths)
+{
+	uint32_t start, end, used;
+	int k, shard;
+
+	for(start = 0; start < length; start = end + 1)
+	{
+		for(end = start; end < length && text[end] != '\n'; end++);
+		if(line_shard(text + start, end - start, shards, home) == lineShardCross)
+			return -1;
+	}
+	used = 0;
+	for(k=0; k<shards; k++)
+	{
+		offsets[k] = used;
+		for(start = 0; start < length; start = end + 1)
+		{
+			for(end = start; end < length && text[end] != '\n'; end++);
+			shard = line_shard(text + start, end - start, shards, home);
+			if(shard != k)
+				continue;
+			memcpy(pieces + used, text + start, end - start);
+			used += end - start;
+			pieces[used++] = '\n';
+		}
+		lengths[k] = used - offsets[k];
+	}
+	return 0;
+}
@@ -0,0 +1,24 @@
+/*
+ * shard.h
+ *
+ * The keyspace is hash partitioned over the middlewares, each of them with the
+ * database server next to it holding one shard. A key goes to the shard its
+ * name hashes to; the part of the name before the first ':' is hashed when
+ * there is one, so keys like acct7:balance and acct7:limit stay together.
+ */
+
+#ifndef SHARD_H_
+#define SHARD_H_
+
+#include <stdint.h>
+
+#define shardTag ':'
+#define shardMaxKeys 256			/* Keys one transaction can lock at a database server (its maxLockedKeys) */
+#define shardMaxKeyLength 255		/* Longest key a database server takes (its maxKeyLength) */
+
+unsigned int shard_of(const char *key, int length, int shards);
+int shard_check(const char *text, uint32_t length, int shards);
+int shard_read_only(const char *text, uint32_t length);
+int shard_split(const char *text, uint32_t length, int shards, int home, char *pieces, uint32_t *offsets, uint32_t *lengths);
+
+#endif /* SHARD_H_ */
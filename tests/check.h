@@ -0,0 +1,37 @@
+/*
+ * check.h
+ *
+ * What the unit tests share: check() notes an expectation that does not hold
+ * and carries on with the rest, main returns check_result() once all of them ran.
+ */
+
+#ifndef CHECK_H_
+#define CHECK_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static int failures;
+
+/* Count a failure of test <test> unless <ok>, saying <what> was expected */
+static inline void check(int ok, const char *test, const char *what)
+{
+	if(!ok)
+	{
+		fprintf(stderr, "%s: %s\n", test, what);
+		failures++;
+	}
+}
+
+/* Exit status of the test program */
+static inline int check_result(void)
+{
+	if(failures)
+	{
+		fprintf(stderr, "%d checks failed\n", failures);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+#endif /* CHECK_H_ */
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "check.h"
+#include "protocol.h"
+#include "deadlock.h"
+
+#define G(n) (globalTxidFlag | (n))		/* A global transaction id */
+
+/* Is transaction <txid> of shard <shard> (-1 for a global id) among the <count> victims */
+static int picked(const struct deadlock_victim *victims, int count, uint64_t txid, int shard)
+{
+	int i;
+
+	for(i=0; i<count; i++)
+		if(victims[i].txid == txid && victims[i].shard == shard)
+			return 1;
+	return 0;
+}
+
+/* Two transactions of one shard waiting for each other: the younger one goes */
+static void two_cycle(void)
+{
+	struct wait_edge edges[] = {
+		{ 1, 2, 100, 0 },
+		{ 2, 1, 50, 0 },
+	};
+	struct deadlock_victim victims[maxDeadlockVictims];
+	int n;
+
+	n = deadlock_victims(edges, 2, victims, maxDeadlockVictims);
+	check(n == 1, "two_cycle", "one victim");
+	check(picked(victims, n, 2, 0), "two_cycle", "the younger transaction is the victim");
+	check(n == 1 && victims[0].shards == 1u << 0, "two_cycle", "its wait is broken off at shard 0");
+}
+
+/* Three global transactions, each waiting for the next at another shard: the cycle only shows once the
+edges of all three shards are put together */
+static void three_cycle_across_shards(void)
+{
+	struct wait_edge edges[] = {
+		{ G(1), G(2), 30, 0 },
+		{ G(2), G(3), 10, 1 },
+		{ G(3), G(1), 20, 2 },
+	};
+	struct deadlock_victim victims[maxDeadlockVictims];
+	int n;
+
+	n = deadlock_victims(edges, 3, victims, maxDeadlockVictims);
+	check(n == 1, "three_cycle_across_shards", "one victim");
+	check(picked(victims, n, G(2), -1), "three_cycle_across_shards", "the youngest transaction is the victim");
+	check(n == 1 && victims[0].shards == 1u << 1, "three_cycle_across_shards", "its wait is broken off at shard 1");
+}
+
+/* Two cycles with nothing in common, one victim each. Local ids 1 and 2 are different transactions at each shard */
+static void disjoint_cycles(void)
+{
+	struct wait_edge edges[] = {
+		{ 1, 2, 40, 0 },
+		{ 2, 1, 60, 0 },
+		{ 1, 2, 70, 1 },
+		{ 2, 1, 20, 1 },
+		{ G(5), G(6), 5, 0 },
+		{ G(6), G(5), 8, 1 },
+	};
+	struct deadlock_victim victims[maxDeadlockVictims];
+	int n;
+
+	n = deadlock_victims(edges, 6, victims, maxDeadlockVictims);
+	check(n == 3, "disjoint_cycles", "one victim per cycle");
+	check(picked(victims, n, 1, 0), "disjoint_cycles", "the younger transaction of shard 0's cycle is the victim");
+	check(picked(victims, n, 2, 1), "disjoint_cycles", "the younger transaction of shard 1's cycle is the victim");
+	check(picked(victims, n, G(5), -1), "disjoint_cycles", "the younger global transaction is the victim");
+	check(deadlock_victims(edges, 6, victims, 2) == 2, "disjoint_cycles", "no more victims than there is room for");
+}
+
+/* A chain of waits ends at a transaction that is running: nothing to break. Nor do local ids that happen to be
+the same at two shards close a cycle */
+static void chain(void)
+{
+	struct wait_edge edges[] = {
+		{ G(1), G(2), 10, 0 },
+		{ G(2), G(3), 20, 1 },
+		{ G(3), G(4), 30, 0 },
+		{ 7, 8, 10, 0 },
+		{ 8, 7, 10, 1 },
+	};
+	struct deadlock_victim victims[maxDeadlockVictims];
+
+	check(deadlock_victims(edges, 5, victims, maxDeadlockVictims) == 0, "chain", "no victims");
+	check(deadlock_victims(edges, 0, victims, maxDeadlockVictims) == 0, "chain", "no victims without edges");
+}
+
+int main(void)
+{
+	two_cycle();
+	three_cycle_across_shards();
+	disjoint_cycles();
+	chain();
+	return check_result();
+}
@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "check.h"
+#include "lock_manager.h"
+#include "store.h"
+
+#define shortWaitMs 20			/* For a request that is expected to time out */
+#define longWaitMs 5000			/* For one that is expected to be granted (or broken off) long before */
+
+/* A lock request made on a thread of its own, for one that has to wait */
+struct waiter
+{
+	struct lock_txn *t;
+	unsigned long key;
+	int mode;
+	int rc;
+	pthread_t thread;
+};
+
+static struct lock_txn a, b, c;		/* Three transactions, set up afresh by each test */
+
+static void * wait_thread(void *args)
+{
+	struct waiter *w = (struct waiter *)args;
+
+	w->rc = lock_acquire(w->t, w->key, w->mode, longWaitMs);
+	return NULL;
+}
+
+/* Does transaction <waiter> wait for <holder> */
+static int waits_for(unsigned long long waiter, unsigned long long holder)
+{
+	struct lock_edge edges[16];
+	int i, n;
+
+	n = lock_wait_edges(edges, 16);
+	for(i=0; i<n; i++)
+	{
+		if(edges[i].waiter == waiter && edges[i].holder == holder)
+			return 1;
+	}
+	return 0;
+}
+
+/* Ask for <key> in <mode> for <t> on a thread of its own, and return once it waits for <holder> */
+static void start_wait(struct waiter *w, struct lock_txn *t, unsigned long key, int mode, unsigned long long holder)
+{
+	int i;
+
+	w->t = t;
+	w->key = key;
+	w->mode = mode;
+	w->rc = -1;
+	if(pthread_create(&w->thread, NULL, wait_thread, w) != 0)
+	{
+		perror("Could not start a waiting thread\n");
+		exit(EXIT_FAILURE);
+	}
+	for(i=0; i<1000 && !waits_for(t->txid, holder); i++)
+		usleep(1000);
+}
+
+/* Fresh transactions for the next test */
+static void fresh_txns(void)
+{
+	lock_txn_init(&a, 1);
+	lock_txn_init(&b, 2);
+	lock_txn_init(&c, 3);
+}
+
+static unsigned long key(const char *name)
+{
+	return store_intern(name, strlen(name));
+}
+
+/* Shared locks go together, an exclusive one waits for them all */
+static void shared_and_exclusive(void)
+{
+	unsigned long k = key("shared");
+
+	fresh_txns();
+	check(lock_acquire(&a, k, LOCK_SHARED, 0) == LOCK_OK, "shared_and_exclusive", "a first shared lock");
+	check(lock_acquire(&b, k, LOCK_SHARED, 0) == LOCK_OK, "shared_and_exclusive", "a second shared lock");
+	check(lock_acquire(&c, k, LOCK_EXCLUSIVE, shortWaitMs) == LOCK_TIMEOUT, "shared_and_exclusive", "an exclusive lock times out");
+	check(lock_mode_held(&c, k) == LOCK_NONE, "shared_and_exclusive", "and is not held");
+	lock_release_all(&a);
+	check(lock_acquire(&c, k, LOCK_EXCLUSIVE, shortWaitMs) == LOCK_TIMEOUT, "shared_and_exclusive", "one shared lock is enough to wait for");
+	lock_release_all(&b);
+	check(lock_acquire(&c, k, LOCK_EXCLUSIVE, 0) == LOCK_OK, "shared_and_exclusive", "granted once nobody holds it");
+	check(lock_acquire(&c, k, LOCK_SHARED, 0) == LOCK_OK && lock_mode_held(&c, k) == LOCK_EXCLUSIVE, "shared_and_exclusive",
+		"asking for less than what is held is a no-op");
+	lock_release_all(&c);
+}
+
+/* Requests are granted in arrival order: a shared request does not overtake an exclusive one waiting ahead of it */
+static void fifo_queue(void)
+{
+	struct waiter w;
+	unsigned long k = key("fifo");
+
+	fresh_txns();
+	check(lock_acquire(&a, k, LOCK_SHARED, 0) == LOCK_OK, "fifo_queue", "shared lock");
+	start_wait(&w, &b, k, LOCK_EXCLUSIVE, a.txid);
+	check(waits_for(b.txid, a.txid), "fifo_queue", "the exclusive request waits for the shared lock");
+	check(lock_acquire(&c, k, LOCK_SHARED, shortWaitMs) == LOCK_TIMEOUT, "fifo_queue", "a shared request waits behind it");
+	lock_release_all(&a);
+	pthread_join(w.thread, NULL);
+	check(w.rc == LOCK_OK && lock_mode_held(&b, k) == LOCK_EXCLUSIVE, "fifo_queue", "the release grants the exclusive lock");
+	lock_release_all(&b);
+}
+
+/* Waiters of one key make a chain of wait-for edges, and a broken off wait gives up with LOCK_DEADLOCK */
+static void wait_chain_and_break(void)
+{
+	struct waiter wb, wc;
+	unsigned long k = key("chain");
+
+	fresh_txns();
+	check(lock_acquire(&a, k, LOCK_EXCLUSIVE, 0) == LOCK_OK, "wait_chain_and_break", "exclusive lock");
+	start_wait(&wb, &b, k, LOCK_EXCLUSIVE, a.txid);
+	start_wait(&wc, &c, k, LOCK_SHARED, b.txid);
+	check(waits_for(b.txid, a.txid) && waits_for(c.txid, b.txid), "wait_chain_and_break", "each waiter waits for the one ahead");
+	check(!waits_for(c.txid, a.txid), "wait_chain_and_break", "not for everyone ahead");
+	check(lock_break(b.txid) == 1, "wait_chain_and_break", "the first waiter's wait is broken off");
+	pthread_join(wb.thread, NULL);
+	check(wb.rc == LOCK_DEADLOCK && lock_mode_held(&b, k) == LOCK_NONE, "wait_chain_and_break", "it gives up");
+	check(lock_break(a.txid) == 0, "wait_chain_and_break", "a transaction that does not wait has nothing to break");
+	lock_release_all(&a);
+	pthread_join(wc.thread, NULL);
+	check(wc.rc == LOCK_OK, "wait_chain_and_break", "the one behind it gets the lock");
+	lock_release_all(&b);
+	lock_release_all(&c);
+}
+
+/* A shared lock is upgraded in place: at once if it is the only one, ahead of the waiters behind it otherwise;
+an upgrade that times out leaves the shared lock held */
+static void upgrades(void)
+{
+	struct waiter wa, wc;
+	unsigned long k = key("upgrade");
+
+	fresh_txns();
+	check(lock_acquire(&a, k, LOCK_SHARED, 0) == LOCK_OK, "upgrades", "shared lock");
+	check(lock_acquire(&a, k, LOCK_EXCLUSIVE, 0) == LOCK_OK && lock_mode_held(&a, k) == LOCK_EXCLUSIVE, "upgrades", "upgraded alone");
+	check(a.count == 1, "upgrades", "in place");
+	lock_release_all(&a);
+
+	check(lock_acquire(&a, k, LOCK_SHARED, 0) == LOCK_OK, "upgrades", "shared lock");
+	check(lock_acquire(&b, k, LOCK_SHARED, 0) == LOCK_OK, "upgrades", "another shared lock");
+	check(lock_acquire(&a, k, LOCK_EXCLUSIVE, shortWaitMs) == LOCK_TIMEOUT, "upgrades", "an upgrade waits for the other shared lock");
+	check(lock_mode_held(&a, k) == LOCK_SHARED, "upgrades", "and falls back to the shared lock if it times out");
+
+	start_wait(&wc, &c, k, LOCK_EXCLUSIVE, a.txid);
+	start_wait(&wa, &a, k, LOCK_EXCLUSIVE, b.txid);
+	lock_release_all(&b);
+	pthread_join(wa.thread, NULL);
+	check(wa.rc == LOCK_OK && lock_mode_held(&a, k) == LOCK_EXCLUSIVE, "upgrades", "the upgrade goes ahead of the waiter that came first");
+	check(waits_for(c.txid, a.txid), "upgrades", "which waits on");
+	lock_release_all(&a);
+	pthread_join(wc.thread, NULL);
+	check(wc.rc == LOCK_OK, "upgrades", "and gets the lock after the upgraded one");
+	lock_release_all(&c);
+}
+
+/* Increments go together but not with the other modes, and are admitted escrow-style: with the key at 100 and a
+bound of 0, decrements of 60 and 40 both fit, one more of 1 does not, even without a bound of its own */
+static void increments_and_escrow(void)
+{
+	unsigned long k = key("escrow");
+
+	fresh_txns();
+	store_set(k, 100);
+	check(lock_acquire_increment(&a, k, -60, 0, INT64_MAX, 0) == LOCK_OK, "increments_and_escrow", "a decrement that fits");
+	check(lock_acquire_increment(&b, k, -50, 0, INT64_MAX, 0) == LOCK_REFUSED, "increments_and_escrow", "one that does not with the first");
+	check(lock_mode_held(&b, k) == LOCK_NONE, "increments_and_escrow", "a refused increment is not held");
+	check(lock_acquire_increment(&b, k, -40, 0, INT64_MAX, 0) == LOCK_OK, "increments_and_escrow", "one that does");
+	check(lock_acquire_increment(&c, k, -1, INT64_MIN, INT64_MAX, 0) == LOCK_REFUSED, "increments_and_escrow",
+		"an unbounded one is refused if it could break a granted one's bound");
+	check(lock_acquire_increment(&c, k, 1000, INT64_MIN, INT64_MAX, 0) == LOCK_OK, "increments_and_escrow", "an increase breaks no lower bound");
+	lock_release_all(&c);
+	check(lock_acquire_increment(&c, k, 1, INT64_MIN, 100, 0) == LOCK_REFUSED, "increments_and_escrow",
+		"an upper bound is checked counting none of the decrements");
+	check(lock_acquire(&c, k, LOCK_SHARED, shortWaitMs) == LOCK_TIMEOUT, "increments_and_escrow", "a read waits for the increments");
+	lock_release_all(&a);
+	lock_release_all(&b);
+	check(lock_acquire(&c, k, LOCK_EXCLUSIVE, 0) == LOCK_OK, "increments_and_escrow", "and goes once they are released");
+	lock_release_all(&c);
+}
+
+int main(void)
+{
+	lock_table_init();
+	store_init();
+	shared_and_exclusive();
+	fifo_queue();
+	wait_chain_and_break();
+	upgrades();
+	increments_and_escrow();
+	return check_result();
+}
@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "check.h"
+#include "metrics.h"
+
+/* The smallest values have a bucket each */
+static void small_values(void)
+{
+	uint64_t us;
+
+	for(us=0; us < (1 << histogramSubBits); us++)
+	{
+		check(bucket_of(us) == (int)us, "small_values", "bucket of its own");
+		check(bucket_top((int)us) == us, "small_values", "labelled with itself");
+	}
+}
+
+/* The buckets follow each other without gaps or overlaps, each one holds the values up to its label,
+and none of them is wider than a quarter of its smallest value */
+static void bucket_bounds(void)
+{
+	uint64_t low, top;
+	int i;
+
+	low = 0;
+	for(i=0; i<histogramBuckets; i++)
+	{
+		top = bucket_top(i);
+		check(top >= low, "bucket_bounds", "labels go up");
+		check(bucket_of(low) == i, "bucket_bounds", "the value after the previous label starts the bucket");
+		check(bucket_of(top) == i, "bucket_bounds", "the label is in the bucket");
+		if(low >= (1 << histogramSubBits))
+			check((top - low + 1) * (1 << histogramSubBits) <= low, "bucket_bounds", "within 25% of the smallest value");
+		low = top + 1;
+	}
+}
+
+/* Past 2^38 us everything goes in the last bucket */
+static void last_bucket(void)
+{
+	check(bucket_top(histogramBuckets - 1) == (1ULL << 38) - 1, "last_bucket", "the last label is 2^38 - 1");
+	check(bucket_of(1ULL << 38) == histogramBuckets - 1, "last_bucket", "2^38 goes in the last bucket");
+	check(bucket_of(UINT64_MAX) == histogramBuckets - 1, "last_bucket", "so does the largest value");
+}
+
+int main(void)
+{
+	small_values();
+	bucket_bounds();
+	last_bucket();
+	return check_result();
+}
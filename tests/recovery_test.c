@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "check.h"
+#include "scratch.h"
+#include "db_serv.h"
+#include "wal.h"
+#include "recovery.h"
+
+/* What recovery needs of the database server, whose main cannot be linked in */
+unsigned long long nextTxid;
+
+struct transaction * transaction_new(void)
+{
+	struct transaction *t;
+
+	t = calloc(1, sizeof(struct transaction));
+	if(!t)
+	{
+		perror("Could not allocate transaction state\n");
+		exit(EXIT_FAILURE);
+	}
+	lock_txn_init(&t->locks, ++nextTxid);
+	t->txid = t->locks.txid;
+	return t;
+}
+
+int64_t * cache_slot(struct transaction *t, uint32_t id)
+{
+	int i;
+
+	for(i=0; i<t->locks.count; i++)
+	{
+		if(t->locks.requests[i].key == id && t->locks.requests[i].mode != LOCK_NONE)
+			return &t->trans_cache[i];
+	}
+	return NULL;
+}
+
+static unsigned long long decidedTxids[8];		/* What decided_add was told, in order */
+static char decidedOutcomes[8];
+static int decidedCount;
+
+void decided_add(unsigned long long txid, char outcome)
+{
+	if(decidedCount == 8)
+		return;
+	decidedTxids[decidedCount] = txid;
+	decidedOutcomes[decidedCount++] = outcome;
+}
+
+/* Append a record of <type> for transaction <txid> with one entry for <key>, or none if <key> is NULL */
+static void append(struct wal *w, int type, uint64_t txid, const char *key, int64_t value, int64_t low, int64_t high)
+{
+	struct wal_entry entry;
+
+	entry.key = key;
+	entry.keyLength = key ? strlen(key) : 0;
+	entry.value = value;
+	entry.low = low;
+	entry.high = high;
+	wal_flush(w, wal_append(w, type, txid, &entry, key ? 1 : 0, NULL));
+}
+
+/* Current value of <key> */
+static int64_t value_of(const char *key)
+{
+	return store_get(store_intern(key, strlen(key)));
+}
+
+/* A prepared transaction is replayed as it was decided: a commit applies the PREPARE record's values, an abort does not,
+and status queries are told either way. One without a decision is in doubt, holding its locks with the values it would write */
+static void decided_and_in_doubt(void)
+{
+	struct recovery_result result;
+	struct transaction *t;
+	struct wal w;
+	uint64_t prepared;
+
+	scratch_enter();
+	decidedCount = 0;
+	wal_open(&w, 0, WAL_SYNC_COMMIT, 0);
+	append(&w, WAL_PREPARE, globalTxidFlag | 1, "x", 10, 0, 0);
+	append(&w, WAL_COMMIT, globalTxidFlag | 1, NULL, 0, 0, 0);
+	append(&w, WAL_PREPARE, globalTxidFlag | 2, "y", 20, 0, 0);
+	append(&w, WAL_ABORT, globalTxidFlag | 2, NULL, 0, 0, 0);
+	prepared = wal_end(&w);
+	append(&w, WAL_PREPARE, 7, "z", 30, 0, 0);
+	append(&w, WAL_COMMIT, 5, "u", 50, 0, 0);
+	close(w.fd);
+
+	recovery_run(SNAPSHOT_FILE, &result);
+	check(value_of("x") == 10, "decided_and_in_doubt", "a committed prepare is applied");
+	check(value_of("y") == STORE_UNSET, "decided_and_in_doubt", "an aborted one is not");
+	check(value_of("u") == 50, "decided_and_in_doubt", "nor does an undecided one hold up the commits after it");
+	check(decidedCount == 2 && decidedTxids[0] == (globalTxidFlag | 1) && decidedOutcomes[0] == RESULT_COMMITTED &&
+		decidedTxids[1] == (globalTxidFlag | 2) && decidedOutcomes[1] == RESULT_ABORTED, "decided_and_in_doubt", "both outcomes are remembered");
+	t = result.inDoubt;
+	check(t && t->txid == 7 && t->prepared && !t->next, "decided_and_in_doubt", "the undecided one is in doubt");
+	if(t)
+	{
+		check(t->prepareLsn == prepared && result.replayLsn == prepared, "decided_and_in_doubt", "the next replay starts at its PREPARE record");
+		check(t->locks.count == 1 && lock_mode_held(&t->locks, store_intern("z", 1)) == LOCK_EXCLUSIVE, "decided_and_in_doubt", "it holds its lock");
+		check(*cache_slot(t, store_intern("z", 1)) == 30 && value_of("z") == STORE_UNSET, "decided_and_in_doubt", "with its value, which is not applied");
+		lock_release_all(&t->locks);
+	}
+	check(result.endLsn == wal_end(&w) && result.nextTxid == 8, "decided_and_in_doubt", "the log and the transaction ids go on after it");
+	scratch_leave();
+}
+
+/* A sequencer's batch is replayed whole once its BATCH record follows, not at all otherwise */
+static void batches(void)
+{
+	struct recovery_result result;
+	struct wal w;
+	uint64_t first = (3ULL << 32) | 1, second = (3ULL << 32) | 2;
+
+	scratch_enter();
+	wal_open(&w, 0, WAL_SYNC_COMMIT, 0);
+	append(&w, WAL_SEQUENCED, first, "s", 1, 0, 0);
+	append(&w, WAL_SEQUENCED, first, "r", 1, 0, 0);
+	append(&w, WAL_BATCH, first, NULL, 0, 0, 0);
+	append(&w, WAL_SEQUENCED, second, "s", 2, 0, 0);
+	close(w.fd);
+
+	recovery_run(SNAPSHOT_FILE, &result);
+	check(value_of("s") == 1 && value_of("r") == 1, "batches", "a batch that got to the end is applied");
+	check(result.lastBatch == first, "batches", "and is the last one run");
+	check(!result.inDoubt, "batches", "nothing is in doubt");
+	scratch_leave();
+}
+
+/* A prepared increment that was never decided keeps the room it was granted under its bound: with k at 100 and
+"INCR k -80 0" in doubt, a later decrement by 50 is refused, one by 10 is not */
+static void in_doubt_increment_bounds(void)
+{
+	struct recovery_result result;
+	struct lock_txn later;
+	struct wal w;
+	uint32_t k;
+
+	scratch_enter();
+	wal_open(&w, 0, WAL_SYNC_COMMIT, 0);
+	append(&w, WAL_COMMIT, 1, "k", 100, 0, 0);
+	append(&w, WAL_INCREMENTS, 2, "k", -80, 0, INT64_MAX);
+	append(&w, WAL_PREPARE, 2, NULL, 0, 0, 0);
+	close(w.fd);
+
+	recovery_run(SNAPSHOT_FILE, &result);
+	check(value_of("k") == 100, "in_doubt_increment_bounds", "the committed value is back");
+	check(result.inDoubt && result.inDoubt->txid == 2 && !result.inDoubt->next, "in_doubt_increment_bounds", "the prepared transaction is in doubt");
+	if(!result.inDoubt)
+	{
+		scratch_leave();
+		return;
+	}
+	k = store_intern("k", 1);
+	check(result.inDoubt->locks.count == 1 && result.inDoubt->locks.requests[0].delta == -80, "in_doubt_increment_bounds", "it holds its increment again");
+	lock_txn_init(&later, 3);
+	check(lock_acquire_increment(&later, k, -50, INT64_MIN, INT64_MAX, 0) == LOCK_REFUSED, "in_doubt_increment_bounds", "a decrement that could take k below 0 is refused");
+	check(lock_acquire_increment(&later, k, -10, INT64_MIN, INT64_MAX, 0) == LOCK_OK, "in_doubt_increment_bounds", "one that cannot is granted");
+	lock_release_all(&later);
+	lock_release_all(&result.inDoubt->locks);
+	scratch_leave();
+}
+
+/* A record cut short by a crash ends the log: recovery cuts it off, together with the segments after it,
+and the log goes on from the last intact record */
+static void torn_tail(void)
+{
+	struct recovery_result result;
+	struct wal w;
+	uint64_t intact, end;
+	char name[64], record[64];
+	int fd, ok;
+
+	scratch_enter();
+	wal_open(&w, 0, WAL_SYNC_COMMIT, 0);
+	append(&w, WAL_COMMIT, 1, "t", 1, 0, 0);
+	append(&w, WAL_COMMIT, 2, "t", 2, 0, 0);
+	intact = wal_end(&w);
+	append(&w, WAL_COMMIT, 3, "t", 3, 0, 0);
+	end = wal_end(&w);
+	close(w.fd);
+	/* The last record again, as a segment of its own after the torn one */
+	wal_segment_name(name, sizeof(name), 0);
+	ok = (fd = open(name, O_RDWR)) >= 0 && pread(fd, record, end - intact, intact) == (ssize_t)(end - intact) && ftruncate(fd, end - 3) == 0;
+	close(fd);
+	wal_segment_name(name, sizeof(name), end);
+	ok &= (fd = open(name, O_WRONLY | O_CREAT, 0644)) >= 0 && write(fd, record, end - intact) == (ssize_t)(end - intact);
+	close(fd);
+	if(!ok)
+	{
+		perror("Could not tear the log\n");
+		exit(EXIT_FAILURE);
+	}
+
+	recovery_run(SNAPSHOT_FILE, &result);
+	check(value_of("t") == 2, "torn_tail", "the intact records are replayed");
+	check(result.endLsn == intact, "torn_tail", "the log ends after them");
+	check(access(name, F_OK) < 0, "torn_tail", "the segment after the torn record is deleted");
+	wal_open(&w, result.endLsn, WAL_SYNC_COMMIT, 0);		//Exits unless the torn record is gone from the file
+	append(&w, WAL_COMMIT, 4, "t", 4, 0, 0);
+	close(w.fd);
+	recovery_run(SNAPSHOT_FILE, &result);
+	check(value_of("t") == 4 && result.endLsn == intact + (end - intact), "torn_tail", "a record appended after the cut replays");
+	scratch_leave();
+}
+
+int main(void)
+{
+	lock_table_init();
+	store_init();
+	decided_and_in_doubt();
+	batches();
+	in_doubt_increment_bounds();
+	torn_tail();
+	return check_result();
+}
@@ -0,0 +1,49 @@
+/*
+ * scratch.h
+ *
+ * Scratch directory for the tests that write a log or a snapshot: the
+ * database server keeps its files in the working directory, so a test
+ * moves into an empty one and removes it with everything in it after.
+ */
+
+#ifndef SCRATCH_H_
+#define SCRATCH_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+
+static char scratchPath[64];
+
+/* Move into a new empty directory */
+static inline void scratch_enter(void)
+{
+	strcpy(scratchPath, "/tmp/distra_testXXXXXX");
+	if(!mkdtemp(scratchPath) || chdir(scratchPath) < 0)
+	{
+		perror("Could not make a directory to run in\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Leave the directory of the last scratch_enter and remove it */
+static inline void scratch_leave(void)
+{
+	DIR *dir;
+	struct dirent *d;
+
+	dir = opendir(".");
+	while(dir && (d = readdir(dir)))
+	{
+		if(strcmp(d->d_name, ".") && strcmp(d->d_name, ".."))
+			unlink(d->d_name);
+	}
+	if(dir)
+		closedir(dir);
+	if(chdir("/") < 0 || rmdir(scratchPath) < 0)
+		perror("Could not remove the test directory\n");
+}
+
+#endif /* SCRATCH_H_ */
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "check.h"
+#include "shard.h"
+
+#define shards 3
+
+/* A one letter key (in <key>) that lives at shard <shard> */
+static void key_at(int shard, char *key)
+{
+	for(key[0] = 'a'; key[0] <= 'z'; key[0]++)
+	{
+		if((int)shard_of(key, 1, shards) == shard)
+			return;
+	}
+	fprintf(stderr, "No one letter key at shard %d\n", shard);
+	exit(EXIT_FAILURE);
+}
+
+/* Keys with the same part before the ':' live together, whatever follows it */
+static void tagged_keys(void)
+{
+	check(shard_of("acct7:balance", 13, shards) == shard_of("acct7:limit", 11, shards), "tagged_keys", "same tag, same shard");
+	check(shard_of("acct7:balance", 13, shards) == shard_of("acct7", 5, shards), "tagged_keys", "the tag alone hashes the same");
+}
+
+/* Each shard gets its operations, in order; a shard the transaction does not touch gets nothing */
+static void split_by_shard(void)
+{
+	char a[2] = "", b[2] = "", text[128], expect[128], pieces[129];
+	uint32_t offsets[shards], lengths[shards];
+	int length;
+
+	key_at(0, a);
+	key_at(2, b);
+	length = snprintf(text, sizeof(text), "ASSIGN %s 1\nADD %s %s 2\nPRINT %s\nSLEEP 5\nADD %s %s %s", a, b, b, a, a, a, a);
+	check(shard_split(text, length, shards, 1, pieces, offsets, lengths) == 0, "split_by_shard", "split");
+	snprintf(expect, sizeof(expect), "ASSIGN %s 1\nPRINT %s\nADD %s %s %s\n", a, a, a, a, a);
+	check(lengths[0] == strlen(expect) && !memcmp(pieces + offsets[0], expect, lengths[0]), "split_by_shard", "shard 0's piece");
+	check(lengths[1] == 0, "split_by_shard", "shard 1 is not touched");
+	snprintf(expect, sizeof(expect), "ADD %s %s 2\n", b, b);
+	check(lengths[2] == strlen(expect) && !memcmp(pieces + offsets[2], expect, lengths[2]), "split_by_shard", "shard 2's piece");
+}
+
+/* An operation that reads a key of another shard than the one it writes is turned away whole */
+static void cross_shard_read(void)
+{
+	char a[2] = "", b[2] = "", text[64], pieces[65];
+	uint32_t offsets[shards], lengths[shards];
+	int length;
+
+	key_at(0, a);
+	key_at(1, b);
+	length = snprintf(text, sizeof(text), "ASSIGN %s 1\nADD %s %s 1\n", a, a, b);
+	check(shard_split(text, length, shards, 0, pieces, offsets, lengths) < 0, "cross_shard_read", "refused");
+}
+
+/* A malformed operation goes to the home shard, whose database server rejects it */
+static void malformed_goes_home(void)
+{
+	char pieces[32];
+	uint32_t offsets[shards], lengths[shards];
+
+	check(shard_split("ASSIGN 5 5\n", 11, shards, 1, pieces, offsets, lengths) == 0, "malformed_goes_home", "split");
+	check(lengths[0] == 0 && lengths[1] == 11 && lengths[2] == 0, "malformed_goes_home", "only the home shard gets it");
+}
+
+/* What the sequencer lets through: operations the database servers will run as they are */
+static void check_grammar(void)
+{
+	check(shard_check("ASSIGN a 1\nADD b a 2\nINCR c -3\nPRINT d\nSLEEP 5\n", 47, shards) == 0, "check_grammar", "valid operations");
+	check(shard_check("FOO bar\n\n", 9, shards) == 0, "check_grammar", "unknown operations and empty lines are skipped");
+	check(shard_check("ASSIGN a b\n", 11, shards) < 0, "check_grammar", "ASSIGN of a key");
+	check(shard_check("ADD a b\n", 8, shards) < 0, "check_grammar", "ADD with a missing operand");
+	check(shard_check("ADD a 1 -2\n", 11, shards) < 0, "check_grammar", "ADD of a negative literal");
+	check(shard_check("INCR a 5 10\n", 12, shards) < 0, "check_grammar", "INCR with a bound, which could be refused");
+	check(shard_check("PRINT 5\n", 8, shards) < 0, "check_grammar", "PRINT of a literal");
+	check(shard_check("ASSIGN a% 1\n", 12, shards) < 0, "check_grammar", "key with a character the database servers refuse");
+}
+
+/* More keys than a database server can lock for one transaction, at one shard */
+static void check_key_count(void)
+{
+	char text[(shardMaxKeys + 1) * 8 + 1];
+	int i, length;
+
+	length = 0;
+	for(i=0; i<shardMaxKeys; i++)
+		length += sprintf(text + length, "PRINT a\n");
+	check(shard_check(text, length, shards) == 0, "check_key_count", "as many keys as can be locked");
+	length += sprintf(text + length, "PRINT a\n");
+	check(shard_check(text, length, shards) < 0, "check_key_count", "one too many");
+}
+
+int main(void)
+{
+	tagged_keys();
+	split_by_shard();
+	cross_shard_read();
+	malformed_goes_home();
+	check_grammar();
+	check_key_count();
+	return check_result();
+}
@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "check.h"
+#include "store.h"
+#include "snapshot.h"
+
+#define transfers 20000			/* Commits of the writer in concurrent_reads */
+
+static uint32_t key(const char *name)
+{
+	return store_intern(name, strlen(name));
+}
+
+/* Commit <count> values, <values>[i] to key <ids>[i], under one timestamp. Returns it */
+static uint64_t commit(const uint32_t *ids, const int64_t *values, int count)
+{
+	uint64_t stamp, horizon;
+	int i;
+
+	stamp = snapshot_begin(&horizon);
+	for(i=0; i<count; i++)
+		snapshot_install(ids[i], values[i], stamp, horizon);
+	snapshot_publish(stamp);
+	return stamp;
+}
+
+/* A plan reading the keys <ids> */
+static void read_plan(struct plan *p, const uint32_t *ids, int count)
+{
+	int i;
+
+	memset(p, 0, sizeof(*p));
+	p->keyCount = count;
+	for(i=0; i<count; i++)
+		p->keys[i].id = ids[i];
+}
+
+/* How many replaced values key <id> keeps */
+static int older_count(uint32_t id)
+{
+	struct store_version *v;
+	int n = 0;
+
+	for(v = storeChunks[id >> storeChunkBits]->older[id & (storeChunkSize - 1)]; v; v = v->next)
+		n++;
+	return n;
+}
+
+/* A held snapshot reads the values as they were when it was taken, however many commits come after;
+the versions it needs are kept until it is dropped, and pruned after */
+static void held_snapshot(void)
+{
+	uint32_t id = key("held");
+	int64_t value;
+	uint64_t s, newer;
+	int slot, i;
+
+	value = 1;
+	commit(&id, &value, 1);
+	slot = snapshot_hold(snapshot_clock(), &s);
+	for(value = 2; value <= 5; value++)
+		commit(&id, &value, 1);
+	check(snapshot_value(id, s) == 1, "held_snapshot", "the snapshot still reads the value it was taken at");
+	i = snapshot_hold(snapshot_clock(), &newer);
+	check(snapshot_value(id, newer) == 5, "held_snapshot", "a newer one reads the last commit");
+	snapshot_drop(i);
+	check(older_count(id) >= 4, "held_snapshot", "the versions in between are kept while it is held");
+	snapshot_drop(slot);
+	value = 6;
+	commit(&id, &value, 1);
+	check(older_count(id) == 1, "held_snapshot", "and pruned by the first commit after it is dropped");
+}
+
+/* A commit still installing its values is not seen at all, by a snapshot taken before it publishes */
+static void installing_commit(void)
+{
+	uint32_t ids[2] = { key("pair:a"), key("pair:b") };
+	int64_t values[2] = { 10, 20 }, read[2];
+	uint64_t stamp, horizon;
+	struct plan p;
+
+	commit(ids, values, 2);
+	read_plan(&p, ids, 2);
+	stamp = snapshot_begin(&horizon);
+	snapshot_install(ids[0], 11, stamp, horizon);
+	snapshot_read(&p, read);
+	check(read[0] == 10 && read[1] == 20, "installing_commit", "half a commit is not read");
+	snapshot_install(ids[1], 21, stamp, horizon);
+	snapshot_read(&p, read);
+	check(read[0] == 10 && read[1] == 20, "installing_commit", "nor is a whole one before it is published");
+	snapshot_publish(stamp);
+	snapshot_read(&p, read);
+	check(read[0] == 11 && read[1] == 21, "installing_commit", "it is read once it is");
+}
+
+/* A key the plan found no trace of reads as never written */
+static void unknown_key(void)
+{
+	struct plan p;
+	int64_t value;
+
+	memset(&p, 0, sizeof(p));
+	p.keyCount = 1;
+	p.keys[0].id = planNoKey;
+	p.keys[0].name = "nowhere";
+	p.keys[0].length = 7;
+	snapshot_read(&p, &value);
+	check(value == STORE_UNSET, "unknown_key", "unset");
+}
+
+static uint32_t accounts[2];
+
+/* Writer: moves amounts between the two accounts, their sum stays 100 */
+static void * transfer_thread(void *args)
+{
+	int64_t values[2];
+	int i;
+
+	for(i=0; i<transfers; i++)
+	{
+		values[0] = i % 101;
+		values[1] = 100 - values[0];
+		commit(accounts, values, 2);
+	}
+	return NULL;
+}
+
+/* Snapshots read while a writer commits see every commit entirely or not at all */
+static void concurrent_reads(void)
+{
+	pthread_t writer;
+	struct plan p;
+	int64_t values[2] = { 100, 0 };
+	int i, consistent;
+
+	accounts[0] = key("acct:x");
+	accounts[1] = key("acct:y");
+	commit(accounts, values, 2);
+	read_plan(&p, accounts, 2);
+	if(pthread_create(&writer, NULL, transfer_thread, NULL) != 0)
+	{
+		perror("Could not start the writer\n");
+		exit(EXIT_FAILURE);
+	}
+	consistent = 1;
+	for(i=0; i<transfers; i++)
+	{
+		snapshot_read(&p, values);
+		consistent &= (values[0] + values[1] == 100);
+	}
+	pthread_join(writer, NULL);
+	check(consistent, "concurrent_reads", "every snapshot sees the accounts add up");
+	snapshot_read(&p, values);
+	check(values[0] == (transfers - 1) % 101, "concurrent_reads", "the last commit is read after the writer is done");
+}
+
+int main(void)
+{
+	store_init();
+	held_snapshot();
+	installing_commit();
+	unknown_key();
+	concurrent_reads();
+	return check_result();
+}
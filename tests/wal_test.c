@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "check.h"
+#include "scratch.h"
+#include "wal.h"
+
+#define groupThreads 8
+#define groupCommits 200		/* Per thread */
+
+/* The log, read back from its first segment into <size> bytes */
+static char * read_log(size_t *size)
+{
+	struct stat st;
+	char name[64], *data;
+	int fd;
+
+	wal_segment_name(name, sizeof(name), 0);
+	fd = open(name, O_RDONLY);
+	if(fd < 0 || fstat(fd, &st) < 0 || !(data = malloc(st.st_size + 1)) || read(fd, data, st.st_size) != st.st_size)
+	{
+		perror("Could not read the log back\n");
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+	*size = st.st_size;
+	return data;
+}
+
+/* Is the record at <data> (<size> bytes left) whole, with its checksum right */
+static int record_intact(const char *data, size_t size, struct wal_record_header *header)
+{
+	if(size < sizeof(*header))
+		return 0;
+	memcpy(header, data, sizeof(*header));
+	return header->length >= sizeof(*header) && header->length <= size &&
+		wal_crc32(data + 8, header->length - 8) == header->checksum;
+}
+
+/* A record is its header and its entries, INCREMENTS entries with their bounds after the delta */
+static void record_layout(void)
+{
+	struct wal w;
+	struct wal_entry commit = { "ab", 2, 7, 0, 0 }, increment = { "k", 1, -3, 0, 10 };
+	struct wal_record_header header;
+	uint64_t first, second, start;
+	int64_t values[3];
+	char *log;
+	size_t size;
+
+	scratch_enter();
+	wal_open(&w, 0, WAL_SYNC_COMMIT, 0);
+	first = wal_append(&w, WAL_COMMIT, 5, &commit, 1, &start);
+	check(start == 0 && first == sizeof(header) + 1 + 2 + sizeof(int64_t), "record_layout", "a COMMIT record's size");
+	second = wal_append(&w, WAL_INCREMENTS, 6, &increment, 1, &start);
+	check(start == first && second == first + sizeof(header) + 1 + 1 + 3 * sizeof(int64_t), "record_layout", "an INCREMENTS record's size");
+	wal_flush(&w, second);
+	close(w.fd);
+
+	log = read_log(&size);
+	check(size == second, "record_layout", "both records are on disk");
+	check(record_intact(log, size, &header) && header.txid == 5 && header.type == WAL_COMMIT && header.count == 1, "record_layout", "the COMMIT header");
+	check(log[sizeof(header)] == 2 && !memcmp(log + sizeof(header) + 1, "ab", 2), "record_layout", "its key");
+	memcpy(values, log + sizeof(header) + 3, sizeof(int64_t));
+	check(values[0] == 7, "record_layout", "its value");
+	check(record_intact(log + first, size - first, &header) && header.txid == 6 && header.type == WAL_INCREMENTS, "record_layout", "the INCREMENTS header");
+	memcpy(values, log + first + sizeof(header) + 2, sizeof(values));
+	check(values[0] == -3 && values[1] == 0 && values[2] == 10, "record_layout", "its delta and bounds");
+	log[first + sizeof(header)] ^= 1;
+	check(!record_intact(log + first, size - first, &header), "record_layout", "a changed byte breaks the checksum");
+	free(log);
+	scratch_leave();
+}
+
+static struct wal groupWal;
+
+/* A committer: appends its records one at a time and waits for each to be durable. Returns whether each one was
+once its flush returned */
+static void * committer(void *args)
+{
+	struct wal_entry entry = { "g", 1, 0, 0, 0 };
+	uint64_t lsn;
+	int i, ok;
+
+	ok = 1;
+	for(i=0; i<groupCommits; i++)
+	{
+		entry.value = i;
+		lsn = wal_append(&groupWal, WAL_COMMIT, (uint64_t)(long)args * groupCommits + i, &entry, 1, NULL);
+		wal_flush(&groupWal, lsn);
+		ok &= (wal_wait(&groupWal, lsn - 1, 0) >= lsn);
+	}
+	return (void *)(long)ok;
+}
+
+/* Committers sharing fsyncs: whatever order the leaders write the buffers in, every record ends up on disk whole,
+in the order it was appended, and each committer's records in its own order */
+static void group_commit(void)
+{
+	pthread_t threads[groupThreads];
+	struct wal_record_header header;
+	uint64_t last[groupThreads];
+	char *log;
+	size_t size, pos;
+	void *ok;
+	long i;
+	int count, ordered, durable;
+
+	scratch_enter();
+	wal_open(&groupWal, 0, WAL_SYNC_GROUP, 0);
+	for(i=0; i<groupThreads; i++)
+	{
+		if(pthread_create(&threads[i], NULL, committer, (void *)i) != 0)
+		{
+			perror("Could not start a committer\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	durable = 1;
+	for(i=0; i<groupThreads; i++)
+	{
+		pthread_join(threads[i], &ok);
+		durable &= (ok != NULL);
+	}
+	close(groupWal.fd);
+	check(durable, "group_commit", "every commit is durable once its flush returns");
+
+	log = read_log(&size);
+	check(size == wal_end(&groupWal), "group_commit", "the log on disk ends where the appends did");
+	memset(last, 0, sizeof(last));
+	count = 0;
+	ordered = 1;
+	for(pos = 0; record_intact(log + pos, size - pos, &header); pos += header.length)
+	{
+		i = header.txid / groupCommits;
+		ordered &= (i < groupThreads && (header.txid % groupCommits == 0 || header.txid == last[i] + 1));
+		if(i < groupThreads)
+			last[i] = header.txid;
+		count++;
+	}
+	check(pos == size, "group_commit", "every record is intact");
+	check(count == groupThreads * groupCommits, "group_commit", "none is missing");
+	check(ordered, "group_commit", "each committer's records are in its order");
+	free(log);
+	scratch_leave();
+}
+
+static struct wal periodicWal;		/* Its flusher thread lives on */
+
+/* Periodic mode: a flush does not wait, the background flusher makes the record durable shortly after */
+static void periodic(void)
+{
+	struct wal_entry entry = { "p", 1, 1, 0, 0 };
+	uint64_t lsn;
+
+	scratch_enter();
+	wal_open(&periodicWal, 0, WAL_SYNC_PERIODIC, 5);
+	lsn = wal_append(&periodicWal, WAL_COMMIT, 1, &entry, 1, NULL);
+	wal_flush(&periodicWal, lsn);
+	check(wal_wait(&periodicWal, lsn - 1, 2000) >= lsn, "periodic", "the flusher makes it durable");
+	wal_flush_all(&periodicWal);
+	scratch_leave();
+}
+
+int main(void)
+{
+	record_layout();
+	group_commit();
+	periodic();
+	return check_result();
+}